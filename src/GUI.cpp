@@ -2,6 +2,8 @@
 
 #include "imgui/imgui.h"
 
+#include "util/Trace.hpp"
+
 static const std::string vertex_shader_string =
     R"(#version 100
     #ifdef GL_ES
@@ -133,6 +135,8 @@ void GUI::Draw(
     const uint32_t window_width,
     const uint32_t window_height)
 {
+    TRACE_ZONE("GUI::Draw");
+
     ImGuiIO& io = ImGui::GetIO();
     io.DisplaySize = ImVec2(
         static_cast<float>(window_width),
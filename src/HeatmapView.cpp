@@ -0,0 +1,230 @@
+#include "HeatmapView.hpp"
+
+#include "speccy/Coverage.hpp"
+
+#include "imgui/imgui.h"
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+// level of a channel at full brightness, in accesses per frame
+static const float full_level = 1024.0f;
+
+// brightness of bytes touched before but not lately
+static const float touched_floor = 0.2f;
+
+zx_heat_t* HeatmapView::Heat()
+{
+    if (counters.empty())
+    {
+        counters.resize(
+            zx_heat_bytes() / sizeof(uint32_t));
+
+        zx_heat_init(
+            &heat,
+            counters.data(),
+            zx_heat_bytes());
+
+        for (int kind = 0; kind < ZX_HEAT_KINDS; kind++)
+        {
+            previous[kind].assign(map_bytes, 0);
+            levels[kind].assign(map_bytes, 0.0f);
+        }
+
+        pixels.assign(map_bytes, 0xFF000000);
+    }
+    return &heat;
+}
+
+void HeatmapView::Deinit()
+{
+    if (texture)
+    {
+        glDeleteTextures(
+            1,
+            &texture);
+
+        texture = 0;
+    }
+}
+
+void HeatmapView::Clear()
+{
+    zx_heat_clear(
+        &heat);
+
+    for (int kind = 0; kind < ZX_HEAT_KINDS; kind++)
+    {
+        previous[kind].assign(map_bytes, 0);
+        levels[kind].assign(map_bytes, 0.0f);
+    }
+}
+
+void HeatmapView::Update()
+{
+    if (counters.empty())
+    {
+        return;
+    }
+
+    const float scale = 1.0f / std::log2(1.0f + full_level);
+
+    for (int addr = 0; addr < map_bytes; addr++)
+    {
+        const uint32_t phys = zx_heat_phys(
+            &heat,
+            static_cast<uint16_t>(addr));
+
+        float channels[ZX_HEAT_KINDS];
+
+        for (int kind = 0; kind < ZX_HEAT_KINDS; kind++)
+        {
+            // a bank paged in since the last frame brings lower counts
+            const uint32_t count = heat.counts[kind][phys];
+            const uint32_t delta = (count > previous[kind][addr]) ?
+                (count - previous[kind][addr]) : 0;
+            previous[kind][addr] = count;
+
+            float& level = levels[kind][addr];
+            level = (level * fade) + static_cast<float>(delta);
+
+            const float brightness = touched_floor +
+                ((1.0f - touched_floor) * std::log2(1.0f + level) * scale);
+
+            channels[kind] = count ?
+                ((brightness < 1.0f) ? brightness : 1.0f) : 0.0f;
+        }
+
+        // RGBA in memory
+        pixels[addr] =
+            0xFF000000 |
+            (static_cast<uint32_t>(channels[ZX_HEAT_READ] * 255.0f) << 16) |
+            (static_cast<uint32_t>(channels[ZX_HEAT_EXEC] * 255.0f) << 8) |
+            static_cast<uint32_t>(channels[ZX_HEAT_WRITE] * 255.0f);
+    }
+}
+
+void HeatmapView::UploadTexture()
+{
+    if (!texture)
+    {
+        glGenTextures(
+            1,
+            &texture);
+    }
+
+    glActiveTexture(
+        GL_TEXTURE0);
+
+    glBindTexture(
+        GL_TEXTURE_2D,
+        texture);
+
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0,
+        GL_RGBA,
+        map_size,
+        map_size,
+        0,
+        GL_RGBA,
+        GL_UNSIGNED_BYTE,
+        (GLvoid*)pixels.data());
+}
+
+void HeatmapView::Draw(
+    const float x,
+    const float y)
+{
+    if (counters.empty())
+    {
+        return;
+    }
+
+    UploadTexture();
+
+    ImGui::SetNextWindowPos(
+        ImVec2(x, y),
+        ImGuiCond_Appearing);
+
+    ImGui::Begin(
+        "Heatmap",
+        &enabled,
+        ImGuiWindowFlags_AlwaysAutoResize);
+
+    ImGui::Text(
+        "Red writes, green opcode fetches, blue reads, 256 bytes a row");
+
+    const float zoom = 2.0f;
+
+    ImGui::Image(
+        (ImTextureID)(intptr_t)texture,
+        ImVec2(map_size * zoom, map_size * zoom));
+
+    if (ImGui::IsItemHovered())
+    {
+        const ImVec2 mouse = ImGui::GetMousePos();
+        const ImVec2 origin = ImGui::GetItemRectMin();
+        const int column = static_cast<int>((mouse.x - origin.x) / zoom);
+        const int row = static_cast<int>((mouse.y - origin.y) / zoom);
+
+        if ((column >= 0) && (column < map_size) && (row >= 0) && (row < map_size))
+        {
+            const uint16_t addr = static_cast<uint16_t>((row * map_size) + column);
+            const uint32_t phys = zx_heat_phys(&heat, addr);
+            const int bank = zx_heat_bank(phys);
+
+            char region[16];
+            if (bank < 0)
+            {
+                snprintf(region, sizeof(region), "ROM");
+            }
+            else
+            {
+                snprintf(region, sizeof(region), "bank %d", bank);
+            }
+
+            ImGui::SetTooltip(
+                "%04X (%s)\nexecuted %u\nread %u\nwritten %u",
+                addr,
+                region,
+                heat.counts[ZX_HEAT_EXEC][phys],
+                heat.counts[ZX_HEAT_READ][phys],
+                heat.counts[ZX_HEAT_WRITE][phys]);
+        }
+    }
+
+    ImGui::SliderFloat(
+        "Fade",
+        &fade,
+        0.5f,
+        0.99f);
+
+    if (ImGui::Button("Clear"))
+    {
+        Clear();
+    }
+
+    ImGui::InputText(
+        "Coverage File",
+        coverage_path,
+        sizeof(coverage_path));
+
+    if (ImGui::Button("Save Coverage"))
+    {
+        try
+        {
+            Speccy::SaveCoverage(
+                heat,
+                coverage_path);
+
+            printf("coverage written to %s\n", coverage_path);
+        }
+        catch (const std::runtime_error&)
+        {
+        }
+    }
+
+    ImGui::End();
+}
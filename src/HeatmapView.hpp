@@ -0,0 +1,63 @@
+#pragma once
+
+#include "gl/GL.hpp"
+
+#include "speccy/Heatmap.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+// Memory access heatmap of the 64K the CPU sees, 256 bytes to a row:
+// red for writes, green for opcode fetches and blue for reads. Each
+// frame's accesses add to a level which fades over about a second, so
+// hot loops glow while they run. Bytes touched at all since the last
+// clear keep a dim colour, the dark gaps in green code are code which
+// never ran. The counters are only attached while the view is open.
+class HeatmapView
+{
+private:
+    static const int map_size = 256;
+    static const int map_bytes = map_size * map_size;
+
+    bool enabled = false;
+
+    std::vector<uint32_t> counters;
+    zx_heat_t heat;
+
+    // per CPU address, the counts last frame and the fading levels
+    std::vector<uint32_t> previous[ZX_HEAT_KINDS];
+    std::vector<float> levels[ZX_HEAT_KINDS];
+
+    std::vector<uint32_t> pixels;
+    GLuint texture = 0;
+
+    float fade = 0.92f;
+    char coverage_path[256] = "coverage.txt";
+
+    void Clear();
+    void UploadTexture();
+
+public:
+    void Deinit();
+
+    bool Enabled() const
+    {
+        return enabled;
+    }
+
+    bool* EnabledFlag()
+    {
+        return &enabled;
+    }
+
+    // the counters to attach, allocated on first use
+    zx_heat_t* Heat();
+
+    // fades the levels and adds the counts since the last update
+    void Update();
+
+    void Draw(
+        const float x,
+        const float y);
+};
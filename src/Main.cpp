@@ -1,20 +1,82 @@
 #include "Main.hpp"
 
+#include <chrono>
+
 #include "sdl/SDL.hpp"
 #include "sdl/SDLFile.hpp"
 
+#include "util/MappedFile.hpp"
+#include "util/ThreadPool.hpp"
+#include "util/Trace.hpp"
+
+#include "speccy/WavTape.hpp"
+
 #include "imgui/imgui.h"
 
 extern "C" {
-#include "speccy/Speccy.h"
+#include "speccy/Snapshot.h"
+#include "speccy/Savestate.h"
+#include "speccy/Rewind.h"
+#include "speccy/Movie.h"
+#include "speccy/Debugger.h"
 }
 
 zx_t zx_sys;
 zx_desc_t zx_desc;
+zx_rewind_t zx_rewind;
+zx_movie_t zx_movie;
+zx_debug_t zx_debug;
 
 uint16_t remap_stuntcar_keys(uint16_t key);
 uint16_t remap_stuntcar_buttons(uint16_t id);
 
+// times the real decode inside zx_exec while the overlay is on
+static uint64_t decode_clock_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static bool parse_hex(const char* text, uint16_t& value)
+{
+    char* end = nullptr;
+    const unsigned long v = strtoul(text, &end, 16);
+    if ((end == text) || (*end != '\0') || (v > 0xFFFF))
+    {
+        return false;
+    }
+    value = static_cast<uint16_t>(v);
+    return true;
+}
+
+static std::string file_extension(const std::string& path)
+{
+    const size_t ext_pos = path.find_last_of('.');
+    std::string ext = (ext_pos == std::string::npos) ? "" : path.substr(ext_pos + 1);
+    for (auto& c : ext)
+    {
+        c = static_cast<char>(tolower(c));
+    }
+    return ext;
+}
+
+// the debugger stops on the breakpoint and on writes to the watched
+// bytes, either is left out while its field doesn't hold an address
+static zx_debug_cond_t debug_cond(const char* breakpoint, const char* watch, int watch_len)
+{
+    zx_debug_cond_t cond;
+    memset(&cond, 0, sizeof(cond));
+    if (parse_hex(breakpoint, cond.breakpoints[0]))
+    {
+        cond.num_breakpoints = 1;
+    }
+    if (parse_hex(watch, cond.watch_addr))
+    {
+        cond.watch_len = watch_len;
+    }
+    return cond;
+}
+
 void Main::Init()
 {
     display_pixels.resize(
@@ -29,22 +91,22 @@ void Main::Init()
 
     sdl_key_up_callback = [=](uint16_t key)
     {
-        zx_key_up(&zx_sys, remap_stuntcar_keys(key));
+        Input(ZX_MOVIE_KEY_UP, remap_stuntcar_keys(key));
     };
 
     sdl_key_down_callback = [=](uint16_t key)
     {
-        zx_key_down(&zx_sys, remap_stuntcar_keys(key));
+        Input(ZX_MOVIE_KEY_DOWN, remap_stuntcar_keys(key));
     };
 
     sdl_controller_button_up_callback = [=](uint16_t id)
     {
-        zx_key_up(&zx_sys, remap_stuntcar_buttons(id));
+        Input(ZX_MOVIE_KEY_UP, remap_stuntcar_buttons(id));
     };
 
     sdl_controller_button_down_callback = [=](uint16_t id)
     {
-        zx_key_down(&zx_sys, remap_stuntcar_buttons(id));
+        Input(ZX_MOVIE_KEY_DOWN, remap_stuntcar_buttons(id));
     };
 
     zx_desc.pixel_buffer = &display_pixels[0];
@@ -53,16 +115,368 @@ void Main::Init()
     zx_init(
         &zx_sys,
         &zx_desc);
+
+    tape_output.resize(
+        0x100000);
+
+    zx_set_tape_output(
+        &zx_sys,
+        &tape_output[0],
+        static_cast<int>(tape_output.size()));
+
+    snapshot_buffer.resize(
+        ZX_SNAPSHOT_MAX_SIZE);
+
+    state_buffer.resize(
+        ZX_SAVESTATE_MAX_SIZE);
+
+    rewind_buffer.resize(
+        rewind_budget);
+
+    zx_rewind_init(
+        &zx_rewind,
+        &rewind_buffer[0],
+        static_cast<int>(rewind_buffer.size()),
+        1,
+        250);
+
+    movie_buffer.resize(
+        movie_budget);
+
+    debug_buffer.resize(
+        debug_budget);
+
+    zx_debug_init(
+        &zx_debug,
+        &debug_buffer[0],
+        static_cast<int>(debug_buffer.size()),
+        16667,
+        10);
+}
+
+void Main::LoadFile(const std::string& path)
+{
+    TRACE_ZONE("Main::LoadFile");
+
+    const std::string ext = file_extension(path);
+
+    try
+    {
+        if ((ext == "tap") || (ext == "tzx"))
+        {
+            zx_eject_tape(&zx_sys);
+            tape_file.reset(new MappedFile(path));
+            if (!zx_insert_tape(
+                &zx_sys,
+                tape_file->Data(),
+                static_cast<int>(tape_file->Length())))
+            {
+                printf("invalid tape: %s\n", path.c_str());
+                tape_file.reset();
+            }
+        }
+        else if (ext == "wav")
+        {
+            // recordings are decoded to pulses once and played as TZX
+            ThreadPool thread_pool;
+            Speccy::WavTape wav(path, thread_pool);
+            zx_eject_tape(&zx_sys);
+            tape_file.reset();
+            tape_image = wav.TZX();
+            if (!zx_insert_tape(
+                &zx_sys,
+                &tape_image[0],
+                static_cast<int>(tape_image.size())))
+            {
+                printf("invalid tape: %s\n", path.c_str());
+            }
+        }
+        else
+        {
+            MappedFile file(path);
+            if (!zx_quickload(
+                &zx_sys,
+                file.Data(),
+                static_cast<int>(file.Length())))
+            {
+                printf("invalid snapshot: %s\n", path.c_str());
+            }
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+    }
+}
+
+void Main::SaveTapeOutput(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        printf("failed to write %s\n", path.c_str());
+        return;
+    }
+    fwrite(&tape_output[0], 1, zx_sys.tape.out_pos, file);
+    fclose(file);
+}
+
+void Main::SaveSnapshot(const std::string& path)
+{
+    const std::string ext = file_extension(path);
+    const zx_snapshot_format_t format =
+        (ext == "sna") ? ZX_SNAPSHOT_SNA :
+        (ext == "szx") ? ZX_SNAPSHOT_SZX :
+        ZX_SNAPSHOT_Z80;
+
+    const int size = zx_save_snapshot(
+        &zx_sys,
+        format,
+        &snapshot_buffer[0],
+        static_cast<int>(snapshot_buffer.size()));
+
+    if (size == 0)
+    {
+        printf("can't save snapshot: %s\n", path.c_str());
+        return;
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        printf("failed to write %s\n", path.c_str());
+        return;
+    }
+    fwrite(&snapshot_buffer[0], 1, size, file);
+    fclose(file);
+}
+
+void Main::RecordMovie(const std::string& path)
+{
+    StopMovie();
+    debugging = false;
+
+    if (!zx_movie_record(
+        &zx_movie,
+        &zx_sys,
+        &movie_buffer[0],
+        static_cast<int>(movie_buffer.size()),
+        16667,
+        300))
+    {
+        printf("can't record movie: %s\n", path.c_str());
+        return;
+    }
+    movie_path = path;
+}
+
+void Main::PlayMovie(const std::string& path)
+{
+    StopMovie();
+    debugging = false;
+
+    try
+    {
+        movie_file.reset(new MappedFile(path));
+        if (!zx_movie_play(
+            &zx_movie,
+            &zx_sys,
+            movie_file->Data(),
+            static_cast<int>(movie_file->Length())))
+        {
+            printf("invalid movie: %s\n", path.c_str());
+            movie_file.reset();
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        movie_file.reset();
+    }
+}
+
+// anything which changes the machine outside of the movie's input ends
+// recording and playback, the movie couldn't be replayed otherwise
+void Main::StopMovie()
+{
+    if (zx_movie.mode == ZX_MOVIE_RECORDING)
+    {
+        const int size = zx_movie_finish(&zx_movie);
+
+        FILE* file = fopen(movie_path.c_str(), "wb");
+        if (file == nullptr)
+        {
+            printf("failed to write %s\n", movie_path.c_str());
+        }
+        else
+        {
+            fwrite(&movie_buffer[0], 1, size, file);
+            fclose(file);
+        }
+    }
+    zx_movie_stop(&zx_movie);
+    movie_file.reset();
+}
+
+// the debugger's history can't be replayed across these either
+void Main::MachineChanged()
+{
+    StopMovie();
+    if (debugging)
+    {
+        zx_debug_reset(
+            &zx_debug,
+            &zx_sys);
+    }
+}
+
+// input goes through whatever logs it for replay
+void Main::Input(int type, int value)
+{
+    if (debugging)
+    {
+        zx_debug_input(
+            &zx_debug,
+            &zx_sys,
+            static_cast<zx_movie_record_t>(type),
+            value);
+    }
+    else
+    {
+        zx_movie_input(
+            &zx_movie,
+            &zx_sys,
+            static_cast<zx_movie_record_t>(type),
+            value);
+    }
+}
+
+void Main::DebugControls()
+{
+    if (ImGui::Checkbox(
+        "Debugger",
+        &debugging))
+    {
+        if (debugging)
+        {
+            StopMovie();
+            zx_debug_reset(
+                &zx_debug,
+                &zx_sys);
+        }
+        debug_paused = false;
+    }
+
+    if (!debugging)
+    {
+        return;
+    }
+
+    ImGui::InputText(
+        "Breakpoint",
+        debug_breakpoint,
+        sizeof(debug_breakpoint));
+
+    ImGui::InputText(
+        "Watch",
+        debug_watch,
+        sizeof(debug_watch));
+
+    ImGui::SliderInt(
+        "Watch Bytes",
+        &debug_watch_len,
+        1,
+        ZX_DEBUG_MAX_WATCH);
+
+    if (ImGui::Button(debug_paused ? "Continue" : "Pause"))
+    {
+        debug_paused = !debug_paused;
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Step"))
+    {
+        zx_debug_step(
+            &zx_debug,
+            &zx_sys);
+        debug_paused = true;
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Step Back"))
+    {
+        zx_debug_step_back(
+            &zx_debug,
+            &zx_sys,
+            1);
+        debug_paused = true;
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Frame Back") && (zx_sys.ticks > zx_sys.frame_ticks))
+    {
+        zx_debug_goto(
+            &zx_debug,
+            &zx_sys,
+            zx_sys.ticks - zx_sys.frame_ticks);
+        debug_paused = true;
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Run Back"))
+    {
+        zx_debug_cond_t cond = debug_cond(
+            debug_breakpoint,
+            debug_watch,
+            debug_watch_len);
+        if ((cond.num_breakpoints > 0) || (cond.watch_len > 0))
+        {
+            if (!zx_debug_run_back(
+                &zx_debug,
+                &zx_sys,
+                &cond))
+            {
+                printf("no earlier hit in the history\n");
+            }
+        }
+        debug_paused = true;
+    }
+
+    z80_t* cpu = &zx_sys.cpu;
+    ImGui::Text(
+        "PC %04X SP %04X AF %04X BC %04X DE %04X HL %04X IX %04X IY %04X",
+        z80_pc(cpu),
+        z80_sp(cpu),
+        z80_af(cpu),
+        z80_bc(cpu),
+        z80_de(cpu),
+        z80_hl(cpu),
+        z80_ix(cpu),
+        z80_iy(cpu));
+
+    ImGui::Text(
+        "T-state %llu, history %.1f s",
+        static_cast<unsigned long long>(zx_sys.ticks),
+        (zx_sys.ticks - zx_debug_oldest(&zx_debug)) / static_cast<float>(cpu_freq << cpu_clock));
 }
 
 void Main::Deinit()
 {
+    StopMovie();
     speccy_render.Deinit();
+    perf_overlay.Deinit();
+    heatmap_view.Deinit();
     gui.Deinit();
 }
 
 void Main::Update()
 {
+    TRACE_ZONE("Main::Update");
+
+    const bool timing = perf_overlay.BeginFrame();
+
     ImGui::NewFrame();
 
     ImGui::Begin(
@@ -78,6 +492,194 @@ void Main::Update()
         "Supersampling",
         &supersampling);
 
+    if (ImGui::Combo(
+        "CPU Clock",
+        &cpu_clock,
+        "3.5 MHz\0" "7 MHz\0" "14 MHz\0" "28 MHz\0"))
+    {
+        MachineChanged();
+
+        zx_set_cpu_freq(
+            &zx_sys,
+            cpu_freq << cpu_clock);
+    }
+
+    ImGui::InputText(
+        "File",
+        file_path,
+        sizeof(file_path));
+
+    if (ImGui::Button("Load"))
+    {
+        MachineChanged();
+        LoadFile(file_path);
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Eject Tape"))
+    {
+        zx_eject_tape(&zx_sys);
+        tape_file.reset();
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Save Tape"))
+    {
+        SaveTapeOutput(file_path);
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Save Snapshot"))
+    {
+        SaveSnapshot(file_path);
+    }
+
+    if (ImGui::Button("Save State"))
+    {
+        state_size = zx_save_state(
+            &zx_sys,
+            &state_buffer[0],
+            static_cast<int>(state_buffer.size()));
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Load State") && (state_size > 0))
+    {
+        MachineChanged();
+
+        zx_load_state(
+            &zx_sys,
+            &state_buffer[0],
+            state_size);
+    }
+
+    ImGui::Button("Rewind");
+    const bool rewinding = ImGui::IsItemActive();
+    if (rewinding)
+    {
+        MachineChanged();
+    }
+
+    ImGui::SameLine();
+
+    ImGui::Text(
+        "%.1f s, %.1f MB, %.0fx",
+        zx_rewind_count(&zx_rewind) * zx_rewind.interval * (16667 / 1e6f),
+        zx_rewind.stored_bytes / (1024.0f * 1024.0f),
+        zx_rewind_ratio(&zx_rewind));
+
+    if (ImGui::Button("Record Movie"))
+    {
+        RecordMovie(file_path);
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Play Movie"))
+    {
+        PlayMovie(file_path);
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Stop Movie"))
+    {
+        StopMovie();
+    }
+
+    if (zx_movie.mode == ZX_MOVIE_PLAYING)
+    {
+        movie_frame = zx_movie.frame;
+        if (ImGui::SliderInt(
+            "Movie Frame",
+            &movie_frame,
+            0,
+            zx_movie.num_frames))
+        {
+            zx_movie_seek(
+                &zx_movie,
+                &zx_sys,
+                movie_frame);
+        }
+    }
+    else if (zx_movie.mode == ZX_MOVIE_RECORDING)
+    {
+        ImGui::Text(
+            "Recording %.1f s, %.1f MB",
+            zx_movie.frame / 60.0f,
+            zx_movie.pos / (1024.0f * 1024.0f));
+    }
+
+    // tape controls change the emulation, so they are logged like keys
+    if (ImGui::Button("Play"))
+    {
+        Input(
+            ZX_MOVIE_TAPE_PLAY,
+            0);
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Stop"))
+    {
+        Input(
+            ZX_MOVIE_TAPE_STOP,
+            0);
+    }
+
+    bool flash_load = zx_sys.tape_flash_load;
+    if (ImGui::Checkbox(
+        "Flash Load",
+        &flash_load))
+    {
+        Input(
+            ZX_MOVIE_FLASH_LOAD,
+            flash_load);
+    }
+
+    bool accelerate = zx_sys.tape_accelerate;
+    if (ImGui::Checkbox(
+        "Accelerate Loaders",
+        &accelerate))
+    {
+        Input(
+            ZX_MOVIE_ACCELERATE,
+            accelerate);
+    }
+
+    ImGui::Checkbox(
+        "Fast Forward Tape",
+        &fast_forward_tape);
+
+    ImGui::Checkbox(
+        "Performance",
+        perf_overlay.EnabledFlag());
+
+#if !defined(ZX_NO_HEATMAP)
+    ImGui::Checkbox(
+        "Heatmap",
+        heatmap_view.EnabledFlag());
+#endif
+
+    DebugControls();
+
+#if defined(ZXSC_TRACE)
+    if (ImGui::Button("Dump Trace"))
+    {
+        if (Trace::Dump("trace.json"))
+        {
+            printf("trace written to trace.json\n");
+        }
+    }
+#endif
+
+    const ImVec2 menu_pos = ImGui::GetWindowPos();
+    const ImVec2 menu_size = ImGui::GetWindowSize();
+
     ImGui::End();
 
     if (update_count == 180)
@@ -85,24 +687,197 @@ void Main::Update()
         File file("files/scr.z80", "rb");
         std::vector<uint8_t> data(file.Length());
         file.Read(&data[0], sizeof(uint8_t), file.Length());
+        MachineChanged();
         zx_quickload(&zx_sys, &data[0], static_cast<int>(file.Length()));
         printf("file loaded\n");
     }
 
-    zx_exec(
-        &zx_sys,
-        16667);
+    // memory accesses are only counted while the heatmap is open
+    zx_heat_t* heat = heatmap_view.Enabled() ? heatmap_view.Heat() : 0;
+    if (zx_sys.heat != heat)
+    {
+        zx_set_heatmap(
+            &zx_sys,
+            heat);
+    }
+
+    const zx_clock_t decode_clock = timing ? decode_clock_ns : 0;
+    if (zx_sys.decode_clock != decode_clock)
+    {
+        zx_set_decode_clock(
+            &zx_sys,
+            decode_clock);
+    }
+
+    // run several frames per update while the tape plays, the
+    // accelerated loaders keep this cheap
+    const int num_frames = (fast_forward_tape && zx_sys.tape.playing) ?
+        fast_forward_frames : 1;
+
+    // frames the machine ran to the end, for the speed
+    int frames_run = 0;
+
+    if (timing)
+    {
+        perf_overlay.Begin(
+            PerfOverlay::STAGE_EXEC);
+    }
+
+    if (rewinding)
+    {
+        // one capture back, running the frame after it redraws the screen
+        zx_rewind_step_back(
+            &zx_rewind,
+            &zx_sys);
+
+        zx_exec(
+            &zx_sys,
+            16667);
+
+        frames_run++;
+    }
+    else if (debugging)
+    {
+        // a hit pauses in the middle of the frame, continuing resumes it
+        for (int i = 0; (i < num_frames) && !debug_paused; i++)
+        {
+            zx_debug_cond_t cond = debug_cond(
+                debug_breakpoint,
+                debug_watch,
+                debug_watch_len);
+            debug_paused = zx_debug_run(
+                &zx_debug,
+                &zx_sys,
+                &cond);
+
+            frames_run += debug_paused ? 0 : 1;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < num_frames; i++)
+        {
+            if (zx_movie.mode == ZX_MOVIE_RECORDING)
+            {
+                if (!zx_movie_record_frame(
+                    &zx_movie,
+                    &zx_sys))
+                {
+                    StopMovie();
+                }
+            }
+            else if (zx_movie.mode == ZX_MOVIE_PLAYING)
+            {
+                // stays on the last frame at the end of the movie
+                zx_movie_play_frame(
+                    &zx_movie,
+                    &zx_sys);
+            }
+            else
+            {
+                zx_exec(
+                    &zx_sys,
+                    16667);
+            }
+
+            zx_rewind_push(
+                &zx_rewind,
+                &zx_sys);
+
+            frames_run++;
+        }
+    }
+
+    if (heatmap_view.Enabled())
+    {
+        heatmap_view.Update();
+
+        heatmap_view.Draw(
+            menu_pos.x,
+            menu_pos.y + menu_size.y + 10.0f);
+    }
+
+    if (!timing)
+    {
+        speccy_render.Draw(
+            sdl_window_width,
+            sdl_window_height,
+            zx_sys.border_color,
+            supersampling);
+
+        gui.Draw(
+            sdl_window_width,
+            sdl_window_height);
+
+        update_count++;
+        return;
+    }
+
+    perf_overlay.End(
+        PerfOverlay::STAGE_EXEC);
+
+    // the decode runs inside zx_exec, its share is taken off the exec time
+    const double decode_ms = zx_sys.decode_time / 1e6;
+    zx_sys.decode_time = 0;
+
+    perf_overlay.Add(
+        PerfOverlay::STAGE_DECODE,
+        decode_ms);
 
-    speccy_render.Draw(
+    perf_overlay.Add(
+        PerfOverlay::STAGE_EXEC,
+        -decode_ms);
+
+    perf_overlay.Begin(
+        PerfOverlay::STAGE_UPLOAD);
+
+    speccy_render.UploadDisplay();
+
+    perf_overlay.End(
+        PerfOverlay::STAGE_UPLOAD);
+
+    if (supersampling)
+    {
+        perf_overlay.Begin(
+            PerfOverlay::STAGE_SUPERSAMPLE);
+
+        speccy_render.DrawSupersampled();
+
+        perf_overlay.End(
+            PerfOverlay::STAGE_SUPERSAMPLE);
+    }
+
+    perf_overlay.Begin(
+        PerfOverlay::STAGE_PRESENT);
+
+    speccy_render.DrawWindow(
         sdl_window_width,
         sdl_window_height,
         zx_sys.border_color,
         supersampling);
 
+    perf_overlay.End(
+        PerfOverlay::STAGE_PRESENT);
+
+    perf_overlay.Draw(
+        menu_pos.x + menu_size.x + 10.0f,
+        menu_pos.y);
+
+    perf_overlay.Begin(
+        PerfOverlay::STAGE_GUI);
+
     gui.Draw(
         sdl_window_width,
         sdl_window_height);
 
+    perf_overlay.End(
+        PerfOverlay::STAGE_GUI);
+
+    perf_overlay.EndFrame(
+        static_cast<uint32_t>(frames_run) * 16667,
+        16667,
+        zx_sys.clk.overrun_ticks);
+
     update_count++;
 }
 
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "GUI.hpp"
+#include "PerfOverlay.hpp"
+#include "HeatmapView.hpp"
+
+#include "util/MappedFile.hpp"
 
 #include "speccy/Render.hpp"
 
@@ -17,8 +23,52 @@ private:
     GUI gui;
 
     bool supersampling = true;
+    int cpu_clock = 0;
+
+    bool fast_forward_tape = true;
+    const int fast_forward_frames = 25;
+
+    char file_path[256] = "files/scr.z80";
+    std::unique_ptr<MappedFile> tape_file;
+    std::vector<uint8_t> tape_image;
+    std::vector<uint8_t> tape_output;
+    std::vector<uint8_t> snapshot_buffer;
+    std::vector<uint8_t> state_buffer;
+    int state_size = 0;
+
+    std::vector<uint8_t> rewind_buffer;
+    const int rewind_budget = 64 << 20;
+
+    std::vector<uint8_t> movie_buffer;
+    const int movie_budget = 64 << 20;
+    std::unique_ptr<MappedFile> movie_file;
+    std::string movie_path;
+    int movie_frame = 0;
+
+    std::vector<uint8_t> debug_buffer;
+    const int debug_budget = 32 << 20;
+    bool debugging = false;
+    bool debug_paused = false;
+    char debug_breakpoint[8] = "";
+    char debug_watch[8] = "";
+    int debug_watch_len = 1;
+
     Speccy::Render speccy_render;
 
+    PerfOverlay perf_overlay;
+
+    HeatmapView heatmap_view;
+
+    void LoadFile(const std::string& path);
+    void SaveTapeOutput(const std::string& path);
+    void SaveSnapshot(const std::string& path);
+    void RecordMovie(const std::string& path);
+    void PlayMovie(const std::string& path);
+    void StopMovie();
+    void MachineChanged();
+    void Input(int type, int value);
+    void DebugControls();
+
 public:
     void Init();
     void Deinit();
@@ -0,0 +1,322 @@
+#include "PerfOverlay.hpp"
+
+#include "imgui/imgui.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static const char* stage_names[PerfOverlay::NUM_STAGES] =
+{
+    "zx_exec",
+    "Scanline Decode",
+    "Texture Upload",
+    "Supersample",
+    "Final Blit",
+    "GUI",
+    "Swap / Wait"
+};
+
+PerfOverlay::PerfOverlay()
+{
+    memset(queries, 0, sizeof(queries));
+    memset(query_pending, 0, sizeof(query_pending));
+    memset(query_history, 0, sizeof(query_history));
+    memset(history, 0, sizeof(history));
+    memset(speed_history, 0, sizeof(speed_history));
+    memset(frame_ms, 0, sizeof(frame_ms));
+}
+
+void PerfOverlay::Deinit()
+{
+    if (queries_created)
+    {
+        glDeleteQueries(
+            query_latency * NUM_STAGES,
+            &queries[0][0]);
+
+        queries_created = false;
+    }
+}
+
+bool PerfOverlay::IsGPUStage(const Stage stage)
+{
+    return
+        (stage == STAGE_UPLOAD) ||
+        (stage == STAGE_SUPERSAMPLE) ||
+        (stage == STAGE_PRESENT) ||
+        (stage == STAGE_GUI);
+}
+
+void PerfOverlay::CreateQueries()
+{
+    queries_created = true;
+
+    const char* extensions = reinterpret_cast<const char*>(
+        glGetString(GL_EXTENSIONS));
+
+    const char* renderer = reinterpret_cast<const char*>(
+        glGetString(GL_RENDERER));
+
+    // software renderers rasterize at the next flush, their queries
+    // time the wrong stages so the CPU times are the better guess
+    const bool software = renderer &&
+        (strstr(renderer, "llvmpipe") ||
+        strstr(renderer, "softpipe") ||
+        strstr(renderer, "SwiftShader"));
+
+    // GL_EXT_disjoint_timer_query, or its webgl2 flavour
+    gpu_timers = !software &&
+        extensions &&
+        strstr(extensions, "disjoint_timer_query");
+
+    if (gpu_timers)
+    {
+        glGenQueries(
+            query_latency * NUM_STAGES,
+            &queries[0][0]);
+    }
+}
+
+void PerfOverlay::ReadQueries()
+{
+    // a disjoint clock voids everything in flight
+    GLint disjoint = 0;
+    glGetIntegerv(
+        GL_GPU_DISJOINT_EXT,
+        &disjoint);
+
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        if (!query_pending[query_frame][stage])
+        {
+            continue;
+        }
+
+        query_pending[query_frame][stage] = false;
+
+        GLuint available = 0;
+        glGetQueryObjectuiv(
+            queries[query_frame][stage],
+            GL_QUERY_RESULT_AVAILABLE,
+            &available);
+
+        // keep the CPU time rather than stall on a late result
+        if (disjoint || !available)
+        {
+            continue;
+        }
+
+        GLuint ns = 0;
+        glGetQueryObjectuiv(
+            queries[query_frame][stage],
+            GL_QUERY_RESULT,
+            &ns);
+
+        history[stage][query_history[query_frame]] = ns / 1e6f;
+    }
+}
+
+bool PerfOverlay::BeginFrame()
+{
+    if (!enabled)
+    {
+        has_previous_frame = false;
+        return false;
+    }
+
+    if (!queries_created)
+    {
+        CreateQueries();
+    }
+
+    const Clock::time_point now = Clock::now();
+
+    if (has_previous_frame)
+    {
+        // the swap and the wait for vsync belong to the previous frame
+        const int previous = (history_index + history_length - 1) % history_length;
+
+        history[STAGE_SWAP][previous] = std::chrono::duration<float, std::milli>(
+            now - update_end).count();
+
+        const float period_us = std::chrono::duration<float, std::micro>(
+            now - frame_start).count();
+
+        speed_history[previous] = (period_us > 0.0f) ?
+            (100.0f * last_emulated_us / period_us) : 0.0f;
+
+        // a late update means the display showed a frame twice
+        if ((last_emulated_us > 0) && (period_us > 1.5f * last_frame_us))
+        {
+            dropped_frames += static_cast<uint32_t>(
+                std::lround(period_us / last_frame_us)) - 1;
+        }
+    }
+
+    frame_start = now;
+
+    memset(frame_ms, 0, sizeof(frame_ms));
+
+    if (gpu_timers)
+    {
+        ReadQueries();
+    }
+
+    return true;
+}
+
+void PerfOverlay::Begin(const Stage stage)
+{
+    stage_start[stage] = Clock::now();
+
+    if (gpu_timers && IsGPUStage(stage))
+    {
+        glBeginQuery(
+            GL_TIME_ELAPSED_EXT,
+            queries[query_frame][stage]);
+    }
+}
+
+void PerfOverlay::End(const Stage stage)
+{
+    if (gpu_timers && IsGPUStage(stage))
+    {
+        glEndQuery(
+            GL_TIME_ELAPSED_EXT);
+
+        query_pending[query_frame][stage] = true;
+    }
+
+    frame_ms[stage] += std::chrono::duration<float, std::milli>(
+        Clock::now() - stage_start[stage]).count();
+}
+
+void PerfOverlay::Add(
+    const Stage stage,
+    const double ms)
+{
+    frame_ms[stage] += static_cast<float>(ms);
+}
+
+void PerfOverlay::EndFrame(
+    const uint32_t emulated_us,
+    const uint32_t frame_us,
+    const int clk_overrun_ticks)
+{
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        if (stage != STAGE_SWAP)
+        {
+            history[stage][history_index] = frame_ms[stage];
+        }
+    }
+
+    // an update that ran nothing puts the same picture up again
+    if (emulated_us == 0)
+    {
+        duplicated_frames++;
+    }
+
+    overrun_ticks = clk_overrun_ticks;
+    if (overrun_ticks > max_overrun_ticks)
+    {
+        max_overrun_ticks = overrun_ticks;
+    }
+
+    last_emulated_us = emulated_us;
+    last_frame_us = frame_us;
+
+    query_history[query_frame] = history_index;
+    query_frame = (query_frame + 1) % query_latency;
+    history_index = (history_index + 1) % history_length;
+
+    update_end = Clock::now();
+    has_previous_frame = true;
+}
+
+void PerfOverlay::Draw(
+    const float x,
+    const float y)
+{
+    ImGui::SetNextWindowPos(
+        ImVec2(x, y),
+        ImGuiCond_Appearing);
+
+    ImGui::Begin(
+        "Performance",
+        &enabled,
+        ImGuiWindowFlags_AlwaysAutoResize);
+
+    ImGui::Text(
+        "Stage times in ms, %s",
+        gpu_timers ? "GPU stages from timer queries" : "CPU timed");
+
+    char overlay[64];
+
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        float sum = 0.0f;
+        float max = 0.0f;
+        for (int i = 0; i < history_length; i++)
+        {
+            sum += history[stage][i];
+            max = (history[stage][i] > max) ? history[stage][i] : max;
+        }
+
+        snprintf(
+            overlay,
+            sizeof(overlay),
+            "avg %.2f max %.2f",
+            sum / history_length,
+            max);
+
+        ImGui::PlotHistogram(
+            stage_names[stage],
+            history[stage],
+            history_length,
+            history_index,
+            overlay,
+            0.0f,
+            FLT_MAX,
+            ImVec2(240, 40));
+    }
+
+    const int latest = (history_index + history_length - 2) % history_length;
+
+    snprintf(
+        overlay,
+        sizeof(overlay),
+        "%.0f%%",
+        speed_history[latest]);
+
+    ImGui::PlotLines(
+        "Speed",
+        speed_history,
+        history_length,
+        history_index,
+        overlay,
+        0.0f,
+        200.0f,
+        ImVec2(240, 40));
+
+    ImGui::Text(
+        "Overrun ticks %d (max %d)",
+        overrun_ticks,
+        max_overrun_ticks);
+
+    ImGui::Text(
+        "Dropped %u, duplicated %u",
+        dropped_frames,
+        duplicated_frames);
+
+    if (ImGui::Button("Reset"))
+    {
+        max_overrun_ticks = 0;
+        dropped_frames = 0;
+        duplicated_frames = 0;
+    }
+
+    ImGui::End();
+}
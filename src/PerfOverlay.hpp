@@ -0,0 +1,103 @@
+#pragma once
+
+#include "gl/GL.hpp"
+
+#include <chrono>
+#include <stdint.h>
+
+// Rolling frame time breakdown shown next to the menu. While it's
+// disabled nothing is timed and no queries are issued, Main draws the
+// frame in one go as before.
+class PerfOverlay
+{
+public:
+    enum Stage
+    {
+        STAGE_EXEC,
+        STAGE_DECODE,
+        STAGE_UPLOAD,
+        STAGE_SUPERSAMPLE,
+        STAGE_PRESENT,
+        STAGE_GUI,
+        STAGE_SWAP,
+        NUM_STAGES
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static const int history_length = 120;
+
+    // GPU results are read back this many frames late, so reading them
+    // doesn't wait for the GPU
+    static const int query_latency = 4;
+
+    bool enabled = false;
+    bool gpu_timers = false;
+    bool queries_created = false;
+
+    GLuint queries[query_latency][NUM_STAGES];
+    bool query_pending[query_latency][NUM_STAGES];
+    int query_history[query_latency];
+    int query_frame = 0;
+
+    Clock::time_point stage_start[NUM_STAGES];
+    Clock::time_point frame_start;
+    Clock::time_point update_end;
+    bool has_previous_frame = false;
+
+    float history[NUM_STAGES][history_length];
+    float speed_history[history_length];
+    int history_index = 0;
+
+    float frame_ms[NUM_STAGES];
+
+    int overrun_ticks = 0;
+    int max_overrun_ticks = 0;
+    uint32_t dropped_frames = 0;
+    uint32_t duplicated_frames = 0;
+    uint32_t last_emulated_us = 0;
+    uint32_t last_frame_us = 16667;
+
+    static bool IsGPUStage(const Stage stage);
+
+    void CreateQueries();
+    void ReadQueries();
+
+public:
+    PerfOverlay();
+
+    void Deinit();
+
+    bool Enabled() const
+    {
+        return enabled;
+    }
+
+    bool* EnabledFlag()
+    {
+        return &enabled;
+    }
+
+    // start of an update, the time since the last one ended is what
+    // swapping and waiting for the display took. false when disabled,
+    // the rest of the update then skips timing altogether
+    bool BeginFrame();
+
+    void Begin(const Stage stage);
+    void End(const Stage stage);
+    void Add(
+        const Stage stage,
+        const double ms);
+
+    // emulated_us is the emulated time this update ran, frame_us what a
+    // display refresh takes
+    void EndFrame(
+        const uint32_t emulated_us,
+        const uint32_t frame_us,
+        const int clk_overrun_ticks);
+
+    void Draw(
+        const float x,
+        const float y);
+};
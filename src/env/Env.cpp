@@ -0,0 +1,299 @@
+#include "Env.h"
+
+#include "../util/HugeBuffer.hpp"
+#include "../util/ThreadPool.hpp"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Pool.h"
+#include "../speccy/Observe.h"
+}
+
+#include <string.h>
+
+#include <algorithm>
+#include <exception>
+#include <vector>
+
+static const uint32_t frame_us = 20000;
+static const uint64_t input_mask = (static_cast<uint64_t>(1) << 40) - 1;
+
+// a step hands out a few ranges of machines per thread, enough to even
+// out machines which take longer (tape loaders) without taking the
+// thread pool's lock for every single one
+static const size_t ranges_per_thread = 4;
+
+struct zxsc_env
+{
+    const int num_envs;
+    ThreadPool thread_pool;
+    HugeBuffer arena;
+    zx_pool_t pool;
+    std::vector<zx_t*> machines;
+    std::vector<uint64_t> held;
+    std::vector<uint32_t> frames;
+    std::vector<uint32_t> pixels;
+
+    // resets fork this, it never runs
+    zx_t base;
+    bool loaded = false;
+
+    zxsc_env(int num_envs, int num_threads, int flags) :
+        num_envs(num_envs),
+        thread_pool(static_cast<size_t>(num_threads)),
+        arena(zx_pool_bytes(num_envs, ZX_RAM_BANKS)),
+        machines(num_envs),
+        held(num_envs),
+        frames(num_envs)
+    {
+        zx_pool_init(
+            &pool,
+            arena.Data(),
+            arena.Length());
+
+        if (flags & ZXSC_ENV_PIXELS)
+        {
+            pixels.resize(static_cast<size_t>(num_envs) * DISPLAY_WIDTH * DISPLAY_HEIGHT);
+        }
+
+        zx_desc_t desc;
+        memset(&desc, 0, sizeof(desc));
+        for (int i = 0; i < num_envs; i++)
+        {
+            if (!pixels.empty())
+            {
+                desc.pixel_buffer = Pixels(i);
+                desc.pixel_buffer_size = DISPLAY_BYTES;
+            }
+            machines[i] = zx_pool_alloc(&pool, &desc);
+        }
+
+        memset(&desc, 0, sizeof(desc));
+        zx_init(&base, &desc);
+    }
+
+    ~zxsc_env()
+    {
+        zx_discard(&base);
+    }
+
+    uint32_t* Pixels(int index)
+    {
+        return pixels.empty() ? nullptr : &pixels[static_cast<size_t>(index) * DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    }
+
+    // runs task(index) for every machine, on all threads
+    template<typename Task>
+    void ForEach(const Task& task)
+    {
+        const size_t count = static_cast<size_t>(num_envs);
+        const size_t num_ranges = std::min(count, thread_pool.ThreadCount() * ranges_per_thread);
+        thread_pool.Run(num_ranges, [&](size_t range)
+        {
+            const size_t begin = (count * range) / num_ranges;
+            const size_t end = (count * (range + 1)) / num_ranges;
+            for (size_t i = begin; i < end; i++)
+            {
+                task(static_cast<int>(i));
+            }
+        });
+    }
+};
+
+// key codes the keyboard matrix is registered with, by input mask bit
+static int key_code(int bit)
+{
+    switch (bit)
+    {
+    case 0: return 0x0E;    // caps shift
+    case 30: return 0x0D;   // enter
+    case 35: return ' ';
+    case 36: return 0x0F;   // symbol shift
+    default: return _zx_keymap[bit];
+    }
+}
+
+static bool valid_index(const zxsc_env_t* env, int index)
+{
+    return env && (index >= 0) && (index < env->num_envs);
+}
+
+int zxsc_env_version(void)
+{
+    return ZXSC_ENV_VERSION;
+}
+
+zxsc_env_t* zxsc_env_create(int num_envs, int num_threads, int flags)
+{
+    if ((num_envs <= 0) || (num_threads < 0))
+    {
+        return nullptr;
+    }
+    try
+    {
+        zxsc_env_t* env = new zxsc_env(num_envs, num_threads, flags);
+        if (std::find(env->machines.begin(), env->machines.end(), nullptr) != env->machines.end())
+        {
+            delete env;
+            return nullptr;
+        }
+        return env;
+    }
+    catch (const std::exception&)
+    {
+        return nullptr;
+    }
+}
+
+void zxsc_env_destroy(zxsc_env_t* env)
+{
+    delete env;
+}
+
+int zxsc_env_count(const zxsc_env_t* env)
+{
+    return env ? env->num_envs : 0;
+}
+
+int zxsc_env_load(zxsc_env_t* env, const uint8_t* snapshot, int num_bytes)
+{
+    if (!env || !snapshot || (num_bytes <= 0))
+    {
+        return 0;
+    }
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    zx_discard(&env->base);
+    zx_init(&env->base, &desc);
+    env->loaded = zx_quickload(&env->base, snapshot, num_bytes);
+    return env->loaded ? 1 : 0;
+}
+
+void zxsc_env_reset(zxsc_env_t* env, const uint8_t* reset)
+{
+    if (!env || !env->loaded)
+    {
+        return;
+    }
+
+    // the pool hands out banks on one thread only, forks into machines
+    // which have all of the base's banks don't need any
+    for (int i = 0; i < env->num_envs; i++)
+    {
+        for (int bank = 0; bank < ZX_RAM_BANKS; bank++)
+        {
+            if ((!reset || reset[i]) && env->base.ram[bank])
+            {
+                _zx_alloc_bank(env->machines[i], bank);
+            }
+        }
+    }
+
+    // every machine gets its own copy of the RAM, so the views into it
+    // are plain banks and loading another base doesn't pull it away
+    env->ForEach([&](int i)
+    {
+        if (reset && !reset[i])
+        {
+            return;
+        }
+        zx_t* sys = env->machines[i];
+        zx_fork(sys, &env->base);
+        zx_unshare(sys);
+        sys->pixel_buffer = env->Pixels(i);
+        sys->video_decode = (nullptr != sys->pixel_buffer);
+        env->held[i] = 0;
+        env->frames[i] = 0;
+    });
+}
+
+void zxsc_env_step(zxsc_env_t* env, const uint64_t* inputs, int num_frames)
+{
+    if (!env || (num_frames <= 0))
+    {
+        return;
+    }
+    env->ForEach([&](int i)
+    {
+        zx_t* sys = env->machines[i];
+        const uint64_t keys = inputs ? (inputs[i] & input_mask) : 0;
+        const uint64_t changed = keys ^ env->held[i];
+        for (int bit = 0; (changed >> bit) != 0; bit++)
+        {
+            if (((changed >> bit) & 1) == 0)
+            {
+                continue;
+            }
+            if ((keys >> bit) & 1)
+            {
+                zx_key_down(sys, key_code(bit));
+            }
+            else
+            {
+                zx_key_up(sys, key_code(bit));
+            }
+        }
+        env->held[i] = keys;
+
+        for (int frame = 0; frame < num_frames; frame++)
+        {
+            zx_exec(sys, frame_us);
+        }
+        env->frames[i] += num_frames;
+    });
+}
+
+int zxsc_env_observe(zxsc_env_t* env, int format, int width, int height, int stack, uint8_t* out)
+{
+    zx_obs_t obs;
+    const zx_obs_format_t obs_format = ((format & 0xFF) == ZXSC_ENV_OBS_GRAY) ? ZX_OBS_GRAY : ZX_OBS_INDEX;
+    if (!env || !out || (stack <= 0) || !zx_obs_init(&obs, obs_format, width, height, 0 != (format & ZXSC_ENV_OBS_BORDER)))
+    {
+        return 0;
+    }
+    const size_t frame_bytes = static_cast<size_t>(width) * height;
+    const size_t env_bytes = frame_bytes * stack;
+    env->ForEach([&](int i)
+    {
+        uint8_t* frames = out + (env_bytes * i);
+        memmove(frames, frames + frame_bytes, env_bytes - frame_bytes);
+        zx_observe(&obs, env->machines[i], frames + (env_bytes - frame_bytes));
+    });
+    return static_cast<int>(env_bytes);
+}
+
+const uint8_t* zxsc_env_screen(const zxsc_env_t* env, int index)
+{
+    if (!valid_index(env, index))
+    {
+        return nullptr;
+    }
+    const zx_t* sys = env->machines[index];
+    return sys->ram[sys->display_ram_bank];
+}
+
+int zxsc_env_border(const zxsc_env_t* env, int index)
+{
+    return valid_index(env, index) ? (env->machines[index]->last_fe_out & 7) : 0;
+}
+
+const uint32_t* zxsc_env_pixels(const zxsc_env_t* env, int index)
+{
+    return valid_index(env, index) ? env->machines[index]->pixel_buffer : nullptr;
+}
+
+const uint8_t* zxsc_env_ram(const zxsc_env_t* env, int index, int bank)
+{
+    if (!valid_index(env, index) || (bank < 0) || (bank >= ZX_RAM_BANKS))
+    {
+        return nullptr;
+    }
+    return env->machines[index]->ram[bank];
+}
+
+uint32_t zxsc_env_frames(const zxsc_env_t* env, int index)
+{
+    return valid_index(env, index) ? env->frames[index] : 0;
+}
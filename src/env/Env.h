@@ -0,0 +1,112 @@
+#pragma once
+
+// Batched environments for training and search loops: a fixed number of
+// machines which are reset from one snapshot and stepped together,
+// every machine with its own keys held down, spread over a thread pool.
+//
+//     zxsc_env_t* env = zxsc_env_create(256, 0, 0);
+//     zxsc_env_load(env, snapshot, snapshot_size);
+//     zxsc_env_reset(env, NULL);
+//     for (;;)
+//     {
+//         zxsc_env_step(env, actions, 4);
+//         for (int i = 0; i < 256; i++)
+//             observe(zxsc_env_screen(env, i));
+//     }
+//
+// The views point straight into the machines, nothing is copied. A RAM
+// bank doesn't move once a machine has it, screen and pixel views are
+// valid until the next step or reset (the 128K switches screen banks).
+//
+// Inputs are one mask per machine with a bit per key of the 40 key
+// matrix, see ZXSC_ENV_KEY. A key stays down as long as its bit is set,
+// the keyboard only takes 4 keys at a time though.
+//
+// This is a C ABI, only the functions below are exported and the
+// machines are opaque, so the library can change under a caller
+// without rebuilding it as long as ZXSC_ENV_VERSION stays the same.
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+    #if defined(ZXSC_ENV_BUILD)
+        #define ZXSC_ENV_API __declspec(dllexport)
+    #else
+        #define ZXSC_ENV_API __declspec(dllimport)
+    #endif
+#else
+    #define ZXSC_ENV_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ZXSC_ENV_VERSION (1)
+
+// create flags
+#define ZXSC_ENV_PIXELS (1 << 0)    // decode video into RGBA pixel buffers
+
+// half rows of the matrix, as selected by address lines A8 to A15
+#define ZXSC_ENV_ROW_SHIFT_V (0)    // caps shift, z, x, c, v
+#define ZXSC_ENV_ROW_A_G (1)        // a, s, d, f, g
+#define ZXSC_ENV_ROW_Q_T (2)        // q, w, e, r, t
+#define ZXSC_ENV_ROW_1_5 (3)        // 1, 2, 3, 4, 5
+#define ZXSC_ENV_ROW_0_6 (4)        // 0, 9, 8, 7, 6
+#define ZXSC_ENV_ROW_P_Y (5)        // p, o, i, u, y
+#define ZXSC_ENV_ROW_ENTER_H (6)    // enter, l, k, j, h
+#define ZXSC_ENV_ROW_SPACE_B (7)    // space, symbol shift, m, n, b
+
+// input mask bit of a key, column counts from the outer end of the row
+#define ZXSC_ENV_KEY(row, column) ((uint64_t)1 << ((row) * 5 + (column)))
+
+#define ZXSC_ENV_SCREEN_BYTES (6912)    // bitmap followed by attributes
+#define ZXSC_ENV_RAM_BANKS (8)
+#define ZXSC_ENV_RAM_BANK_BYTES (0x4000)
+#define ZXSC_ENV_PIXELS_WIDTH (320)
+#define ZXSC_ENV_PIXELS_HEIGHT (256)
+
+// observation formats, one byte per pixel
+#define ZXSC_ENV_OBS_INDEX (0)      // palette index, 8-15 are the bright colors
+#define ZXSC_ENV_OBS_GRAY (1)
+#define ZXSC_ENV_OBS_BORDER (1 << 8)    // 320x256 with the border, else 256x192
+
+typedef struct zxsc_env zxsc_env_t;
+
+ZXSC_ENV_API int zxsc_env_version(void);
+
+// 0 threads picks one per hardware thread, returns NULL on failure
+ZXSC_ENV_API zxsc_env_t* zxsc_env_create(int num_envs, int num_threads, int flags);
+ZXSC_ENV_API void zxsc_env_destroy(zxsc_env_t* env);
+ZXSC_ENV_API int zxsc_env_count(const zxsc_env_t* env);
+
+// sets the state resets start from, a .z80, .sna or .szx snapshot,
+// returns 0 if the snapshot can't be loaded
+ZXSC_ENV_API int zxsc_env_load(zxsc_env_t* env, const uint8_t* snapshot, int num_bytes);
+
+// resets the machines whose reset byte is non-zero, NULL resets all,
+// and releases their keys
+ZXSC_ENV_API void zxsc_env_reset(zxsc_env_t* env, const uint8_t* reset);
+
+// runs every machine for num_frames frames with its input mask held
+// down, NULL inputs release all keys
+ZXSC_ENV_API void zxsc_env_step(zxsc_env_t* env, const uint64_t* inputs, int num_frames);
+
+ZXSC_ENV_API const uint8_t* zxsc_env_screen(const zxsc_env_t* env, int index);
+ZXSC_ENV_API int zxsc_env_border(const zxsc_env_t* env, int index);
+// NULL unless created with ZXSC_ENV_PIXELS
+ZXSC_ENV_API const uint32_t* zxsc_env_pixels(const zxsc_env_t* env, int index);
+// NULL for banks the loaded machine doesn't have
+ZXSC_ENV_API const uint8_t* zxsc_env_ram(const zxsc_env_t* env, int index, int bank);
+// writes every machine's screen into out, width x height bytes per
+// frame scaled down from the screen. With a stack of n frames each
+// machine has n frames in out, oldest first, which move up by one to
+// make room for the new one. Returns the bytes per machine, 0 if the
+// size is bigger than the screen
+ZXSC_ENV_API int zxsc_env_observe(zxsc_env_t* env, int format, int width, int height, int stack, uint8_t* out);
+// frames run since the last reset
+ZXSC_ENV_API uint32_t zxsc_env_frames(const zxsc_env_t* env, int index);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
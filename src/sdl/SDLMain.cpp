@@ -6,6 +6,8 @@
 
 #include "../gl/GL.hpp"
 
+#include "../util/Trace.hpp"
+
 #include "SDL.hpp"
 #include "SDLFile.hpp"
 #include "SDLImgui.hpp"
@@ -53,6 +55,8 @@ int main(int argc, char *argv[])
     sdl_imgui_initialise();
     sdl_init_graphics();
 
+    TRACE_THREAD_NAME("main");
+
     m.Init();
 
     bool done = false;
@@ -70,7 +74,11 @@ int main(int argc, char *argv[])
         sdl_imgui_update_cursor();
 
         m.Update();
-        eglSwapBuffers(egl_display, egl_surface);
+
+        {
+            TRACE_ZONE("eglSwapBuffers");
+            eglSwapBuffers(egl_display, egl_surface);
+        }
     }
 
     m.Deinit();
@@ -0,0 +1,181 @@
+#include "Coverage.hpp"
+
+#include <stdio.h>
+
+#include <iostream>
+#include <stdexcept>
+
+namespace Speccy
+{
+    static const int access_read = 1;
+    static const int access_write = 2;
+    static const int access_exec = 4;
+
+    static int access(
+        const zx_heat_t& heat,
+        const uint32_t phys)
+    {
+        return
+            (heat.counts[ZX_HEAT_READ][phys] ? access_read : 0) |
+            (heat.counts[ZX_HEAT_WRITE][phys] ? access_write : 0) |
+            (heat.counts[ZX_HEAT_EXEC][phys] ? access_exec : 0);
+    }
+
+    // CPU address a physical one is paged in at, -1 if it isn't
+    static int cpu_address(
+        const zx_heat_t& heat,
+        const uint32_t phys)
+    {
+        const uint32_t page_mask = (1 << ZX_HEAT_PAGE_SHIFT) - 1;
+        for (int page = 0; page < ZX_HEAT_CPU_PAGES; page++)
+        {
+            if (heat.page_base[page] == (phys & ~page_mask))
+            {
+                return (page << ZX_HEAT_PAGE_SHIFT) | static_cast<int>(phys & page_mask);
+            }
+        }
+        return -1;
+    }
+
+    static void region_name(
+        const uint32_t phys,
+        char* name,
+        const size_t size)
+    {
+        const int bank = zx_heat_bank(phys);
+        if (bank < 0)
+        {
+            snprintf(name, size, "rom");
+        }
+        else
+        {
+            snprintf(name, size, "bank%d", bank);
+        }
+    }
+
+    static uint32_t region_start(
+        const uint32_t phys)
+    {
+        const int bank = zx_heat_bank(phys);
+        return (bank < 0) ? 0 : (ZX_HEAT_ROM_SIZE + bank * ZX_HEAT_BANK_SIZE);
+    }
+
+    static void write_range(
+        FILE* file,
+        const zx_heat_t& heat,
+        const uint32_t first,
+        const uint32_t last,
+        const int flags)
+    {
+        char name[16];
+        region_name(first, name, sizeof(name));
+
+        const uint32_t start = region_start(first);
+        fprintf(file, "%-6s  %04X-%04X  ", name, first - start, last - start);
+
+        const int cpu = cpu_address(heat, first);
+        if (cpu >= 0)
+        {
+            fprintf(file, "%04X-%04X", cpu, cpu + (last - first));
+        }
+        else
+        {
+            fprintf(file, "----     ");
+        }
+
+        fprintf(file, "  %c%c%c\n",
+            (flags & access_exec) ? 'x' : '-',
+            (flags & access_read) ? 'r' : '-',
+            (flags & access_write) ? 'w' : '-');
+    }
+
+    void SaveCoverage(
+        const zx_heat_t& heat,
+        const std::string& path)
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            std::cout << "Failed to open file: " << path << std::endl;
+            throw std::runtime_error("Failed to open file.");
+        }
+
+        fprintf(file, "# x executed (opcode fetch), r read, w written\n");
+
+        // totals per region, banks which were never touched are skipped
+        for (uint32_t start = 0; start < ZX_HEAT_SIZE;)
+        {
+            const uint32_t size = (start == 0) ? ZX_HEAT_ROM_SIZE : ZX_HEAT_BANK_SIZE;
+            uint32_t executed = 0;
+            uint32_t read = 0;
+            uint32_t written = 0;
+            for (uint32_t phys = start; phys < (start + size); phys++)
+            {
+                const int flags = access(heat, phys);
+                executed += (flags & access_exec) ? 1 : 0;
+                read += (flags & access_read) ? 1 : 0;
+                written += (flags & access_write) ? 1 : 0;
+            }
+            if (executed || read || written)
+            {
+                char name[16];
+                region_name(start, name, sizeof(name));
+                fprintf(file, "# %-6s  %5u executed  %5u read  %5u written  of %u bytes\n",
+                    name,
+                    executed,
+                    read,
+                    written,
+                    size);
+            }
+            start += size;
+        }
+
+        fprintf(file, "# region  offset     cpu        access\n");
+
+        // a range ends where the accesses, the region or the CPU mapping change
+        uint32_t first = 0;
+        int first_flags = access(heat, 0);
+        int first_cpu = cpu_address(heat, 0);
+
+        for (uint32_t phys = 1; phys <= ZX_HEAT_SIZE; phys++)
+        {
+            if (phys < ZX_HEAT_SIZE)
+            {
+                const int flags = access(heat, phys);
+                const int cpu = cpu_address(heat, phys);
+                const bool contiguous = (first_cpu < 0) ?
+                    (cpu < 0) :
+                    (cpu == (first_cpu + static_cast<int>(phys - first)));
+
+                if ((flags == first_flags) &&
+                    contiguous &&
+                    (zx_heat_bank(phys) == zx_heat_bank(first)))
+                {
+                    continue;
+                }
+
+                if (first_flags)
+                {
+                    write_range(file, heat, first, phys - 1, first_flags);
+                }
+
+                first = phys;
+                first_flags = flags;
+                first_cpu = cpu;
+            }
+            else if (first_flags)
+            {
+                write_range(file, heat, first, phys - 1, first_flags);
+            }
+        }
+
+        const bool written = !ferror(file);
+        fclose(file);
+
+        if (!written)
+        {
+            std::cout << "Failed to write file: " << path << std::endl;
+            throw std::runtime_error("Failed to write file.");
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Heatmap.h"
+
+#include <string>
+
+namespace Speccy
+{
+    // Writes the bytes the counters saw executed, read or written as a
+    // text listing of address ranges, one line per run of bytes with the
+    // same accesses. Each line gives the ROM or RAM bank, the offset in
+    // it and the CPU address it is mapped at, "----" where the bank isn't
+    // paged in. Bytes nothing touched are left out, so gaps in the
+    // executed ranges of a title's code are the code that never ran.
+    //
+    // Throws std::runtime_error if the file can't be written.
+    void SaveCoverage(
+        const zx_heat_t& heat,
+        const std::string& path);
+}
@@ -0,0 +1,453 @@
+#pragma once
+
+// Reverse debugging by re-execution: the rewind history keeps a
+// checkpoint every few frames and the debugger logs the input given in
+// between, so the machine can be taken back to any earlier instruction
+// by restoring the checkpoint before it and running forward with video
+// decoding off until the instruction is reached.
+//
+// Positions are T-states since power on (zx_t.ticks). Searching back
+// goes through the windows between checkpoints, newest first, and
+// runs each window up to twice: once to count the instructions a
+// condition holds on, once more to stop at the one it was looking for.
+//
+//     zx_debug_step_back   back a number of instructions
+//     zx_debug_run_back    back to the last instruction a condition
+//                          held on (breakpoints, watchpoints, callback)
+//     zx_debug_goto        to the first instruction at or after a T-state
+//
+// Running forward from an earlier position replays the logged input,
+// the machine stays on the recorded timeline until new input is given,
+// which drops the history after the current position. Anything else
+// which changes the machine (loading snapshots or states, changing the
+// CPU clock) needs a zx_debug_reset().
+
+#include "Rewind.h"
+#include "Movie.h"
+
+#define ZX_DEBUG_MAX_BREAKPOINTS (16)
+#define ZX_DEBUG_MAX_WATCH (64)
+#define ZX_DEBUG_MAX_INPUTS (1 << 16)
+
+typedef struct
+{
+    uint64_t ticks;                 // when the input was given
+    uint8_t type;                   // zx_movie_record_t
+    uint8_t value;
+} zx_debug_input_t;
+
+// holds after an instruction if the PC is at a breakpoint, a watched
+// byte changed or the callback returns true
+typedef struct
+{
+    int num_breakpoints;
+    uint16_t breakpoints[ZX_DEBUG_MAX_BREAKPOINTS];
+    uint16_t watch_addr;
+    int watch_len;                  // up to ZX_DEBUG_MAX_WATCH, 0 for none
+    zx_debug_cb_t cb;
+    void* user_data;
+} zx_debug_cond_t;
+
+typedef struct
+{
+    uint32_t frame_us;
+    zx_rewind_t history;            // the checkpoints
+
+    zx_debug_input_t* inputs;       // ring of the input since the oldest checkpoint
+    int max_inputs;
+    int first_input;
+    int num_inputs;
+    int next_input;                 // first input not applied yet
+    uint64_t min_ticks;             // checkpoints before lost their input
+
+    uint8_t* state;                 // position to return to if a search fails
+
+    // re-execution
+    const zx_debug_cond_t* cond;
+    uint64_t stop_ticks;            // stop at the first instruction at or after
+    uint64_t scan_end;              // the condition is checked up to here
+    int matches;
+    int stop_match;                 // stop at this match, 0 to count all
+    uint64_t match_ticks;
+    uint8_t watch[ZX_DEBUG_MAX_WATCH];
+} zx_debug_t;
+
+static bool zx_debug_init(zx_debug_t* dbg, uint8_t* ptr, int num_bytes, uint32_t frame_us, int interval);
+static void zx_debug_reset(zx_debug_t* dbg, zx_t* sys);
+static void zx_debug_input(zx_debug_t* dbg, zx_t* sys, zx_movie_record_t type, int value);
+static bool zx_debug_run(zx_debug_t* dbg, zx_t* sys, const zx_debug_cond_t* cond);
+static bool zx_debug_step(zx_debug_t* dbg, zx_t* sys);
+static bool zx_debug_goto(zx_debug_t* dbg, zx_t* sys, uint64_t ticks);
+static bool zx_debug_step_back(zx_debug_t* dbg, zx_t* sys, int num_instructions);
+static bool zx_debug_run_back(zx_debug_t* dbg, zx_t* sys, const zx_debug_cond_t* cond);
+static uint64_t zx_debug_oldest(zx_debug_t* dbg);
+
+#define _ZX_DEBUG_NEVER (~(uint64_t)0)
+
+// the buffer holds the input log and a state, the rest goes to the
+// rewind history
+static bool zx_debug_init(zx_debug_t* dbg, uint8_t* ptr, int num_bytes, uint32_t frame_us, int interval)
+{
+    CHIPS_ASSERT(dbg && ptr && (frame_us > 0) && (interval > 0));
+    memset(dbg, 0, sizeof(zx_debug_t));
+    dbg->frame_us = frame_us;
+
+    const int inputs_size = ZX_DEBUG_MAX_INPUTS * (int)sizeof(zx_debug_input_t);
+    if (num_bytes < (inputs_size + ZX_SAVESTATE_MAX_SIZE + 16))
+    {
+        return false;
+    }
+    dbg->inputs = (zx_debug_input_t*)_zx_rewind_align(ptr);
+    dbg->max_inputs = ZX_DEBUG_MAX_INPUTS;
+    dbg->state = (uint8_t*)(dbg->inputs + ZX_DEBUG_MAX_INPUTS);
+    uint8_t* history = dbg->state + ZX_SAVESTATE_MAX_SIZE;
+    return zx_rewind_init(&dbg->history, history, (int)(ptr + num_bytes - history), interval, 25);
+}
+
+static zx_debug_input_t* _zx_debug_input(zx_debug_t* dbg, int index)
+{
+    return &dbg->inputs[(dbg->first_input + index) % dbg->max_inputs];
+}
+
+// start the history at the current state
+static void zx_debug_reset(zx_debug_t* dbg, zx_t* sys)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid);
+    zx_rewind_reset(&dbg->history);
+    dbg->first_input = 0;
+    dbg->num_inputs = 0;
+    dbg->next_input = 0;
+    dbg->min_ticks = sys->ticks;
+    dbg->history.frame_counter = dbg->history.interval - 1;
+    zx_rewind_push(&dbg->history, sys);
+}
+
+// T-state of the oldest position the debugger can go back to
+static uint64_t zx_debug_oldest(zx_debug_t* dbg)
+{
+    CHIPS_ASSERT(dbg);
+    for (int i = 0; i < zx_rewind_count(&dbg->history); i++)
+    {
+        const uint64_t ticks = zx_rewind_ticks(&dbg->history, i);
+        if (ticks >= dbg->min_ticks)
+        {
+            return ticks;
+        }
+    }
+    return _ZX_DEBUG_NEVER;
+}
+
+// newest checkpoint before (or at) the position, -1 if there is none
+static int _zx_debug_checkpoint(zx_debug_t* dbg, uint64_t ticks, bool inclusive)
+{
+    int lo = 0;
+    int hi = zx_rewind_count(&dbg->history) - 1;
+    int found = -1;
+    while (lo <= hi)
+    {
+        const int mid = (lo + hi) / 2;
+        const uint64_t t = zx_rewind_ticks(&dbg->history, mid);
+        if ((t < ticks) || (inclusive && (t == ticks)))
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    if ((found >= 0) && (zx_rewind_ticks(&dbg->history, found) < dbg->min_ticks))
+    {
+        return -1;
+    }
+    return found;
+}
+
+static bool _zx_debug_restore(zx_debug_t* dbg, zx_t* sys, int checkpoint)
+{
+    if (!zx_rewind_load(&dbg->history, sys, checkpoint))
+    {
+        return false;
+    }
+    // input given at a checkpoint's T-state came after it was captured
+    int index = 0;
+    while ((index < dbg->num_inputs) && (_zx_debug_input(dbg, index)->ticks < sys->ticks))
+    {
+        index++;
+    }
+    dbg->next_input = index;
+    return true;
+}
+
+static void _zx_debug_apply_inputs(zx_debug_t* dbg, zx_t* sys)
+{
+    while (dbg->next_input < dbg->num_inputs)
+    {
+        const zx_debug_input_t* in = _zx_debug_input(dbg, dbg->next_input);
+        if (in->ticks > sys->ticks)
+        {
+            break;
+        }
+        _zx_movie_apply(sys, (zx_movie_record_t)in->type, in->value);
+        dbg->next_input++;
+    }
+}
+
+static bool _zx_debug_cond_holds(zx_debug_t* dbg, zx_t* sys, uint16_t pc)
+{
+    const zx_debug_cond_t* cond = dbg->cond;
+    bool holds = false;
+    for (int i = 0; i < cond->num_breakpoints; i++)
+    {
+        if (cond->breakpoints[i] == pc)
+        {
+            holds = true;
+        }
+    }
+    for (int i = 0; i < cond->watch_len; i++)
+    {
+        const uint8_t val = mem_rd(&sys->mem, (uint16_t)(cond->watch_addr + i));
+        if (val != dbg->watch[i])
+        {
+            dbg->watch[i] = val;
+            holds = true;
+        }
+    }
+    if (cond->cb && cond->cb(sys, pc, cond->user_data))
+    {
+        holds = true;
+    }
+    return holds;
+}
+
+static bool _zx_debug_hook(zx_t* sys, uint16_t pc, void* user_data)
+{
+    zx_debug_t* dbg = (zx_debug_t*)user_data;
+    if (sys->ticks > dbg->scan_end)
+    {
+        return true;
+    }
+    if (dbg->cond && _zx_debug_cond_holds(dbg, sys, pc))
+    {
+        dbg->matches++;
+        dbg->match_ticks = sys->ticks;
+        if (dbg->matches == dbg->stop_match)
+        {
+            return true;
+        }
+    }
+    return sys->ticks >= dbg->stop_ticks;
+}
+
+// capture a checkpoint after each new frame, frames which run again
+// after going back have one already
+static void _zx_debug_capture(zx_debug_t* dbg, zx_t* sys)
+{
+    const int count = zx_rewind_count(&dbg->history);
+    if ((count == 0) || (sys->ticks > zx_rewind_ticks(&dbg->history, count - 1)))
+    {
+        zx_rewind_push(&dbg->history, sys);
+    }
+}
+
+// run from the current position until the stop match, the first
+// instruction at or after target or past scan_end, or until the end of
+// the frame. Going back only draws the frames just before draw_from.
+static void _zx_debug_advance(zx_debug_t* dbg, zx_t* sys, uint64_t target, bool one_frame, uint64_t draw_from)
+{
+    const bool video_decode = sys->video_decode;
+    const uint64_t frame_ticks = clk_us_to_ticks(sys->clk.freq_hz, dbg->frame_us);
+    if (dbg->cond)
+    {
+        for (int i = 0; i < dbg->cond->watch_len; i++)
+        {
+            dbg->watch[i] = mem_rd(&sys->mem, (uint16_t)(dbg->cond->watch_addr + i));
+        }
+    }
+    zx_set_debug_cb(sys, _zx_debug_hook, dbg);
+    while (true)
+    {
+        // a position is the state before the input given there
+        if ((sys->ticks >= target) || (sys->ticks > dbg->scan_end))
+        {
+            break;
+        }
+        _zx_debug_apply_inputs(dbg, sys);
+        dbg->stop_ticks = target;
+        if (dbg->next_input < dbg->num_inputs)
+        {
+            const uint64_t input_ticks = _zx_debug_input(dbg, dbg->next_input)->ticks;
+            dbg->stop_ticks = (input_ticks < target) ? input_ticks : target;
+        }
+        if (!one_frame)
+        {
+            sys->video_decode = video_decode && ((sys->ticks + 2 * frame_ticks) >= draw_from);
+        }
+        if (sys->frame_pending)
+        {
+            zx_exec_resume(sys);
+        }
+        else
+        {
+            zx_exec(sys, dbg->frame_us);
+        }
+        if (!sys->frame_pending)
+        {
+            _zx_debug_capture(dbg, sys);
+        }
+        if ((dbg->stop_match > 0) && (dbg->matches >= dbg->stop_match))
+        {
+            break;
+        }
+        if (one_frame && !sys->frame_pending)
+        {
+            break;
+        }
+    }
+    zx_set_debug_cb(sys, 0, 0);
+    sys->video_decode = video_decode;
+}
+
+static void _zx_debug_setup(zx_debug_t* dbg, const zx_debug_cond_t* cond, uint64_t scan_end, int stop_match)
+{
+    dbg->cond = cond;
+    dbg->scan_end = scan_end;
+    dbg->matches = 0;
+    dbg->stop_match = stop_match;
+    dbg->match_ticks = 0;
+}
+
+// give input and log it, input while back in the history starts a new
+// timeline from there
+static void zx_debug_input(zx_debug_t* dbg, zx_t* sys, zx_movie_record_t type, int value)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid);
+    dbg->num_inputs = dbg->next_input;
+    int checkpoint = zx_rewind_count(&dbg->history) - 1;
+    while ((checkpoint > 0) && (zx_rewind_ticks(&dbg->history, checkpoint) > sys->ticks))
+    {
+        checkpoint--;
+    }
+    zx_rewind_truncate(&dbg->history, checkpoint);
+    if (dbg->num_inputs == dbg->max_inputs)
+    {
+        // checkpoints before the dropped input can't be replayed anymore
+        dbg->min_ticks = _zx_debug_input(dbg, 0)->ticks + 1;
+        dbg->first_input = (dbg->first_input + 1) % dbg->max_inputs;
+        dbg->num_inputs--;
+    }
+    _zx_movie_apply(sys, type, value);
+    zx_debug_input_t* in = _zx_debug_input(dbg, dbg->num_inputs++);
+    in->ticks = sys->ticks;
+    in->type = (uint8_t)type;
+    in->value = (uint8_t)value;
+    dbg->next_input = dbg->num_inputs;
+}
+
+// run to the end of the frame, returns true if the condition stopped
+// it earlier, cond may be 0
+static bool zx_debug_run(zx_debug_t* dbg, zx_t* sys, const zx_debug_cond_t* cond)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid);
+    _zx_debug_setup(dbg, cond, _ZX_DEBUG_NEVER, 1);
+    _zx_debug_advance(dbg, sys, _ZX_DEBUG_NEVER, true, _ZX_DEBUG_NEVER);
+    return dbg->matches > 0;
+}
+
+static bool _zx_debug_always(zx_t* sys, uint16_t pc, void* user_data)
+{
+    (void)sys;
+    (void)pc;
+    (void)user_data;
+    return true;
+}
+
+// one instruction forward
+static bool zx_debug_step(zx_debug_t* dbg, zx_t* sys)
+{
+    zx_debug_cond_t cond;
+    memset(&cond, 0, sizeof(cond));
+    cond.cb = _zx_debug_always;
+    return zx_debug_run(dbg, sys, &cond);
+}
+
+static bool zx_debug_goto(zx_debug_t* dbg, zx_t* sys, uint64_t ticks)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid);
+    const int checkpoint = _zx_debug_checkpoint(dbg, ticks, true);
+    if ((checkpoint < 0) || !_zx_debug_restore(dbg, sys, checkpoint))
+    {
+        return false;
+    }
+    _zx_debug_setup(dbg, 0, _ZX_DEBUG_NEVER, 0);
+    _zx_debug_advance(dbg, sys, ticks, false, ticks);
+    return true;
+}
+
+// run the window from a checkpoint up to and including end, returns
+// the number of instructions the condition held on, or stops at the
+// stop_match one
+static int _zx_debug_scan(zx_debug_t* dbg, zx_t* sys, int checkpoint, uint64_t end, const zx_debug_cond_t* cond, int stop_match, uint64_t draw_from)
+{
+    if (!_zx_debug_restore(dbg, sys, checkpoint))
+    {
+        return 0;
+    }
+    _zx_debug_setup(dbg, cond, end, stop_match);
+    _zx_debug_advance(dbg, sys, end + 1, false, draw_from);
+    return dbg->matches;
+}
+
+// go back to the num_matches'th last instruction before the current
+// position the condition held on, stays put if there aren't as many
+static bool _zx_debug_search_back(zx_debug_t* dbg, zx_t* sys, const zx_debug_cond_t* cond, int num_matches)
+{
+    const uint64_t start = sys->ticks;
+    const int state_size = zx_save_state(sys, dbg->state, ZX_SAVESTATE_MAX_SIZE);
+    const int next_input = dbg->next_input;
+    if ((start == 0) || (state_size == 0))
+    {
+        return false;
+    }
+    uint64_t end = start - 1;
+    for (int checkpoint = _zx_debug_checkpoint(dbg, start, false); checkpoint >= 0; checkpoint--)
+    {
+        const uint64_t checkpoint_ticks = zx_rewind_ticks(&dbg->history, checkpoint);
+        if (checkpoint_ticks < dbg->min_ticks)
+        {
+            break;
+        }
+        const int matches = _zx_debug_scan(dbg, sys, checkpoint, end, cond, 0, _ZX_DEBUG_NEVER);
+        if (matches >= num_matches)
+        {
+            // only the tick of the last match is known up front
+            const uint64_t draw_from = (num_matches == 1) ? dbg->match_ticks : _ZX_DEBUG_NEVER;
+            _zx_debug_scan(dbg, sys, checkpoint, end, cond, matches - num_matches + 1, draw_from);
+            return true;
+        }
+        num_matches -= matches;
+        end = checkpoint_ticks;
+    }
+    zx_load_state(sys, dbg->state, state_size);
+    dbg->next_input = next_input;
+    return false;
+}
+
+static bool zx_debug_step_back(zx_debug_t* dbg, zx_t* sys, int num_instructions)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid && (num_instructions > 0));
+    zx_debug_cond_t cond;
+    memset(&cond, 0, sizeof(cond));
+    cond.cb = _zx_debug_always;
+    return _zx_debug_search_back(dbg, sys, &cond, num_instructions);
+}
+
+// back to the last instruction before the current one which hit a
+// breakpoint, changed a watched byte or made the callback return true
+static bool zx_debug_run_back(zx_debug_t* dbg, zx_t* sys, const zx_debug_cond_t* cond)
+{
+    CHIPS_ASSERT(dbg && dbg->inputs && sys && sys->valid && cond);
+    CHIPS_ASSERT((cond->watch_len >= 0) && (cond->watch_len <= ZX_DEBUG_MAX_WATCH));
+    return _zx_debug_search_back(dbg, sys, cond, 1);
+}
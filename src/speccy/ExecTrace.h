@@ -0,0 +1,1143 @@
+#pragma once
+
+// Execution trace: a compact binary record of every instruction the
+// machine ran, its PC and opcode bytes, the T-states it took, the
+// registers after it and the memory and port writes it made, for
+// chasing bugs over millions of instructions. tools/ExecTrace.cpp
+// records traces and decodes, filters and searches them.
+//
+// Everything is taken from the bus while the machine runs at full
+// speed: this header sets ZX_TICK_HOOK and ZX_TRAP_HOOK, which has to
+// happen before Speccy.h is included, like Profiler.h does. An opcode
+// fetch which doesn't continue a prefix starts the next instruction
+// and encodes the one before. Other code built without this header has
+// no hooks at all.
+//
+// The registers aren't on the bus. The CPU state goes into the trace at
+// the end of each frame and after tape traps, which run ROM routines on
+// the host, and the reader gets the registers after each instruction by
+// running it again on a Z80 of its own, fed with the recorded opcode
+// bytes and reads. The writes, interrupts and T-states it makes have to
+// match the recorded ones, if they don't the registers are unknown up
+// to the next CPU state. What a trap did to memory isn't in the trace.
+//
+// Records go into chunks which each decode on their own, so a ring of
+// the latest chunks is as good a trace as the whole run. Chunks which
+// start at the end of a frame hold the CPU state, those which start
+// within one because the previous chunk was full get the registers from
+// the end of the previous chunk. Inside a chunk a record is a flags byte
+// followed by whatever the flags say is there:
+//
+//     JUMP     the PC differs from the one which followed the previous
+//              PC last time, zigzag varint of the difference
+//     OPS      the opcode bytes differ from last time at this PC, a
+//              length byte and the bytes
+//     TICKS    the T-states differ from last time at this PC, varint
+//     READS    the other bytes read differ from last time at this PC,
+//              a count byte and the bytes: memory and ports in the
+//              order they were read, and the bus at an interrupt
+//              acknowledge
+//     WRITES   varint count, then per write a zigzag varint from the
+//              previous write address and the byte written
+//     OUTS     varint count, then per write the port (16 bit little
+//              endian) and the byte written
+//     INT      an interrupt was accepted after the instruction, its
+//              pushes are among the writes
+//
+// A flags byte of STATE is a CPU state instead of an instruction,
+// followed by the T-state (64 bit) and the CPU state as in the chunk
+// header. Both sides keep the last opcode bytes, reads, T-states and
+// successor per PC, so a loop which runs the same way again costs about
+// a byte per instruction plus its writes.
+//
+// The opcode bytes are the bytes read from the instruction's address
+// on, up to the first other access, so an instruction which reads data
+// right after itself shows that byte too.
+
+#if defined(ZX_TICK_HOOK)
+#error "ExecTrace.h has to be included before Speccy.h"
+#endif
+
+#include <stdint.h>
+
+typedef struct zx_t zx_t;
+static void _zx_etrace_tick(zx_t* sys, int num_ticks, uint64_t pins);
+static void _zx_etrace_trap(zx_t* sys);
+
+#define ZX_TICK_HOOK(sys, num_ticks, pins) _zx_etrace_tick(sys, num_ticks, pins)
+#define ZX_TRAP_HOOK(sys, trap_id) _zx_etrace_trap(sys)
+
+#include "Speccy.h"
+
+#include <string.h>
+
+#define ZX_ETRACE_VERSION (2)
+#define ZX_ETRACE_CHUNK_HEADER_SIZE (80)
+#define ZX_ETRACE_MAX_RECORD (128)      // the largest a record can encode to
+#define ZX_ETRACE_MAX_OPS (4)
+#define ZX_ETRACE_MAX_READS (8)
+#define ZX_ETRACE_MAX_WRITES (8)        // an instruction and an interrupt push
+#define ZX_ETRACE_MAX_OUTS (4)
+
+#define ZX_ETRACE_JUMP (1 << 0)
+#define ZX_ETRACE_OPS (1 << 1)
+#define ZX_ETRACE_TICKS (1 << 2)
+#define ZX_ETRACE_READS (1 << 3)
+#define ZX_ETRACE_WRITES (1 << 4)
+#define ZX_ETRACE_OUTS (1 << 5)
+#define ZX_ETRACE_INT (1 << 6)
+#define ZX_ETRACE_STATE (1 << 7)
+
+#define _ZX_ETRACE_MAGIC (0x5445585A)   // 'ZXET'
+#define _ZX_ETRACE_CHUNK_CPU (1 << 0)   // the header holds the CPU state
+
+// how far into an instruction the opcode fetches are
+typedef enum
+{
+    _ZX_ETRACE_IDLE,                // nothing recorded yet
+    _ZX_ETRACE_DONE,                // the next fetch starts an instruction
+    _ZX_ETRACE_INDEX,               // after DD or FD
+    _ZX_ETRACE_ED,                  // after ED, one more fetch
+    _ZX_ETRACE_CB                   // after CB, one more fetch
+} _zx_etrace_prefix_t;
+
+// I holds I in the high byte and IM << 2 | IFF2 << 1 | IFF1 in the low
+typedef enum
+{
+    ZX_ETRACE_AF,
+    ZX_ETRACE_BC,
+    ZX_ETRACE_DE,
+    ZX_ETRACE_HL,
+    ZX_ETRACE_IX,
+    ZX_ETRACE_IY,
+    ZX_ETRACE_SP,
+    ZX_ETRACE_AF_,
+    ZX_ETRACE_BC_,
+    ZX_ETRACE_DE_,
+    ZX_ETRACE_HL_,
+    ZX_ETRACE_I,
+    ZX_ETRACE_NUM_REGS
+} zx_etrace_reg_t;
+
+static const char* zx_etrace_reg_names[ZX_ETRACE_NUM_REGS] =
+{
+    "AF", "BC", "DE", "HL", "IX", "IY", "SP", "AF'", "BC'", "DE'", "HL'", "I"
+};
+
+// an instruction as decoded, the registers are those after it and only
+// there when the reader replays and the replay agreed with the trace
+typedef struct
+{
+    uint64_t index;                 // instructions since the trace started
+    uint64_t ticks;                 // T-state it started at
+    uint32_t num_ticks;
+    uint16_t pc;
+    uint8_t num_ops;
+    uint8_t ops[ZX_ETRACE_MAX_OPS];
+    bool interrupt;
+    bool has_regs;
+    uint16_t changed;               // mask of the registers it changed
+    uint16_t regs[ZX_ETRACE_NUM_REGS];
+    int num_reads;
+    uint8_t read_data[ZX_ETRACE_MAX_READS];
+    int num_writes;
+    uint16_t write_addr[ZX_ETRACE_MAX_WRITES];
+    uint8_t write_data[ZX_ETRACE_MAX_WRITES];
+    int num_outs;
+    uint16_t out_port[ZX_ETRACE_MAX_OUTS];
+    uint8_t out_data[ZX_ETRACE_MAX_OUTS];
+} zx_etrace_rec_t;
+
+// what both sides remember about a PC
+typedef struct
+{
+    uint32_t ops;                   // first byte in the low bits
+    uint32_t reads;
+    uint16_t next;                  // the PC which followed it last time
+    uint8_t num_ops;                // 0 until the PC first ran
+    uint8_t num_ticks;
+    uint8_t num_reads;              // 0xFF after more than fit in reads
+} _zx_etrace_pc_t;
+
+typedef struct
+{
+    _zx_etrace_pc_t pcs[0x10000];
+    bool has_prev;
+    uint16_t prev_pc;
+    uint16_t start_pc;              // of the next record after a reset
+    uint16_t last_write;
+} _zx_etrace_model_t;
+
+// called with a full chunk, returns where the next one goes, which
+// may be the same buffer once the chunk was copied out
+typedef uint8_t* (*zx_etrace_flush_t)(void* user_data, uint8_t* chunk, int num_bytes);
+
+typedef struct
+{
+    _zx_etrace_model_t model;
+    uint8_t* buffer;
+    int buffer_size;
+    int pos;
+    uint32_t chunk_records;
+    zx_etrace_flush_t flush;
+    void* flush_user_data;
+
+    uint64_t instructions;
+    uint64_t bytes;                 // in flushed chunks
+    uint64_t chunks;
+
+    // from the tick hook, for the instruction running now
+    _zx_etrace_prefix_t prefix;
+    bool resync;                    // a trap changed the CPU state
+    uint16_t pc;                    // where it started
+    uint64_t ticks;
+    uint32_t ops;
+    uint32_t reads;                 // the first 4 of read_data
+    uint8_t num_ops;
+    uint8_t num_reads;
+    uint8_t num_writes;
+    uint8_t num_outs;
+    bool ops_done;
+    bool int_ack;
+    uint8_t read_data[ZX_ETRACE_MAX_READS];
+    uint16_t write_addr[ZX_ETRACE_MAX_WRITES];
+    uint8_t write_data[ZX_ETRACE_MAX_WRITES];
+    uint16_t out_port[ZX_ETRACE_MAX_OUTS];
+    uint8_t out_data[ZX_ETRACE_MAX_OUTS];
+} zx_etrace_t;
+
+// reads a trace record by record, damaged chunks end it
+typedef struct
+{
+    _zx_etrace_model_t model;
+    const uint8_t* data;
+    int size;
+    int pos;                        // of the next chunk header
+    const uint8_t* chunk;           // records of the current chunk
+    int chunk_size;
+    int chunk_pos;
+    uint32_t chunk_left;            // instructions
+    uint64_t chunks;
+    uint64_t index;
+    uint64_t ticks;
+
+    // the Z80 the instructions run on again for the registers, valid
+    // while has_cpu
+    bool replay;
+    bool has_cpu;
+    z80_t cpu;
+    uint16_t regs[ZX_ETRACE_NUM_REGS];
+    const zx_etrace_rec_t* rec;     // the one running
+    int op_pos;
+    bool ops_done;
+    int read_pos;
+    int write_pos;
+    int out_pos;
+    uint32_t num_ticks;
+    bool int_ack;
+    bool failed;
+} zx_etrace_reader_t;
+
+static bool zx_etrace_init(zx_etrace_t* tr, uint8_t* buffer, int num_bytes, zx_etrace_flush_t flush, void* user_data);
+static void zx_etrace_start(zx_etrace_t* tr, zx_t* sys);
+static void zx_etrace_end_frame(zx_etrace_t* tr, zx_t* sys);
+static void zx_etrace_stop(zx_etrace_t* tr, zx_t* sys);
+static void zx_etrace_reader_init(zx_etrace_reader_t* rd, const uint8_t* data, int num_bytes, bool replay);
+static void zx_etrace_seek(zx_etrace_reader_t* rd, uint64_t index);
+static int zx_etrace_next(zx_etrace_reader_t* rd, zx_etrace_rec_t* rec);
+
+static inline uint8_t* _zx_etrace_put_varint(uint8_t* ptr, uint32_t val)
+{
+    while (val >= 0x80)
+    {
+        *ptr++ = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    *ptr++ = (uint8_t)val;
+    return ptr;
+}
+
+// differences are of 16 bit values, so they wrap around to +-32K
+static inline uint32_t _zx_etrace_zigzag(uint16_t from, uint16_t to)
+{
+    const int16_t diff = (int16_t)(uint16_t)(to - from);
+    return ((uint32_t)(int32_t)diff << 1) ^ (uint32_t)(int32_t)(diff >> 15);
+}
+
+static inline uint16_t _zx_etrace_unzigzag(uint16_t from, uint32_t val)
+{
+    return (uint16_t)(from + (uint16_t)((val >> 1) ^ (0u - (val & 1))));
+}
+
+static inline void _zx_etrace_wr16(uint8_t* ptr, uint16_t val)
+{
+    ptr[0] = (uint8_t)val;
+    ptr[1] = (uint8_t)(val >> 8);
+}
+
+static inline uint16_t _zx_etrace_rd16(const uint8_t* ptr)
+{
+    return (uint16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static inline void _zx_etrace_wr32(uint8_t* ptr, uint32_t val)
+{
+    _zx_etrace_wr16(ptr, (uint16_t)val);
+    _zx_etrace_wr16(ptr + 2, (uint16_t)(val >> 16));
+}
+
+static inline uint32_t _zx_etrace_rd32(const uint8_t* ptr)
+{
+    return _zx_etrace_rd16(ptr) | ((uint32_t)_zx_etrace_rd16(ptr + 2) << 16);
+}
+
+static inline void _zx_etrace_wr64(uint8_t* ptr, uint64_t val)
+{
+    _zx_etrace_wr32(ptr, (uint32_t)val);
+    _zx_etrace_wr32(ptr + 4, (uint32_t)(val >> 32));
+}
+
+static inline uint64_t _zx_etrace_rd64(const uint8_t* ptr)
+{
+    return _zx_etrace_rd32(ptr) | ((uint64_t)_zx_etrace_rd32(ptr + 4) << 32);
+}
+
+// the CPU state as it is in z80_t, 40 bytes
+static void _zx_etrace_put_cpu(uint8_t* ptr, const z80_t* cpu)
+{
+    _zx_etrace_wr64(ptr, cpu->bc_de_hl_fa);
+    _zx_etrace_wr64(ptr + 8, cpu->bc_de_hl_fa_);
+    _zx_etrace_wr64(ptr + 16, cpu->wz_ix_iy_sp);
+    _zx_etrace_wr64(ptr + 24, cpu->im_ir_pc_bits);
+    _zx_etrace_wr64(ptr + 32, cpu->pins);
+}
+
+static void _zx_etrace_get_cpu(const uint8_t* ptr, z80_t* cpu)
+{
+    cpu->bc_de_hl_fa = _zx_etrace_rd64(ptr);
+    cpu->bc_de_hl_fa_ = _zx_etrace_rd64(ptr + 8);
+    cpu->wz_ix_iy_sp = _zx_etrace_rd64(ptr + 16);
+    cpu->im_ir_pc_bits = _zx_etrace_rd64(ptr + 24);
+    cpu->pins = _zx_etrace_rd64(ptr + 32);
+}
+
+static void _zx_etrace_read_regs(z80_t* cpu, uint16_t* regs)
+{
+    regs[ZX_ETRACE_AF] = z80_af(cpu);
+    regs[ZX_ETRACE_BC] = z80_bc(cpu);
+    regs[ZX_ETRACE_DE] = z80_de(cpu);
+    regs[ZX_ETRACE_HL] = z80_hl(cpu);
+    regs[ZX_ETRACE_IX] = z80_ix(cpu);
+    regs[ZX_ETRACE_IY] = z80_iy(cpu);
+    regs[ZX_ETRACE_SP] = z80_sp(cpu);
+    regs[ZX_ETRACE_AF_] = z80_af_(cpu);
+    regs[ZX_ETRACE_BC_] = z80_bc_(cpu);
+    regs[ZX_ETRACE_DE_] = z80_de_(cpu);
+    regs[ZX_ETRACE_HL_] = z80_hl_(cpu);
+    regs[ZX_ETRACE_I] = (uint16_t)((z80_i(cpu) << 8) |
+        (z80_im(cpu) << 2) |
+        (z80_iff2(cpu) ? 2 : 0) |
+        (z80_iff1(cpu) ? 1 : 0));
+}
+
+// both sides forget everything at a chunk start
+static void _zx_etrace_model_reset(_zx_etrace_model_t* model, uint16_t pc)
+{
+    memset(model->pcs, 0, sizeof(model->pcs));
+    model->has_prev = false;
+    model->start_pc = pc;
+    model->last_write = 0;
+}
+
+// the chunk header, its record count and size are filled in at the flush:
+//
+//     0   magic
+//     4   version (16 bit)
+//     6   flags (16 bit)
+//     8   size of the records
+//     12  number of instructions
+//     16  index of the first instruction
+//     24  T-state the first record starts at
+//     32  PC of the first record, 6 bytes reserved
+//     40  the CPU state, if the flags say so
+static void _zx_etrace_begin_chunk(zx_etrace_t* tr, uint16_t pc, uint64_t ticks, const z80_t* cpu)
+{
+    _zx_etrace_model_reset(&tr->model, pc);
+
+    uint8_t* hdr = tr->buffer;
+    memset(hdr, 0, ZX_ETRACE_CHUNK_HEADER_SIZE);
+    _zx_etrace_wr32(hdr, _ZX_ETRACE_MAGIC);
+    _zx_etrace_wr16(hdr + 4, ZX_ETRACE_VERSION);
+    _zx_etrace_wr64(hdr + 16, tr->instructions);
+    _zx_etrace_wr64(hdr + 24, ticks);
+    _zx_etrace_wr16(hdr + 32, pc);
+    if (cpu)
+    {
+        _zx_etrace_wr16(hdr + 6, _ZX_ETRACE_CHUNK_CPU);
+        _zx_etrace_put_cpu(hdr + 40, cpu);
+    }
+    tr->pos = ZX_ETRACE_CHUNK_HEADER_SIZE;
+    tr->chunk_records = 0;
+}
+
+static void _zx_etrace_flush(zx_etrace_t* tr)
+{
+    if (tr->pos <= ZX_ETRACE_CHUNK_HEADER_SIZE)
+    {
+        return;
+    }
+    _zx_etrace_wr32(tr->buffer + 8, (uint32_t)(tr->pos - ZX_ETRACE_CHUNK_HEADER_SIZE));
+    _zx_etrace_wr32(tr->buffer + 12, tr->chunk_records);
+    tr->bytes += (uint64_t)tr->pos;
+    tr->chunks++;
+    tr->buffer = tr->flush(tr->flush_user_data, tr->buffer, tr->pos);
+    CHIPS_ASSERT(tr->buffer);
+    tr->pos = 0;
+    tr->chunk_records = 0;
+}
+
+// the buffer holds one chunk, larger ones compress better since each
+// chunk starts over
+static bool zx_etrace_init(zx_etrace_t* tr, uint8_t* buffer, int num_bytes, zx_etrace_flush_t flush, void* user_data)
+{
+    CHIPS_ASSERT(tr && buffer && flush);
+    memset(tr, 0, sizeof(zx_etrace_t));
+    if (num_bytes < (ZX_ETRACE_CHUNK_HEADER_SIZE + ZX_ETRACE_MAX_RECORD))
+    {
+        return false;
+    }
+    tr->buffer = buffer;
+    tr->buffer_size = num_bytes;
+    tr->flush = flush;
+    tr->flush_user_data = user_data;
+    return true;
+}
+
+// records from the next instruction on
+static void zx_etrace_start(zx_etrace_t* tr, zx_t* sys)
+{
+    CHIPS_ASSERT(tr && tr->buffer && sys && sys->valid && !sys->frame_pending && !sys->hook_user_data);
+    tr->prefix = _ZX_ETRACE_IDLE;
+    tr->resync = false;
+    _zx_etrace_begin_chunk(tr, z80_pc(&sys->cpu), sys->ticks, &sys->cpu);
+    sys->hook_user_data = tr;
+}
+
+// the CPU state in sys->cpu is current: after a trap until z80_exec()
+// runs the next instruction, and between frames. Chunks which are
+// close to full start over with the state in the header.
+static void _zx_etrace_state(zx_etrace_t* tr, zx_t* sys, uint64_t ticks)
+{
+    const uint16_t pc = z80_pc(&sys->cpu);
+    if ((tr->pos + ZX_ETRACE_MAX_RECORD) > (tr->buffer_size - (tr->buffer_size / 4)))
+    {
+        _zx_etrace_flush(tr);
+        _zx_etrace_begin_chunk(tr, pc, ticks, &sys->cpu);
+    }
+    else
+    {
+        uint8_t* ptr = tr->buffer + tr->pos;
+        ptr[0] = ZX_ETRACE_STATE;
+        _zx_etrace_wr64(ptr + 1, ticks);
+        _zx_etrace_put_cpu(ptr + 9, &sys->cpu);
+        tr->pos += 49;
+        tr->model.has_prev = false;
+        tr->model.start_pc = pc;
+    }
+    tr->resync = false;
+}
+
+// encodes the instruction the hook collected, which ended at end_ticks
+static void _zx_etrace_record(zx_etrace_t* tr, uint64_t end_ticks)
+{
+    // a new chunk within a frame has no CPU state, the reader carries
+    // the registers over from the previous one
+    if ((tr->pos + ZX_ETRACE_MAX_RECORD) > tr->buffer_size)
+    {
+        _zx_etrace_flush(tr);
+        _zx_etrace_begin_chunk(tr, tr->pc, tr->ticks, 0);
+    }
+
+    _zx_etrace_model_t* model = &tr->model;
+    uint8_t* flags = tr->buffer + tr->pos;
+    uint8_t* ptr = flags + 1;
+    *flags = 0;
+
+    const uint16_t pc = tr->pc;
+    const uint16_t expected = model->has_prev ? model->pcs[model->prev_pc].next : model->start_pc;
+    if (pc != expected)
+    {
+        *flags |= ZX_ETRACE_JUMP;
+        ptr = _zx_etrace_put_varint(ptr, _zx_etrace_zigzag(expected, pc));
+    }
+    if (model->has_prev)
+    {
+        model->pcs[model->prev_pc].next = pc;
+    }
+
+    _zx_etrace_pc_t* entry = &model->pcs[pc];
+    if ((entry->num_ops != tr->num_ops) || (entry->ops != tr->ops))
+    {
+        *flags |= ZX_ETRACE_OPS;
+        *ptr++ = tr->num_ops;
+        for (int i = 0; i < tr->num_ops; i++)
+        {
+            *ptr++ = (uint8_t)(tr->ops >> (8 * i));
+        }
+        if (entry->num_ops == 0)
+        {
+            entry->next = (uint16_t)(pc + tr->num_ops);
+        }
+        entry->num_ops = tr->num_ops;
+        entry->ops = tr->ops;
+    }
+
+    // long ones span a frame's end, they are kept out of the table
+    const uint32_t num_ticks = (uint32_t)(end_ticks - tr->ticks);
+    if (num_ticks != entry->num_ticks)
+    {
+        *flags |= ZX_ETRACE_TICKS;
+        ptr = _zx_etrace_put_varint(ptr, num_ticks);
+        entry->num_ticks = (num_ticks < 0x100) ? (uint8_t)num_ticks : 0;
+    }
+
+    if ((entry->num_reads != tr->num_reads) || (entry->reads != tr->reads))
+    {
+        *flags |= ZX_ETRACE_READS;
+        *ptr++ = tr->num_reads;
+        for (int i = 0; i < tr->num_reads; i++)
+        {
+            *ptr++ = tr->read_data[i];
+        }
+        entry->num_reads = (tr->num_reads <= 4) ? tr->num_reads : 0xFF;
+        entry->reads = tr->reads;
+    }
+
+    if (tr->num_writes > 0)
+    {
+        *flags |= ZX_ETRACE_WRITES;
+        ptr = _zx_etrace_put_varint(ptr, (uint32_t)tr->num_writes);
+        for (int i = 0; i < tr->num_writes; i++)
+        {
+            ptr = _zx_etrace_put_varint(ptr, _zx_etrace_zigzag(model->last_write, tr->write_addr[i]));
+            *ptr++ = tr->write_data[i];
+            model->last_write = tr->write_addr[i];
+        }
+    }
+
+    if (tr->num_outs > 0)
+    {
+        *flags |= ZX_ETRACE_OUTS;
+        ptr = _zx_etrace_put_varint(ptr, (uint32_t)tr->num_outs);
+        for (int i = 0; i < tr->num_outs; i++)
+        {
+            _zx_etrace_wr16(ptr, tr->out_port[i]);
+            ptr[2] = tr->out_data[i];
+            ptr += 3;
+        }
+    }
+
+    if (tr->int_ack)
+    {
+        *flags |= ZX_ETRACE_INT;
+    }
+
+    model->has_prev = true;
+    model->prev_pc = pc;
+    tr->pos = (int)(ptr - tr->buffer);
+    tr->chunk_records++;
+    tr->instructions++;
+}
+
+static inline _zx_etrace_prefix_t _zx_etrace_next_prefix(_zx_etrace_prefix_t prefix, uint8_t op)
+{
+    if (prefix >= _ZX_ETRACE_ED)
+    {
+        return _ZX_ETRACE_DONE;
+    }
+    switch (op)
+    {
+        case 0xDD:
+        case 0xFD:
+            return _ZX_ETRACE_INDEX;
+        case 0xED:
+            return _ZX_ETRACE_ED;
+        case 0xCB:
+            return _ZX_ETRACE_CB;
+        default:
+            return _ZX_ETRACE_DONE;
+    }
+}
+
+static inline void _zx_etrace_read(zx_etrace_t* tr, uint8_t data)
+{
+    if (tr->num_reads < 4)
+    {
+        tr->reads |= (uint32_t)data << (8 * tr->num_reads);
+    }
+    if (tr->num_reads < ZX_ETRACE_MAX_READS)
+    {
+        tr->read_data[tr->num_reads++] = data;
+    }
+}
+
+static void _zx_etrace_tick(zx_t* sys, int num_ticks, uint64_t pins)
+{
+    zx_etrace_t* tr = (zx_etrace_t*)sys->hook_user_data;
+    if (!tr)
+    {
+        return;
+    }
+    if ((pins & (Z80_M1 | Z80_MREQ)) == (Z80_M1 | Z80_MREQ))
+    {
+        if (tr->prefix <= _ZX_ETRACE_DONE)
+        {
+            const uint64_t ticks = sys->ticks - num_ticks;
+            if (tr->prefix == _ZX_ETRACE_DONE)
+            {
+                _zx_etrace_record(tr, ticks);
+            }
+            if (tr->resync)
+            {
+                _zx_etrace_state(tr, sys, ticks);
+            }
+            tr->pc = Z80_GET_ADDR(pins);
+            tr->ticks = ticks;
+            tr->ops = 0;
+            tr->reads = 0;
+            tr->num_ops = 0;
+            tr->num_reads = 0;
+            tr->num_writes = 0;
+            tr->num_outs = 0;
+            tr->ops_done = false;
+            tr->int_ack = false;
+        }
+        tr->prefix = _zx_etrace_next_prefix(tr->prefix, Z80_GET_DATA(pins));
+    }
+
+    // the reader's replay sorts the accesses the same way
+    if (pins & Z80_MREQ)
+    {
+        const uint16_t addr = Z80_GET_ADDR(pins);
+        if (pins & Z80_RD)
+        {
+            if (!tr->ops_done && (addr == (uint16_t)(tr->pc + tr->num_ops)) && (tr->num_ops < ZX_ETRACE_MAX_OPS))
+            {
+                tr->ops |= (uint32_t)Z80_GET_DATA(pins) << (8 * tr->num_ops++);
+            }
+            else
+            {
+                tr->ops_done = true;
+                _zx_etrace_read(tr, Z80_GET_DATA(pins));
+            }
+        }
+        else if (pins & Z80_WR)
+        {
+            tr->ops_done = true;
+            if (tr->num_writes < ZX_ETRACE_MAX_WRITES)
+            {
+                tr->write_addr[tr->num_writes] = addr;
+                tr->write_data[tr->num_writes] = Z80_GET_DATA(pins);
+                tr->num_writes++;
+            }
+        }
+    }
+    else if (pins & Z80_IORQ)
+    {
+        tr->ops_done = true;
+        if (pins & (Z80_M1 | Z80_RD))
+        {
+            tr->int_ack = tr->int_ack || (pins & Z80_M1);
+            _zx_etrace_read(tr, Z80_GET_DATA(pins));
+        }
+        else if ((pins & Z80_WR) && (tr->num_outs < ZX_ETRACE_MAX_OUTS))
+        {
+            tr->out_port[tr->num_outs] = Z80_GET_ADDR(pins);
+            tr->out_data[tr->num_outs] = Z80_GET_DATA(pins);
+            tr->num_outs++;
+        }
+    }
+}
+
+// traps come between instructions, the one before is complete and the
+// state the trap leaves goes in front of the next
+static void _zx_etrace_trap(zx_t* sys)
+{
+    zx_etrace_t* tr = (zx_etrace_t*)sys->hook_user_data;
+    if (!tr)
+    {
+        return;
+    }
+    if (tr->prefix == _ZX_ETRACE_DONE)
+    {
+        _zx_etrace_record(tr, sys->ticks);
+        tr->prefix = _ZX_ETRACE_IDLE;
+    }
+    tr->resync = true;
+}
+
+// after each zx_exec() or movie frame. Unless the frame ended within a
+// prefixed instruction this ends the last instruction and writes the
+// CPU state, the next frame may start with anything done to it.
+static void zx_etrace_end_frame(zx_etrace_t* tr, zx_t* sys)
+{
+    CHIPS_ASSERT(tr && sys && (sys->hook_user_data == tr) && !sys->frame_pending);
+    if (!z80_opdone(&sys->cpu))
+    {
+        return;
+    }
+    if (tr->prefix == _ZX_ETRACE_DONE)
+    {
+        _zx_etrace_record(tr, sys->ticks);
+        tr->prefix = _ZX_ETRACE_IDLE;
+    }
+    _zx_etrace_state(tr, sys, sys->ticks);
+}
+
+// flushes the last chunk
+static void zx_etrace_stop(zx_etrace_t* tr, zx_t* sys)
+{
+    CHIPS_ASSERT(tr && sys && (sys->hook_user_data == tr) && !sys->frame_pending);
+    if (tr->prefix == _ZX_ETRACE_DONE)
+    {
+        _zx_etrace_record(tr, sys->ticks);
+        tr->prefix = _ZX_ETRACE_IDLE;
+    }
+    _zx_etrace_flush(tr);
+    sys->hook_user_data = 0;
+}
+
+// serves the replayed instruction from its record and checks what it
+// does against it, the accesses are sorted like in _zx_etrace_tick()
+static uint64_t _zx_etrace_replay_tick(int num_ticks, uint64_t pins, void* user_data)
+{
+    zx_etrace_reader_t* rd = (zx_etrace_reader_t*)user_data;
+    const zx_etrace_rec_t* rec = rd->rec;
+    rd->num_ticks += (uint32_t)num_ticks;
+    if (pins & Z80_MREQ)
+    {
+        const uint16_t addr = Z80_GET_ADDR(pins);
+        if (pins & Z80_RD)
+        {
+            uint8_t data = 0xFF;
+            if (!rd->ops_done && (addr == (uint16_t)(rec->pc + rd->op_pos)) && (rd->op_pos < ZX_ETRACE_MAX_OPS))
+            {
+                if (rd->op_pos < rec->num_ops)
+                {
+                    data = rec->ops[rd->op_pos];
+                }
+                rd->failed = rd->failed || (rd->op_pos >= rec->num_ops);
+                rd->op_pos++;
+            }
+            else
+            {
+                rd->ops_done = true;
+                if (rd->read_pos < rec->num_reads)
+                {
+                    data = rec->read_data[rd->read_pos];
+                }
+                rd->failed = rd->failed || (rd->read_pos >= rec->num_reads);
+                rd->read_pos++;
+            }
+            Z80_SET_DATA(pins, data);
+        }
+        else if (pins & Z80_WR)
+        {
+            rd->ops_done = true;
+            rd->failed = rd->failed ||
+                (rd->write_pos >= rec->num_writes) ||
+                (rec->write_addr[rd->write_pos] != addr) ||
+                (rec->write_data[rd->write_pos] != Z80_GET_DATA(pins));
+            rd->write_pos++;
+        }
+    }
+    else if (pins & Z80_IORQ)
+    {
+        rd->ops_done = true;
+        if (pins & (Z80_M1 | Z80_RD))
+        {
+            rd->int_ack = rd->int_ack || (pins & Z80_M1);
+            uint8_t data = 0xFF;
+            if (rd->read_pos < rec->num_reads)
+            {
+                data = rec->read_data[rd->read_pos];
+            }
+            rd->failed = rd->failed || (rd->read_pos >= rec->num_reads);
+            rd->read_pos++;
+            Z80_SET_DATA(pins, data);
+        }
+        else if (pins & Z80_WR)
+        {
+            rd->failed = rd->failed ||
+                (rd->out_pos >= rec->num_outs) ||
+                (rec->out_port[rd->out_pos] != Z80_GET_ADDR(pins)) ||
+                (rec->out_data[rd->out_pos] != Z80_GET_DATA(pins));
+            rd->out_pos++;
+        }
+    }
+    // the CPU looks at the last tick of an instruction for interrupts
+    if (rec->interrupt)
+    {
+        pins |= Z80_INT;
+    }
+    else
+    {
+        pins &= ~Z80_INT;
+    }
+    return pins;
+}
+
+// runs the instruction again for its registers
+static void _zx_etrace_replay(zx_etrace_reader_t* rd, zx_etrace_rec_t* rec)
+{
+    rec->has_regs = false;
+    rec->changed = 0;
+    if (!rd->has_cpu)
+    {
+        return;
+    }
+    rd->rec = rec;
+    rd->op_pos = 0;
+    rd->ops_done = false;
+    rd->read_pos = 0;
+    rd->write_pos = 0;
+    rd->out_pos = 0;
+    rd->num_ticks = 0;
+    rd->int_ack = false;
+    rd->failed = z80_pc(&rd->cpu) != rec->pc;
+    while (!rd->failed)
+    {
+        z80_exec(&rd->cpu, 1);
+        if (z80_opdone(&rd->cpu))
+        {
+            break;
+        }
+    }
+    rd->rec = 0;
+    if (rd->failed ||
+        (rd->op_pos != rec->num_ops) ||
+        (rd->read_pos != rec->num_reads) ||
+        (rd->write_pos != rec->num_writes) ||
+        (rd->out_pos != rec->num_outs) ||
+        (rd->num_ticks != rec->num_ticks) ||
+        (rd->int_ack != rec->interrupt))
+    {
+        rd->has_cpu = false;
+        return;
+    }
+
+    uint16_t regs[ZX_ETRACE_NUM_REGS];
+    _zx_etrace_read_regs(&rd->cpu, regs);
+    for (int i = 0; i < ZX_ETRACE_NUM_REGS; i++)
+    {
+        rec->changed |= (uint16_t)((regs[i] != rd->regs[i]) << i);
+    }
+    memcpy(rec->regs, regs, sizeof(rec->regs));
+    memcpy(rd->regs, regs, sizeof(rd->regs));
+    rec->has_regs = true;
+}
+
+// with replay the registers come out of decoding from a CPU state on,
+// without it they are never there
+static void zx_etrace_reader_init(zx_etrace_reader_t* rd, const uint8_t* data, int num_bytes, bool replay)
+{
+    CHIPS_ASSERT(rd && (data || (num_bytes == 0)));
+    memset(rd, 0, sizeof(zx_etrace_reader_t));
+    rd->data = data;
+    rd->size = num_bytes;
+    rd->replay = replay;
+    z80_desc_t desc;
+    desc.tick_cb = _zx_etrace_replay_tick;
+    desc.user_data = rd;
+    z80_init(&rd->cpu, &desc);
+}
+
+// a CPU state from a chunk header or a STATE record
+static void _zx_etrace_load_cpu(zx_etrace_reader_t* rd, const uint8_t* ptr)
+{
+    _zx_etrace_get_cpu(ptr, &rd->cpu);
+    _zx_etrace_read_regs(&rd->cpu, rd->regs);
+    rd->has_cpu = rd->replay;
+}
+
+// false for a damaged header
+static bool _zx_etrace_check_chunk(const zx_etrace_reader_t* rd, int pos)
+{
+    if ((rd->size - pos) < ZX_ETRACE_CHUNK_HEADER_SIZE)
+    {
+        return false;
+    }
+    const uint8_t* hdr = rd->data + pos;
+    return
+        (_zx_etrace_rd32(hdr) == _ZX_ETRACE_MAGIC) &&
+        (_zx_etrace_rd16(hdr + 4) == ZX_ETRACE_VERSION) &&
+        (_zx_etrace_rd32(hdr + 8) <= (uint32_t)(rd->size - pos - ZX_ETRACE_CHUNK_HEADER_SIZE));
+}
+
+// a chunk without CPU state goes on with the registers the previous
+// one left
+static bool _zx_etrace_open_chunk(zx_etrace_reader_t* rd)
+{
+    if (!_zx_etrace_check_chunk(rd, rd->pos))
+    {
+        return false;
+    }
+    const uint8_t* hdr = rd->data + rd->pos;
+    const uint32_t size = _zx_etrace_rd32(hdr + 8);
+    _zx_etrace_model_reset(&rd->model, _zx_etrace_rd16(hdr + 32));
+    if (_zx_etrace_rd16(hdr + 6) & _ZX_ETRACE_CHUNK_CPU)
+    {
+        _zx_etrace_load_cpu(rd, hdr + 40);
+    }
+    rd->chunk = hdr + ZX_ETRACE_CHUNK_HEADER_SIZE;
+    rd->chunk_size = (int)size;
+    rd->chunk_pos = 0;
+    rd->chunk_left = _zx_etrace_rd32(hdr + 12);
+    rd->chunks++;
+    rd->index = _zx_etrace_rd64(hdr + 16);
+    rd->ticks = _zx_etrace_rd64(hdr + 24);
+    rd->pos += ZX_ETRACE_CHUNK_HEADER_SIZE + (int)size;
+    return true;
+}
+
+// goes back to the chunk decoding has to start from for the
+// instruction at index, from there zx_etrace_next() gets to it.
+// Replaying starts at the latest chunk with a CPU state before it, so
+// the registers are known from the start.
+static void zx_etrace_seek(zx_etrace_reader_t* rd, uint64_t index)
+{
+    CHIPS_ASSERT(rd);
+    int start = 0;
+    int cpu_start = -1;
+    for (int pos = 0; _zx_etrace_check_chunk(rd, pos);)
+    {
+        const uint8_t* hdr = rd->data + pos;
+        if (_zx_etrace_rd64(hdr + 16) > index)
+        {
+            break;
+        }
+        start = pos;
+        if (_zx_etrace_rd16(hdr + 6) & _ZX_ETRACE_CHUNK_CPU)
+        {
+            cpu_start = pos;
+        }
+        pos += ZX_ETRACE_CHUNK_HEADER_SIZE + (int)_zx_etrace_rd32(hdr + 8);
+    }
+    rd->pos = (rd->replay && (cpu_start >= 0)) ? cpu_start : start;
+    rd->chunk_size = 0;
+    rd->chunk_pos = 0;
+    rd->chunk_left = 0;
+    rd->has_cpu = false;
+}
+
+static inline bool _zx_etrace_get_byte(zx_etrace_reader_t* rd, uint8_t* val)
+{
+    if (rd->chunk_pos >= rd->chunk_size)
+    {
+        return false;
+    }
+    *val = rd->chunk[rd->chunk_pos++];
+    return true;
+}
+
+static inline bool _zx_etrace_get_varint(zx_etrace_reader_t* rd, uint32_t* val)
+{
+    *val = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        uint8_t byte;
+        if (!_zx_etrace_get_byte(rd, &byte))
+        {
+            return false;
+        }
+        *val |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// decodes the next instruction, 1 if there was one, 0 at the end of the
+// trace and -1 if the trace is damaged there
+static int zx_etrace_next(zx_etrace_reader_t* rd, zx_etrace_rec_t* rec)
+{
+    CHIPS_ASSERT(rd && rec);
+    _zx_etrace_model_t* model = &rd->model;
+    uint8_t flags;
+    uint32_t val;
+    for (;;)
+    {
+        if (rd->chunk_pos >= rd->chunk_size)
+        {
+            if (rd->chunk_left > 0)
+            {
+                return -1;
+            }
+            if (rd->pos >= rd->size)
+            {
+                return 0;
+            }
+            if (!_zx_etrace_open_chunk(rd))
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (!_zx_etrace_get_byte(rd, &flags))
+        {
+            return -1;
+        }
+        if (!(flags & ZX_ETRACE_STATE))
+        {
+            break;
+        }
+        if ((flags != ZX_ETRACE_STATE) || ((rd->chunk_pos + 48) > rd->chunk_size))
+        {
+            return -1;
+        }
+        rd->ticks = _zx_etrace_rd64(rd->chunk + rd->chunk_pos);
+        _zx_etrace_load_cpu(rd, rd->chunk + rd->chunk_pos + 8);
+        rd->chunk_pos += 48;
+        model->has_prev = false;
+        model->start_pc = z80_pc(&rd->cpu);
+    }
+    if (rd->chunk_left == 0)
+    {
+        return -1;
+    }
+
+    const uint16_t expected = model->has_prev ? model->pcs[model->prev_pc].next : model->start_pc;
+    uint16_t pc = expected;
+    if (flags & ZX_ETRACE_JUMP)
+    {
+        if (!_zx_etrace_get_varint(rd, &val))
+        {
+            return -1;
+        }
+        pc = _zx_etrace_unzigzag(expected, val);
+    }
+    if (model->has_prev)
+    {
+        model->pcs[model->prev_pc].next = pc;
+    }
+
+    _zx_etrace_pc_t* entry = &model->pcs[pc];
+    if (flags & ZX_ETRACE_OPS)
+    {
+        uint8_t num_ops;
+        if (!_zx_etrace_get_byte(rd, &num_ops) ||
+            (num_ops > ZX_ETRACE_MAX_OPS) ||
+            ((rd->chunk_pos + num_ops) > rd->chunk_size))
+        {
+            return -1;
+        }
+        if (entry->num_ops == 0)
+        {
+            entry->next = (uint16_t)(pc + num_ops);
+        }
+        entry->num_ops = num_ops;
+        entry->ops = 0;
+        for (int i = 0; i < num_ops; i++)
+        {
+            entry->ops |= (uint32_t)rd->chunk[rd->chunk_pos++] << (8 * i);
+        }
+    }
+
+    uint32_t num_ticks = entry->num_ticks;
+    if (flags & ZX_ETRACE_TICKS)
+    {
+        if (!_zx_etrace_get_varint(rd, &num_ticks))
+        {
+            return -1;
+        }
+        entry->num_ticks = (num_ticks < 0x100) ? (uint8_t)num_ticks : 0;
+    }
+
+    if (flags & ZX_ETRACE_READS)
+    {
+        uint8_t num_reads;
+        if (!_zx_etrace_get_byte(rd, &num_reads) ||
+            (num_reads > ZX_ETRACE_MAX_READS) ||
+            ((rd->chunk_pos + num_reads) > rd->chunk_size))
+        {
+            return -1;
+        }
+        rec->num_reads = num_reads;
+        entry->reads = 0;
+        for (int i = 0; i < num_reads; i++)
+        {
+            rec->read_data[i] = rd->chunk[rd->chunk_pos++];
+            entry->reads |= (i < 4) ? ((uint32_t)rec->read_data[i] << (8 * i)) : 0;
+        }
+        entry->num_reads = (num_reads <= 4) ? num_reads : 0xFF;
+    }
+    else
+    {
+        if (entry->num_reads > 4)
+        {
+            return -1;
+        }
+        rec->num_reads = entry->num_reads;
+        for (int i = 0; i < rec->num_reads; i++)
+        {
+            rec->read_data[i] = (uint8_t)(entry->reads >> (8 * i));
+        }
+    }
+
+    rec->num_writes = 0;
+    if (flags & ZX_ETRACE_WRITES)
+    {
+        if (!_zx_etrace_get_varint(rd, &val) || (val > ZX_ETRACE_MAX_WRITES))
+        {
+            return -1;
+        }
+        rec->num_writes = (int)val;
+        for (int i = 0; i < rec->num_writes; i++)
+        {
+            if (!_zx_etrace_get_varint(rd, &val) || !_zx_etrace_get_byte(rd, &rec->write_data[i]))
+            {
+                return -1;
+            }
+            model->last_write = _zx_etrace_unzigzag(model->last_write, val);
+            rec->write_addr[i] = model->last_write;
+        }
+    }
+
+    rec->num_outs = 0;
+    if (flags & ZX_ETRACE_OUTS)
+    {
+        if (!_zx_etrace_get_varint(rd, &val) ||
+            (val > ZX_ETRACE_MAX_OUTS) ||
+            ((rd->chunk_pos + (int)(3 * val)) > rd->chunk_size))
+        {
+            return -1;
+        }
+        rec->num_outs = (int)val;
+        for (int i = 0; i < rec->num_outs; i++)
+        {
+            rec->out_port[i] = _zx_etrace_rd16(rd->chunk + rd->chunk_pos);
+            rec->out_data[i] = rd->chunk[rd->chunk_pos + 2];
+            rd->chunk_pos += 3;
+        }
+    }
+
+    rec->index = rd->index++;
+    rec->ticks = rd->ticks;
+    rec->num_ticks = num_ticks;
+    rec->pc = pc;
+    rec->num_ops = entry->num_ops;
+    for (int i = 0; i < ZX_ETRACE_MAX_OPS; i++)
+    {
+        rec->ops[i] = (uint8_t)(entry->ops >> (8 * i));
+    }
+    rec->interrupt = 0 != (flags & ZX_ETRACE_INT);
+    _zx_etrace_replay(rd, rec);
+
+    rd->ticks += num_ticks;
+    model->has_prev = true;
+    model->prev_pc = pc;
+    rd->chunk_left--;
+    return 1;
+}
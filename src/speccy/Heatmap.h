@@ -0,0 +1,93 @@
+#pragma once
+
+// Memory access counters for heatmaps and code coverage. Every read,
+// write and opcode fetch counts against the physical byte it touched:
+// the 16K ROM comes first, then the RAM banks, so a bank keeps its
+// counts wherever it is paged in. Counters saturate instead of
+// wrapping, a count above zero always means the byte was touched.
+//
+// A zx_t counts while zx_set_heatmap() attached counters to it, the
+// tick then does one table lookup and one increment per memory cycle.
+// Detached it tests a pointer, and with ZX_NO_HEATMAP defined the tick
+// has no counting code at all.
+//
+// Opcode fetches are the M1 cycles, which includes the prefix bytes of
+// DD/FD/ED/CB instructions but not their operands or displacements.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef CHIPS_ASSERT
+    #include <assert.h>
+    #define CHIPS_ASSERT(c) assert(c)
+#endif
+
+#define ZX_HEAT_ROM_SIZE (0x4000)
+#define ZX_HEAT_BANK_SIZE (0x4000)
+#define ZX_HEAT_BANKS (8)               // ZX_RAM_BANKS
+#define ZX_HEAT_SIZE (ZX_HEAT_ROM_SIZE + (ZX_HEAT_BANKS * ZX_HEAT_BANK_SIZE))
+#define ZX_HEAT_CPU_PAGES (64)          // 1K pages, MEM_NUM_PAGES
+#define ZX_HEAT_PAGE_SHIFT (10)
+
+typedef enum
+{
+    ZX_HEAT_READ,
+    ZX_HEAT_WRITE,
+    ZX_HEAT_EXEC,
+    ZX_HEAT_KINDS
+} zx_heat_kind_t;
+
+typedef struct
+{
+    uint32_t* counts[ZX_HEAT_KINDS];            // ZX_HEAT_SIZE counters each
+    uint32_t page_base[ZX_HEAT_CPU_PAGES];      // physical address of each 1K CPU page
+} zx_heat_t;
+
+static inline size_t zx_heat_bytes(void)
+{
+    return (size_t)ZX_HEAT_KINDS * ZX_HEAT_SIZE * sizeof(uint32_t);
+}
+
+static inline void zx_heat_clear(zx_heat_t* heat)
+{
+    for (int kind = 0; kind < ZX_HEAT_KINDS; kind++)
+    {
+        memset(heat->counts[kind], 0, ZX_HEAT_SIZE * sizeof(uint32_t));
+    }
+}
+
+// the counters live in the caller's buffer of zx_heat_bytes(), the page
+// map starts out as the 48K one until zx_set_heatmap() reads the machine's
+static inline void zx_heat_init(zx_heat_t* heat, void* ptr, size_t num_bytes)
+{
+    CHIPS_ASSERT(heat && ptr && (num_bytes >= zx_heat_bytes()));
+    (void)num_bytes;
+    for (int kind = 0; kind < ZX_HEAT_KINDS; kind++)
+    {
+        heat->counts[kind] = (uint32_t*)ptr + ((size_t)kind * ZX_HEAT_SIZE);
+    }
+    for (int page = 0; page < ZX_HEAT_CPU_PAGES; page++)
+    {
+        heat->page_base[page] = (uint32_t)page << ZX_HEAT_PAGE_SHIFT;
+    }
+    zx_heat_clear(heat);
+}
+
+// physical address a CPU address is mapped to
+static inline uint32_t zx_heat_phys(const zx_heat_t* heat, uint16_t addr)
+{
+    return heat->page_base[addr >> ZX_HEAT_PAGE_SHIFT] + (addr & ((1 << ZX_HEAT_PAGE_SHIFT) - 1));
+}
+
+// RAM bank of a physical address, -1 for the ROM
+static inline int zx_heat_bank(uint32_t phys)
+{
+    return (phys < ZX_HEAT_ROM_SIZE) ? -1 : (int)((phys - ZX_HEAT_ROM_SIZE) / ZX_HEAT_BANK_SIZE);
+}
+
+static inline void zx_heat_count(zx_heat_t* heat, zx_heat_kind_t kind, uint16_t addr)
+{
+    uint32_t* count = &heat->counts[kind][zx_heat_phys(heat, addr)];
+    *count += (*count != UINT32_MAX);
+}
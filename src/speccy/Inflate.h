@@ -0,0 +1,309 @@
+#pragma once
+
+// Minimal zlib/deflate decoder (RFC 1950/1951) for compressed snapshot
+// pages. Decodes straight into the caller's buffer, there is no
+// streaming and no allocation, which is all a 16 KByte page needs.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct
+{
+    uint16_t counts[16];        // number of codes per length
+    uint16_t symbols[288];      // symbols ordered by code
+} _inflate_huffman_t;
+
+typedef struct
+{
+    const uint8_t* src;
+    int src_len;
+    int src_pos;
+    uint32_t bit_buf;
+    int bit_count;
+    uint8_t* dst;
+    int dst_len;
+    int dst_pos;
+    bool error;
+} _inflate_state_t;
+
+static int inflate_zlib(const uint8_t* src, int src_len, uint8_t* dst, int dst_len);
+static int inflate_raw(const uint8_t* src, int src_len, uint8_t* dst, int dst_len);
+
+static int _inflate_bits(_inflate_state_t* s, int num)
+{
+    while (s->bit_count < num)
+    {
+        if (s->src_pos >= s->src_len)
+        {
+            s->error = true;
+            return 0;
+        }
+        s->bit_buf |= (uint32_t)s->src[s->src_pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+    const int val = (int)(s->bit_buf & ((1u << num) - 1));
+    s->bit_buf >>= num;
+    s->bit_count -= num;
+    return val;
+}
+
+static void _inflate_build(_inflate_huffman_t* h, const uint8_t* lengths, int num)
+{
+    uint16_t offsets[16];
+    memset(h->counts, 0, sizeof(h->counts));
+    for (int i = 0; i < num; i++)
+    {
+        h->counts[lengths[i]]++;
+    }
+    h->counts[0] = 0;
+    offsets[1] = 0;
+    for (int i = 1; i < 15; i++)
+    {
+        offsets[i + 1] = offsets[i] + h->counts[i];
+    }
+    for (int i = 0; i < num; i++)
+    {
+        if (lengths[i])
+        {
+            h->symbols[offsets[lengths[i]]++] = (uint16_t)i;
+        }
+    }
+}
+
+// canonical codes are read one bit at a time, first code of each length
+// follows the last code of the previous length
+static int _inflate_decode(_inflate_state_t* s, const _inflate_huffman_t* h)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        code |= _inflate_bits(s, 1);
+        const int count = h->counts[len];
+        if ((code - first) < count)
+        {
+            return h->symbols[index + code - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    s->error = true;
+    return 0;
+}
+
+static void _inflate_stored(_inflate_state_t* s)
+{
+    // stored blocks start on a byte boundary
+    s->bit_buf = 0;
+    s->bit_count = 0;
+    if ((s->src_pos + 4) > s->src_len)
+    {
+        s->error = true;
+        return;
+    }
+    const int len = s->src[s->src_pos] | (s->src[s->src_pos + 1] << 8);
+    const int nlen = s->src[s->src_pos + 2] | (s->src[s->src_pos + 3] << 8);
+    s->src_pos += 4;
+    if ((len != (~nlen & 0xFFFF)) || ((s->src_pos + len) > s->src_len) || ((s->dst_pos + len) > s->dst_len))
+    {
+        s->error = true;
+        return;
+    }
+    memcpy(s->dst + s->dst_pos, s->src + s->src_pos, len);
+    s->src_pos += len;
+    s->dst_pos += len;
+}
+
+static void _inflate_codes(_inflate_state_t* s, const _inflate_huffman_t* lit, const _inflate_huffman_t* dist)
+{
+    static const uint16_t len_base[29] =
+    {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const uint8_t len_extra[29] =
+    {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const uint16_t dist_base[30] =
+    {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static const uint8_t dist_extra[30] =
+    {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    while (!s->error)
+    {
+        const int sym = _inflate_decode(s, lit);
+        if (sym < 256)
+        {
+            if (s->dst_pos >= s->dst_len)
+            {
+                s->error = true;
+                return;
+            }
+            s->dst[s->dst_pos++] = (uint8_t)sym;
+        }
+        else if (sym == 256)
+        {
+            return;
+        }
+        else
+        {
+            const int len_sym = sym - 257;
+            if (len_sym >= 29)
+            {
+                s->error = true;
+                return;
+            }
+            const int len = len_base[len_sym] + _inflate_bits(s, len_extra[len_sym]);
+            const int dist_sym = _inflate_decode(s, dist);
+            if (dist_sym >= 30)
+            {
+                s->error = true;
+                return;
+            }
+            const int distance = dist_base[dist_sym] + _inflate_bits(s, dist_extra[dist_sym]);
+            if ((distance > s->dst_pos) || ((s->dst_pos + len) > s->dst_len))
+            {
+                s->error = true;
+                return;
+            }
+            // overlapping copies repeat the last bytes, so go byte by byte
+            uint8_t* dst = s->dst + s->dst_pos;
+            const uint8_t* from = dst - distance;
+            for (int i = 0; i < len; i++)
+            {
+                dst[i] = from[i];
+            }
+            s->dst_pos += len;
+        }
+    }
+}
+
+static void _inflate_fixed(_inflate_state_t* s)
+{
+    _inflate_huffman_t lit, dist;
+    uint8_t lengths[288];
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    _inflate_build(&lit, lengths, 288);
+    for (i = 0; i < 30; i++) lengths[i] = 5;
+    _inflate_build(&dist, lengths, 30);
+    _inflate_codes(s, &lit, &dist);
+}
+
+static void _inflate_dynamic(_inflate_state_t* s)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    _inflate_huffman_t lit, dist, code;
+    uint8_t lengths[288 + 32];
+
+    const int num_lit = _inflate_bits(s, 5) + 257;
+    const int num_dist = _inflate_bits(s, 5) + 1;
+    const int num_code = _inflate_bits(s, 4) + 4;
+    if ((num_lit > 286) || (num_dist > 30))
+    {
+        s->error = true;
+        return;
+    }
+    memset(lengths, 0, 19);
+    for (int i = 0; i < num_code; i++)
+    {
+        lengths[order[i]] = (uint8_t)_inflate_bits(s, 3);
+    }
+    _inflate_build(&code, lengths, 19);
+
+    int i = 0;
+    while ((i < (num_lit + num_dist)) && !s->error)
+    {
+        const int sym = _inflate_decode(s, &code);
+        int repeat = 0;
+        uint8_t val = 0;
+        if (sym < 16)
+        {
+            lengths[i++] = (uint8_t)sym;
+            continue;
+        }
+        else if (sym == 16)
+        {
+            if (i == 0)
+            {
+                s->error = true;
+                return;
+            }
+            val = lengths[i - 1];
+            repeat = 3 + _inflate_bits(s, 2);
+        }
+        else if (sym == 17)
+        {
+            repeat = 3 + _inflate_bits(s, 3);
+        }
+        else
+        {
+            repeat = 11 + _inflate_bits(s, 7);
+        }
+        if ((i + repeat) > (num_lit + num_dist))
+        {
+            s->error = true;
+            return;
+        }
+        memset(lengths + i, val, repeat);
+        i += repeat;
+    }
+    if (s->error)
+    {
+        return;
+    }
+    _inflate_build(&lit, lengths, num_lit);
+    _inflate_build(&dist, lengths + num_lit, num_dist);
+    _inflate_codes(s, &lit, &dist);
+}
+
+// decode a raw deflate stream, returns the number of bytes written or
+// -1 on errors
+static int inflate_raw(const uint8_t* src, int src_len, uint8_t* dst, int dst_len)
+{
+    _inflate_state_t s;
+    memset(&s, 0, sizeof(s));
+    s.src = src;
+    s.src_len = src_len;
+    s.dst = dst;
+    s.dst_len = dst_len;
+
+    bool last = false;
+    while (!last && !s.error)
+    {
+        last = 0 != _inflate_bits(&s, 1);
+        switch (_inflate_bits(&s, 2))
+        {
+        case 0: _inflate_stored(&s); break;
+        case 1: _inflate_fixed(&s); break;
+        case 2: _inflate_dynamic(&s); break;
+        default: s.error = true; break;
+        }
+    }
+    return s.error ? -1 : s.dst_pos;
+}
+
+// decode a zlib stream (2 byte header, deflate data, adler-32), the
+// checksum isn't verified
+static int inflate_zlib(const uint8_t* src, int src_len, uint8_t* dst, int dst_len)
+{
+    if ((src_len < 2) || ((src[0] & 0x0F) != 8) || ((((src[0] << 8) | src[1]) % 31) != 0) || (src[1] & 0x20))
+    {
+        return -1;
+    }
+    return inflate_raw(src + 2, src_len - 2, dst, dst_len);
+}
@@ -0,0 +1,425 @@
+#pragma once
+
+// Input movies: a savestate of the machine at the first frame followed
+// by the input of every frame, which replays bit-exact because the
+// emulation only depends on its state and its input.
+//
+// A movie is a stream of records in time order:
+//
+//     FRAMES n                 run n frames (1-255) without new input
+//     KEY_DOWN/KEY_UP key      keyboard matrix changes, joysticks map to keys
+//     FLASH_LOAD/ACCELERATE v  tape options, they change the emulation
+//     TAPE_PLAY/TAPE_STOP
+//     KEYFRAME frame size      savestate at the start of a frame
+//
+// A keyframe is written every keyframe_interval frames, the first one
+// is the initial state. The trailer indexes the keyframes, seeking
+// restores keyframe frame / keyframe_interval and fast-forwards from
+// there with video decoding turned off.
+//
+// Tape images aren't part of a movie, the tape a movie was recorded
+// with has to be inserted before playing it.
+//
+// Recording writes into a caller provided buffer, playing reads
+// straight from the caller's (usually memory mapped) movie file.
+
+#include "Savestate.h"
+
+#define ZX_MOVIE_VERSION (1)
+
+typedef enum
+{
+    ZX_MOVIE_FRAMES = 0x01,
+    ZX_MOVIE_KEY_DOWN = 0x02,
+    ZX_MOVIE_KEY_UP = 0x03,
+    ZX_MOVIE_FLASH_LOAD = 0x04,
+    ZX_MOVIE_ACCELERATE = 0x05,
+    ZX_MOVIE_TAPE_PLAY = 0x06,
+    ZX_MOVIE_TAPE_STOP = 0x07,
+    ZX_MOVIE_KEYFRAME = 0x10,
+} zx_movie_record_t;
+
+typedef enum
+{
+    ZX_MOVIE_IDLE,
+    ZX_MOVIE_RECORDING,
+    ZX_MOVIE_PLAYING,
+} zx_movie_mode_t;
+
+typedef struct
+{
+    zx_movie_mode_t mode;
+    uint32_t frame_us;              // micro seconds per frame
+    int keyframe_interval;
+    int frame;                      // current frame
+    int num_frames;
+
+    // recording: the stream is written to data, playing: read from data
+    uint8_t* out_data;
+    const uint8_t* data;
+    int size;
+    int pos;
+    int frames_pos;                 // last FRAMES record while recording
+    int frames_left;                // of the current FRAMES record while playing
+    bool overflow;
+
+    // keyframe offsets, recording keeps them at the end of the buffer
+    const uint8_t* index;
+    int num_keyframes;
+} zx_movie_t;
+
+static bool zx_movie_record(zx_movie_t* movie, zx_t* sys, uint8_t* ptr, int max_bytes, uint32_t frame_us, int keyframe_interval);
+static void zx_movie_input(zx_movie_t* movie, zx_t* sys, zx_movie_record_t type, int value);
+static bool zx_movie_record_frame(zx_movie_t* movie, zx_t* sys);
+static int zx_movie_finish(zx_movie_t* movie);
+static bool zx_movie_play(zx_movie_t* movie, zx_t* sys, const uint8_t* ptr, int num_bytes);
+static bool zx_movie_play_frame(zx_movie_t* movie, zx_t* sys);
+static bool zx_movie_seek(zx_movie_t* movie, zx_t* sys, int frame);
+static void zx_movie_stop(zx_movie_t* movie);
+
+#define _ZX_MOVIE_MAGIC (0x564D585A)        // 'ZXMV'
+#define _ZX_MOVIE_INDEX_MAGIC (0x494D585A)  // 'ZXMI'
+#define _ZX_MOVIE_HEADER_SIZE (16)
+#define _ZX_MOVIE_TRAILER_SIZE (16)
+#define _ZX_MOVIE_KEYFRAME_HEADER_SIZE (9)
+#define _ZX_MOVIE_MAX_FRAME_US (1000000)
+#define _ZX_MOVIE_MAX_KEYFRAME_INTERVAL (1 << 20)
+
+static inline uint32_t _zx_movie_rd32(const uint8_t* ptr)
+{
+    uint32_t val;
+    memcpy(&val, ptr, 4);
+    return val;
+}
+
+static inline void _zx_movie_wr32(uint8_t* ptr, uint32_t val)
+{
+    memcpy(ptr, &val, 4);
+}
+
+// the keyframe index grows down from the end of the record buffer
+static uint8_t* _zx_movie_index_slot(zx_movie_t* movie, int keyframe)
+{
+    return movie->out_data + movie->size - 4 * (keyframe + 1);
+}
+
+static uint8_t* _zx_movie_reserve(zx_movie_t* movie, int num_bytes)
+{
+    // nothing goes in after the first record which didn't fit, so the
+    // stream stays valid up to the last complete frame
+    const int index_start = movie->size - 4 * movie->num_keyframes;
+    if (movie->overflow || ((movie->pos + num_bytes) > index_start))
+    {
+        movie->overflow = true;
+        return 0;
+    }
+    uint8_t* ptr = movie->out_data + movie->pos;
+    movie->pos += num_bytes;
+    return ptr;
+}
+
+static void _zx_movie_write_keyframe(zx_movie_t* movie, zx_t* sys)
+{
+    // the state goes straight into the buffer, its size is patched in
+    uint8_t* hdr = _zx_movie_reserve(movie, _ZX_MOVIE_KEYFRAME_HEADER_SIZE);
+    if (!hdr)
+    {
+        return;
+    }
+    const int max_bytes = movie->size - 4 * (movie->num_keyframes + 1) - movie->pos;
+    const int state_size = (max_bytes > 0) ? zx_save_state(sys, movie->out_data + movie->pos, max_bytes) : 0;
+    if (state_size == 0)
+    {
+        movie->pos = (int)(hdr - movie->out_data);
+        movie->overflow = true;
+        return;
+    }
+    hdr[0] = ZX_MOVIE_KEYFRAME;
+    _zx_movie_wr32(hdr + 1, (uint32_t)movie->frame);
+    _zx_movie_wr32(hdr + 5, (uint32_t)state_size);
+    _zx_movie_wr32(_zx_movie_index_slot(movie, movie->num_keyframes), (uint32_t)(hdr - movie->out_data));
+    movie->num_keyframes++;
+    movie->pos += state_size;
+    movie->frames_pos = -1;
+}
+
+static void _zx_movie_apply(zx_t* sys, zx_movie_record_t type, int value)
+{
+    switch (type)
+    {
+    case ZX_MOVIE_KEY_DOWN: zx_key_down(sys, value); break;
+    case ZX_MOVIE_KEY_UP: zx_key_up(sys, value); break;
+    case ZX_MOVIE_FLASH_LOAD: sys->tape_flash_load = (value != 0); break;
+    case ZX_MOVIE_ACCELERATE: sys->tape_accelerate = (value != 0); break;
+    case ZX_MOVIE_TAPE_PLAY: zx_play_tape(sys); break;
+    case ZX_MOVIE_TAPE_STOP: zx_stop_tape(sys); break;
+    default: break;
+    }
+}
+
+// start recording from the machine's current state
+static bool zx_movie_record(zx_movie_t* movie, zx_t* sys, uint8_t* ptr, int max_bytes, uint32_t frame_us, int keyframe_interval)
+{
+    CHIPS_ASSERT(movie && sys && sys->valid && ptr);
+    CHIPS_ASSERT((frame_us > 0) && (frame_us <= _ZX_MOVIE_MAX_FRAME_US));
+    CHIPS_ASSERT((keyframe_interval > 0) && (keyframe_interval <= _ZX_MOVIE_MAX_KEYFRAME_INTERVAL));
+    memset(movie, 0, sizeof(zx_movie_t));
+    if (max_bytes < (_ZX_MOVIE_HEADER_SIZE + _ZX_MOVIE_TRAILER_SIZE))
+    {
+        return false;
+    }
+    movie->mode = ZX_MOVIE_RECORDING;
+    movie->frame_us = frame_us;
+    movie->keyframe_interval = keyframe_interval;
+    movie->out_data = ptr;
+    movie->data = ptr;
+    movie->size = max_bytes - _ZX_MOVIE_TRAILER_SIZE;
+    movie->frames_pos = -1;
+
+    uint8_t* hdr = _zx_movie_reserve(movie, _ZX_MOVIE_HEADER_SIZE);
+    _zx_movie_wr32(hdr + 0, _ZX_MOVIE_MAGIC);
+    _zx_movie_wr32(hdr + 4, ZX_MOVIE_VERSION);
+    _zx_movie_wr32(hdr + 8, frame_us);
+    _zx_movie_wr32(hdr + 12, (uint32_t)keyframe_interval);
+    _zx_movie_write_keyframe(movie, sys);
+    if (movie->overflow)
+    {
+        movie->mode = ZX_MOVIE_IDLE;
+        return false;
+    }
+    return true;
+}
+
+// apply input to the machine, and record it while recording
+static void zx_movie_input(zx_movie_t* movie, zx_t* sys, zx_movie_record_t type, int value)
+{
+    CHIPS_ASSERT(movie && sys && sys->valid);
+    if (movie->mode == ZX_MOVIE_PLAYING)
+    {
+        // the movie is in control
+        return;
+    }
+    _zx_movie_apply(sys, type, value);
+    if (movie->mode == ZX_MOVIE_RECORDING)
+    {
+        uint8_t* rec = _zx_movie_reserve(movie, 2);
+        if (rec)
+        {
+            rec[0] = (uint8_t)type;
+            rec[1] = (uint8_t)value;
+        }
+        movie->frames_pos = -1;
+    }
+}
+
+// run one frame and record it, returns false once the buffer is full
+static bool zx_movie_record_frame(zx_movie_t* movie, zx_t* sys)
+{
+    CHIPS_ASSERT(movie && (movie->mode == ZX_MOVIE_RECORDING) && sys && sys->valid);
+    if (movie->overflow)
+    {
+        return false;
+    }
+    zx_exec(sys, movie->frame_us);
+    if ((movie->frames_pos >= 0) && (movie->out_data[movie->frames_pos + 1] < 0xFF))
+    {
+        movie->out_data[movie->frames_pos + 1]++;
+    }
+    else
+    {
+        uint8_t* rec = _zx_movie_reserve(movie, 2);
+        if (rec)
+        {
+            rec[0] = ZX_MOVIE_FRAMES;
+            rec[1] = 1;
+            movie->frames_pos = (int)(rec - movie->out_data);
+        }
+    }
+    movie->frame++;
+    if ((movie->frame % movie->keyframe_interval) == 0)
+    {
+        _zx_movie_write_keyframe(movie, sys);
+    }
+    if (!movie->overflow)
+    {
+        movie->num_frames = movie->frame;
+    }
+    return !movie->overflow;
+}
+
+// stop recording and write the keyframe index, returns the movie size
+static int zx_movie_finish(zx_movie_t* movie)
+{
+    CHIPS_ASSERT(movie && (movie->mode == ZX_MOVIE_RECORDING));
+    movie->mode = ZX_MOVIE_IDLE;
+    // the index grew down from the end of the buffer, put it in order
+    // and move it behind the records
+    uint8_t* index = _zx_movie_index_slot(movie, movie->num_keyframes - 1);
+    for (int i = 0, j = movie->num_keyframes - 1; i < j; i++, j--)
+    {
+        uint8_t tmp[4];
+        memcpy(tmp, index + 4 * i, 4);
+        memcpy(index + 4 * i, index + 4 * j, 4);
+        memcpy(index + 4 * j, tmp, 4);
+    }
+    uint8_t* dst = movie->out_data + movie->pos;
+    memmove(dst, index, 4 * movie->num_keyframes);
+    uint8_t* trailer = dst + 4 * movie->num_keyframes;
+    _zx_movie_wr32(trailer + 0, (uint32_t)movie->num_frames);
+    _zx_movie_wr32(trailer + 4, (uint32_t)movie->num_keyframes);
+    _zx_movie_wr32(trailer + 8, (uint32_t)movie->pos);
+    _zx_movie_wr32(trailer + 12, _ZX_MOVIE_INDEX_MAGIC);
+    return (int)(trailer + _ZX_MOVIE_TRAILER_SIZE - movie->out_data);
+}
+
+static const uint8_t* _zx_movie_keyframe(const zx_movie_t* movie, int keyframe, int* state_size)
+{
+    const uint32_t offset = _zx_movie_rd32(movie->index + 4 * keyframe);
+    const uint8_t* hdr = movie->data + offset;
+    *state_size = (int)_zx_movie_rd32(hdr + 5);
+    return hdr + _ZX_MOVIE_KEYFRAME_HEADER_SIZE;
+}
+
+// open a movie and restore its first frame
+static bool zx_movie_play(zx_movie_t* movie, zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(movie && sys && sys->valid && ptr);
+    memset(movie, 0, sizeof(zx_movie_t));
+    if ((num_bytes < (_ZX_MOVIE_HEADER_SIZE + _ZX_MOVIE_TRAILER_SIZE)) ||
+        (_zx_movie_rd32(ptr) != _ZX_MOVIE_MAGIC) ||
+        (_zx_movie_rd32(ptr + 4) != ZX_MOVIE_VERSION))
+    {
+        return false;
+    }
+    const uint8_t* trailer = ptr + num_bytes - _ZX_MOVIE_TRAILER_SIZE;
+    const uint32_t num_frames = _zx_movie_rd32(trailer + 0);
+    const uint32_t num_keyframes = _zx_movie_rd32(trailer + 4);
+    const uint32_t records_size = _zx_movie_rd32(trailer + 8);
+    const uint32_t keyframe_interval = _zx_movie_rd32(ptr + 12);
+    if ((_zx_movie_rd32(trailer + 12) != _ZX_MOVIE_INDEX_MAGIC) ||
+        (keyframe_interval == 0) || (keyframe_interval > _ZX_MOVIE_MAX_KEYFRAME_INTERVAL) ||
+        (_zx_movie_rd32(ptr + 8) == 0) || (_zx_movie_rd32(ptr + 8) > _ZX_MOVIE_MAX_FRAME_US) ||
+        (num_keyframes == 0) || (num_keyframes > (uint32_t)num_bytes / 4) ||
+        (records_size < _ZX_MOVIE_HEADER_SIZE) ||
+        ((records_size + 4 * num_keyframes) != (uint32_t)(trailer - ptr)) ||
+        (((num_frames / keyframe_interval) + 1) < num_keyframes) ||
+        (((uint64_t)num_keyframes * keyframe_interval) < num_frames))
+    {
+        return false;
+    }
+    movie->frame_us = _zx_movie_rd32(ptr + 8);
+    movie->keyframe_interval = (int)keyframe_interval;
+    movie->num_frames = (int)num_frames;
+    movie->data = ptr;
+    movie->size = (int)records_size;
+    movie->index = ptr + records_size;
+    movie->num_keyframes = (int)num_keyframes;
+
+    // keyframes have to be where the index says
+    for (int i = 0; i < movie->num_keyframes; i++)
+    {
+        const uint32_t offset = _zx_movie_rd32(movie->index + 4 * i);
+        if ((offset < _ZX_MOVIE_HEADER_SIZE) ||
+            ((offset + _ZX_MOVIE_KEYFRAME_HEADER_SIZE) > records_size) ||
+            (ptr[offset] != ZX_MOVIE_KEYFRAME) ||
+            (_zx_movie_rd32(ptr + offset + 1) != (uint32_t)(i * movie->keyframe_interval)) ||
+            (_zx_movie_rd32(ptr + offset + 5) > (records_size - offset - _ZX_MOVIE_KEYFRAME_HEADER_SIZE)))
+        {
+            return false;
+        }
+    }
+    movie->mode = ZX_MOVIE_PLAYING;
+    if (!zx_movie_seek(movie, sys, 0))
+    {
+        movie->mode = ZX_MOVIE_IDLE;
+        return false;
+    }
+    return true;
+}
+
+// apply the input up to the next frame and run it, returns false at
+// the end of the movie
+static bool zx_movie_play_frame(zx_movie_t* movie, zx_t* sys)
+{
+    CHIPS_ASSERT(movie && sys && sys->valid);
+    if ((movie->mode != ZX_MOVIE_PLAYING) || (movie->frame >= movie->num_frames))
+    {
+        return false;
+    }
+    while (movie->frames_left == 0)
+    {
+        if ((movie->pos + 2) > movie->size)
+        {
+            return false;
+        }
+        const uint8_t* rec = movie->data + movie->pos;
+        if (rec[0] == ZX_MOVIE_KEYFRAME)
+        {
+            if (((movie->pos + _ZX_MOVIE_KEYFRAME_HEADER_SIZE) > movie->size) ||
+                (_zx_movie_rd32(rec + 5) > (uint32_t)(movie->size - movie->pos - _ZX_MOVIE_KEYFRAME_HEADER_SIZE)))
+            {
+                return false;
+            }
+            movie->pos += _ZX_MOVIE_KEYFRAME_HEADER_SIZE + (int)_zx_movie_rd32(rec + 5);
+        }
+        else if (rec[0] == ZX_MOVIE_FRAMES)
+        {
+            movie->frames_left = rec[1];
+            movie->pos += 2;
+        }
+        else
+        {
+            _zx_movie_apply(sys, (zx_movie_record_t)rec[0], rec[1]);
+            movie->pos += 2;
+        }
+    }
+    zx_exec(sys, movie->frame_us);
+    movie->frames_left--;
+    movie->frame++;
+    return true;
+}
+
+// restore the keyframe before the frame and fast-forward to it, only
+// the last frame before it is drawn
+static bool zx_movie_seek(zx_movie_t* movie, zx_t* sys, int frame)
+{
+    CHIPS_ASSERT(movie && sys && sys->valid);
+    if ((movie->mode != ZX_MOVIE_PLAYING) || (frame < 0) || (frame > movie->num_frames))
+    {
+        return false;
+    }
+    int keyframe = frame / movie->keyframe_interval;
+    if (keyframe >= movie->num_keyframes)
+    {
+        keyframe = movie->num_keyframes - 1;
+    }
+    int state_size;
+    const uint8_t* state = _zx_movie_keyframe(movie, keyframe, &state_size);
+    if (!zx_load_state(sys, state, state_size))
+    {
+        return false;
+    }
+    movie->frame = keyframe * movie->keyframe_interval;
+    movie->pos = (int)(state - movie->data) + state_size;
+    movie->frames_left = 0;
+
+    const bool video_decode = sys->video_decode;
+    bool ok = true;
+    while (ok && (movie->frame < frame))
+    {
+        sys->video_decode = video_decode && (movie->frame == (frame - 1));
+        ok = zx_movie_play_frame(movie, sys);
+    }
+    sys->video_decode = video_decode;
+    return ok;
+}
+
+static void zx_movie_stop(zx_movie_t* movie)
+{
+    CHIPS_ASSERT(movie);
+    if (movie->mode == ZX_MOVIE_RECORDING)
+    {
+        zx_movie_finish(movie);
+    }
+    movie->mode = ZX_MOVIE_IDLE;
+}
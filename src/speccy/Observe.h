@@ -0,0 +1,308 @@
+#pragma once
+
+// Observations for learning and search code: the screen as one byte
+// per pixel, either palette indices (8-15 are the bright colors) or
+// gray levels, at full size or scaled down. They are computed from the
+// bitmap and attributes straight away, which is a lot less work than
+// decoding RGBA scanlines and scaling those down.
+//
+// Gray frames are scaled with a box filter, every output pixel is the
+// average of the source pixels it covers. Index frames can't be
+// averaged, they take the pixel in the middle of each box. Halving
+// both sides (128x96, or 160x128 with the border) has its own kernel.
+//
+// The border is the colour last written to port 0xFE, effects which
+// change it during a frame don't show.
+
+#include "Speccy.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #include <emmintrin.h>
+    #define _ZX_OBS_SSE2
+#endif
+
+#define ZX_OBS_MAX_WIDTH (320)
+#define ZX_OBS_MAX_HEIGHT (256)
+
+typedef enum
+{
+    ZX_OBS_INDEX,
+    ZX_OBS_GRAY
+} zx_obs_format_t;
+
+typedef struct
+{
+    zx_obs_format_t format;
+    bool border;                    // 320x256 with the border, else 256x192
+    int width;
+    int height;
+    int src_width;
+    int src_height;
+    uint8_t levels[16];             // output value of each palette index
+    uint8_t ink[2][256];            // of each attribute, without and with blink
+    uint8_t paper[2][256];
+    uint16_t x_begin[ZX_OBS_MAX_WIDTH + 1];     // source columns of each output column
+    uint16_t y_begin[ZX_OBS_MAX_HEIGHT + 1];
+    float x_scale[ZX_OBS_MAX_WIDTH];
+} zx_obs_t;
+
+static bool zx_obs_init(zx_obs_t* obs, zx_obs_format_t format, int width, int height, bool border);
+static void zx_observe(const zx_obs_t* obs, const zx_t* sys, uint8_t* out);
+
+// returns false if the size is bigger than the source
+static bool zx_obs_init(zx_obs_t* obs, zx_obs_format_t format, int width, int height, bool border)
+{
+    CHIPS_ASSERT(obs);
+    memset(obs, 0, sizeof(zx_obs_t));
+    obs->format = format;
+    obs->border = border;
+    obs->width = width;
+    obs->height = height;
+    obs->src_width = border ? DISPLAY_WIDTH : 256;
+    obs->src_height = border ? DISPLAY_HEIGHT : 192;
+    if ((width <= 0) || (height <= 0) || (width > obs->src_width) || (height > obs->src_height))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        const uint32_t c = _zx_palette[i & 7] & ((i & 8) ? 0xFFFFFFFF : 0xFFD7D7D7);
+        const uint32_t r = c & 0xFF;
+        const uint32_t g = (c >> 8) & 0xFF;
+        const uint32_t b = (c >> 16) & 0xFF;
+        obs->levels[i] = (format == ZX_OBS_INDEX) ? (uint8_t)i : (uint8_t)(((r * 77) + (g * 150) + (b * 29) + 128) >> 8);
+    }
+    for (int attr = 0; attr < 256; attr++)
+    {
+        const int bright = (attr & (1 << 6)) ? 8 : 0;
+        const uint8_t ink = obs->levels[(attr & 7) | bright];
+        const uint8_t paper = obs->levels[((attr >> 3) & 7) | bright];
+        const bool flash = 0 != (attr & (1 << 7));
+        obs->ink[0][attr] = ink;
+        obs->paper[0][attr] = paper;
+        obs->ink[1][attr] = flash ? paper : ink;
+        obs->paper[1][attr] = flash ? ink : paper;
+    }
+
+    for (int x = 0; x <= width; x++)
+    {
+        obs->x_begin[x] = (uint16_t)((x * obs->src_width) / width);
+    }
+    for (int y = 0; y <= height; y++)
+    {
+        obs->y_begin[y] = (uint16_t)((y * obs->src_height) / height);
+    }
+    for (int x = 0; x < width; x++)
+    {
+        obs->x_scale[x] = 1.0f / (float)(obs->x_begin[x + 1] - obs->x_begin[x]);
+    }
+    return true;
+}
+
+// 32 character cells to 256 pixels, ink where a bitmap bit is set
+static inline void _zx_obs_expand(const uint8_t* pix, const uint8_t* ink, const uint8_t* paper, uint8_t* dst)
+{
+#if defined(_ZX_OBS_SSE2)
+    // bit 7 is the leftmost pixel
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    for (int x = 0; x < 32; x += 8)
+    {
+        // spread 8 cells over 4 vectors of 2 cells by 8 pixels
+        __m128i p[4], i[4], b[4];
+        const __m128i p2 = _mm_loadl_epi64((const __m128i*)(pix + x));
+        const __m128i i2 = _mm_loadl_epi64((const __m128i*)(ink + x));
+        const __m128i b2 = _mm_loadl_epi64((const __m128i*)(paper + x));
+        const __m128i p4 = _mm_unpacklo_epi8(p2, p2);
+        const __m128i i4 = _mm_unpacklo_epi8(i2, i2);
+        const __m128i b4 = _mm_unpacklo_epi8(b2, b2);
+        const __m128i p8[2] = { _mm_unpacklo_epi16(p4, p4), _mm_unpackhi_epi16(p4, p4) };
+        const __m128i i8[2] = { _mm_unpacklo_epi16(i4, i4), _mm_unpackhi_epi16(i4, i4) };
+        const __m128i b8[2] = { _mm_unpacklo_epi16(b4, b4), _mm_unpackhi_epi16(b4, b4) };
+        for (int k = 0; k < 2; k++)
+        {
+            p[k * 2] = _mm_unpacklo_epi32(p8[k], p8[k]);
+            p[k * 2 + 1] = _mm_unpackhi_epi32(p8[k], p8[k]);
+            i[k * 2] = _mm_unpacklo_epi32(i8[k], i8[k]);
+            i[k * 2 + 1] = _mm_unpackhi_epi32(i8[k], i8[k]);
+            b[k * 2] = _mm_unpacklo_epi32(b8[k], b8[k]);
+            b[k * 2 + 1] = _mm_unpackhi_epi32(b8[k], b8[k]);
+        }
+        for (int k = 0; k < 4; k++)
+        {
+            const __m128i set = _mm_cmpeq_epi8(_mm_and_si128(p[k], bits), bits);
+            const __m128i px = _mm_xor_si128(b[k], _mm_and_si128(set, _mm_xor_si128(i[k], b[k])));
+            _mm_storeu_si128((__m128i*)(dst + (x * 8) + (k * 16)), px);
+        }
+    }
+#else
+    // 8 pixels in a 64-bit word, the first pixel in the lowest byte
+    for (int x = 0; x < 32; x++)
+    {
+        const uint64_t bytes = 0x0101010101010101ULL;
+        const uint64_t lit = ((uint64_t)pix[x] * bytes) & 0x0102040810204080ULL;
+        const uint64_t set = (((lit + 0x7F7F7F7F7F7F7F7FULL) & 0x8080808080808080ULL) >> 7) * 0xFF;
+        const uint64_t b = paper[x] * bytes;
+        const uint64_t px = b ^ (set & ((ink[x] * bytes) ^ b));
+        memcpy(dst + (x * 8), &px, 8);
+    }
+#endif
+}
+
+// levels of a character row's attributes, the 8 lines of a row share them
+typedef struct
+{
+    const uint8_t* clr;
+    uint8_t ink[32];
+    uint8_t paper[32];
+} _zx_obs_row_t;
+
+// one source line, y counts from the top of the border if there is one
+static void _zx_obs_line(const zx_obs_t* obs, const zx_t* sys, int y, int blink, _zx_obs_row_t* row, uint8_t* dst)
+{
+    if (obs->border)
+    {
+        const uint8_t border = obs->levels[sys->last_fe_out & 7];
+        if ((y < 32) || (y >= 224))
+        {
+            memset(dst, border, DISPLAY_WIDTH);
+            return;
+        }
+        memset(dst, border, 32);
+        memset(dst + 288, border, 32);
+        dst += 32;
+        y -= 32;
+    }
+
+    // see _zx_decode_scanline() for the address layout
+    const int bank_page = (int)sys->display_ram_bank * ZX_RAM_BANK_PAGES;
+    const uint16_t y_offset = ((y & 0xC0) << 5) | ((y & 0x07) << 8) | ((y & 0x38) << 2);
+    const uint16_t clr_line = 0x1800 + ((y & ~0x7) << 2);
+    const uint8_t* pix = _zx_ram_page(sys, bank_page + (y_offset >> MEM_PAGE_SHIFT)) + (y_offset & MEM_PAGE_MASK);
+    const uint8_t* clr = _zx_ram_page(sys, bank_page + (clr_line >> MEM_PAGE_SHIFT)) + (clr_line & MEM_PAGE_MASK);
+
+    if (row->clr != clr)
+    {
+        row->clr = clr;
+        for (int x = 0; x < 32; x++)
+        {
+            row->ink[x] = obs->ink[blink][clr[x]];
+            row->paper[x] = obs->paper[blink][clr[x]];
+        }
+    }
+    _zx_obs_expand(pix, row->ink, row->paper, dst);
+}
+
+// averages two lines down to half their width
+static void _zx_obs_half(const uint8_t* line0, const uint8_t* line1, int src_width, uint8_t* dst)
+{
+#if defined(_ZX_OBS_SSE2)
+    const __m128i low = _mm_set1_epi16(0xFF);
+    const __m128i round = _mm_set1_epi16(2);
+    for (int x = 0; x < src_width; x += 16)
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(line0 + x));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(line1 + x));
+        const __m128i even = _mm_add_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+        const __m128i odd = _mm_add_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        const __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(even, odd), round), 2);
+        _mm_storel_epi64((__m128i*)(dst + (x / 2)), _mm_packus_epi16(sum, sum));
+    }
+#else
+    for (int x = 0; x < src_width; x += 2)
+    {
+        dst[x / 2] = (uint8_t)((line0[x] + line0[x + 1] + line1[x] + line1[x + 1] + 2) >> 2);
+    }
+#endif
+}
+
+static void _zx_obs_accumulate(const uint8_t* line, int src_width, uint16_t* sums)
+{
+#if defined(_ZX_OBS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (int x = 0; x < src_width; x += 16)
+    {
+        const __m128i px = _mm_loadu_si128((const __m128i*)(line + x));
+        __m128i* lo = (__m128i*)(sums + x);
+        __m128i* hi = (__m128i*)(sums + x + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(px, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(px, zero)));
+    }
+#else
+    for (int x = 0; x < src_width; x++)
+    {
+        sums[x] += line[x];
+    }
+#endif
+}
+
+// writes width x height bytes, reads the screen through the fork pages
+// like the video decode does, so forks can be observed too
+static void zx_observe(const zx_obs_t* obs, const zx_t* sys, uint8_t* out)
+{
+    CHIPS_ASSERT(obs && sys && sys->valid && out);
+    const int blink = (sys->blink_counter & 0x10) ? 1 : 0;
+    const int width = obs->width;
+    const int height = obs->height;
+    const int src_width = obs->src_width;
+    uint8_t line[2][ZX_OBS_MAX_WIDTH];
+    _zx_obs_row_t row;
+    row.clr = 0;
+
+    if ((width == src_width) && (height == obs->src_height))
+    {
+        for (int y = 0; y < height; y++)
+        {
+            _zx_obs_line(obs, sys, y, blink, &row, out + (y * width));
+        }
+    }
+    else if (obs->format == ZX_OBS_INDEX)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            _zx_obs_line(obs, sys, (obs->y_begin[y] + obs->y_begin[y + 1]) / 2, blink, &row, line[0]);
+            for (int x = 0; x < width; x++)
+            {
+                out[(y * width) + x] = line[0][(obs->x_begin[x] + obs->x_begin[x + 1]) / 2];
+            }
+        }
+    }
+    else if (((width * 2) == src_width) && ((height * 2) == obs->src_height))
+    {
+        for (int y = 0; y < height; y++)
+        {
+            _zx_obs_line(obs, sys, y * 2, blink, &row, line[0]);
+            _zx_obs_line(obs, sys, (y * 2) + 1, blink, &row, line[1]);
+            _zx_obs_half(line[0], line[1], src_width, out + (y * width));
+        }
+    }
+    else
+    {
+        uint16_t sums[ZX_OBS_MAX_WIDTH];
+        uint32_t prefix[ZX_OBS_MAX_WIDTH + 1];
+        prefix[0] = 0;
+        for (int y = 0; y < height; y++)
+        {
+            memset(sums, 0, sizeof(sums));
+            for (int src_y = obs->y_begin[y]; src_y < obs->y_begin[y + 1]; src_y++)
+            {
+                _zx_obs_line(obs, sys, src_y, blink, &row, line[0]);
+                _zx_obs_accumulate(line[0], src_width, sums);
+            }
+
+            // box sums from running sums, the boxes are only a few wide
+            for (int src_x = 0; src_x < src_width; src_x++)
+            {
+                prefix[src_x + 1] = prefix[src_x] + sums[src_x];
+            }
+            const float y_scale = 1.0f / (float)(obs->y_begin[y + 1] - obs->y_begin[y]);
+            for (int x = 0; x < width; x++)
+            {
+                const uint32_t sum = prefix[obs->x_begin[x + 1]] - prefix[obs->x_begin[x]];
+                out[(y * width) + x] = (uint8_t)(((float)sum * obs->x_scale[x] * y_scale) + 0.5f);
+            }
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+// Many machines in one block of memory. Machines are packed from the
+// start of the arena on cache line boundaries and the RAM banks they
+// map from the end, so stepping the machines one after another walks
+// through their state in order, and 48K machines never take up the
+// banks they don't map. The ROM is shared by all of them anyway.
+//
+// Machines and banks which are given back get reused. A pool isn't
+// thread safe: allocate the machines up front, they can then run on any
+// number of threads as long as nothing maps new banks meanwhile (forks
+// into a machine which already has the source's banks don't).
+
+#include "Speccy.h"
+
+#define ZX_POOL_ALIGN (64)
+#define ZX_POOL_MACHINE_SIZE ((sizeof(zx_t) + (ZX_POOL_ALIGN - 1)) & ~(size_t)(ZX_POOL_ALIGN - 1))
+
+typedef struct
+{
+    uint8_t* begin;
+    uint8_t* end;
+    uint8_t* machines_end;          // machines grow up from begin
+    uint8_t* banks_begin;           // banks grow down from end
+    void* free_machines;
+    void* free_banks;
+    int num_machines;
+    int num_banks;
+} zx_pool_t;
+
+static void zx_pool_init(zx_pool_t* pool, void* ptr, size_t num_bytes);
+static size_t zx_pool_bytes(int num_machines, int banks_per_machine);
+static zx_t* zx_pool_alloc(zx_pool_t* pool, const zx_desc_t* desc);
+static void zx_pool_free(zx_pool_t* pool, zx_t* sys);
+
+static void zx_pool_init(zx_pool_t* pool, void* ptr, size_t num_bytes)
+{
+    CHIPS_ASSERT(pool && ptr);
+    memset(pool, 0, sizeof(zx_pool_t));
+    const uintptr_t begin = ((uintptr_t)ptr + (ZX_POOL_ALIGN - 1)) & ~(uintptr_t)(ZX_POOL_ALIGN - 1);
+    const uintptr_t end = ((uintptr_t)ptr + num_bytes) & ~(uintptr_t)(ZX_POOL_ALIGN - 1);
+    pool->begin = (uint8_t*)begin;
+    pool->end = (uint8_t*)((end > begin) ? end : begin);
+    pool->machines_end = pool->begin;
+    pool->banks_begin = pool->end;
+}
+
+// arena size for a number of machines, 48K machines map 3 banks
+static size_t zx_pool_bytes(int num_machines, int banks_per_machine)
+{
+    return (size_t)num_machines * (ZX_POOL_MACHINE_SIZE + (size_t)banks_per_machine * ZX_RAM_BANK_SIZE) + ZX_POOL_ALIGN;
+}
+
+// free lists keep the next pointer in the first bytes of each block
+static void* _zx_pool_pop(void** list)
+{
+    void* block = *list;
+    if (block)
+    {
+        memcpy(list, block, sizeof(void*));
+    }
+    return block;
+}
+
+static void _zx_pool_push(void** list, void* block)
+{
+    memcpy(block, list, sizeof(void*));
+    *list = block;
+}
+
+static uint8_t* _zx_pool_alloc_bank(void* user_data)
+{
+    zx_pool_t* pool = (zx_pool_t*)user_data;
+    uint8_t* bank = (uint8_t*)_zx_pool_pop(&pool->free_banks);
+    if (!bank)
+    {
+        if ((size_t)(pool->banks_begin - pool->machines_end) < ZX_RAM_BANK_SIZE)
+        {
+            return 0;
+        }
+        pool->banks_begin -= ZX_RAM_BANK_SIZE;
+        bank = pool->banks_begin;
+    }
+    memset(bank, 0, ZX_RAM_BANK_SIZE);
+    pool->num_banks++;
+    return bank;
+}
+
+static void _zx_pool_free_bank(void* user_data, uint8_t* bank)
+{
+    zx_pool_t* pool = (zx_pool_t*)user_data;
+    _zx_pool_push(&pool->free_banks, bank);
+    pool->num_banks--;
+}
+
+// returns an initialized machine, or 0 if the pool is full
+static zx_t* zx_pool_alloc(zx_pool_t* pool, const zx_desc_t* desc)
+{
+    CHIPS_ASSERT(pool && pool->begin && desc);
+    zx_t* sys = (zx_t*)_zx_pool_pop(&pool->free_machines);
+    if (!sys)
+    {
+        if ((size_t)(pool->banks_begin - pool->machines_end) < ZX_POOL_MACHINE_SIZE)
+        {
+            return 0;
+        }
+        sys = (zx_t*)pool->machines_end;
+        pool->machines_end += ZX_POOL_MACHINE_SIZE;
+    }
+    pool->num_machines++;
+
+    zx_desc_t pool_desc = *desc;
+    pool_desc.alloc_bank = _zx_pool_alloc_bank;
+    pool_desc.free_bank = _zx_pool_free_bank;
+    pool_desc.alloc_user_data = pool;
+    zx_init(sys, &pool_desc);
+    if (!sys->valid)
+    {
+        zx_pool_free(pool, sys);
+        return 0;
+    }
+    return sys;
+}
+
+static void zx_pool_free(zx_pool_t* pool, zx_t* sys)
+{
+    CHIPS_ASSERT(pool && sys && ((uint8_t*)sys >= pool->begin) && ((uint8_t*)sys < pool->machines_end));
+    zx_discard(sys);
+    _zx_pool_push(&pool->free_machines, sys);
+    pool->num_machines--;
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+// Profiler for the emulated program: T-states and instruction counts
+// per PC, an opcode mix per prefix table, and a shadow call stack built
+// from CALL, RST, RET and interrupts, so every instruction's T-states
+// go to the call path it ran in. Inclusive and exclusive time per
+// function and the call edges come out of that tree (zx_prof_node_t),
+// tools/Profile.cpp writes them out for callgrind and flame graphs.
+//
+// Instructions are seen through the debug callback, which takes the
+// place of a debugger while profiling. The registers are stale during
+// zx_exec(), so the stack pointer comes from the bus: this header sets
+// ZX_TICK_HOOK, which has to happen before Speccy.h is included, and
+// records the last stack write and read and the interrupt acknowledge
+// of each instruction. Other code built without this header has no
+// hook at all.
+//
+// Frames are tied to the address of their return address on the
+// stack. A return drops every frame at or below the new stack pointer
+// and a call drops those it overwrites, so code which resets SP or
+// returns through a JP (HL) loses frames instead of unbalancing the
+// stack.
+
+#if defined(ZX_TICK_HOOK)
+#error "Profiler.h has to be included before Speccy.h"
+#endif
+
+#include <stdint.h>
+
+typedef struct zx_t zx_t;
+static void _zx_prof_tick(zx_t* sys, int num_ticks, uint64_t pins);
+static bool _zx_prof_step(zx_t* sys, uint16_t pc, void* user_data);
+
+#define ZX_TICK_HOOK(sys, num_ticks, pins) _zx_prof_tick(sys, num_ticks, pins)
+
+#include "Speccy.h"
+
+#include <string.h>
+
+#define ZX_PROF_MAX_DEPTH (256)
+
+// opcode tables: unprefixed, CB, ED, DD, FD, DD CB, FD CB
+#define ZX_PROF_OP_TABLES (7)
+
+typedef enum
+{
+    ZX_PROF_ROOT,                   // whatever ran before the first call
+    ZX_PROF_CALL,                   // CALL or RST
+    ZX_PROF_INTERRUPT
+} zx_prof_kind_t;
+
+// one call path, a node per distinct chain of callers. Children always
+// come after their parent, so a pass from the last node to the first
+// adds up inclusive times
+typedef struct
+{
+    int parent;                     // -1 for the root
+    uint16_t func;                  // entry address
+    uint16_t call_pc;               // the CALL or RST, or the interrupted PC
+    zx_prof_kind_t kind;
+    uint64_t calls;
+    uint64_t cycles;                // exclusive
+    uint64_t instructions;          // exclusive
+} zx_prof_node_t;
+
+typedef struct
+{
+    int node;
+    uint16_t sp;                    // where the return address is
+} zx_prof_frame_t;
+
+typedef struct
+{
+    // per PC, the node is the call path the PC last ran in
+    uint64_t* pc_cycles;
+    uint32_t* pc_count;
+    int32_t* pc_node;
+
+    uint64_t op_count[ZX_PROF_OP_TABLES][256];
+    uint64_t op_cycles[ZX_PROF_OP_TABLES][256];
+
+    zx_prof_node_t* nodes;
+    int num_nodes;
+    int max_nodes;
+    int32_t* node_hash;             // open addressing, node index + 1
+    int hash_mask;
+
+    zx_prof_frame_t stack[ZX_PROF_MAX_DEPTH];
+    int depth;
+    int node;                       // current call path
+
+    uint16_t pc;                    // the instruction running now
+    uint64_t ticks;                 // T-state it started at
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t interrupts;
+    uint64_t lost_calls;            // stack or node table full
+
+    // from the tick hook, for the instruction running now
+    uint16_t last_read;
+    uint16_t last_write;
+    bool int_ack;
+    uint64_t int_ticks;             // T-state the acknowledge started at
+} zx_prof_t;
+
+static size_t zx_prof_bytes(int max_nodes);
+static bool zx_prof_init(zx_prof_t* prof, void* ptr, size_t num_bytes, int max_nodes);
+static void zx_prof_start(zx_prof_t* prof, zx_t* sys);
+static void zx_prof_stop(zx_prof_t* prof, zx_t* sys);
+
+static int _zx_prof_hash_size(int max_nodes)
+{
+    int size = 1;
+    while (size < (2 * max_nodes))
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+// the buffer holds the per PC tables and the call tree
+static size_t zx_prof_bytes(int max_nodes)
+{
+    return 0x10000 * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(int32_t)) +
+        (size_t)max_nodes * sizeof(zx_prof_node_t) +
+        (size_t)_zx_prof_hash_size(max_nodes) * sizeof(int32_t) + 16;
+}
+
+static bool zx_prof_init(zx_prof_t* prof, void* ptr, size_t num_bytes, int max_nodes)
+{
+    CHIPS_ASSERT(prof && ptr && (max_nodes > 0));
+    memset(prof, 0, sizeof(zx_prof_t));
+    if (num_bytes < zx_prof_bytes(max_nodes))
+    {
+        return false;
+    }
+    memset(ptr, 0, num_bytes);
+    uint8_t* p = (uint8_t*)(((uintptr_t)ptr + 15) & ~(uintptr_t)15);
+    prof->pc_cycles = (uint64_t*)p;
+    p += 0x10000 * sizeof(uint64_t);
+    prof->nodes = (zx_prof_node_t*)p;
+    p += (size_t)max_nodes * sizeof(zx_prof_node_t);
+    prof->pc_count = (uint32_t*)p;
+    p += 0x10000 * sizeof(uint32_t);
+    prof->pc_node = (int32_t*)p;
+    p += 0x10000 * sizeof(int32_t);
+    prof->node_hash = (int32_t*)p;
+    prof->hash_mask = _zx_prof_hash_size(max_nodes) - 1;
+    prof->max_nodes = max_nodes;
+
+    prof->nodes[0].parent = -1;
+    prof->nodes[0].kind = ZX_PROF_ROOT;
+    prof->num_nodes = 1;
+    return true;
+}
+
+// profiles from the next instruction on, in place of the debug callback
+static void zx_prof_start(zx_prof_t* prof, zx_t* sys)
+{
+    CHIPS_ASSERT(prof && prof->nodes && sys && sys->valid && !sys->frame_pending);
+    prof->pc = z80_pc(&sys->cpu);
+    prof->ticks = sys->ticks;
+    prof->int_ack = false;
+    zx_set_debug_cb(sys, _zx_prof_step, prof);
+}
+
+static void zx_prof_stop(zx_prof_t* prof, zx_t* sys)
+{
+    CHIPS_ASSERT(prof && sys && (sys->debug_user_data == prof));
+    (void)prof;
+    zx_set_debug_cb(sys, 0, 0);
+}
+
+static void _zx_prof_tick(zx_t* sys, int num_ticks, uint64_t pins)
+{
+    if (sys->debug_cb != _zx_prof_step)
+    {
+        return;
+    }
+    zx_prof_t* prof = (zx_prof_t*)sys->debug_user_data;
+    if (pins & Z80_MREQ)
+    {
+        if (pins & Z80_WR)
+        {
+            prof->last_write = Z80_GET_ADDR(pins);
+        }
+        else if (!(pins & Z80_M1))
+        {
+            prof->last_read = Z80_GET_ADDR(pins);
+        }
+    }
+    else if ((pins & (Z80_M1 | Z80_IORQ)) == (Z80_M1 | Z80_IORQ))
+    {
+        prof->int_ack = true;
+        prof->int_ticks = sys->ticks - num_ticks;
+    }
+}
+
+static int _zx_prof_child(zx_prof_t* prof, int parent, uint16_t func, uint16_t call_pc, zx_prof_kind_t kind)
+{
+    uint32_t h = ((uint32_t)parent * 0x9E3779B1u) ^ ((uint32_t)func * 0x85EBCA77u) ^ (uint32_t)kind;
+    for (;;)
+    {
+        h &= (uint32_t)prof->hash_mask;
+        const int32_t entry = prof->node_hash[h];
+        if (entry == 0)
+        {
+            break;
+        }
+        zx_prof_node_t* node = &prof->nodes[entry - 1];
+        if ((node->parent == parent) && (node->func == func) && (node->kind == kind))
+        {
+            return entry - 1;
+        }
+        h++;
+    }
+    if (prof->num_nodes == prof->max_nodes)
+    {
+        return -1;
+    }
+    const int index = prof->num_nodes++;
+    zx_prof_node_t* node = &prof->nodes[index];
+    node->parent = parent;
+    node->func = func;
+    node->call_pc = call_pc;
+    node->kind = kind;
+    prof->node_hash[h] = index + 1;
+    return index;
+}
+
+static void _zx_prof_push(zx_prof_t* prof, uint16_t func, uint16_t call_pc, uint16_t sp, zx_prof_kind_t kind)
+{
+    // frames whose return address the push overwrote are gone
+    while ((prof->depth > 0) && (prof->stack[prof->depth - 1].sp <= sp))
+    {
+        prof->depth--;
+    }
+    const int parent = (prof->depth > 0) ? prof->stack[prof->depth - 1].node : 0;
+    const int node = (prof->depth < ZX_PROF_MAX_DEPTH) ? _zx_prof_child(prof, parent, func, call_pc, kind) : -1;
+    if (node < 0)
+    {
+        prof->lost_calls++;
+        prof->node = parent;
+        return;
+    }
+    prof->nodes[node].calls++;
+    prof->stack[prof->depth].node = node;
+    prof->stack[prof->depth].sp = sp;
+    prof->depth++;
+    prof->node = node;
+}
+
+static void _zx_prof_pop(zx_prof_t* prof, uint16_t sp)
+{
+    while ((prof->depth > 0) && (prof->stack[prof->depth - 1].sp < sp))
+    {
+        prof->depth--;
+    }
+    prof->node = (prof->depth > 0) ? prof->stack[prof->depth - 1].node : 0;
+}
+
+static bool _zx_prof_step(zx_t* sys, uint16_t pc, void* user_data)
+{
+    zx_prof_t* prof = (zx_prof_t*)user_data;
+    const uint16_t op_pc = prof->pc;
+
+    // an accepted interrupt ran after the instruction, its acknowledge
+    // and the push go to the interrupt
+    const uint64_t end = prof->int_ack ? prof->int_ticks : sys->ticks;
+    const uint32_t cycles = (uint32_t)(end - prof->ticks);
+
+    prof->pc_cycles[op_pc] += cycles;
+    prof->pc_count[op_pc]++;
+    prof->pc_node[op_pc] = prof->node;
+    prof->nodes[prof->node].cycles += cycles;
+    prof->nodes[prof->node].instructions++;
+    prof->cycles += cycles;
+    prof->instructions++;
+
+    mem_t* mem = &sys->mem;
+    uint8_t op = mem_rd(mem, op_pc);
+    int table = 0;
+    if (op == 0xCB)
+    {
+        table = 1;
+        op = mem_rd(mem, op_pc + 1);
+    }
+    else if (op == 0xED)
+    {
+        table = 2;
+        op = mem_rd(mem, op_pc + 1);
+    }
+    else if ((op == 0xDD) || (op == 0xFD))
+    {
+        const bool iy = (op == 0xFD);
+        op = mem_rd(mem, op_pc + 1);
+        if (op == 0xCB)
+        {
+            table = iy ? 6 : 5;
+            op = mem_rd(mem, op_pc + 3);
+        }
+        else
+        {
+            table = iy ? 4 : 3;
+        }
+    }
+    prof->op_count[table][op]++;
+    prof->op_cycles[table][op] += cycles;
+
+    // where the instruction itself went and what it left in SP: an
+    // interrupt pushed that PC, its stack write was the last one
+    const uint16_t int_sp = prof->last_write;
+    const uint16_t next = prof->int_ack ? mem_rd16(mem, int_sp) : pc;
+    const uint16_t call_sp = prof->int_ack ? (uint16_t)(int_sp + 2) : prof->last_write;
+    const uint16_t ret_sp = prof->int_ack ? (uint16_t)(int_sp + 2) : (uint16_t)(prof->last_read + 1);
+
+    if (table == 0)
+    {
+        if ((op == 0xCD) || ((op & 0xC7) == 0xC4))
+        {
+            // CALL nn, CALL cc,nn
+            const uint16_t target = mem_rd16(mem, op_pc + 1);
+            if ((next == target) && ((op == 0xCD) || (target != (uint16_t)(op_pc + 3))))
+            {
+                _zx_prof_push(prof, target, op_pc, call_sp, ZX_PROF_CALL);
+            }
+        }
+        else if ((op & 0xC7) == 0xC7)
+        {
+            // RST p
+            _zx_prof_push(prof, op & 0x38, op_pc, call_sp, ZX_PROF_CALL);
+        }
+        else if ((op == 0xC9) || (((op & 0xC7) == 0xC0) && (next != (uint16_t)(op_pc + 1))))
+        {
+            // RET, RET cc
+            _zx_prof_pop(prof, ret_sp);
+        }
+    }
+    else if ((table == 2) && ((op & 0xC7) == 0x45))
+    {
+        // RETN, RETI
+        _zx_prof_pop(prof, ret_sp);
+    }
+
+    prof->ticks = sys->ticks;
+    if (prof->int_ack)
+    {
+        prof->int_ack = false;
+        prof->interrupts++;
+        _zx_prof_push(prof, pc, next, int_sp, ZX_PROF_INTERRUPT);
+
+        const uint32_t int_cycles = (uint32_t)(sys->ticks - prof->int_ticks);
+        prof->nodes[prof->node].cycles += int_cycles;
+        prof->cycles += int_cycles;
+    }
+
+    prof->pc = pc;
+    return false;
+}
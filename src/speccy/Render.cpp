@@ -1,5 +1,7 @@
 #include "Render.hpp"
 
+#include "../util/Trace.hpp"
+
 namespace Speccy
 {
     static const std::string vertex_shader_string =
@@ -140,6 +142,26 @@ namespace Speccy
         const uint32_t border_color,
         const bool supersampling)
     {
+        TRACE_ZONE("Render::Draw");
+
+        UploadDisplay();
+
+        if (supersampling)
+        {
+            DrawSupersampled();
+        }
+
+        DrawWindow(
+            window_width,
+            window_height,
+            border_color,
+            supersampling);
+    }
+
+    void Render::UploadDisplay()
+    {
+        TRACE_ZONE("Render::UploadDisplay");
+
         glDisable(GL_CULL_FACE);
         glCullFace(GL_BACK);
 
@@ -169,55 +191,64 @@ namespace Speccy
 
         glGenerateMipmap(
             GL_TEXTURE_2D);
+    }
 
-        // Render Speccy display to FBO
+    // Render Speccy display to FBO
+    void Render::DrawSupersampled()
+    {
+        TRACE_ZONE("Render::DrawSupersampled");
 
-        if (supersampling)
-        {
-            glBindFramebuffer(
-                GL_FRAMEBUFFER,
-                frame_buffer.frame);
+        glBindFramebuffer(
+            GL_FRAMEBUFFER,
+            frame_buffer.frame);
 
-            glViewport(
-                0, 0,
-                frame_buffer.width,
-                frame_buffer.height);
+        glViewport(
+            0, 0,
+            frame_buffer.width,
+            frame_buffer.height);
 
-            glClearColor(0, 0, 0, 0);
+        glClearColor(0, 0, 0, 0);
 
-            glClear(
-                GL_COLOR_BUFFER_BIT |
-                GL_DEPTH_BUFFER_BIT |
-                GL_STENCIL_BUFFER_BIT);
+        glClear(
+            GL_COLOR_BUFFER_BIT |
+            GL_DEPTH_BUFFER_BIT |
+            GL_STENCIL_BUFFER_BIT);
 
-            const glm::mat4 proj_fb = glm::ortho<float>(
-                0,
-                static_cast<float>(frame_buffer.width),
-                static_cast<float>(frame_buffer.height),
-                0,
-                -1.0f,
-                1.0f);
+        const glm::mat4 proj_fb = glm::ortho<float>(
+            0,
+            static_cast<float>(frame_buffer.width),
+            static_cast<float>(frame_buffer.height),
+            0,
+            -1.0f,
+            1.0f);
 
-            glm::mat4 view_fb;
+        glm::mat4 view_fb;
 
-            view_fb = glm::scale(
-                view_fb,
-                glm::vec3(frame_buffer.width, frame_buffer.height, 1.0f));
+        view_fb = glm::scale(
+            view_fb,
+            glm::vec3(frame_buffer.width, frame_buffer.height, 1.0f));
 
-            DrawDisplay(
-                proj_fb,
-                view_fb,
-                display_texture,
-                true,
-                GL_NEAREST,
-                GL_NEAREST);
+        DrawDisplay(
+            proj_fb,
+            view_fb,
+            display_texture,
+            true,
+            GL_NEAREST,
+            GL_NEAREST);
 
-            glBindFramebuffer(
-                GL_FRAMEBUFFER,
-                0);
-        }
+        glBindFramebuffer(
+            GL_FRAMEBUFFER,
+            0);
+    }
 
-        // Render to front buffer
+    // Render to front buffer
+    void Render::DrawWindow(
+        const uint32_t window_width,
+        const uint32_t window_height,
+        const uint32_t border_color,
+        const bool supersampling)
+    {
+        TRACE_ZONE("Render::DrawWindow");
 
         glViewport(
             0,
@@ -53,5 +53,14 @@ namespace Speccy
             const uint32_t window_height,
             const uint32_t border_color,
             const bool supersampling);
+
+        // the stages of Draw, for timing them one by one
+        void UploadDisplay();
+        void DrawSupersampled();
+        void DrawWindow(
+            const uint32_t window_width,
+            const uint32_t window_height,
+            const uint32_t border_color,
+            const bool supersampling);
     };
 }
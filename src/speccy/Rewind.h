@@ -0,0 +1,654 @@
+#pragma once
+
+// Rewind history: a savestate is captured every few frames into a ring
+// of fixed size, the oldest entries are dropped when it runs full.
+//
+// Most entries are deltas, the XOR of a state against the one before,
+// with a full keyframe every keyframe_interval captures and whenever the
+// state size changes. Entries are stored as 1 KByte pages: pages which
+// are zero (unchanged in a delta) are left out, identical pages are
+// stored once, and what's left is packed with a small LZ codec. Frames
+// in which a game only touches the screen and a few variables come
+// down to a couple hundred bytes.
+//
+// Stepping back from the newest entry undoes one delta at a time, any
+// other entry is decoded forward from the keyframe before it. The
+// oldest entry is always a keyframe, deltas orphaned by dropping their
+// keyframe are dropped as well.
+//
+// All memory comes from the caller's buffer, capturing doesn't allocate
+// and restoring only allocates through the machine's alloc_bank when a
+// state uses banks the machine doesn't have yet.
+
+#include "Savestate.h"
+
+#define ZX_REWIND_PAGE_SIZE (1024)
+#define ZX_REWIND_STATE_SIZE (ZX_SAVESTATE_MAX_SIZE)
+#define ZX_REWIND_NUM_PAGES (ZX_REWIND_STATE_SIZE / ZX_REWIND_PAGE_SIZE)
+#define ZX_REWIND_MAX_ENTRIES (1 << 16)
+
+typedef struct
+{
+    uint32_t offset;                // in the ring
+    uint32_t size;
+    uint32_t state_size;
+    bool keyframe;
+    uint64_t ticks;                 // machine time of the state
+} zx_rewind_entry_t;
+
+typedef struct
+{
+    int interval;                   // frames between captures
+    int keyframe_interval;          // captures between keyframes
+    int frame_counter;
+    int since_keyframe;
+
+    zx_rewind_entry_t* entries;
+    int max_entries;
+    int first;
+    int count;
+
+    uint8_t* ring;
+    uint32_t ring_size;
+    uint32_t write_pos;
+
+    uint8_t* head;                  // state of the newest entry
+    int head_size;
+    uint8_t* next;                  // state being captured or decoded
+    uint8_t* work;                  // page data of an entry
+    uint8_t* encode;                // entry before it goes into the ring
+
+    uint64_t raw_bytes;             // of the states in the ring
+    uint64_t stored_bytes;
+} zx_rewind_t;
+
+static bool zx_rewind_init(zx_rewind_t* rw, uint8_t* ptr, int num_bytes, int interval, int keyframe_interval);
+static void zx_rewind_reset(zx_rewind_t* rw);
+static bool zx_rewind_push(zx_rewind_t* rw, zx_t* sys);
+static int zx_rewind_count(const zx_rewind_t* rw);
+static uint64_t zx_rewind_ticks(zx_rewind_t* rw, int index);
+static bool zx_rewind_load(zx_rewind_t* rw, zx_t* sys, int index);
+static void zx_rewind_truncate(zx_rewind_t* rw, int index);
+static bool zx_rewind_step_back(zx_rewind_t* rw, zx_t* sys);
+static float zx_rewind_ratio(const zx_rewind_t* rw);
+
+#define _ZX_REWIND_ENTRY_HEADER_SIZE (8)
+#define _ZX_REWIND_LZ_BOUND(n) ((n) + ((n) / 255) + 16)
+#define _ZX_REWIND_ENCODE_SIZE (_ZX_REWIND_ENTRY_HEADER_SIZE + 2 * ZX_REWIND_NUM_PAGES + _ZX_REWIND_LZ_BOUND(ZX_REWIND_STATE_SIZE))
+#define _ZX_REWIND_LZ_HASH_BITS (12)
+#define _ZX_REWIND_LZ_MIN_MATCH (4)
+#define _ZX_REWIND_DEDUP_SLOTS (256)
+
+static inline uint32_t _zx_rewind_rd32(const uint8_t* ptr)
+{
+    uint32_t val;
+    memcpy(&val, ptr, 4);
+    return val;
+}
+
+static uint8_t* _zx_rewind_lz_length(uint8_t* dst, int len)
+{
+    while (len >= 255)
+    {
+        *dst++ = 255;
+        len -= 255;
+    }
+    *dst++ = (uint8_t)len;
+    return dst;
+}
+
+// LZ77 with LZ4 style sequences: a token with 4 bit literal and match
+// lengths, extra length bytes, the literals and a 16 bit match offset.
+// The last sequence only has literals. Returns the compressed size or
+// -1 if it doesn't fit.
+static int _zx_rewind_lz_compress(const uint8_t* src, int src_len, uint8_t* dst, int max_bytes)
+{
+    int32_t table[1 << _ZX_REWIND_LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+    if (max_bytes < _ZX_REWIND_LZ_BOUND(src_len))
+    {
+        return -1;
+    }
+    uint8_t* out = dst;
+    int pos = 0;
+    int anchor = 0;
+    while ((pos + _ZX_REWIND_LZ_MIN_MATCH) <= src_len)
+    {
+        const uint32_t seq = _zx_rewind_rd32(src + pos);
+        const uint32_t hash = (seq * 2654435761u) >> (32 - _ZX_REWIND_LZ_HASH_BITS);
+        const int ref = table[hash];
+        table[hash] = pos;
+        if ((ref < 0) || ((pos - ref) > 0xFFFF) || (_zx_rewind_rd32(src + ref) != seq))
+        {
+            pos++;
+            continue;
+        }
+        int len = _ZX_REWIND_LZ_MIN_MATCH;
+        while (((pos + len) < src_len) && (src[ref + len] == src[pos + len]))
+        {
+            len++;
+        }
+        const int literals = pos - anchor;
+        const int match = len - _ZX_REWIND_LZ_MIN_MATCH;
+        *out++ = (uint8_t)(((literals < 15) ? literals : 15) << 4 | ((match < 15) ? match : 15));
+        if (literals >= 15)
+        {
+            out = _zx_rewind_lz_length(out, literals - 15);
+        }
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        *out++ = (uint8_t)(pos - ref);
+        *out++ = (uint8_t)((pos - ref) >> 8);
+        if (match >= 15)
+        {
+            out = _zx_rewind_lz_length(out, match - 15);
+        }
+        pos += len;
+        anchor = pos;
+    }
+    const int literals = src_len - anchor;
+    *out++ = (uint8_t)(((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15)
+    {
+        out = _zx_rewind_lz_length(out, literals - 15);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    return (int)(out - dst);
+}
+
+static bool _zx_rewind_lz_read_length(const uint8_t** src, const uint8_t* end, int* len)
+{
+    uint8_t val;
+    do
+    {
+        if (*src >= end)
+        {
+            return false;
+        }
+        val = *(*src)++;
+        *len += val;
+    }
+    while (val == 255);
+    return true;
+}
+
+// returns the decompressed size or -1 on corrupt data
+static int _zx_rewind_lz_decompress(const uint8_t* src, int src_len, uint8_t* dst, int max_bytes)
+{
+    const uint8_t* end = src + src_len;
+    int pos = 0;
+    while (src < end)
+    {
+        const uint8_t token = *src++;
+        int literals = token >> 4;
+        if ((literals == 15) && !_zx_rewind_lz_read_length(&src, end, &literals))
+        {
+            return -1;
+        }
+        if ((literals > (end - src)) || (literals > (max_bytes - pos)))
+        {
+            return -1;
+        }
+        memcpy(dst + pos, src, literals);
+        src += literals;
+        pos += literals;
+        if (src == end)
+        {
+            break;
+        }
+        if ((end - src) < 2)
+        {
+            return -1;
+        }
+        const int offset = src[0] | (src[1] << 8);
+        src += 2;
+        int len = token & 15;
+        if ((len == 15) && !_zx_rewind_lz_read_length(&src, end, &len))
+        {
+            return -1;
+        }
+        len += _ZX_REWIND_LZ_MIN_MATCH;
+        if ((offset == 0) || (offset > pos) || (len > (max_bytes - pos)))
+        {
+            return -1;
+        }
+        // overlapping matches repeat the last bytes
+        uint8_t* out = dst + pos;
+        const uint8_t* from = out - offset;
+        if (offset >= len)
+        {
+            memcpy(out, from, len);
+        }
+        else
+        {
+            for (int i = 0; i < len; i++)
+            {
+                out[i] = from[i];
+            }
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+static bool _zx_rewind_page_zero(const uint8_t* page)
+{
+    uint64_t bits = 0;
+    for (int i = 0; i < ZX_REWIND_PAGE_SIZE; i += 8)
+    {
+        uint64_t val;
+        memcpy(&val, page + i, 8);
+        bits |= val;
+    }
+    return bits == 0;
+}
+
+static void _zx_rewind_page_xor(uint8_t* dst, const uint8_t* a, const uint8_t* b)
+{
+    for (int i = 0; i < ZX_REWIND_PAGE_SIZE; i += 8)
+    {
+        uint64_t va, vb;
+        memcpy(&va, a + i, 8);
+        memcpy(&vb, b + i, 8);
+        va ^= vb;
+        memcpy(dst + i, &va, 8);
+    }
+}
+
+static uint32_t _zx_rewind_page_hash(const uint8_t* page)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < ZX_REWIND_PAGE_SIZE; i += 8)
+    {
+        uint64_t val;
+        memcpy(&val, page + i, 8);
+        hash = (hash ^ val) * 1099511628211ull;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static zx_rewind_entry_t* _zx_rewind_entry(zx_rewind_t* rw, int index)
+{
+    return &rw->entries[(rw->first + index) % rw->max_entries];
+}
+
+static uint8_t* _zx_rewind_align(uint8_t* ptr)
+{
+    return (uint8_t*)(((uintptr_t)ptr + 15) & ~(uintptr_t)15);
+}
+
+// the buffer holds the working states and the entry index, the rest is
+// the ring
+static bool zx_rewind_init(zx_rewind_t* rw, uint8_t* ptr, int num_bytes, int interval, int keyframe_interval)
+{
+    CHIPS_ASSERT(rw && ptr && (interval > 0) && (keyframe_interval > 0));
+    memset(rw, 0, sizeof(zx_rewind_t));
+    rw->interval = interval;
+    rw->keyframe_interval = keyframe_interval;
+
+    uint8_t* end_ptr = ptr + num_bytes;
+    ptr = _zx_rewind_align(ptr);
+    rw->head = ptr;
+    ptr = _zx_rewind_align(ptr + ZX_REWIND_STATE_SIZE);
+    rw->next = ptr;
+    ptr = _zx_rewind_align(ptr + ZX_REWIND_STATE_SIZE);
+    rw->work = ptr;
+    ptr = _zx_rewind_align(ptr + ZX_REWIND_STATE_SIZE);
+    rw->encode = ptr;
+    ptr = _zx_rewind_align(ptr + _ZX_REWIND_ENCODE_SIZE);
+    // the index is sized for entries of 256 bytes on average
+    const intptr_t avail = end_ptr - ptr;
+    const intptr_t max_entries = (avail > 0) ? (avail / (256 + (intptr_t)sizeof(zx_rewind_entry_t))) : 0;
+    rw->max_entries = (max_entries < ZX_REWIND_MAX_ENTRIES) ? (int)max_entries : ZX_REWIND_MAX_ENTRIES;
+    rw->entries = (zx_rewind_entry_t*)ptr;
+    ptr = _zx_rewind_align(ptr + sizeof(zx_rewind_entry_t) * rw->max_entries);
+    if ((rw->max_entries < 2) || ((end_ptr - ptr) < _ZX_REWIND_ENCODE_SIZE))
+    {
+        rw->ring = 0;
+        return false;
+    }
+    rw->ring = ptr;
+    rw->ring_size = (uint32_t)(end_ptr - ptr);
+    memset(rw->head, 0, ZX_REWIND_STATE_SIZE);
+    memset(rw->next, 0, ZX_REWIND_STATE_SIZE);
+    return true;
+}
+
+static void zx_rewind_reset(zx_rewind_t* rw)
+{
+    CHIPS_ASSERT(rw && rw->ring);
+    rw->frame_counter = 0;
+    rw->since_keyframe = 0;
+    rw->first = 0;
+    rw->count = 0;
+    rw->write_pos = 0;
+    rw->raw_bytes = 0;
+    rw->stored_bytes = 0;
+}
+
+static void _zx_rewind_drop_oldest(zx_rewind_t* rw)
+{
+    // deltas can't be decoded without their keyframe
+    do
+    {
+        const zx_rewind_entry_t* e = _zx_rewind_entry(rw, 0);
+        rw->raw_bytes -= e->state_size;
+        rw->stored_bytes -= e->size;
+        rw->first = (rw->first + 1) % rw->max_entries;
+        rw->count--;
+    }
+    while ((rw->count > 0) && !_zx_rewind_entry(rw, 0)->keyframe);
+}
+
+// find room for an entry after the newest one, dropping old entries
+static uint8_t* _zx_rewind_alloc(zx_rewind_t* rw, uint32_t size)
+{
+    if (rw->count == rw->max_entries)
+    {
+        _zx_rewind_drop_oldest(rw);
+    }
+    if (rw->count == 0)
+    {
+        rw->write_pos = 0;
+    }
+    uint32_t pos = rw->write_pos;
+    const bool wrapped = (pos + size) > rw->ring_size;
+    if (wrapped)
+    {
+        pos = 0;
+    }
+    while (rw->count > 0)
+    {
+        const zx_rewind_entry_t* e = _zx_rewind_entry(rw, 0);
+        // entries past the old write position are older than those at
+        // the start of the ring
+        const bool skipped = wrapped && (e->offset >= rw->write_pos);
+        const bool overlaps = (e->offset < (pos + size)) && ((e->offset + e->size) > pos);
+        if (!skipped && !overlaps)
+        {
+            break;
+        }
+        _zx_rewind_drop_oldest(rw);
+    }
+    if (rw->count == 0)
+    {
+        pos = 0;
+    }
+    return rw->ring + pos;
+}
+
+// encode the captured state, as pages or as pages XOR the newest state
+static int _zx_rewind_encode(zx_rewind_t* rw, int state_size, bool keyframe)
+{
+    int16_t slots[_ZX_REWIND_DEDUP_SLOTS];
+    memset(slots, 0xFF, sizeof(slots));
+
+    const int num_pages = (state_size + ZX_REWIND_PAGE_SIZE - 1) / ZX_REWIND_PAGE_SIZE;
+    uint8_t* codes = rw->encode + _ZX_REWIND_ENTRY_HEADER_SIZE;
+    int num_literals = 0;
+    for (int i = 0; i < num_pages; i++)
+    {
+        const int offset = i * ZX_REWIND_PAGE_SIZE;
+        uint8_t* page = rw->work + num_literals * ZX_REWIND_PAGE_SIZE;
+        if (keyframe)
+        {
+            memcpy(page, rw->next + offset, ZX_REWIND_PAGE_SIZE);
+        }
+        else
+        {
+            _zx_rewind_page_xor(page, rw->next + offset, rw->head + offset);
+        }
+
+        int code = 0;
+        if (!_zx_rewind_page_zero(page))
+        {
+            uint32_t slot = _zx_rewind_page_hash(page) % _ZX_REWIND_DEDUP_SLOTS;
+            while ((slots[slot] >= 0) && (0 != memcmp(rw->work + slots[slot] * ZX_REWIND_PAGE_SIZE, page, ZX_REWIND_PAGE_SIZE)))
+            {
+                slot = (slot + 1) % _ZX_REWIND_DEDUP_SLOTS;
+            }
+            if (slots[slot] < 0)
+            {
+                slots[slot] = (int16_t)num_literals++;
+            }
+            code = 1 + slots[slot];
+        }
+        codes[i * 2 + 0] = (uint8_t)code;
+        codes[i * 2 + 1] = (uint8_t)(code >> 8);
+    }
+
+    uint8_t* hdr = rw->encode;
+    const uint32_t size32 = (uint32_t)state_size;
+    memcpy(hdr, &size32, 4);
+    hdr[4] = (uint8_t)num_pages;
+    hdr[5] = (uint8_t)(num_pages >> 8);
+    hdr[6] = (uint8_t)num_literals;
+    hdr[7] = (uint8_t)(num_literals >> 8);
+
+    uint8_t* stream = codes + num_pages * 2;
+    const int stream_len = _zx_rewind_lz_compress(
+        rw->work,
+        num_literals * ZX_REWIND_PAGE_SIZE,
+        stream,
+        _ZX_REWIND_ENCODE_SIZE - (int)(stream - rw->encode));
+    CHIPS_ASSERT(stream_len >= 0);
+    return (int)(stream - rw->encode) + stream_len;
+}
+
+// apply an entry to dst, which holds the previous state for deltas
+static bool _zx_rewind_decode_entry(zx_rewind_t* rw, const zx_rewind_entry_t* e, uint8_t* dst)
+{
+    const uint8_t* src = rw->ring + e->offset;
+    const int num_pages = src[4] | (src[5] << 8);
+    const int num_literals = src[6] | (src[7] << 8);
+    const uint8_t* codes = src + _ZX_REWIND_ENTRY_HEADER_SIZE;
+    const uint8_t* stream = codes + num_pages * 2;
+    const int stream_len = (int)e->size - (int)(stream - src);
+    if ((num_pages > ZX_REWIND_NUM_PAGES) || (num_literals > num_pages) ||
+        (_zx_rewind_lz_decompress(stream, stream_len, rw->work, ZX_REWIND_STATE_SIZE) != (num_literals * ZX_REWIND_PAGE_SIZE)))
+    {
+        return false;
+    }
+    for (int i = 0; i < num_pages; i++)
+    {
+        const int code = codes[i * 2] | (codes[i * 2 + 1] << 8);
+        uint8_t* page = dst + i * ZX_REWIND_PAGE_SIZE;
+        if (code > num_literals)
+        {
+            return false;
+        }
+        if (code == 0)
+        {
+            if (e->keyframe)
+            {
+                memset(page, 0, ZX_REWIND_PAGE_SIZE);
+            }
+            continue;
+        }
+        const uint8_t* literal = rw->work + (code - 1) * ZX_REWIND_PAGE_SIZE;
+        if (e->keyframe)
+        {
+            memcpy(page, literal, ZX_REWIND_PAGE_SIZE);
+        }
+        else
+        {
+            _zx_rewind_page_xor(page, page, literal);
+        }
+    }
+    return true;
+}
+
+// decode forward from the keyframe before the entry
+static bool _zx_rewind_decode(zx_rewind_t* rw, int index, uint8_t* dst)
+{
+    int keyframe = index;
+    while (!_zx_rewind_entry(rw, keyframe)->keyframe)
+    {
+        keyframe--;
+    }
+    for (int i = keyframe; i <= index; i++)
+    {
+        if (!_zx_rewind_decode_entry(rw, _zx_rewind_entry(rw, i), dst))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _zx_rewind_count_since_keyframe(zx_rewind_t* rw)
+{
+    rw->since_keyframe = 0;
+    for (int i = rw->count - 1; (i >= 0) && !_zx_rewind_entry(rw, i)->keyframe; i--)
+    {
+        rw->since_keyframe++;
+    }
+}
+
+// call once per frame, captures every interval frames, returns true if
+// a state was captured
+static bool zx_rewind_push(zx_rewind_t* rw, zx_t* sys)
+{
+    CHIPS_ASSERT(rw && rw->ring && sys);
+    if (++rw->frame_counter < rw->interval)
+    {
+        return false;
+    }
+    rw->frame_counter = 0;
+
+    const int state_size = zx_save_state(sys, rw->next, ZX_REWIND_STATE_SIZE);
+    if (state_size == 0)
+    {
+        return false;
+    }
+    // pages are compared as a whole
+    const int padded_size = (state_size + ZX_REWIND_PAGE_SIZE - 1) & ~(ZX_REWIND_PAGE_SIZE - 1);
+    memset(rw->next + state_size, 0, padded_size - state_size);
+
+    bool keyframe = (rw->count == 0) || (rw->since_keyframe >= rw->keyframe_interval) || (state_size != rw->head_size);
+    uint8_t* dst = 0;
+    int size = 0;
+    while (true)
+    {
+        size = _zx_rewind_encode(rw, state_size, keyframe);
+        if ((uint32_t)size > rw->ring_size)
+        {
+            return false;
+        }
+        dst = _zx_rewind_alloc(rw, (uint32_t)size);
+        // a delta which pushed out everything before it has no base
+        if (keyframe || (rw->count > 0))
+        {
+            break;
+        }
+        keyframe = true;
+    }
+    memcpy(dst, rw->encode, size);
+
+    zx_rewind_entry_t* e = _zx_rewind_entry(rw, rw->count++);
+    e->offset = (uint32_t)(dst - rw->ring);
+    e->size = (uint32_t)size;
+    e->state_size = (uint32_t)state_size;
+    e->keyframe = keyframe;
+    e->ticks = sys->ticks;
+    rw->write_pos = e->offset + e->size;
+    rw->raw_bytes += state_size;
+    rw->stored_bytes += size;
+    rw->since_keyframe = keyframe ? 0 : (rw->since_keyframe + 1);
+
+    // the captured state becomes the base for the next delta
+    uint8_t* head = rw->head;
+    rw->head = rw->next;
+    rw->next = head;
+    rw->head_size = state_size;
+    return true;
+}
+
+static int zx_rewind_count(const zx_rewind_t* rw)
+{
+    CHIPS_ASSERT(rw);
+    return rw->count;
+}
+
+static uint64_t zx_rewind_ticks(zx_rewind_t* rw, int index)
+{
+    CHIPS_ASSERT(rw && (index >= 0) && (index < rw->count));
+    return _zx_rewind_entry(rw, index)->ticks;
+}
+
+// restore the entry at index (0 is the oldest) and keep the history,
+// for scrubbing
+static bool zx_rewind_load(zx_rewind_t* rw, zx_t* sys, int index)
+{
+    CHIPS_ASSERT(rw && rw->ring && sys);
+    if ((index < 0) || (index >= rw->count))
+    {
+        return false;
+    }
+    if (index == (rw->count - 1))
+    {
+        return zx_load_state(sys, rw->head, rw->head_size);
+    }
+    if (!_zx_rewind_decode(rw, index, rw->next))
+    {
+        return false;
+    }
+    return zx_load_state(sys, rw->next, _zx_rewind_entry(rw, index)->state_size);
+}
+
+// drop all entries after index, to continue from there
+static void zx_rewind_truncate(zx_rewind_t* rw, int index)
+{
+    CHIPS_ASSERT(rw && rw->ring);
+    if ((index < 0) || (index >= (rw->count - 1)))
+    {
+        return;
+    }
+    const zx_rewind_entry_t* newest = _zx_rewind_entry(rw, rw->count - 1);
+    const zx_rewind_entry_t* e = _zx_rewind_entry(rw, index);
+    bool decoded;
+    if ((index == (rw->count - 2)) && !newest->keyframe)
+    {
+        // one delta back from the newest state
+        decoded = _zx_rewind_decode_entry(rw, newest, rw->head);
+    }
+    else
+    {
+        decoded = _zx_rewind_decode(rw, index, rw->head);
+    }
+    CHIPS_ASSERT(decoded);
+    (void)decoded;
+    rw->head_size = (int)e->state_size;
+    const int padded_size = (rw->head_size + ZX_REWIND_PAGE_SIZE - 1) & ~(ZX_REWIND_PAGE_SIZE - 1);
+    memset(rw->head + rw->head_size, 0, padded_size - rw->head_size);
+
+    while (rw->count > (index + 1))
+    {
+        const zx_rewind_entry_t* dropped = _zx_rewind_entry(rw, --rw->count);
+        rw->raw_bytes -= dropped->state_size;
+        rw->stored_bytes -= dropped->size;
+    }
+    rw->write_pos = e->offset + e->size;
+    rw->frame_counter = 0;
+    _zx_rewind_count_since_keyframe(rw);
+}
+
+// go back one capture and continue from there
+static bool zx_rewind_step_back(zx_rewind_t* rw, zx_t* sys)
+{
+    CHIPS_ASSERT(rw && rw->ring && sys);
+    if (rw->count < 2)
+    {
+        return false;
+    }
+    zx_rewind_truncate(rw, rw->count - 2);
+    return zx_load_state(sys, rw->head, rw->head_size);
+}
+
+// uncompressed over stored size of the history
+static float zx_rewind_ratio(const zx_rewind_t* rw)
+{
+    CHIPS_ASSERT(rw);
+    return (rw->stored_bytes > 0) ? (float)((double)rw->raw_bytes / (double)rw->stored_bytes) : 0.0f;
+}
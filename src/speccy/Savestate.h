@@ -0,0 +1,635 @@
+#pragma once
+
+// Savestates capture the complete machine between two zx_exec calls or
+// at a debug break inside a frame: CPU, RAM, memory map, keyboard,
+// clock, scanline timing, loader detection and tape playback. Unlike
+// the snapshot formats in Snapshot.h a restored machine continues cycle
+// for cycle where the saved one was.
+//
+// Host pointers (pixel buffer, callbacks, user data, tape image and
+// output) stay with the machine a state is loaded into. Memory map
+// pointers are stored as page indices into ROM and the RAM banks and are
+// rebuilt on load, and only the RAM banks the map refers to are stored.
+// The tape position is only restored if the same tape is inserted.
+//
+// A state is a header followed by tagged chunks in host byte order,
+// states aren't meant to be exchanged between machines. Saving never
+// allocates, loading may allocate the banks the state uses which the
+// machine doesn't have yet through alloc_bank, otherwise both come down
+// to a few memcpy calls.
+
+#include "Speccy.h"
+
+// bump when the layout of a chunk or of a struct stored as a whole changes
+#define ZX_SAVESTATE_VERSION (3)
+#define ZX_SAVESTATE_MAX_SIZE (0x24000)
+
+static int zx_save_state(zx_t* sys, uint8_t* ptr, int max_bytes);
+static bool zx_load_state(zx_t* sys, const uint8_t* ptr, int num_bytes);
+
+#define _ZX_STATE_MAGIC (0x5653585A)        // 'ZXSV'
+#define _ZX_STATE_BYTE_ORDER (0x01020304)
+#define _ZX_STATE_HEADER_SIZE (16)
+#define _ZX_STATE_CHUNK_HEADER_SIZE (8)
+#define _ZX_STATE_NUM_BANKS (8)
+
+// memory map pointers: region in the top 4 bits, 1 KByte page below
+#define _ZX_STATE_PTR_NULL (0x0000)
+#define _ZX_STATE_PTR_ROM (0x1000)
+#define _ZX_STATE_PTR_RAM (0x2000)
+#define _ZX_STATE_PTR_UNMAPPED (0x3000)
+#define _ZX_STATE_PTR_JUNK (0x4000)
+#define _ZX_STATE_PTR_INVALID (0xFFFF)
+
+typedef struct
+{
+    uint64_t bc_de_hl_fa;
+    uint64_t bc_de_hl_fa_;
+    uint64_t wz_ix_iy_sp;
+    uint64_t im_ir_pc_bits;
+    uint64_t pins;
+} _zx_state_cpu_t;
+
+typedef struct
+{
+    uint8_t kbd_joymask;
+    uint8_t last_mem_config;
+    uint8_t last_fe_out;
+    uint8_t blink_counter;
+    int32_t frame_scan_lines;
+    int32_t top_border_scanlines;
+    int32_t cpu_freq;
+    int32_t scanline_period;
+    int32_t scanline_period_frac;
+    int32_t scanline_frac_counter;
+    int32_t scanline_counter;
+    int32_t scanline_y;
+    uint32_t display_ram_bank;
+    uint32_t border_color;
+    uint8_t tape_flash_load;
+    uint8_t tape_accelerate;
+    uint8_t tape_ear_sampled;
+    uint8_t reserved;
+    uint16_t trap_last_pc;
+    zx_loader_t loader;
+    uint64_t ticks;
+    uint32_t frame_us;
+    uint32_t frame_ticks;
+    uint32_t frame_ticks_executed;
+    uint32_t frame_pending;
+} _zx_state_ula_t;
+
+// the keyboard without its key map, which zx_init() builds and which
+// grows with the keys the machine knows about
+typedef struct
+{
+    uint64_t cur_time;
+    uint32_t sticky_time;
+    uint16_t active_columns;
+    uint16_t active_lines;
+    key_state_t key_buffer[KBD_MAX_PRESSED_KEYS];
+    uint16_t scanout_column_masks[KBD_MAX_LINES];
+    uint16_t scanout_line_masks[KBD_MAX_COLUMNS];
+    uint16_t cur_column_mask;
+    uint16_t cur_scanout_line_mask;
+    uint16_t cur_line_mask;
+    uint16_t cur_scanout_column_mask;
+} _zx_state_kbd_t;
+
+typedef struct
+{
+    uint16_t read[MEM_NUM_LAYERS][MEM_NUM_PAGES];
+    uint16_t write[MEM_NUM_LAYERS][MEM_NUM_PAGES];
+} _zx_state_mem_t;
+
+typedef struct
+{
+    int32_t size;                   // size of the tape image the state was saved with
+    int32_t block_offset;           // block_data in the image, -1 if none
+    tape_t tape;                    // with all pointers cleared
+} _zx_state_tape_t;
+
+typedef struct
+{
+    uint8_t* ptr;
+    uint8_t* end_ptr;
+    bool overflow;
+} _zx_state_writer_t;
+
+static uint8_t* _zx_state_chunk(_zx_state_writer_t* w, const char* tag, int size)
+{
+    if ((w->end_ptr - w->ptr) < (_ZX_STATE_CHUNK_HEADER_SIZE + size))
+    {
+        w->overflow = true;
+        return 0;
+    }
+    const uint32_t chunk_size = (uint32_t)size;
+    memcpy(w->ptr, tag, 4);
+    memcpy(w->ptr + 4, &chunk_size, 4);
+    uint8_t* data = w->ptr + _ZX_STATE_CHUNK_HEADER_SIZE;
+    w->ptr = data + size;
+    return data;
+}
+
+static uint16_t _zx_state_encode_ptr(const zx_t* sys, const uint8_t* ptr)
+{
+    const int ram_index = _zx_ram_index(sys, ptr);
+    if (!ptr)
+    {
+        return _ZX_STATE_PTR_NULL;
+    }
+    if ((ptr >= rom48k) && (ptr < (rom48k + sizeof(rom48k))))
+    {
+        return (uint16_t)(_ZX_STATE_PTR_ROM | ((ptr - rom48k) >> MEM_PAGE_SHIFT));
+    }
+    if (ram_index >= 0)
+    {
+        return (uint16_t)(_ZX_STATE_PTR_RAM | ram_index);
+    }
+    if (ptr == sys->mem.unmapped_page)
+    {
+        return _ZX_STATE_PTR_UNMAPPED;
+    }
+    if (ptr == sys->mem.junk_page)
+    {
+        return _ZX_STATE_PTR_JUNK;
+    }
+    return _ZX_STATE_PTR_INVALID;
+}
+
+static uint8_t* _zx_state_decode_ptr(zx_t* sys, uint16_t val)
+{
+    const int page = val & 0x0FFF;
+    switch (val & 0xF000)
+    {
+    case _ZX_STATE_PTR_NULL:
+        return 0;
+    case _ZX_STATE_PTR_ROM:
+        return (uint8_t*)&rom48k[page << MEM_PAGE_SHIFT];
+    case _ZX_STATE_PTR_RAM:
+        return _zx_ram_ptr(sys, page);
+    case _ZX_STATE_PTR_UNMAPPED:
+        return sys->mem.unmapped_page;
+    default:
+        return sys->mem.junk_page;
+    }
+}
+
+static bool _zx_state_valid_ptr(uint16_t val)
+{
+    const int page = val & 0x0FFF;
+    switch (val & 0xF000)
+    {
+    case _ZX_STATE_PTR_NULL:
+    case _ZX_STATE_PTR_UNMAPPED:
+    case _ZX_STATE_PTR_JUNK:
+        return page == 0;
+    case _ZX_STATE_PTR_ROM:
+        return page < (int)(sizeof(rom48k) >> MEM_PAGE_SHIFT);
+    case _ZX_STATE_PTR_RAM:
+        return page < ZX_RAM_PAGES;
+    }
+    return false;
+}
+
+// banks a state maps are allocated once it checked out, before anything
+// is changed
+static bool _zx_state_alloc_ptr(zx_t* sys, uint16_t val)
+{
+    if ((val & 0xF000) != _ZX_STATE_PTR_RAM)
+    {
+        return true;
+    }
+    return _zx_alloc_bank(sys, (val & 0x0FFF) / ZX_RAM_BANK_PAGES);
+}
+
+// the saved playback position has to fit the inserted image, or the
+// tape would read past it
+static bool _zx_state_valid_tape(const _zx_state_tape_t* t, const tape_t* tape)
+{
+    const tape_t* s = &t->tape;
+    if ((t->size != tape->size) || (s->format != tape->format) || (s->freq_hz <= 0) ||
+        (s->state < TAPE_STATE_IDLE) || (s->state > TAPE_STATE_PAUSE))
+    {
+        return false;
+    }
+    if ((s->pos < 0) || (s->pos > t->size) || (_tape_block_index_at(tape, s->pos) != s->block_index))
+    {
+        return false;
+    }
+    if ((s->loop_count > 0) && (_tape_block_index_at(tape, s->loop_pos) != s->loop_index))
+    {
+        return false;
+    }
+    if ((s->block_len < 0) || (t->block_offset < -1) || (t->block_offset > t->size) ||
+        (s->block_len > ((t->block_offset < 0) ? 0 : (t->size - t->block_offset))))
+    {
+        return false;
+    }
+    if ((s->byte_pos < 0) || (s->byte_pos > s->block_len) || (s->bit_pos < 0) || (s->bit_pos > 8) ||
+        (s->pulse_count < 0))
+    {
+        return false;
+    }
+    // pulse sequences are read two bytes at a time
+    return (s->state != TAPE_STATE_PULSES) || (0 == ((s->byte_pos | s->block_len) & 1));
+}
+
+// returns the state size, 0 if it didn't fit
+static int zx_save_state(zx_t* sys, uint8_t* ptr, int max_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    if (max_bytes < _ZX_STATE_HEADER_SIZE)
+    {
+        return 0;
+    }
+    _zx_state_writer_t w;
+    w.ptr = ptr + _ZX_STATE_HEADER_SIZE;
+    w.end_ptr = ptr + max_bytes;
+    w.overflow = false;
+
+    // memory map, noting the RAM banks it refers to
+    _zx_state_mem_t mem;
+    uint32_t banks = 1u << sys->display_ram_bank;
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++)
+    {
+        for (int page = 0; page < MEM_NUM_PAGES; page++)
+        {
+            const mem_page_t* p = &sys->mem.layers[layer][page];
+            mem.read[layer][page] = _zx_state_encode_ptr(sys, p->read_ptr);
+            mem.write[layer][page] = _zx_state_encode_ptr(sys, p->write_ptr);
+            if ((mem.read[layer][page] == _ZX_STATE_PTR_INVALID) || (mem.write[layer][page] == _ZX_STATE_PTR_INVALID))
+            {
+                return 0;
+            }
+            if ((mem.read[layer][page] & 0xF000) == _ZX_STATE_PTR_RAM)
+            {
+                banks |= 1u << ((mem.read[layer][page] & 0x0FFF) >> (14 - MEM_PAGE_SHIFT));
+            }
+            if ((mem.write[layer][page] & 0xF000) == _ZX_STATE_PTR_RAM)
+            {
+                banks |= 1u << ((mem.write[layer][page] & 0x0FFF) >> (14 - MEM_PAGE_SHIFT));
+            }
+        }
+    }
+
+    _zx_state_cpu_t cpu;
+    cpu.bc_de_hl_fa = sys->cpu.bc_de_hl_fa;
+    cpu.bc_de_hl_fa_ = sys->cpu.bc_de_hl_fa_;
+    cpu.wz_ix_iy_sp = sys->cpu.wz_ix_iy_sp;
+    cpu.im_ir_pc_bits = sys->cpu.im_ir_pc_bits;
+    cpu.pins = sys->cpu.pins;
+
+    _zx_state_ula_t ula;
+    memset(&ula, 0, sizeof(ula));
+    ula.kbd_joymask = sys->kbd_joymask;
+    ula.last_mem_config = sys->last_mem_config;
+    ula.last_fe_out = sys->last_fe_out;
+    ula.blink_counter = sys->blink_counter;
+    ula.frame_scan_lines = sys->frame_scan_lines;
+    ula.top_border_scanlines = sys->top_border_scanlines;
+    ula.cpu_freq = sys->cpu_freq;
+    ula.scanline_period = sys->scanline_period;
+    ula.scanline_period_frac = sys->scanline_period_frac;
+    ula.scanline_frac_counter = sys->scanline_frac_counter;
+    ula.scanline_counter = sys->scanline_counter;
+    ula.scanline_y = sys->scanline_y;
+    ula.display_ram_bank = sys->display_ram_bank;
+    ula.border_color = sys->border_color;
+    ula.tape_flash_load = sys->tape_flash_load;
+    ula.tape_accelerate = sys->tape_accelerate;
+    ula.tape_ear_sampled = sys->tape_ear_sampled;
+    ula.trap_last_pc = sys->trap_last_pc;
+    ula.loader = sys->loader;
+    ula.ticks = sys->ticks;
+    ula.frame_us = sys->frame_us;
+    ula.frame_ticks = sys->frame_ticks;
+    ula.frame_ticks_executed = sys->frame_ticks_executed;
+    ula.frame_pending = sys->frame_pending;
+
+    _zx_state_kbd_t kbd;
+    memset(&kbd, 0, sizeof(kbd));
+    kbd.cur_time = sys->kbd.cur_time;
+    kbd.sticky_time = sys->kbd.sticky_time;
+    kbd.active_columns = sys->kbd.active_columns;
+    kbd.active_lines = sys->kbd.active_lines;
+    memcpy(kbd.key_buffer, sys->kbd.key_buffer, sizeof(kbd.key_buffer));
+    memcpy(kbd.scanout_column_masks, sys->kbd.scanout_column_masks, sizeof(kbd.scanout_column_masks));
+    memcpy(kbd.scanout_line_masks, sys->kbd.scanout_line_masks, sizeof(kbd.scanout_line_masks));
+    kbd.cur_column_mask = sys->kbd.cur_column_mask;
+    kbd.cur_scanout_line_mask = sys->kbd.cur_scanout_line_mask;
+    kbd.cur_line_mask = sys->kbd.cur_line_mask;
+    kbd.cur_scanout_column_mask = sys->kbd.cur_scanout_column_mask;
+
+    _zx_state_tape_t tape;
+    tape.size = sys->tape.size;
+    tape.block_offset = sys->tape.block_data ? (int32_t)(sys->tape.block_data - sys->tape.data) : -1;
+    tape.tape = sys->tape;
+    tape.tape.data = 0;
+    tape.tape.block_data = 0;
+    tape.tape.out_data = 0;
+
+    uint8_t* dst;
+    if ((dst = _zx_state_chunk(&w, "CPU ", sizeof(cpu))))
+    {
+        memcpy(dst, &cpu, sizeof(cpu));
+    }
+    if ((dst = _zx_state_chunk(&w, "ULA ", sizeof(ula))))
+    {
+        memcpy(dst, &ula, sizeof(ula));
+    }
+    if ((dst = _zx_state_chunk(&w, "CLK ", sizeof(clk_t))))
+    {
+        memcpy(dst, &sys->clk, sizeof(clk_t));
+    }
+    if ((dst = _zx_state_chunk(&w, "KBD ", sizeof(kbd))))
+    {
+        memcpy(dst, &kbd, sizeof(kbd));
+    }
+    if ((dst = _zx_state_chunk(&w, "MEM ", sizeof(mem))))
+    {
+        memcpy(dst, &mem, sizeof(mem));
+    }
+    if ((dst = _zx_state_chunk(&w, "TAPE", sizeof(tape))))
+    {
+        memcpy(dst, &tape, sizeof(tape));
+    }
+    for (int bank = 0; bank < _ZX_STATE_NUM_BANKS; bank++)
+    {
+        if ((banks & (1u << bank)) && (dst = _zx_state_chunk(&w, "RAM ", 4 + 0x4000)))
+        {
+            const uint32_t bank_nr = (uint32_t)bank;
+            memcpy(dst, &bank_nr, 4);
+            for (int i = 0; i < ZX_RAM_BANK_PAGES; i++)
+            {
+                const uint8_t* page = _zx_ram_page(sys, (bank * ZX_RAM_BANK_PAGES) + i);
+                memcpy(dst + 4 + (i << MEM_PAGE_SHIFT), page, MEM_PAGE_SIZE);
+            }
+        }
+    }
+    if (w.overflow)
+    {
+        return 0;
+    }
+
+    const uint32_t header[4] =
+    {
+        _ZX_STATE_MAGIC,
+        ZX_SAVESTATE_VERSION,
+        _ZX_STATE_BYTE_ORDER,
+        (uint32_t)(w.ptr - ptr)
+    };
+    memcpy(ptr, header, sizeof(header));
+    return (int)(w.ptr - ptr);
+}
+
+// the state is checked completely before anything is restored, a
+// rejected state leaves the machine as it was. Banks the state needs
+// and the machine doesn't have yet are allocated through alloc_bank.
+static bool zx_load_state(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    uint32_t header[4];
+    if (num_bytes < _ZX_STATE_HEADER_SIZE)
+    {
+        return false;
+    }
+    memcpy(header, ptr, sizeof(header));
+    if ((header[0] != _ZX_STATE_MAGIC) ||
+        (header[1] != ZX_SAVESTATE_VERSION) ||
+        (header[2] != _ZX_STATE_BYTE_ORDER) ||
+        (header[3] > (uint32_t)num_bytes))
+    {
+        return false;
+    }
+    const uint8_t* end_ptr = ptr + header[3];
+
+    const uint8_t* cpu = 0;
+    const uint8_t* ula = 0;
+    const uint8_t* clk = 0;
+    const uint8_t* kbd = 0;
+    const uint8_t* mem = 0;
+    const uint8_t* tape = 0;
+    const uint8_t* chunk = ptr + _ZX_STATE_HEADER_SIZE;
+    while (chunk < end_ptr)
+    {
+        uint32_t size;
+        if ((end_ptr - chunk) < _ZX_STATE_CHUNK_HEADER_SIZE)
+        {
+            return false;
+        }
+        memcpy(&size, chunk + 4, 4);
+        const uint8_t* data = chunk + _ZX_STATE_CHUNK_HEADER_SIZE;
+        if (size > (uint32_t)(end_ptr - data))
+        {
+            return false;
+        }
+        if (0 == memcmp(chunk, "CPU ", 4))
+        {
+            cpu = (size == sizeof(_zx_state_cpu_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "ULA ", 4))
+        {
+            ula = (size == sizeof(_zx_state_ula_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "CLK ", 4))
+        {
+            clk = (size == sizeof(clk_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "KBD ", 4))
+        {
+            kbd = (size == sizeof(_zx_state_kbd_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "MEM ", 4))
+        {
+            mem = (size == sizeof(_zx_state_mem_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "TAPE", 4))
+        {
+            tape = (size == sizeof(_zx_state_tape_t)) ? data : 0;
+        }
+        else if (0 == memcmp(chunk, "RAM ", 4))
+        {
+            uint32_t bank = 0;
+            if (size >= 4)
+            {
+                memcpy(&bank, data, 4);
+            }
+            if ((size != (4 + 0x4000)) || (bank >= _ZX_STATE_NUM_BANKS))
+            {
+                return false;
+            }
+        }
+        chunk = data + size;
+    }
+    if (!cpu || !ula || !clk || !kbd || !mem)
+    {
+        return false;
+    }
+
+    _zx_state_ula_t u;
+    memcpy(&u, ula, sizeof(u));
+    clk_t k;
+    memcpy(&k, clk, sizeof(k));
+    if ((u.scanline_period <= 0) || (u.cpu_freq <= 0) || (u.display_ram_bank >= _ZX_STATE_NUM_BANKS))
+    {
+        return false;
+    }
+    if (u.frame_pending && ((u.frame_us == 0) || (u.frame_ticks_executed >= u.frame_ticks)))
+    {
+        return false;
+    }
+    // the clock and the scanline length follow from the CPU frequency,
+    // see zx_set_cpu_freq()
+    if ((k.freq_hz != u.cpu_freq) || (u.scanline_period != (int)(((int64_t)224 * u.cpu_freq) / cpu_freq)))
+    {
+        return false;
+    }
+    _zx_state_mem_t m;
+    memcpy(&m, mem, sizeof(m));
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++)
+    {
+        for (int page = 0; page < MEM_NUM_PAGES; page++)
+        {
+            if (!_zx_state_valid_ptr(m.read[layer][page]) || !_zx_state_valid_ptr(m.write[layer][page]))
+            {
+                return false;
+            }
+        }
+    }
+
+    // the banks the state stores or maps, only running out of memory
+    // can leave some of them behind
+    if (!_zx_alloc_bank(sys, (int)u.display_ram_bank))
+    {
+        return false;
+    }
+    chunk = ptr + _ZX_STATE_HEADER_SIZE;
+    while (chunk < end_ptr)
+    {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+        const uint8_t* data = chunk + _ZX_STATE_CHUNK_HEADER_SIZE;
+        if (0 == memcmp(chunk, "RAM ", 4))
+        {
+            uint32_t bank;
+            memcpy(&bank, data, 4);
+            if (!_zx_alloc_bank(sys, (int)bank))
+            {
+                return false;
+            }
+        }
+        chunk = data + size;
+    }
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++)
+    {
+        for (int page = 0; page < MEM_NUM_PAGES; page++)
+        {
+            if (!_zx_state_alloc_ptr(sys, m.read[layer][page]) || !_zx_state_alloc_ptr(sys, m.write[layer][page]))
+            {
+                return false;
+            }
+        }
+    }
+
+    // everything checks out, a fork stops reading its source here
+    zx_unshare(sys);
+
+    _zx_state_cpu_t c;
+    memcpy(&c, cpu, sizeof(c));
+    sys->cpu.bc_de_hl_fa = c.bc_de_hl_fa;
+    sys->cpu.bc_de_hl_fa_ = c.bc_de_hl_fa_;
+    sys->cpu.wz_ix_iy_sp = c.wz_ix_iy_sp;
+    sys->cpu.im_ir_pc_bits = c.im_ir_pc_bits;
+    sys->cpu.pins = c.pins;
+    sys->cpu.trap_id = 0;
+
+    sys->kbd_joymask = u.kbd_joymask;
+    sys->last_mem_config = u.last_mem_config;
+    sys->last_fe_out = u.last_fe_out;
+    sys->blink_counter = u.blink_counter;
+    sys->frame_scan_lines = u.frame_scan_lines;
+    sys->top_border_scanlines = u.top_border_scanlines;
+    sys->cpu_freq = u.cpu_freq;
+    sys->scanline_period = u.scanline_period;
+    sys->scanline_period_frac = u.scanline_period_frac;
+    sys->scanline_frac_counter = u.scanline_frac_counter;
+    sys->scanline_counter = u.scanline_counter;
+    sys->scanline_y = u.scanline_y;
+    sys->display_ram_bank = u.display_ram_bank;
+    sys->border_color = u.border_color;
+    sys->tape_flash_load = 0 != u.tape_flash_load;
+    sys->tape_accelerate = 0 != u.tape_accelerate;
+    sys->tape_ear_sampled = 0 != u.tape_ear_sampled;
+    sys->trap_last_pc = u.trap_last_pc;
+    sys->loader = u.loader;
+    sys->ticks = u.ticks;
+    sys->frame_us = u.frame_us;
+    sys->frame_ticks = u.frame_ticks;
+    sys->frame_ticks_executed = u.frame_ticks_executed;
+    sys->frame_pending = 0 != u.frame_pending;
+
+    sys->clk = k;
+    _zx_state_kbd_t b;
+    memcpy(&b, kbd, sizeof(b));
+    sys->kbd.cur_time = b.cur_time;
+    sys->kbd.sticky_time = b.sticky_time;
+    sys->kbd.active_columns = b.active_columns;
+    sys->kbd.active_lines = b.active_lines;
+    memcpy(sys->kbd.key_buffer, b.key_buffer, sizeof(b.key_buffer));
+    memcpy(sys->kbd.scanout_column_masks, b.scanout_column_masks, sizeof(b.scanout_column_masks));
+    memcpy(sys->kbd.scanout_line_masks, b.scanout_line_masks, sizeof(b.scanout_line_masks));
+    sys->kbd.cur_column_mask = b.cur_column_mask;
+    sys->kbd.cur_scanout_line_mask = b.cur_scanout_line_mask;
+    sys->kbd.cur_line_mask = b.cur_line_mask;
+    sys->kbd.cur_scanout_column_mask = b.cur_scanout_column_mask;
+
+    for (int layer = 0; layer < MEM_NUM_LAYERS; layer++)
+    {
+        for (int page = 0; page < MEM_NUM_PAGES; page++)
+        {
+            mem_page_t* p = &sys->mem.layers[layer][page];
+            p->read_ptr = _zx_state_decode_ptr(sys, m.read[layer][page]);
+            p->write_ptr = _zx_state_decode_ptr(sys, m.write[layer][page]);
+        }
+    }
+    for (int page = 0; page < MEM_NUM_PAGES; page++)
+    {
+        _mem_update_page_table(&sys->mem, page);
+    }
+
+    chunk = ptr + _ZX_STATE_HEADER_SIZE;
+    while (chunk < end_ptr)
+    {
+        uint32_t size;
+        memcpy(&size, chunk + 4, 4);
+        const uint8_t* data = chunk + _ZX_STATE_CHUNK_HEADER_SIZE;
+        if (0 == memcmp(chunk, "RAM ", 4))
+        {
+            uint32_t bank;
+            memcpy(&bank, data, 4);
+            memcpy(sys->ram[bank], data + 4, 0x4000);
+        }
+        chunk = data + size;
+    }
+
+    // the tape keeps its host buffers, the position only makes sense
+    // for the image the state was saved with
+    _zx_state_tape_t t;
+    if (tape)
+    {
+        memcpy(&t, tape, sizeof(t));
+    }
+    if (tape && tape_inserted(&sys->tape) && _zx_state_valid_tape(&t, &sys->tape))
+    {
+        t.tape.data = sys->tape.data;
+        t.tape.block_data = (t.block_offset >= 0) ? (sys->tape.data + t.block_offset) : 0;
+        t.tape.out_data = sys->tape.out_data;
+        t.tape.out_size = sys->tape.out_size;
+        t.tape.out_pos = sys->tape.out_pos;
+        sys->tape = t.tape;
+    }
+    tape_set_freq(&sys->tape, sys->cpu_freq);
+    _zx_update_traps(sys);
+    return true;
+}
@@ -0,0 +1,865 @@
+#pragma once
+
+// Snapshot loading and saving for the 48K machine: SNA, Z80 (version 1
+// to 3, compressed and uncompressed pages) and SZX.
+//
+// Loading reads straight from the caller's buffer (usually a memory
+// mapped file) into the machine's RAM without intermediate copies.
+// Saving writes into a caller provided buffer of ZX_SNAPSHOT_MAX_SIZE
+// bytes and never allocates or touches the running machine, so a
+// snapshot can be taken at any point between two zx_exec calls.
+//
+// 128K snapshots are rejected, the machine has no 128K ROM or paging.
+//
+// SNA: https://worldofspectrum.net/faq/reference/formats.htm
+// Z80: https://worldofspectrum.net/faq/reference/z80format.htm
+// SZX: https://www.spectaculator.com/docs/zx-state/intro.shtml
+
+#include "Speccy.h"
+#include "Inflate.h"
+
+#define ZX_SNAPSHOT_MAX_SIZE (0x14000)
+
+#define ZX_SNA_HEADER_SIZE (27)
+#define ZX_SNA_48K_SIZE (ZX_SNA_HEADER_SIZE + 0xC000)
+#define ZX_SNA_128K_SIZE (ZX_SNA_48K_SIZE + 4 + 5 * 0x4000)
+#define ZX_SNA_128K_EXT_SIZE (ZX_SNA_128K_SIZE + 0x4000)
+
+typedef enum
+{
+    ZX_SNAPSHOT_UNKNOWN,
+    ZX_SNAPSHOT_SNA,
+    ZX_SNAPSHOT_Z80,
+    ZX_SNAPSHOT_SZX,
+} zx_snapshot_format_t;
+
+static zx_snapshot_format_t zx_snapshot_detect(const uint8_t* ptr, int num_bytes);
+static bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static bool zx_load_sna(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static bool zx_load_z80(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static bool zx_load_szx(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static int zx_save_snapshot(zx_t* sys, zx_snapshot_format_t format, uint8_t* ptr, int max_bytes);
+static int zx_save_sna(zx_t* sys, uint8_t* ptr, int max_bytes);
+static int zx_save_z80(zx_t* sys, uint8_t* ptr, int max_bytes);
+static int zx_save_szx(zx_t* sys, uint8_t* ptr, int max_bytes);
+
+// ZX Z80 file format header (http://www.worldofspectrum.org/faq/reference/z80format.htm )
+typedef struct
+{
+    uint8_t A, F;
+    uint8_t C, B;
+    uint8_t L, H;
+    uint8_t PC_l, PC_h;
+    uint8_t SP_l, SP_h;
+    uint8_t I, R;
+    uint8_t flags0;
+    uint8_t E, D;
+    uint8_t C_, B_;
+    uint8_t E_, D_;
+    uint8_t L_, H_;
+    uint8_t A_, F_;
+    uint8_t IY_l, IY_h;
+    uint8_t IX_l, IX_h;
+    uint8_t EI;
+    uint8_t IFF2;
+    uint8_t flags1;
+} _zx_z80_header;
+
+typedef struct
+{
+    uint8_t len_l;
+    uint8_t len_h;
+    uint8_t PC_l, PC_h;
+    uint8_t hw_mode;
+    uint8_t out_7ffd;
+    uint8_t rom1;
+    uint8_t flags;
+    uint8_t out_fffd;
+    uint8_t audio[16];
+    uint8_t tlow_l;
+    uint8_t tlow_h;
+    uint8_t spectator_flags;
+    uint8_t mgt_rom_paged;
+    uint8_t multiface_rom_paged;
+    uint8_t rom_0000_1fff;
+    uint8_t rom_2000_3fff;
+    uint8_t joy_mapping[10];
+    uint8_t kbd_mapping[10];
+    uint8_t mgt_type;
+    uint8_t disciple_button_state;
+    uint8_t disciple_flags;
+    uint8_t out_1ffd;
+} _zx_z80_ext_header;
+
+typedef struct
+{
+    uint8_t len_l;
+    uint8_t len_h;
+    uint8_t page_nr;
+} _zx_z80_page_header;
+
+#define _ZX_Z80_V2_EXT_LEN (23)
+#define _ZX_Z80_V3_EXT_LEN (54)
+#define _ZX_Z80_QUARTER_TSTATES (17472)
+
+#define _ZX_SZX_HEADER_SIZE (8)
+#define _ZX_SZX_BLOCK_HEADER_SIZE (8)
+#define _ZX_SZX_Z80R_SIZE (37)
+#define _ZX_SZX_SPCR_SIZE (8)
+#define _ZX_SZX_MACHINE_16K (0)
+#define _ZX_SZX_MACHINE_48K (1)
+#define _ZX_SZX_Z80R_EILAST (1 << 0)
+#define _ZX_SZX_Z80R_HALTED (1 << 1)
+#define _ZX_SZX_RAMP_COMPRESSED (1 << 0)
+
+static bool _zx_overflow(const uint8_t* ptr, intptr_t num_bytes, const uint8_t* end_ptr)
+{
+    return (ptr + num_bytes) > end_ptr;
+}
+
+static inline uint16_t _zx_rd16(const uint8_t* ptr)
+{
+    return (uint16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static inline uint32_t _zx_rd32(const uint8_t* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static inline uint8_t* _zx_wr16(uint8_t* ptr, uint16_t val)
+{
+    ptr[0] = (uint8_t)val;
+    ptr[1] = (uint8_t)(val >> 8);
+    return ptr + 2;
+}
+
+static inline uint8_t* _zx_wr32(uint8_t* ptr, uint32_t val)
+{
+    ptr = _zx_wr16(ptr, (uint16_t)val);
+    return _zx_wr16(ptr, (uint16_t)(val >> 16));
+}
+
+// 16 KByte RAM page at 0x4000, 0x8000 or 0xC000 to load into, forks
+// copy what they share first
+static uint8_t* _zx_snapshot_page(zx_t* sys, int index)
+{
+    zx_unshare(sys);
+    return sys->ram[index];
+}
+
+// copies a 16 KByte RAM page for saving, 1K at a time so the pages a
+// fork still shares are read from its source
+static void _zx_snapshot_copy_page(const zx_t* sys, int index, uint8_t* dst)
+{
+    for (int i = 0; i < ZX_RAM_BANK_PAGES; i++)
+    {
+        memcpy(dst + (i << MEM_PAGE_SHIFT), _zx_ram_page(sys, (index * ZX_RAM_BANK_PAGES) + i), MEM_PAGE_SIZE);
+    }
+}
+
+// RAM of the 48K machine by 128K bank number
+static uint8_t* _zx_snapshot_bank(zx_t* sys, int bank)
+{
+    switch (bank)
+    {
+    case 5: return _zx_snapshot_page(sys, 0);
+    case 2: return _zx_snapshot_page(sys, 1);
+    case 0: return _zx_snapshot_page(sys, 2);
+    }
+    return 0;
+}
+
+// T-states at 3.5 MHz since the vblank interrupt
+static uint32_t _zx_frame_tstates(const zx_t* sys)
+{
+    const int line_ticks = sys->scanline_period - sys->scanline_counter;
+    return sys->scanline_y * 224 + (uint32_t)(((int64_t)line_ticks * 224) / sys->scanline_period);
+}
+
+static void _zx_set_frame_tstates(zx_t* sys, uint32_t tstates)
+{
+    tstates %= (sys->frame_scan_lines + 1) * 224;
+    sys->scanline_y = tstates / 224;
+    sys->scanline_counter = sys->scanline_period - (int)(((int64_t)(tstates % 224) * sys->scanline_period) / 224);
+}
+
+static void _zx_set_border(zx_t* sys, uint8_t color)
+{
+    sys->border_color = _zx_palette[color & 7] & 0xFFD7D7D7;
+    sys->last_fe_out = (sys->last_fe_out & ~7) | (color & 7);
+}
+
+static uint8_t _zx_border(const zx_t* sys)
+{
+    return sys->last_fe_out & 7;
+}
+
+// copy or fill a range of consecutive 16 KByte pages
+static void _zx_pages_copy(uint8_t* const* pages, int pos, const uint8_t* src, int num_bytes)
+{
+    while (num_bytes > 0)
+    {
+        const int offset = pos & 0x3FFF;
+        const int len = (num_bytes < (0x4000 - offset)) ? num_bytes : (0x4000 - offset);
+        memcpy(pages[pos >> 14] + offset, src, len);
+        pos += len;
+        src += len;
+        num_bytes -= len;
+    }
+}
+
+static void _zx_pages_fill(uint8_t* const* pages, int pos, uint8_t val, int num_bytes)
+{
+    while (num_bytes > 0)
+    {
+        const int offset = pos & 0x3FFF;
+        const int len = (num_bytes < (0x4000 - offset)) ? num_bytes : (0x4000 - offset);
+        memset(pages[pos >> 14] + offset, val, len);
+        pos += len;
+        num_bytes -= len;
+    }
+}
+
+// Expand the 'ED ED nn bb' runs of a .z80 block into pages. Literal
+// stretches between ED bytes are found with memchr and copied in one go
+// and runs become a memset, both of which are vectorized by the C
+// library, instead of handling every byte.
+static bool _zx_z80_decompress(const uint8_t* src, int src_len, uint8_t* const* pages, int num_pages)
+{
+    const int dst_len = num_pages * 0x4000;
+    int src_pos = 0;
+    int dst_pos = 0;
+    while (src_pos < src_len)
+    {
+        const uint8_t* ed = (const uint8_t*)memchr(src + src_pos, 0xED, src_len - src_pos);
+        const int literal_len = (ed ? (int)(ed - src) : src_len) - src_pos;
+        if (literal_len > 0)
+        {
+            if ((dst_pos + literal_len) > dst_len)
+            {
+                return false;
+            }
+            _zx_pages_copy(pages, dst_pos, src + src_pos, literal_len);
+            src_pos += literal_len;
+            dst_pos += literal_len;
+        }
+        if (!ed)
+        {
+            break;
+        }
+        if (((src_pos + 1) < src_len) && (src[src_pos + 1] == 0xED))
+        {
+            if ((src_pos + 4) > src_len)
+            {
+                return false;
+            }
+            const int count = src[src_pos + 2];
+            if ((dst_pos + count) > dst_len)
+            {
+                return false;
+            }
+            _zx_pages_fill(pages, dst_pos, src[src_pos + 3], count);
+            src_pos += 4;
+            dst_pos += count;
+        }
+        else
+        {
+            // a single ED, the byte after it is never part of a run
+            if (dst_pos >= dst_len)
+            {
+                return false;
+            }
+            _zx_pages_fill(pages, dst_pos, 0xED, 1);
+            src_pos++;
+            dst_pos++;
+        }
+    }
+    return dst_pos == dst_len;
+}
+
+// compress one page, returns the compressed size or -1 if it doesn't
+// fit into max_bytes
+static int _zx_z80_compress(const uint8_t* src, uint8_t* dst, int max_bytes)
+{
+    int src_pos = 0;
+    int dst_pos = 0;
+    while (src_pos < 0x4000)
+    {
+        const uint8_t val = src[src_pos];
+        int run = 1;
+        while (((src_pos + run) < 0x4000) && (run < 0xFF) && (src[src_pos + run] == val))
+        {
+            run++;
+        }
+        if ((run >= 5) || ((val == 0xED) && (run >= 2)))
+        {
+            if ((dst_pos + 4) > max_bytes)
+            {
+                return -1;
+            }
+            dst[dst_pos++] = 0xED;
+            dst[dst_pos++] = 0xED;
+            dst[dst_pos++] = (uint8_t)run;
+            dst[dst_pos++] = val;
+            src_pos += run;
+        }
+        else if (val == 0xED)
+        {
+            // a single ED takes the next byte along as a literal
+            const int len = (src_pos < 0x3FFF) ? 2 : 1;
+            if ((dst_pos + len) > max_bytes)
+            {
+                return -1;
+            }
+            memcpy(dst + dst_pos, src + src_pos, len);
+            src_pos += len;
+            dst_pos += len;
+        }
+        else
+        {
+            if ((dst_pos + run) > max_bytes)
+            {
+                return -1;
+            }
+            memset(dst + dst_pos, val, run);
+            src_pos += run;
+            dst_pos += run;
+        }
+    }
+    return dst_pos;
+}
+
+// .z80 page number of a 48K machine to RAM
+static uint8_t* _zx_z80_page(zx_t* sys, int page_nr)
+{
+    switch (page_nr)
+    {
+    case 8: return _zx_snapshot_page(sys, 0);
+    case 4: return _zx_snapshot_page(sys, 1);
+    case 5: return _zx_snapshot_page(sys, 2);
+    }
+    return 0;
+}
+
+static zx_snapshot_format_t zx_snapshot_detect(const uint8_t* ptr, int num_bytes)
+{
+    if ((num_bytes >= _ZX_SZX_HEADER_SIZE) && (0 == memcmp(ptr, "ZXST", 4)))
+    {
+        return ZX_SNAPSHOT_SZX;
+    }
+    if ((num_bytes == ZX_SNA_48K_SIZE) || (num_bytes == ZX_SNA_128K_SIZE) || (num_bytes == ZX_SNA_128K_EXT_SIZE))
+    {
+        return ZX_SNAPSHOT_SNA;
+    }
+    if (num_bytes >= (int)sizeof(_zx_z80_header))
+    {
+        return ZX_SNAPSHOT_Z80;
+    }
+    return ZX_SNAPSHOT_UNKNOWN;
+}
+
+static bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    ZX_TRACE_BEGIN("zx_quickload");
+    bool loaded = false;
+    switch (zx_snapshot_detect(ptr, num_bytes))
+    {
+    case ZX_SNAPSHOT_SNA: loaded = zx_load_sna(sys, ptr, num_bytes); break;
+    case ZX_SNAPSHOT_Z80: loaded = zx_load_z80(sys, ptr, num_bytes); break;
+    case ZX_SNAPSHOT_SZX: loaded = zx_load_szx(sys, ptr, num_bytes); break;
+    default: break;
+    }
+    ZX_TRACE_END();
+    return loaded;
+}
+
+static bool zx_load_sna(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    if (num_bytes != ZX_SNA_48K_SIZE)
+    {
+        return false;
+    }
+    const uint8_t* hdr = ptr;
+    for (int i = 0; i < 3; i++)
+    {
+        memcpy(_zx_snapshot_page(sys, i), ptr + ZX_SNA_HEADER_SIZE + i * 0x4000, 0x4000);
+    }
+
+    z80_t* cpu = &sys->cpu;
+    z80_reset(cpu);
+    z80_set_i(cpu, hdr[0]);
+    z80_set_hl_(cpu, _zx_rd16(hdr + 1));
+    z80_set_de_(cpu, _zx_rd16(hdr + 3));
+    z80_set_bc_(cpu, _zx_rd16(hdr + 5));
+    z80_set_af_(cpu, _zx_rd16(hdr + 7));
+    z80_set_hl(cpu, _zx_rd16(hdr + 9));
+    z80_set_de(cpu, _zx_rd16(hdr + 11));
+    z80_set_bc(cpu, _zx_rd16(hdr + 13));
+    z80_set_iy(cpu, _zx_rd16(hdr + 15));
+    z80_set_ix(cpu, _zx_rd16(hdr + 17));
+    // the snapshot resumes through a RETN which copies IFF2 to IFF1
+    z80_set_iff1(cpu, 0 != (hdr[19] & (1 << 2)));
+    z80_set_iff2(cpu, 0 != (hdr[19] & (1 << 2)));
+    z80_set_r(cpu, hdr[20]);
+    z80_set_af(cpu, _zx_rd16(hdr + 21));
+    z80_set_im(cpu, hdr[25] & 3);
+    _zx_set_border(sys, hdr[26]);
+
+    // PC is on the stack
+    const uint16_t sp = _zx_rd16(hdr + 23);
+    z80_set_pc(cpu, mem_rd16(&sys->mem, sp));
+    z80_set_sp(cpu, sp + 2);
+    return true;
+}
+
+static bool zx_load_z80(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    const uint8_t* end_ptr = ptr + num_bytes;
+    if (_zx_overflow(ptr, sizeof(_zx_z80_header), end_ptr))
+    {
+        return false;
+    }
+    const _zx_z80_header* hdr = (const _zx_z80_header*)ptr;
+    ptr += sizeof(_zx_z80_header);
+    const _zx_z80_ext_header* ext_hdr = 0;
+    int ext_hdr_len = 0;
+    // for compatibility a flags byte of 255 has to be taken as 1
+    const uint8_t flags0 = (hdr->flags0 == 0xFF) ? 1 : hdr->flags0;
+    const uint16_t pc = (hdr->PC_h << 8 | hdr->PC_l) & 0xFFFF;
+    const bool is_version1 = 0 != pc;
+
+    if (is_version1)
+    {
+        // 48 KByte in one block, compressed or not
+        uint8_t* pages[3] = { _zx_snapshot_page(sys, 0), _zx_snapshot_page(sys, 1), _zx_snapshot_page(sys, 2) };
+        int src_len = (int)(end_ptr - ptr);
+        if (flags0 & (1 << 5))
+        {
+            if ((src_len >= 4) && (0 == memcmp(end_ptr - 4, "\x00\xED\xED\x00", 4)))
+            {
+                src_len -= 4;
+            }
+            if (!_zx_z80_decompress(ptr, src_len, pages, 3))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (src_len < 0xC000)
+            {
+                return false;
+            }
+            _zx_pages_copy(pages, 0, ptr, 0xC000);
+        }
+    }
+    else
+    {
+        if (_zx_overflow(ptr, 2, end_ptr))
+        {
+            return false;
+        }
+        ext_hdr = (const _zx_z80_ext_header*)ptr;
+        ext_hdr_len = (ext_hdr->len_h << 8) | ext_hdr->len_l;
+        if ((ext_hdr_len < _ZX_Z80_V2_EXT_LEN) || _zx_overflow(ptr, 2 + ext_hdr_len, end_ptr))
+        {
+            return false;
+        }
+        ptr += 2 + ext_hdr_len;
+
+        // 48K models, with or without Interface 1 or MGT
+        const uint8_t hw_mode = ext_hdr->hw_mode;
+        const bool is_48k = (ext_hdr_len == _ZX_Z80_V2_EXT_LEN) ?
+            ((hw_mode == 0) || (hw_mode == 1)) :
+            ((hw_mode == 0) || (hw_mode == 1) || (hw_mode == 3));
+        if (!is_48k)
+        {
+            return false;
+        }
+
+        // check all page headers before anything gets overwritten
+        const uint8_t* page_ptr = ptr;
+        while (page_ptr < end_ptr)
+        {
+            if (_zx_overflow(page_ptr, sizeof(_zx_z80_page_header), end_ptr))
+            {
+                return false;
+            }
+            const _zx_z80_page_header* phdr = (const _zx_z80_page_header*)page_ptr;
+            const int src_len = (phdr->len_h << 8 | phdr->len_l) & 0xFFFF;
+            page_ptr += sizeof(_zx_z80_page_header) + ((0xFFFF == src_len) ? 0x4000 : src_len);
+            if (page_ptr > end_ptr)
+            {
+                return false;
+            }
+        }
+
+        while (ptr < end_ptr)
+        {
+            const _zx_z80_page_header* phdr = (const _zx_z80_page_header*)ptr;
+            ptr += sizeof(_zx_z80_page_header);
+            const int src_len = (phdr->len_h << 8 | phdr->len_l) & 0xFFFF;
+            uint8_t* dst_ptr = _zx_z80_page(sys, phdr->page_nr);
+            if (dst_ptr)
+            {
+                if (0xFFFF == src_len)
+                {
+                    // uncompressed page
+                    memcpy(dst_ptr, ptr, 0x4000);
+                }
+                else if (!_zx_z80_decompress(ptr, src_len, &dst_ptr, 1))
+                {
+                    return false;
+                }
+            }
+            ptr += (0xFFFF == src_len) ? 0x4000 : src_len;
+        }
+    }
+
+    // start loaded image
+    z80_t* cpu = &sys->cpu;
+    z80_reset(cpu);
+    z80_set_a(cpu, hdr->A); z80_set_f(cpu, hdr->F);
+    z80_set_b(cpu, hdr->B); z80_set_c(cpu, hdr->C);
+    z80_set_d(cpu, hdr->D); z80_set_e(cpu, hdr->E);
+    z80_set_h(cpu, hdr->H); z80_set_l(cpu, hdr->L);
+    z80_set_ix(cpu, hdr->IX_h << 8 | hdr->IX_l);
+    z80_set_iy(cpu, hdr->IY_h << 8 | hdr->IY_l);
+    z80_set_af_(cpu, hdr->A_ << 8 | hdr->F_);
+    z80_set_bc_(cpu, hdr->B_ << 8 | hdr->C_);
+    z80_set_de_(cpu, hdr->D_ << 8 | hdr->E_);
+    z80_set_hl_(cpu, hdr->H_ << 8 | hdr->L_);
+    z80_set_sp(cpu, hdr->SP_h << 8 | hdr->SP_l);
+    z80_set_i(cpu, hdr->I);
+    z80_set_r(cpu, (hdr->R & 0x7F) | ((flags0 & 1) << 7));
+    z80_set_iff1(cpu, hdr->EI != 0);
+    z80_set_iff2(cpu, hdr->IFF2 != 0);
+    if (hdr->flags1 != 0xFF)
+    {
+        z80_set_im(cpu, hdr->flags1 & 3);
+    }
+    else
+    {
+        z80_set_im(cpu, 1);
+    }
+    if (ext_hdr)
+    {
+        z80_set_pc(cpu, ext_hdr->PC_h << 8 | ext_hdr->PC_l);
+        if (ext_hdr_len >= _ZX_Z80_V3_EXT_LEN)
+        {
+            // the low T-state counter counts down through each quarter
+            // frame, the high counter is 3 right after the interrupt
+            const uint32_t tlow = (ext_hdr->tlow_h << 8) | ext_hdr->tlow_l;
+            const uint32_t quarter = (ext_hdr->spectator_flags - 3) & 3;
+            if (tlow < _ZX_Z80_QUARTER_TSTATES)
+            {
+                _zx_set_frame_tstates(sys, quarter * _ZX_Z80_QUARTER_TSTATES + (_ZX_Z80_QUARTER_TSTATES - 1 - tlow));
+            }
+        }
+    }
+    else
+    {
+        z80_set_pc(cpu, pc);
+    }
+    _zx_set_border(sys, (flags0 >> 1) & 7);
+    return true;
+}
+
+static bool zx_load_szx(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    const uint8_t* end_ptr = ptr + num_bytes;
+    if (_zx_overflow(ptr, _ZX_SZX_HEADER_SIZE, end_ptr) || (0 != memcmp(ptr, "ZXST", 4)))
+    {
+        return false;
+    }
+    const uint8_t machine = ptr[6];
+    if ((machine != _ZX_SZX_MACHINE_16K) && (machine != _ZX_SZX_MACHINE_48K))
+    {
+        return false;
+    }
+
+    // check the blocks before anything gets overwritten
+    const uint8_t* z80r = 0;
+    const uint8_t* spcr = 0;
+    const uint8_t* block = ptr + _ZX_SZX_HEADER_SIZE;
+    while (block < end_ptr)
+    {
+        if (_zx_overflow(block, _ZX_SZX_BLOCK_HEADER_SIZE, end_ptr))
+        {
+            return false;
+        }
+        const uint32_t size = _zx_rd32(block + 4);
+        if (size > (uint32_t)(end_ptr - block - _ZX_SZX_BLOCK_HEADER_SIZE))
+        {
+            return false;
+        }
+        if ((0 == memcmp(block, "Z80R", 4)) && (size >= _ZX_SZX_Z80R_SIZE))
+        {
+            z80r = block + _ZX_SZX_BLOCK_HEADER_SIZE;
+        }
+        else if ((0 == memcmp(block, "SPCR", 4)) && (size >= _ZX_SZX_SPCR_SIZE))
+        {
+            spcr = block + _ZX_SZX_BLOCK_HEADER_SIZE;
+        }
+        block += _ZX_SZX_BLOCK_HEADER_SIZE + size;
+    }
+    if (!z80r)
+    {
+        return false;
+    }
+
+    block = ptr + _ZX_SZX_HEADER_SIZE;
+    while (block < end_ptr)
+    {
+        const uint32_t size = _zx_rd32(block + 4);
+        const uint8_t* data = block + _ZX_SZX_BLOCK_HEADER_SIZE;
+        block += _ZX_SZX_BLOCK_HEADER_SIZE + size;
+        if ((0 != memcmp(data - _ZX_SZX_BLOCK_HEADER_SIZE, "RAMP", 4)) || (size < 3))
+        {
+            continue;
+        }
+        uint8_t* dst = _zx_snapshot_bank(sys, data[2]);
+        if (!dst)
+        {
+            continue;
+        }
+        if (_zx_rd16(data) & _ZX_SZX_RAMP_COMPRESSED)
+        {
+            if (inflate_zlib(data + 3, (int)size - 3, dst, 0x4000) != 0x4000)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (size < (3 + 0x4000))
+            {
+                return false;
+            }
+            memcpy(dst, data + 3, 0x4000);
+        }
+    }
+
+    z80_t* cpu = &sys->cpu;
+    z80_reset(cpu);
+    z80_set_af(cpu, _zx_rd16(z80r + 0));
+    z80_set_bc(cpu, _zx_rd16(z80r + 2));
+    z80_set_de(cpu, _zx_rd16(z80r + 4));
+    z80_set_hl(cpu, _zx_rd16(z80r + 6));
+    z80_set_af_(cpu, _zx_rd16(z80r + 8));
+    z80_set_bc_(cpu, _zx_rd16(z80r + 10));
+    z80_set_de_(cpu, _zx_rd16(z80r + 12));
+    z80_set_hl_(cpu, _zx_rd16(z80r + 14));
+    z80_set_ix(cpu, _zx_rd16(z80r + 16));
+    z80_set_iy(cpu, _zx_rd16(z80r + 18));
+    z80_set_sp(cpu, _zx_rd16(z80r + 20));
+    z80_set_pc(cpu, _zx_rd16(z80r + 22));
+    z80_set_i(cpu, z80r[24]);
+    z80_set_r(cpu, z80r[25]);
+    z80_set_iff1(cpu, z80r[26] != 0);
+    z80_set_iff2(cpu, z80r[27] != 0);
+    z80_set_im(cpu, z80r[28] & 3);
+    z80_set_ei_pending(cpu, 0 != (z80r[34] & _ZX_SZX_Z80R_EILAST));
+    z80_set_wz(cpu, _zx_rd16(z80r + 35));
+    if (z80r[34] & _ZX_SZX_Z80R_HALTED)
+    {
+        cpu->pins |= Z80_HALT;
+    }
+    _zx_set_frame_tstates(sys, _zx_rd32(z80r + 29));
+    if (spcr)
+    {
+        _zx_set_border(sys, spcr[0]);
+    }
+    return true;
+}
+
+static int zx_save_snapshot(zx_t* sys, zx_snapshot_format_t format, uint8_t* ptr, int max_bytes)
+{
+    switch (format)
+    {
+    case ZX_SNAPSHOT_SNA: return zx_save_sna(sys, ptr, max_bytes);
+    case ZX_SNAPSHOT_Z80: return zx_save_z80(sys, ptr, max_bytes);
+    case ZX_SNAPSHOT_SZX: return zx_save_szx(sys, ptr, max_bytes);
+    default: return 0;
+    }
+}
+
+// returns the snapshot size, 0 if it couldn't be written
+static int zx_save_sna(zx_t* sys, uint8_t* ptr, int max_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    z80_t* cpu = &sys->cpu;
+    // SNA keeps PC on the stack, which has to be in RAM
+    const uint16_t sp = z80_sp(cpu) - 2;
+    if ((max_bytes < ZX_SNA_48K_SIZE) || (sp < 0x4000) || (sp == 0xFFFF))
+    {
+        return 0;
+    }
+
+    uint8_t* hdr = ptr;
+    hdr[0] = z80_i(cpu);
+    _zx_wr16(hdr + 1, z80_hl_(cpu));
+    _zx_wr16(hdr + 3, z80_de_(cpu));
+    _zx_wr16(hdr + 5, z80_bc_(cpu));
+    _zx_wr16(hdr + 7, z80_af_(cpu));
+    _zx_wr16(hdr + 9, z80_hl(cpu));
+    _zx_wr16(hdr + 11, z80_de(cpu));
+    _zx_wr16(hdr + 13, z80_bc(cpu));
+    _zx_wr16(hdr + 15, z80_iy(cpu));
+    _zx_wr16(hdr + 17, z80_ix(cpu));
+    hdr[19] = z80_iff2(cpu) ? (1 << 2) : 0;
+    hdr[20] = z80_r(cpu);
+    _zx_wr16(hdr + 21, z80_af(cpu));
+    _zx_wr16(hdr + 23, sp);
+    hdr[25] = z80_im(cpu);
+    hdr[26] = _zx_border(sys);
+
+    uint8_t* ram = ptr + ZX_SNA_HEADER_SIZE;
+    for (int i = 0; i < 3; i++)
+    {
+        _zx_snapshot_copy_page(sys, i, ram + i * 0x4000);
+    }
+    // push PC in the image only, the machine's RAM stays untouched
+    _zx_wr16(ram + (sp - 0x4000), z80_pc(cpu));
+    return ZX_SNA_48K_SIZE;
+}
+
+static int zx_save_z80(zx_t* sys, uint8_t* ptr, int max_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    const int hdr_size = sizeof(_zx_z80_header) + 2 + _ZX_Z80_V3_EXT_LEN;
+    if (max_bytes < (hdr_size + 3 * ((int)sizeof(_zx_z80_page_header) + 0x4000)))
+    {
+        return 0;
+    }
+    z80_t* cpu = &sys->cpu;
+    memset(ptr, 0, hdr_size);
+
+    _zx_z80_header* hdr = (_zx_z80_header*)ptr;
+    hdr->A = z80_a(cpu); hdr->F = z80_f(cpu);
+    hdr->B = z80_b(cpu); hdr->C = z80_c(cpu);
+    hdr->D = z80_d(cpu); hdr->E = z80_e(cpu);
+    hdr->H = z80_h(cpu); hdr->L = z80_l(cpu);
+    hdr->SP_l = (uint8_t)z80_sp(cpu); hdr->SP_h = (uint8_t)(z80_sp(cpu) >> 8);
+    hdr->I = z80_i(cpu);
+    hdr->R = z80_r(cpu) & 0x7F;
+    hdr->flags0 = (z80_r(cpu) >> 7) | (_zx_border(sys) << 1);
+    hdr->C_ = (uint8_t)z80_bc_(cpu); hdr->B_ = (uint8_t)(z80_bc_(cpu) >> 8);
+    hdr->E_ = (uint8_t)z80_de_(cpu); hdr->D_ = (uint8_t)(z80_de_(cpu) >> 8);
+    hdr->L_ = (uint8_t)z80_hl_(cpu); hdr->H_ = (uint8_t)(z80_hl_(cpu) >> 8);
+    hdr->A_ = (uint8_t)(z80_af_(cpu) >> 8); hdr->F_ = (uint8_t)z80_af_(cpu);
+    hdr->IY_l = (uint8_t)z80_iy(cpu); hdr->IY_h = (uint8_t)(z80_iy(cpu) >> 8);
+    hdr->IX_l = (uint8_t)z80_ix(cpu); hdr->IX_h = (uint8_t)(z80_ix(cpu) >> 8);
+    hdr->EI = z80_iff1(cpu) ? 1 : 0;
+    hdr->IFF2 = z80_iff2(cpu) ? 1 : 0;
+    hdr->flags1 = z80_im(cpu) & 3;
+
+    _zx_z80_ext_header* ext_hdr = (_zx_z80_ext_header*)(ptr + sizeof(_zx_z80_header));
+    ext_hdr->len_l = _ZX_Z80_V3_EXT_LEN;
+    ext_hdr->PC_l = (uint8_t)z80_pc(cpu);
+    ext_hdr->PC_h = (uint8_t)(z80_pc(cpu) >> 8);
+    const uint32_t tstates = _zx_frame_tstates(sys) % (4 * _ZX_Z80_QUARTER_TSTATES);
+    const uint16_t tlow = (uint16_t)(_ZX_Z80_QUARTER_TSTATES - 1 - (tstates % _ZX_Z80_QUARTER_TSTATES));
+    ext_hdr->tlow_l = (uint8_t)tlow;
+    ext_hdr->tlow_h = (uint8_t)(tlow >> 8);
+    ext_hdr->spectator_flags = (uint8_t)((tstates / _ZX_Z80_QUARTER_TSTATES + 3) & 3);
+    ext_hdr->rom_0000_1fff = 0xFF;
+    ext_hdr->rom_2000_3fff = 0xFF;
+
+    static const uint8_t page_nrs[3] = { 8, 4, 5 };
+    uint8_t* dst = ptr + hdr_size;
+    uint8_t src[0x4000];
+    for (int i = 0; i < 3; i++)
+    {
+        _zx_snapshot_copy_page(sys, i, src);
+        _zx_z80_page_header* phdr = (_zx_z80_page_header*)dst;
+        dst += sizeof(_zx_z80_page_header);
+        // pages which don't compress are stored as they are
+        int len = _zx_z80_compress(src, dst, 0x3FFF);
+        if (len < 0)
+        {
+            memcpy(dst, src, 0x4000);
+            phdr->len_l = phdr->len_h = 0xFF;
+            len = 0x4000;
+        }
+        else
+        {
+            phdr->len_l = (uint8_t)len;
+            phdr->len_h = (uint8_t)(len >> 8);
+        }
+        phdr->page_nr = page_nrs[i];
+        dst += len;
+    }
+    return (int)(dst - ptr);
+}
+
+// RAM pages are stored uncompressed, which keeps saving a plain copy
+static int zx_save_szx(zx_t* sys, uint8_t* ptr, int max_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid && ptr);
+    const int size = _ZX_SZX_HEADER_SIZE +
+        _ZX_SZX_BLOCK_HEADER_SIZE + _ZX_SZX_Z80R_SIZE +
+        _ZX_SZX_BLOCK_HEADER_SIZE + _ZX_SZX_SPCR_SIZE +
+        3 * (_ZX_SZX_BLOCK_HEADER_SIZE + 3 + 0x4000);
+    if (max_bytes < size)
+    {
+        return 0;
+    }
+    z80_t* cpu = &sys->cpu;
+    uint8_t* dst = ptr;
+
+    memcpy(dst, "ZXST", 4);
+    dst[4] = 1;
+    dst[5] = 4;
+    dst[6] = _ZX_SZX_MACHINE_48K;
+    dst[7] = 0;
+    dst += _ZX_SZX_HEADER_SIZE;
+
+    memcpy(dst, "Z80R", 4);
+    dst = _zx_wr32(dst + 4, _ZX_SZX_Z80R_SIZE);
+    dst = _zx_wr16(dst, z80_af(cpu));
+    dst = _zx_wr16(dst, z80_bc(cpu));
+    dst = _zx_wr16(dst, z80_de(cpu));
+    dst = _zx_wr16(dst, z80_hl(cpu));
+    dst = _zx_wr16(dst, z80_af_(cpu));
+    dst = _zx_wr16(dst, z80_bc_(cpu));
+    dst = _zx_wr16(dst, z80_de_(cpu));
+    dst = _zx_wr16(dst, z80_hl_(cpu));
+    dst = _zx_wr16(dst, z80_ix(cpu));
+    dst = _zx_wr16(dst, z80_iy(cpu));
+    dst = _zx_wr16(dst, z80_sp(cpu));
+    dst = _zx_wr16(dst, z80_pc(cpu));
+    *dst++ = z80_i(cpu);
+    *dst++ = z80_r(cpu);
+    *dst++ = z80_iff1(cpu) ? 1 : 0;
+    *dst++ = z80_iff2(cpu) ? 1 : 0;
+    *dst++ = z80_im(cpu);
+    dst = _zx_wr32(dst, _zx_frame_tstates(sys));
+    *dst++ = 0;
+    *dst++ = (z80_ei_pending(cpu) ? _ZX_SZX_Z80R_EILAST : 0) | ((cpu->pins & Z80_HALT) ? _ZX_SZX_Z80R_HALTED : 0);
+    dst = _zx_wr16(dst, z80_wz(cpu));
+
+    memcpy(dst, "SPCR", 4);
+    dst = _zx_wr32(dst + 4, _ZX_SZX_SPCR_SIZE);
+    memset(dst, 0, _ZX_SZX_SPCR_SIZE);
+    dst[0] = _zx_border(sys);
+    dst[3] = sys->last_fe_out;
+    dst += _ZX_SZX_SPCR_SIZE;
+
+    static const uint8_t banks[3] = { 5, 2, 0 };
+    for (int i = 0; i < 3; i++)
+    {
+        memcpy(dst, "RAMP", 4);
+        dst = _zx_wr32(dst + 4, 3 + 0x4000);
+        dst = _zx_wr16(dst, 0);
+        *dst++ = banks[i];
+        _zx_snapshot_copy_page(sys, i, dst);
+        dst += 0x4000;
+    }
+    return (int)(dst - ptr);
+}
@@ -6,6 +6,24 @@
 #include "Clock.h"
 #include "Memory.h"
 #include "Keyboard.h"
+#include "Tape.h"
+#include "Trace.h"
+#include "Heatmap.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+// called on every machine cycle with the bus pins once the cycle was
+// served, so the data of reads is on them, and before a trap runs a ROM
+// routine or skips time on the host, with the CPU state current in
+// sys->cpu. Empty unless a tool which has to watch the bus (Profiler.h,
+// ExecTrace.h) defines them before including this header.
+#ifndef ZX_TICK_HOOK
+#define ZX_TICK_HOOK(sys, num_ticks, pins)
+#endif
+#ifndef ZX_TRAP_HOOK
+#define ZX_TRAP_HOOK(sys, trap_id)
+#endif
 
 #define DISPLAY_WIDTH (320)
 #define DISPLAY_HEIGHT (256)
@@ -15,6 +33,21 @@
 
 const int cpu_freq = 3500000;
 
+// ROM entry points trapped for tape flash-loading and saving
+#define ZX_ROM_LD_BYTES (0x0556)
+#define ZX_ROM_SA_BYTES (0x04C2)
+
+#define ZX_TRAP_LD_BYTES (1)
+#define ZX_TRAP_SA_BYTES (2)
+#define ZX_TRAP_LOADER_DETECT (3)
+#define ZX_TRAP_LOADER_SKIP (4)
+#define ZX_TRAP_DEBUG (5)
+
+#define ZX_RAM_BANKS (8)
+#define ZX_RAM_BANK_SIZE (0x4000)
+#define ZX_RAM_BANK_PAGES (ZX_RAM_BANK_SIZE >> MEM_PAGE_SHIFT)
+#define ZX_RAM_PAGES (ZX_RAM_BANKS * ZX_RAM_BANK_PAGES)
+
 const static uint32_t _zx_palette[8] =
 {
     0xFF000000,     // black
@@ -58,40 +91,120 @@ static const char* _zx_keymap =
     " =+-^"         // A14
     "  .,*";        // A15
 
+// hands out a zeroed 16K RAM bank, 0 if there is no memory left
+typedef uint8_t* (*zx_alloc_bank_t)(void* user_data);
+typedef void (*zx_free_bank_t)(void* user_data, uint8_t* bank);
+
 typedef struct
 {
-    void* pixel_buffer;
+    void* pixel_buffer;             // 0 for machines which don't draw
     int pixel_buffer_size;
     void* user_data;
+    int cpu_freq;                   // CPU clock in Hz, 0 for the stock 3.5 MHz
+    zx_alloc_bank_t alloc_bank;     // RAM banks are taken from the heap if 0
+    zx_free_bank_t free_bank;
+    void* alloc_user_data;
 } zx_desc_t;
 
+// an edge detection loop found in a tape loader, see _zx_loader_match
 typedef struct
 {
+    uint16_t loop_pc;               // first instruction of the loop
+    uint16_t in_pc;                 // instruction following the IN A,($FE)
+    uint16_t jump_pc;               // conditional jump closing the loop
+    uint16_t reject_pc;             // last IN site which is not a known loop
+    int counter_step;               // +1 for INC B, -1 for DEC B
+    int ticks_per_loop;
+    int ticks_to_sample;            // from the loop start to the EAR read
+    int ops_per_loop;
+    uint32_t edges;                 // tape edge count at the last EAR read
+} zx_loader_t;
+
+typedef struct zx_t zx_t;
+
+// called after every instruction while set with the PC of the next
+// one, returning true stops zx_exec(). Memory is up to date, the other
+// CPU registers only once zx_exec() returned.
+typedef bool (*zx_debug_cb_t)(zx_t* sys, uint16_t pc, void* user_data);
+
+// host clock in any unit, read around each decoded scanline while set
+typedef uint64_t (*zx_clock_t)(void);
+
+// The fields a tick touches sit together: the keyboard matrix ends
+// with the scanout masks port reads use, followed by the CPU, the
+// scanline counters, the tape and the page table at the start of
+// mem_t. The key mapping and memory layers around them are only
+// touched when keys or the memory map change, the rest comes after.
+struct zx_t
+{
+    kbd_t kbd;
+
+    // hot
     z80_t cpu;
-    bool valid;
-    uint8_t kbd_joymask;
-    uint8_t last_mem_config;
-    uint8_t last_fe_out;
-    uint8_t blink_counter;
-    int frame_scan_lines;
-    int top_border_scanlines;
+    uint64_t ticks;                 // T-states since power on
+    uint64_t shared_pages;          // CPU pages still reading a fork source
+    uint32_t* pixel_buffer;
+    zx_heat_t* heat;                // access counters while attached, see Heatmap.h
+    void* hook_user_data;           // for the hooks, 0 while nothing watches
     int scanline_period;
+    int scanline_period_frac;
+    int scanline_frac_counter;
     int scanline_counter;
     int scanline_y;
+    int frame_scan_lines;
+    int top_border_scanlines;
     uint32_t display_ram_bank;
     uint32_t border_color;
-    clk_t clk;
-    kbd_t kbd;
+    uint8_t last_fe_out;
+    uint8_t blink_counter;
+    uint8_t kbd_joymask;
+    bool video_decode;              // false skips drawing, for fast-forwarding
+    bool tape_ear_sampled;
+    tape_t tape;
     mem_t mem;
-    uint32_t* pixel_buffer;
+
+    // cold
+    bool valid;
+    uint8_t last_mem_config;
+    int cpu_freq;
+    clk_t clk;
+    bool tape_flash_load;           // load standard blocks through the ROM trap
+    bool tape_accelerate;           // fast-forward loader edge detection loops
+    uint16_t trap_last_pc;
+    zx_loader_t loader;
+    uint32_t frame_us;              // of the frame zx_exec is running
+    uint32_t frame_ticks;
+    uint32_t frame_ticks_executed;
+    bool frame_pending;             // a debug break stopped the frame
+    zx_debug_cb_t debug_cb;
+    void* debug_user_data;
+    zx_clock_t decode_clock;
+    uint64_t decode_time;           // decode_clock units spent decoding, the host resets it
     void* user_data;
-    uint8_t ram[8][0x4000];
-    uint8_t junk[0x4000];
-} zx_t;
+    const uint8_t* shared_ram[ZX_RAM_PAGES];    // 0 once a RAM page is private
+
+    // belong to the instance, zx_fork() keeps them
+    zx_alloc_bank_t alloc_bank;
+    zx_free_bank_t free_bank;
+    void* alloc_user_data;
+    uint8_t* ram[ZX_RAM_BANKS];     // allocated when first mapped
+};
 
 static void zx_init(zx_t* sys, const zx_desc_t* desc);
-static void zx_exec(zx_t* sys, uint32_t micro_seconds);
-static bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static void zx_discard(zx_t* sys);
+static bool zx_exec(zx_t* sys, uint32_t micro_seconds);
+static bool zx_exec_resume(zx_t* sys);
+static void zx_set_debug_cb(zx_t* sys, zx_debug_cb_t debug_cb, void* user_data);
+static void zx_set_heatmap(zx_t* sys, zx_heat_t* heat);
+static void zx_set_decode_clock(zx_t* sys, zx_clock_t clock);
+static bool zx_fork(zx_t* sys, const zx_t* src);
+static void zx_unshare(zx_t* sys);
+static void zx_set_cpu_freq(zx_t* sys, int freq_hz);
+static bool zx_insert_tape(zx_t* sys, const uint8_t* ptr, int num_bytes);
+static void zx_eject_tape(zx_t* sys);
+static void zx_set_tape_output(zx_t* sys, uint8_t* ptr, int num_bytes);
+static void zx_play_tape(zx_t* sys);
+static void zx_stop_tape(zx_t* sys);
 static void zx_key_down(zx_t* sys, int key_code);
 static void zx_key_up(zx_t* sys, int key_code);
 
@@ -99,6 +212,11 @@ static uint64_t _zx_tick(int num, uint64_t pins, void* user_data);
 static bool _zx_decode_scanline(zx_t* sys);
 static void _zx_init_memory_map(zx_t* sys);
 static void _zx_init_keyboard_matrix(zx_t* sys);
+static void _zx_update_traps(zx_t* sys);
+static void _zx_unshare_page(zx_t* sys, int page);
+static bool _zx_alloc_bank(zx_t* sys, int bank);
+static int _zx_ram_index(const zx_t* sys, const uint8_t* ptr);
+static uint32_t _zx_handle_trap(zx_t* sys, int trap_id, uint32_t ticks_left);
 
 #define _ZX_DEFAULT(val,def) (((val) != 0) ? (val) : (def));
 #define _ZX_CLEAR(val) memset(&val, 0, sizeof(val))
@@ -106,19 +224,25 @@ static void _zx_init_keyboard_matrix(zx_t* sys);
 static void zx_init(zx_t* sys, const zx_desc_t* desc)
 {
     CHIPS_ASSERT(sys && desc);
-    CHIPS_ASSERT(desc->pixel_buffer && (desc->pixel_buffer_size >= DISPLAY_PIXEL_BYTES));
+    CHIPS_ASSERT(!desc->pixel_buffer || (desc->pixel_buffer_size >= DISPLAY_PIXEL_BYTES));
 
     memset(sys, 0, sizeof(zx_t));
     sys->valid = true;
     sys->pixel_buffer = (uint32_t*)desc->pixel_buffer;
     sys->user_data = desc->user_data;
+    sys->alloc_bank = desc->alloc_bank;
+    sys->free_bank = desc->free_bank;
+    sys->alloc_user_data = desc->alloc_user_data;
     sys->display_ram_bank = 0;
     sys->frame_scan_lines = 312;
     sys->top_border_scanlines = 64;
+    sys->cpu_freq = _ZX_DEFAULT(desc->cpu_freq, cpu_freq);
     sys->scanline_period = 224;
     sys->scanline_counter = sys->scanline_period;
 
     clk_init(&sys->clk, cpu_freq);
+    tape_init(&sys->tape);
+    zx_set_cpu_freq(sys, sys->cpu_freq);
 
     z80_desc_t cpu_desc;
     _ZX_CLEAR(cpu_desc);
@@ -128,22 +252,757 @@ static void zx_init(zx_t* sys, const zx_desc_t* desc)
 
     _zx_init_memory_map(sys);
     _zx_init_keyboard_matrix(sys);
+    sys->tape_flash_load = true;
+    sys->tape_accelerate = true;
+    sys->video_decode = (0 != sys->pixel_buffer);
 
     z80_set_pc(&sys->cpu, 0x0000);
 }
 
-static void zx_exec(zx_t* sys, uint32_t micro_seconds)
+// gives the RAM back, call this before initializing a machine again
+static void zx_discard(zx_t* sys)
 {
-    CHIPS_ASSERT(sys && sys->valid);
-    uint32_t ticks_to_run = clk_ticks_to_run(&sys->clk, micro_seconds);
-    uint32_t ticks_executed = z80_exec(&sys->cpu, ticks_to_run);
+    CHIPS_ASSERT(sys);
+    for (int bank = 0; bank < ZX_RAM_BANKS; bank++)
+    {
+        if (!sys->ram[bank])
+        {
+            continue;
+        }
+        if (sys->alloc_bank)
+        {
+            sys->free_bank(sys->alloc_user_data, sys->ram[bank]);
+        }
+        else
+        {
+            free(sys->ram[bank]);
+        }
+        sys->ram[bank] = 0;
+    }
+    sys->valid = false;
+}
+
+static bool _zx_alloc_bank(zx_t* sys, int bank)
+{
+    CHIPS_ASSERT((bank >= 0) && (bank < ZX_RAM_BANKS));
+    if (!sys->ram[bank])
+    {
+        sys->ram[bank] = sys->alloc_bank ?
+            sys->alloc_bank(sys->alloc_user_data) :
+            (uint8_t*)calloc(1, ZX_RAM_BANK_SIZE);
+    }
+    return 0 != sys->ram[bank];
+}
+
+// 1K RAM page a pointer is in, counted from the start of bank 0, or -1
+static int _zx_ram_index(const zx_t* sys, const uint8_t* ptr)
+{
+    if (!ptr)
+    {
+        return -1;
+    }
+    for (int bank = 0; bank < ZX_RAM_BANKS; bank++)
+    {
+        const uint8_t* ram = sys->ram[bank];
+        if (ram && (ptr >= ram) && (ptr < (ram + ZX_RAM_BANK_SIZE)))
+        {
+            return (bank * ZX_RAM_BANK_PAGES) + (int)((ptr - ram) >> MEM_PAGE_SHIFT);
+        }
+    }
+    return -1;
+}
+
+static inline uint8_t* _zx_ram_ptr(const zx_t* sys, int index)
+{
+    return sys->ram[index / ZX_RAM_BANK_PAGES] + ((index % ZX_RAM_BANK_PAGES) << MEM_PAGE_SHIFT);
+}
+
+// run a frame, returns false if the debug callback stopped it. Unless
+// that was on the last instruction the frame is still pending and gets
+// finished by zx_exec_resume().
+static bool zx_exec(zx_t* sys, uint32_t micro_seconds)
+{
+    CHIPS_ASSERT(sys && sys->valid && !sys->frame_pending);
+    sys->frame_us = micro_seconds;
+    sys->frame_ticks = clk_ticks_to_run(&sys->clk, micro_seconds);
+    sys->frame_ticks_executed = 0;
+    sys->frame_pending = true;
+    return zx_exec_resume(sys);
+}
+
+static bool zx_exec_resume(zx_t* sys)
+{
+    CHIPS_ASSERT(sys && sys->valid && sys->frame_pending);
+    ZX_TRACE_BEGIN("zx_exec");
+    const uint32_t ticks_to_run = sys->frame_ticks;
+    uint32_t ticks_executed = sys->frame_ticks_executed;
+    bool stopped = false;
+    while (ticks_executed < ticks_to_run)
+    {
+        ticks_executed += z80_exec(&sys->cpu, ticks_to_run - ticks_executed);
+        if (0 == sys->cpu.trap_id)
+        {
+            break;
+        }
+        if (ZX_TRAP_DEBUG == sys->cpu.trap_id)
+        {
+            stopped = true;
+            break;
+        }
+        const uint32_t ticks_left = (ticks_executed < ticks_to_run) ? (ticks_to_run - ticks_executed) : 0;
+        ZX_TRAP_HOOK(sys, sys->cpu.trap_id);
+        ticks_executed += _zx_handle_trap(sys, sys->cpu.trap_id, ticks_left);
+    }
+    sys->frame_ticks_executed = ticks_executed;
+    if (ticks_executed < ticks_to_run)
+    {
+        ZX_TRACE_END();
+        return false;
+    }
+    // a break on the last instruction still ends the frame
+    sys->frame_pending = false;
     clk_ticks_executed(&sys->clk, ticks_executed);
-    kbd_update(&sys->kbd, micro_seconds);
+    kbd_update(&sys->kbd, sys->frame_us);
+    ZX_TRACE_COUNTER("overrun_ticks", sys->clk.overrun_ticks);
+    ZX_TRACE_END();
+    return !stopped;
+}
+
+// pass 0 to remove the callback
+static void zx_set_debug_cb(zx_t* sys, zx_debug_cb_t debug_cb, void* user_data)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->debug_cb = debug_cb;
+    sys->debug_user_data = user_data;
+    _zx_update_traps(sys);
+}
+
+// starts counting memory accesses into heat, 0 stops. The page map is
+// read from the machine here, so call it again after the memory map
+// changed.
+static void zx_set_heatmap(zx_t* sys, zx_heat_t* heat)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->heat = heat;
+    if (!heat)
+    {
+        return;
+    }
+    for (int page = 0; page < MEM_NUM_PAGES; page++)
+    {
+        const mem_page_t* p = &sys->mem.page_table[page];
+        const int index = _zx_ram_index(sys, p->write_ptr);
+        if (index >= 0)
+        {
+            heat->page_base[page] = ZX_HEAT_ROM_SIZE + ((uint32_t)index << MEM_PAGE_SHIFT);
+        }
+        else if ((p->read_ptr >= rom48k) && (p->read_ptr < (rom48k + ZX_HEAT_ROM_SIZE)))
+        {
+            heat->page_base[page] = (uint32_t)(p->read_ptr - rom48k);
+        }
+        else
+        {
+            heat->page_base[page] = (uint32_t)page << MEM_PAGE_SHIFT;
+        }
+    }
+}
+
+// times the video decode into decode_time, 0 stops
+static void zx_set_decode_clock(zx_t* sys, zx_clock_t clock)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->decode_clock = clock;
+    sys->decode_time = 0;
+}
+
+// mapped pages always start on a page boundary
+static void _zx_fork_page(zx_t* sys, const zx_t* src, mem_page_t* p)
+{
+    const int read_index = _zx_ram_index(src, p->read_ptr);
+    if (read_index >= 0)
+    {
+        p->read_ptr = _zx_ram_ptr(sys, read_index);
+    }
+    else if (p->read_ptr == src->mem.unmapped_page)
+    {
+        p->read_ptr = sys->mem.unmapped_page;
+    }
+    const int write_index = _zx_ram_index(src, p->write_ptr);
+    if (write_index >= 0)
+    {
+        p->write_ptr = _zx_ram_ptr(sys, write_index);
+    }
+    else if (p->write_ptr == src->mem.junk_page)
+    {
+        p->write_ptr = sys->mem.junk_page;
+    }
+}
+
+// Makes sys a copy of src which reads src's RAM until it writes to it,
+// the first write to a 1K page gives the fork its own copy of that page.
+// This copies the CPU, counters and page tables but no RAM, so a single
+// state can be branched into many cheaply. sys has to be initialized,
+// it keeps its own RAM banks, returns false if it can't get a bank src
+// uses. src must not run, load or be released while forks read from
+// it, forking a fork is fine. Forks share the pixel buffer and tape
+// buffers with src, turn video_decode off or give each its own.
+static bool zx_fork(zx_t* sys, const zx_t* src)
+{
+    CHIPS_ASSERT(sys && src && src->valid && (sys != src));
+    for (int bank = 0; bank < ZX_RAM_BANKS; bank++)
+    {
+        if (src->ram[bank] && !_zx_alloc_bank(sys, bank))
+        {
+            return false;
+        }
+    }
+    memcpy(sys, src, offsetof(zx_t, alloc_bank));
+
+    // pointers into src's memory move over to the fork
+    for (int page = 0; page < MEM_NUM_PAGES; page++)
+    {
+        _zx_fork_page(sys, src, &sys->mem.page_table[page]);
+        for (int layer = 0; layer < MEM_NUM_LAYERS; layer++)
+        {
+            _zx_fork_page(sys, src, &sys->mem.layers[layer][page]);
+        }
+    }
+
+    // RAM pages src shares with its own source stay shared with that
+    for (int i = 0; i < ZX_RAM_PAGES; i++)
+    {
+        if (!src->shared_ram[i] && src->ram[i / ZX_RAM_BANK_PAGES])
+        {
+            sys->shared_ram[i] = _zx_ram_ptr(src, i);
+        }
+    }
+    sys->shared_pages = 0;
+    for (int page = 0; page < MEM_NUM_PAGES; page++)
+    {
+        mem_page_t* p = &sys->mem.page_table[page];
+        const int index = _zx_ram_index(sys, p->write_ptr);
+        if ((index >= 0) && sys->shared_ram[index])
+        {
+            p->read_ptr = sys->shared_ram[index];
+            sys->shared_pages |= (uint64_t)1 << page;
+        }
+    }
+
+    // the source's counters stay with it, a fork only counts once attached
+    sys->heat = 0;
+    sys->hook_user_data = 0;
+    sys->decode_clock = 0;
+    sys->decode_time = 0;
+
+    sys->cpu.user_data = sys;
+    _zx_update_traps(sys);
+    return true;
+}
+
+// copy whatever a fork still reads from its source, after this the
+// source may go away
+static void zx_unshare(zx_t* sys)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    for (int page = 0; sys->shared_pages; page++)
+    {
+        if (sys->shared_pages & ((uint64_t)1 << page))
+        {
+            _zx_unshare_page(sys, page);
+        }
+    }
+    for (int i = 0; i < ZX_RAM_PAGES; i++)
+    {
+        if (sys->shared_ram[i])
+        {
+            memcpy(_zx_ram_ptr(sys, i), sys->shared_ram[i], MEM_PAGE_SIZE);
+            sys->shared_ram[i] = 0;
+        }
+    }
+}
+
+// a RAM page to read from, 1K pages counted from the start of bank 0
+static inline const uint8_t* _zx_ram_page(const zx_t* sys, int index)
+{
+    return sys->shared_ram[index] ? sys->shared_ram[index] : _zx_ram_ptr(sys, index);
+}
+
+// first write to a CPU page which reads from the fork source
+static void _zx_unshare_page(zx_t* sys, int page)
+{
+    uint8_t* ptr = sys->mem.page_table[page].write_ptr;
+    const int index = _zx_ram_index(sys, ptr);
+    if (sys->shared_ram[index])
+    {
+        memcpy(ptr, sys->shared_ram[index], MEM_PAGE_SIZE);
+        sys->shared_ram[index] = 0;
+    }
+    for (int i = 0; i < MEM_NUM_PAGES; i++)
+    {
+        if (sys->mem.page_table[i].write_ptr == ptr)
+        {
+            sys->mem.page_table[i].read_ptr = ptr;
+            sys->shared_pages &= ~((uint64_t)1 << i);
+        }
+    }
+}
+
+static inline void _zx_mem_wr(zx_t* sys, uint16_t addr, uint8_t data)
+{
+    if ((sys->shared_pages >> (addr >> MEM_PAGE_SHIFT)) & 1)
+    {
+        _zx_unshare_page(sys, addr >> MEM_PAGE_SHIFT);
+    }
+    mem_wr(&sys->mem, addr, data);
+}
+
+static void zx_set_cpu_freq(zx_t* sys, int freq_hz)
+{
+    CHIPS_ASSERT(sys && sys->valid && (freq_hz > 0));
+
+    // the ULA keeps running off the 3.5 MHz master clock, so like the
+    // turbo clones we stretch each 224 T-state scanline by the clock
+    // ratio, which keeps video and the vblank interrupt at 50 Hz
+    const int64_t scaled_period = (int64_t)224 * freq_hz;
+    const int old_period = sys->scanline_period;
+
+    sys->cpu_freq = freq_hz;
+    sys->scanline_period = (int)(scaled_period / cpu_freq);
+    sys->scanline_period_frac = (int)(scaled_period % cpu_freq);
+    sys->scanline_frac_counter = 0;
+    CHIPS_ASSERT(sys->scanline_period > 0);
+
+    // rescale what is left of the current scanline
+    sys->scanline_counter = (int)(((int64_t)sys->scanline_counter * sys->scanline_period) / old_period);
+
+    sys->clk.freq_hz = freq_hz;
+    sys->clk.overrun_ticks = 0;
+
+    // tape pulses are timed in 3.5 MHz T-states
+    tape_set_freq(&sys->tape, freq_hz);
+}
+
+static bool zx_insert_tape(zx_t* sys, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    const bool inserted = tape_insert(&sys->tape, ptr, num_bytes);
+    _zx_update_traps(sys);
+    return inserted;
+}
+
+static void zx_eject_tape(zx_t* sys)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    tape_eject(&sys->tape);
+    _zx_update_traps(sys);
+}
+
+static void zx_set_tape_output(zx_t* sys, uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    tape_set_output(&sys->tape, ptr, num_bytes);
+    _zx_update_traps(sys);
+}
+
+static void zx_play_tape(zx_t* sys)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    tape_play(&sys->tape);
+}
+
+static void zx_stop_tape(zx_t* sys)
+{
+    CHIPS_ASSERT(sys && sys->valid);
+    tape_stop(&sys->tape);
+}
+
+// watch the EAR reads of a playing tape for loader loops which can be
+// fast-forwarded until the next edge
+static int _zx_loader_trap(zx_t* sys, uint16_t pc)
+{
+    zx_loader_t* loader = &sys->loader;
+    if (sys->tape_ear_sampled)
+    {
+        sys->tape_ear_sampled = false;
+        if (pc == loader->in_pc)
+        {
+            loader->edges = sys->tape.edges;
+            return 0;
+        }
+        return (pc != loader->reject_pc) ? ZX_TRAP_LOADER_DETECT : 0;
+    }
+    // only skip once the loop came around after a read which saw no edge
+    if ((pc == loader->loop_pc) && (sys->trap_last_pc == loader->jump_pc) && (sys->tape.edges == loader->edges))
+    {
+        return ZX_TRAP_LOADER_SKIP;
+    }
+    return 0;
+}
+
+static int _zx_trap(uint16_t pc, uint32_t ticks, uint64_t pins, void* user_data)
+{
+    (void)ticks;
+    (void)pins;
+    zx_t* sys = (zx_t*)user_data;
+    int trap_id = 0;
+    if ((pc == ZX_ROM_LD_BYTES) && tape_inserted(&sys->tape))
+    {
+        trap_id = ZX_TRAP_LD_BYTES;
+    }
+    else if ((pc == ZX_ROM_SA_BYTES) && sys->tape.out_data)
+    {
+        trap_id = ZX_TRAP_SA_BYTES;
+    }
+    else if (sys->tape.playing && sys->tape_accelerate)
+    {
+        trap_id = _zx_loader_trap(sys, pc);
+    }
+    sys->trap_last_pc = pc;
+    return trap_id;
+}
+
+static bool _zx_needs_traps(zx_t* sys)
+{
+    return tape_inserted(&sys->tape) || sys->tape.out_data;
+}
+
+// tape traps win, a debug break on the same instruction would stop
+// before the trapped ROM routine ran
+static int _zx_debug_trap(uint16_t pc, uint32_t ticks, uint64_t pins, void* user_data)
+{
+    zx_t* sys = (zx_t*)user_data;
+    if (_zx_needs_traps(sys))
+    {
+        const int trap_id = _zx_trap(pc, ticks, pins, user_data);
+        if (trap_id)
+        {
+            return trap_id;
+        }
+    }
+    return sys->debug_cb(sys, pc, sys->debug_user_data) ? ZX_TRAP_DEBUG : 0;
+}
+
+// the trap callback is checked after every instruction, so only
+// install it while there is something to trap
+static void _zx_update_traps(zx_t* sys)
+{
+    if (sys->debug_cb)
+    {
+        z80_trap_cb(&sys->cpu, _zx_debug_trap, sys);
+    }
+    else
+    {
+        z80_trap_cb(&sys->cpu, _zx_needs_traps(sys) ? _zx_trap : 0, sys);
+    }
+}
+
+// return from a trapped ROM routine, the ROM leaves both tape routines
+// through SA/LD-RET which re-enables interrupts
+static void _zx_trap_return(zx_t* sys)
+{
+    uint16_t sp = z80_sp(&sys->cpu);
+    z80_set_pc(&sys->cpu, mem_rd16(&sys->mem, sp));
+    z80_set_sp(&sys->cpu, sp + 2);
+    z80_set_iff1(&sys->cpu, true);
+    z80_set_iff2(&sys->cpu, true);
+}
+
+// LD-BYTES: A = expected flag byte, IX = destination, DE = length,
+// carry set for LOAD and reset for VERIFY; returns carry set on success
+static void _zx_trap_ld_bytes(zx_t* sys)
+{
+    z80_t* cpu = &sys->cpu;
+    const uint8_t* block;
+    int block_len;
+    if (!sys->tape_flash_load || !tape_next_block(&sys->tape, &block, &block_len))
+    {
+        // not a standard block (or in the middle of one), play the tape
+        // and let the ROM routine read the pulses
+        tape_play(&sys->tape);
+        return;
+    }
+
+    const bool verify = 0 == (z80_f(cpu) & Z80_CF);
+    const uint8_t flag = z80_a(cpu);
+    uint16_t ix = z80_ix(cpu);
+    uint16_t de = z80_de(cpu);
+    uint8_t parity = 0;
+    uint8_t last = 0x01;
+    uint8_t a, f;
+
+    if ((block_len == 0) || (block[0] != flag))
+    {
+        // LD-FLAG: 'XOR L; RET NZ' on a flag mismatch
+        a = block_len ? (flag ^ block[0]) : flag;
+        f = (a & Z80_SF) | (a ? 0 : Z80_ZF) | (a & (Z80_YF | Z80_XF));
+    }
+    else
+    {
+        int pos = 0;
+        parity = block[pos++];
+        while ((de > 0) && (pos < block_len))
+        {
+            last = block[pos++];
+            parity ^= last;
+            if (verify)
+            {
+                if (mem_rd(&sys->mem, ix) != last)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                _zx_mem_wr(sys, ix, last);
+            }
+            ix++;
+            de--;
+        }
+        if ((de == 0) && (pos < block_len))
+        {
+            // checksum byte
+            last = block[pos++];
+            parity ^= last;
+        }
+        else
+        {
+            parity |= 0x01;
+        }
+        // LD-BYTES ends with 'LD A,H; CP $01' where H holds the parity
+        a = parity;
+        const uint8_t res = a - 1;
+        f = Z80_NF | (res & Z80_SF) | (res ? 0 : Z80_ZF) |
+            (((a & 0x0F) == 0) ? Z80_HF : 0) |
+            ((a == 0x80) ? Z80_VF : 0) |
+            ((a == 0) ? Z80_CF : 0);
+    }
+
+    z80_set_a(cpu, a);
+    z80_set_f(cpu, f);
+    z80_set_bc(cpu, 0xB001);
+    z80_set_h(cpu, parity);
+    z80_set_l(cpu, last);
+    z80_set_ix(cpu, ix);
+    z80_set_de(cpu, de);
+    _zx_trap_return(sys);
+
+    // custom loaders take over from here if the next block can't be
+    // flash-loaded, so start the tape for them
+    if (!tape_has_standard_block(&sys->tape) && !tape_at_end(&sys->tape))
+    {
+        tape_play(&sys->tape);
+    }
+}
+
+// SA-BYTES: A = flag byte, IX = source, DE = length
+static void _zx_trap_sa_bytes(zx_t* sys)
+{
+    z80_t* cpu = &sys->cpu;
+    const uint8_t flag = z80_a(cpu);
+    uint16_t ix = z80_ix(cpu);
+    const uint16_t de = z80_de(cpu);
+    if ((de + 2) > 0xFFFF)
+    {
+        return;
+    }
+    uint8_t* dst = tape_alloc_block(&sys->tape, de + 2);
+    if (!dst)
+    {
+        // no room left, the ROM routine will just beep the block out
+        return;
+    }
+    uint8_t parity = flag;
+    *dst++ = flag;
+    for (int i = 0; i < de; i++)
+    {
+        const uint8_t val = mem_rd(&sys->mem, ix++);
+        parity ^= val;
+        *dst++ = val;
+    }
+    *dst = parity;
+
+    z80_set_ix(cpu, ix);
+    z80_set_de(cpu, 0);
+    z80_set_f(cpu, z80_f(cpu) | Z80_CF);
+    _zx_trap_return(sys);
+}
+
+// Match an edge detection loop around the IN A,($FE) ending before pc.
+// These are all variations of the ROM's LD-SAMPLE loop:
+//
+//      INC B / DEC B
+//      RET Z
+//      LD A,n                      (optional)
+//      IN A,($FE)
+//      RRA / RLA
+//      RET NC / RET C
+//      XOR C
+//      AND n
+//      JR Z / JR NZ / JP Z / JP NZ     loop
+//
+// While the EAR level doesn't change every pass through the loop is the
+// same apart from B and R, so passes which can't see an edge can be
+// skipped without changing the outcome.
+static bool _zx_loader_match(zx_t* sys, uint16_t pc)
+{
+    mem_t* mem = &sys->mem;
+    if ((mem_rd(mem, pc - 2) != 0xDB) || (mem_rd(mem, pc - 1) != 0xFE))
+    {
+        return false;
+    }
+    for (int has_ld = 1; has_ld >= 0; has_ld--)
+    {
+        const uint16_t loop_pc = pc - (has_ld ? 6 : 4);
+        const uint8_t counter_op = mem_rd(mem, loop_pc);
+        if (((counter_op != 0x04) && (counter_op != 0x05)) ||
+            (mem_rd(mem, loop_pc + 1) != 0xC8) ||
+            (has_ld && (mem_rd(mem, loop_pc + 2) != 0x3E)))
+        {
+            continue;
+        }
+        const uint8_t rot_op = mem_rd(mem, pc);
+        const uint8_t ret_op = mem_rd(mem, pc + 1);
+        if (((rot_op != 0x1F) && (rot_op != 0x17)) ||
+            ((ret_op != 0xD0) && (ret_op != 0xD8)) ||
+            (mem_rd(mem, pc + 2) != 0xA9) ||
+            (mem_rd(mem, pc + 3) != 0xE6))
+        {
+            continue;
+        }
+        const uint16_t jump_pc = pc + 5;
+        const uint8_t jump_op = mem_rd(mem, jump_pc);
+        uint16_t target;
+        int jump_ticks;
+        if ((jump_op == 0x28) || (jump_op == 0x20))
+        {
+            target = jump_pc + 2 + (int8_t)mem_rd(mem, jump_pc + 1);
+            jump_ticks = 12;
+        }
+        else if ((jump_op == 0xCA) || (jump_op == 0xC2))
+        {
+            target = mem_rd16(mem, jump_pc + 1);
+            jump_ticks = 10;
+        }
+        else
+        {
+            continue;
+        }
+        if (target != loop_pc)
+        {
+            continue;
+        }
+
+        zx_loader_t* loader = &sys->loader;
+        loader->loop_pc = loop_pc;
+        loader->in_pc = pc;
+        loader->jump_pc = jump_pc;
+        loader->counter_step = (counter_op == 0x04) ? 1 : -1;
+        loader->ticks_to_sample = 4 + 5 + (has_ld ? 7 : 0) + 11;
+        loader->ticks_per_loop = loader->ticks_to_sample + 4 + 5 + 4 + 7 + jump_ticks;
+        loader->ops_per_loop = has_ld ? 9 : 8;
+        return true;
+    }
+    return false;
+}
+
+static void _zx_trap_loader_detect(zx_t* sys)
+{
+    const uint16_t pc = z80_pc(&sys->cpu);
+    if (_zx_loader_match(sys, pc))
+    {
+        sys->loader.edges = sys->tape.edges;
+    }
+    else
+    {
+        sys->loader.reject_pc = pc;
+    }
+}
+
+// run the machine side of skipped CPU cycles in steps of at most a
+// scanline so no video line is missed
+static void _zx_skip_ticks(zx_t* sys, uint32_t num_ticks)
+{
+    while (num_ticks > 0)
+    {
+        const int ticks = (num_ticks < (uint32_t)sys->scanline_period) ? (int)num_ticks : sys->scanline_period;
+        _zx_tick(ticks, 0, sys);
+        num_ticks -= ticks;
+    }
+}
+
+// fast-forward the loader loop up to the pass which reads the next
+// edge, returns the number of ticks skipped
+static uint32_t _zx_trap_loader_skip(zx_t* sys, uint32_t ticks_left)
+{
+    z80_t* cpu = &sys->cpu;
+    zx_loader_t* loader = &sys->loader;
+
+    // the loop must still be there and nothing may interrupt it
+    if (z80_iff1(cpu) || !sys->tape.playing || !_zx_loader_match(sys, loader->in_pc))
+    {
+        return 0;
+    }
+    // passes reading the EAR bit before the current level ends
+    const int ticks_to_edge = sys->tape.ticks_to_next;
+    if (ticks_to_edge <= loader->ticks_to_sample)
+    {
+        return 0;
+    }
+    uint32_t num_loops = (ticks_to_edge - loader->ticks_to_sample + loader->ticks_per_loop - 1) / loader->ticks_per_loop;
+
+    // leave the pass which times out to the CPU, as well as the end of
+    // the frame
+    const uint8_t b = z80_b(cpu);
+    uint32_t loops_to_timeout = ((loader->counter_step > 0) ? (0x100 - b) : b) & 0xFF;
+    if (loops_to_timeout == 0)
+    {
+        loops_to_timeout = 0x100;
+    }
+    if (num_loops >= loops_to_timeout)
+    {
+        num_loops = loops_to_timeout - 1;
+    }
+    if (num_loops > (ticks_left / loader->ticks_per_loop))
+    {
+        num_loops = ticks_left / loader->ticks_per_loop;
+    }
+    if (num_loops == 0)
+    {
+        return 0;
+    }
+
+    const uint8_t r = z80_r(cpu);
+    z80_set_b(cpu, (uint8_t)(b + num_loops * loader->counter_step));
+    z80_set_r(cpu, (r & 0x80) | ((r + num_loops * loader->ops_per_loop) & 0x7F));
+
+    const uint32_t num_ticks = num_loops * loader->ticks_per_loop;
+    _zx_skip_ticks(sys, num_ticks);
+    return num_ticks;
+}
+
+static uint32_t _zx_handle_trap(zx_t* sys, int trap_id, uint32_t ticks_left)
+{
+    switch (trap_id)
+    {
+    case ZX_TRAP_LD_BYTES: _zx_trap_ld_bytes(sys); break;
+    case ZX_TRAP_SA_BYTES: _zx_trap_sa_bytes(sys); break;
+    case ZX_TRAP_LOADER_DETECT: _zx_trap_loader_detect(sys); break;
+    case ZX_TRAP_LOADER_SKIP: return _zx_trap_loader_skip(sys, ticks_left);
+    }
+    return 0;
 }
 
 static void _zx_init_memory_map(zx_t* sys)
 {
     mem_init(&sys->mem);
+    for (int bank = 0; bank < 3; bank++)
+    {
+        if (!_zx_alloc_bank(sys, bank))
+        {
+            sys->valid = false;
+            return;
+        }
+    }
     mem_map_ram(&sys->mem, 0, 0x4000, 0x4000, sys->ram[0]);
     mem_map_ram(&sys->mem, 0, 0x8000, 0x4000, sys->ram[1]);
     mem_map_ram(&sys->mem, 0, 0xC000, 0x4000, sys->ram[2]);
@@ -185,6 +1044,7 @@ static void _zx_init_keyboard_matrix(zx_t* sys)
 
     // special keys
     kbd_register_key(&sys->kbd, ' ', 7, 0, 0);  // Space
+    kbd_register_key(&sys->kbd, 0x0E, 0, 0, 0); // CapsShift
     kbd_register_key(&sys->kbd, 0x0F, 7, 1, 0); // SymShift
     kbd_register_key(&sys->kbd, 0x08, 3, 4, 1); // Cursor Left (Shift+5)
     kbd_register_key(&sys->kbd, 0x0A, 4, 4, 1); // Cursor Down (Shift+6)
@@ -198,11 +1058,33 @@ static void _zx_init_keyboard_matrix(zx_t* sys)
 static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data)
 {
     zx_t* sys = (zx_t*)user_data;
+    sys->ticks += num_ticks;
+#if !defined(ZX_NO_HEATMAP)
+    // refresh cycles have neither RD nor WR
+    if (sys->heat && (pins & Z80_MREQ) && (pins & (Z80_RD | Z80_WR)))
+    {
+        const zx_heat_kind_t kind = (pins & Z80_WR) ? ZX_HEAT_WRITE :
+            ((pins & Z80_M1) ? ZX_HEAT_EXEC : ZX_HEAT_READ);
+        zx_heat_count(sys->heat, kind, Z80_GET_ADDR(pins));
+    }
+#endif
+    if (sys->tape.playing)
+    {
+        tape_tick(&sys->tape, num_ticks);
+    }
+
     // video decoding and vblank interrupt
     sys->scanline_counter -= num_ticks;
     if (sys->scanline_counter <= 0)
     {
         sys->scanline_counter += sys->scanline_period;
+        // spread the remainder of non-integer clock ratios over the frame
+        sys->scanline_frac_counter += sys->scanline_period_frac;
+        if (sys->scanline_frac_counter >= cpu_freq)
+        {
+            sys->scanline_frac_counter -= cpu_freq;
+            sys->scanline_counter++;
+        }
         // decode next video scanline
         if (_zx_decode_scanline(sys))
         {
@@ -221,7 +1103,7 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data)
         }
         else if (pins & Z80_WR)
         {
-            mem_wr(&sys->mem, addr, Z80_GET_DATA(pins));
+            _zx_mem_wr(sys, addr, Z80_GET_DATA(pins));
         }
     }
     else if (pins & Z80_IORQ)
@@ -230,9 +1112,18 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data)
         {
             if ((pins & Z80_A0) == 0) {
                 uint8_t data = (1 << 7) | (1 << 5);
-                // MIC/EAR flags -> bit 6
-                if (sys->last_fe_out & (1 << 3 | 1 << 4))
+                if (sys->tape.playing)
                 {
+                    // tape EAR input -> bit 6
+                    if (sys->tape.level)
+                    {
+                        data |= (1 << 6);
+                    }
+                    sys->tape_ear_sampled = true;
+                }
+                else if (sys->last_fe_out & (1 << 3 | 1 << 4))
+                {
+                    // MIC/EAR flags -> bit 6
                     data |= (1 << 6);
                 }
                 // keyboard matrix bits are encoded in the upper 8 bit of the port address
@@ -257,19 +1148,22 @@ static uint64_t _zx_tick(int num_ticks, uint64_t pins, void* user_data)
             }
         }
     }
+    ZX_TICK_HOOK(sys, num_ticks, pins);
     return pins;
 }
 
 static bool _zx_decode_scanline(zx_t* sys)
 {
+    ZX_TRACE_BEGIN("_zx_decode_scanline");
     const int top_decode_line = sys->top_border_scanlines - 32;
     const int btm_decode_line = sys->top_border_scanlines + 192 + 32;
 
-    if ((sys->scanline_y >= top_decode_line) && (sys->scanline_y < btm_decode_line))
+    if (sys->video_decode && sys->pixel_buffer && (sys->scanline_y >= top_decode_line) && (sys->scanline_y < btm_decode_line))
     {
+        const uint64_t start_time = sys->decode_clock ? sys->decode_clock() : 0;
         const uint16_t y = sys->scanline_y - top_decode_line;
         uint32_t* dst = &sys->pixel_buffer[y * DISPLAY_WIDTH];
-        const uint8_t* vidmem_bank = sys->ram[sys->display_ram_bank];
+        const int bank_page = (int)sys->display_ram_bank * ZX_RAM_BANK_PAGES;
         const bool blink = 0 != (sys->blink_counter & 0x10);
         uint32_t fg, bg;
 
@@ -290,6 +1184,11 @@ static bool _zx_decode_scanline(zx_t* sys)
             //
             const uint16_t yy = y - 32;
             const uint16_t y_offset = ((yy & 0xC0) << 5) | ((yy & 0x07) << 8) | ((yy & 0x38) << 2);
+            const uint16_t clr_line = 0x1800 + ((yy & ~0x7) << 2);
+
+            // a line's 32 pixel and attribute bytes each sit in one page
+            const uint8_t* pix_page = _zx_ram_page(sys, bank_page + (y_offset >> MEM_PAGE_SHIFT));
+            const uint8_t* clr_page = _zx_ram_page(sys, bank_page + (clr_line >> MEM_PAGE_SHIFT));
 
             // left border
             for (int x = 0; x < (4 * 8); x++)
@@ -300,12 +1199,12 @@ static bool _zx_decode_scanline(zx_t* sys)
             // valid 256x192 vidmem area
             for (uint16_t x = 0; x < 32; x++)
             {
-                const uint16_t pix_offset = y_offset | x;
-                const uint16_t clr_offset = 0x1800 + (((yy & ~0x7) << 2) | x);
+                const uint16_t pix_offset = (y_offset & MEM_PAGE_MASK) | x;
+                const uint16_t clr_offset = (clr_line & MEM_PAGE_MASK) | x;
 
                 // pixel mask and color attribute bytes
-                const uint8_t pix = vidmem_bank[pix_offset];
-                const uint8_t clr = vidmem_bank[clr_offset];
+                const uint8_t pix = pix_page[pix_offset];
+                const uint8_t clr = clr_page[clr_offset];
 
                 // foreground and background color
                 if ((clr & (1 << 7)) && blink)
@@ -336,6 +1235,10 @@ static bool _zx_decode_scanline(zx_t* sys)
                 *dst++ = sys->border_color;
             }
         }
+        if (sys->decode_clock)
+        {
+            sys->decode_time += sys->decode_clock() - start_time;
+        }
     }
 
     if (sys->scanline_y++ >= sys->frame_scan_lines)
@@ -343,241 +1246,10 @@ static bool _zx_decode_scanline(zx_t* sys)
         // start new frame, request vblank interrupt
         sys->scanline_y = 0;
         sys->blink_counter++;
+        ZX_TRACE_END();
         return true;
     }
 
+    ZX_TRACE_END();
     return false;
 }
-
-// ZX Z80 file format header (http://www.worldofspectrum.org/faq/reference/z80format.htm )
-typedef struct
-{
-    uint8_t A, F;
-    uint8_t C, B;
-    uint8_t L, H;
-    uint8_t PC_l, PC_h;
-    uint8_t SP_l, SP_h;
-    uint8_t I, R;
-    uint8_t flags0;
-    uint8_t E, D;
-    uint8_t C_, B_;
-    uint8_t E_, D_;
-    uint8_t L_, H_;
-    uint8_t A_, F_;
-    uint8_t IY_l, IY_h;
-    uint8_t IX_l, IX_h;
-    uint8_t EI;
-    uint8_t IFF2;
-    uint8_t flags1;
-} _zx_z80_header;
-
-typedef struct
-{
-    uint8_t len_l;
-    uint8_t len_h;
-    uint8_t PC_l, PC_h;
-    uint8_t hw_mode;
-    uint8_t out_7ffd;
-    uint8_t rom1;
-    uint8_t flags;
-    uint8_t out_fffd;
-    uint8_t audio[16];
-    uint8_t tlow_l;
-    uint8_t tlow_h;
-    uint8_t spectator_flags;
-    uint8_t mgt_rom_paged;
-    uint8_t multiface_rom_paged;
-    uint8_t rom_0000_1fff;
-    uint8_t rom_2000_3fff;
-    uint8_t joy_mapping[10];
-    uint8_t kbd_mapping[10];
-    uint8_t mgt_type;
-    uint8_t disciple_button_state;
-    uint8_t disciple_flags;
-    uint8_t out_1ffd;
-} _zx_z80_ext_header;
-
-typedef struct
-{
-    uint8_t len_l;
-    uint8_t len_h;
-    uint8_t page_nr;
-} _zx_z80_page_header;
-
-static bool _zx_overflow(const uint8_t* ptr, intptr_t num_bytes, const uint8_t* end_ptr)
-{
-    return (ptr + num_bytes) > end_ptr;
-}
-
-static bool zx_quickload(zx_t* sys, const uint8_t* ptr, int num_bytes)
-{
-    const uint8_t* end_ptr = ptr + num_bytes;
-    if (_zx_overflow(ptr, sizeof(_zx_z80_header), end_ptr))
-    {
-        return false;
-    }
-    const _zx_z80_header* hdr = (const _zx_z80_header*)ptr;
-    ptr += sizeof(_zx_z80_header);
-    const _zx_z80_ext_header* ext_hdr = 0;
-    uint16_t pc = (hdr->PC_h << 8 | hdr->PC_l) & 0xFFFF;
-    const bool is_version1 = 0 != pc;
-    if (!is_version1)
-    {
-        if (_zx_overflow(ptr, sizeof(_zx_z80_ext_header), end_ptr))
-        {
-            return false;
-        }
-        ext_hdr = (_zx_z80_ext_header*)ptr;
-        int ext_hdr_len = (ext_hdr->len_h << 8) | ext_hdr->len_l;
-        ptr += 2 + ext_hdr_len;
-        if (ext_hdr->hw_mode < 3)
-        {
-        }
-        else
-        {
-            return false;
-        }
-    }
-    else
-    {
-    }
-    const bool v1_compr = 0 != (hdr->flags0 & (1 << 5));
-    while (ptr < end_ptr)
-    {
-        int page_index = 0;
-        int src_len = 0;
-        if (is_version1)
-        {
-            src_len = num_bytes - sizeof(_zx_z80_header);
-        }
-        else
-        {
-            _zx_z80_page_header* phdr = (_zx_z80_page_header*)ptr;
-            if (_zx_overflow(ptr, sizeof(_zx_z80_page_header), end_ptr))
-            {
-                return false;
-            }
-            ptr += sizeof(_zx_z80_page_header);
-            src_len = (phdr->len_h << 8 | phdr->len_l) & 0xFFFF;
-            page_index = phdr->page_nr - 3;
-            if (page_index == 5)
-            {
-                page_index = 0;
-            }
-            if ((page_index < 0) || (page_index > 7))
-            {
-                page_index = -1;
-            }
-        }
-        uint8_t* dst_ptr;
-        if (-1 == page_index)
-        {
-            dst_ptr = sys->junk;
-        }
-        else
-        {
-            dst_ptr = sys->ram[page_index];
-        }
-        if (0xFFFF == src_len)
-        {
-            // FIXME: uncompressed not supported yet
-            return false;
-        }
-        else
-        {
-            // compressed
-            int src_pos = 0;
-            bool v1_done = false;
-            uint8_t val[4];
-            while ((src_pos < src_len) && !v1_done)
-            {
-                val[0] = ptr[src_pos];
-                val[1] = ptr[src_pos + 1];
-                val[2] = ptr[src_pos + 2];
-                val[3] = ptr[src_pos + 3];
-                // check for version 1 end marker
-                if (v1_compr && (0 == val[0]) && (0xED == val[1]) && (0xED == val[2]) && (0 == val[3]))
-                {
-                    v1_done = true;
-                    src_pos += 4;
-                }
-                else if (0xED == val[0])
-                {
-                    if (0xED == val[1])
-                    {
-                        uint8_t count = val[2];
-                        CHIPS_ASSERT(0 != count);
-                        uint8_t data = val[3];
-                        src_pos += 4;
-                        for (int i = 0; i < count; i++) {
-                            *dst_ptr++ = data;
-                        }
-                    }
-                    else
-                    {
-                        *dst_ptr++ = val[0];
-                        src_pos++;
-                    }
-                }
-                else
-                {
-                    *dst_ptr++ = val[0];
-                    src_pos++;
-                }
-            }
-            CHIPS_ASSERT(src_pos == src_len);
-        }
-        if (0xFFFF == src_len)
-        {
-            ptr += 0x4000;
-        }
-        else
-        {
-            ptr += src_len;
-        }
-    }
-
-    // start loaded image
-    z80_reset(&sys->cpu);
-    z80_set_a(&sys->cpu, hdr->A); z80_set_f(&sys->cpu, hdr->F);
-    z80_set_b(&sys->cpu, hdr->B); z80_set_c(&sys->cpu, hdr->C);
-    z80_set_d(&sys->cpu, hdr->D); z80_set_e(&sys->cpu, hdr->E);
-    z80_set_h(&sys->cpu, hdr->H); z80_set_l(&sys->cpu, hdr->L);
-    z80_set_ix(&sys->cpu, hdr->IX_h << 8 | hdr->IX_l);
-    z80_set_iy(&sys->cpu, hdr->IY_h << 8 | hdr->IY_l);
-    z80_set_af_(&sys->cpu, hdr->A_ << 8 | hdr->F_);
-    z80_set_bc_(&sys->cpu, hdr->B_ << 8 | hdr->C_);
-    z80_set_de_(&sys->cpu, hdr->D_ << 8 | hdr->E_);
-    z80_set_hl_(&sys->cpu, hdr->H_ << 8 | hdr->L_);
-    z80_set_sp(&sys->cpu, hdr->SP_h << 8 | hdr->SP_l);
-    z80_set_i(&sys->cpu, hdr->I);
-    z80_set_r(&sys->cpu, (hdr->R & 0x7F) | ((hdr->flags0 & 1) << 7));
-    z80_set_iff2(&sys->cpu, hdr->IFF2 != 0);
-    z80_set_ei_pending(&sys->cpu, hdr->EI != 0);
-    if (hdr->flags1 != 0xFF)
-    {
-        z80_set_im(&sys->cpu, hdr->flags1 & 3);
-    }
-    else
-    {
-        z80_set_im(&sys->cpu, 1);
-    }
-    if (ext_hdr)
-    {
-        z80_set_pc(&sys->cpu, ext_hdr->PC_h << 8 | ext_hdr->PC_l);
-        // simulate an out of port 0xFFFD and 0x7FFD
-        uint64_t pins = Z80_IORQ | Z80_WR;
-        Z80_SET_ADDR(pins, 0xFFFD);
-        Z80_SET_DATA(pins, ext_hdr->out_fffd);
-        _zx_tick(4, pins, sys);
-        Z80_SET_ADDR(pins, 0x7FFD);
-        Z80_SET_DATA(pins, ext_hdr->out_7ffd);
-        _zx_tick(4, pins, sys);
-    }
-    else
-    {
-        z80_set_pc(&sys->cpu, hdr->PC_h << 8 | hdr->PC_l);
-    }
-    sys->border_color = _zx_palette[(hdr->flags0 >> 1) & 7] & 0xFFD7D7D7;
-    return true;
-}
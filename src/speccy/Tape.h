@@ -0,0 +1,730 @@
+#pragma once
+
+// Tape image access and playback for the ZX Spectrum.
+//
+// The tape does not own the image memory, it only keeps a view into
+// it (usually a memory mapped file), so inserting a tape is free and
+// blocks are handed out as pointers into the image.
+//
+// Blocks can either be fetched whole by the ROM tape traps
+// (tape_next_block), or played back as a pulse stream which drives the
+// EAR input bit (tape_play / tape_tick). Pulse lengths are in 3.5 MHz
+// T-states and get converted to CPU ticks with tape_set_freq, so the
+// tape keeps running in real time on an overclocked CPU.
+//
+// TAP layout: a sequence of blocks, each a 16-bit little endian length
+// followed by that many bytes (flag byte, data, xor checksum). TAP
+// blocks play back with the standard ROM timings.
+//
+// TZX layout: see https://worldofspectrum.net/TZXformat.html, all
+// pulse blocks are supported except CSW (0x18) and generalized data
+// (0x19) blocks which are skipped, as are call sequences (0x26/0x27).
+//
+// Saved blocks are appended in TAP layout to an optional output buffer
+// provided by the host.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define TAPE_TSTATE_FREQ (3500000)
+#define TAPE_TSTATES_PER_MS (3500)
+
+// standard ROM timings
+#define TAPE_ROM_PILOT_PULSE (2168)
+#define TAPE_ROM_HEADER_PILOTS (8063)
+#define TAPE_ROM_DATA_PILOTS (3223)
+#define TAPE_ROM_SYNC1_PULSE (667)
+#define TAPE_ROM_SYNC2_PULSE (735)
+#define TAPE_ROM_ZERO_PULSE (855)
+#define TAPE_ROM_ONE_PULSE (1710)
+#define TAPE_ROM_PAUSE_MS (1000)
+
+// control blocks stepped over in one go before the tape counts as ended,
+// jumps and loops around blocks without a signal would never get out
+#define TAPE_MAX_CONTROL_BLOCKS (4096)
+
+typedef enum
+{
+    TAPE_FORMAT_NONE,
+    TAPE_FORMAT_TAP,
+    TAPE_FORMAT_TZX,
+} tape_format_t;
+
+typedef enum
+{
+    TAPE_STATE_IDLE,        // at a block boundary
+    TAPE_STATE_PILOT,
+    TAPE_STATE_SYNC1,
+    TAPE_STATE_SYNC2,
+    TAPE_STATE_DATA,
+    TAPE_STATE_PULSES,      // pulse sequence (0x13)
+    TAPE_STATE_DIRECT,      // direct recording (0x15)
+    TAPE_STATE_PAUSE,
+} tape_state_t;
+
+typedef struct
+{
+    tape_format_t format;
+    const uint8_t* data;
+    int size;
+    int pos;                // offset of the next block
+    int block_index;        // index of the next block (TZX jumps)
+
+    // pulse playback
+    bool playing;
+    bool level;             // current EAR level
+    uint32_t edges;         // number of level changes so far
+    int ticks_to_next;      // CPU ticks until the current segment ends
+    int freq_hz;
+    tape_state_t state;
+    int pilot_pulse;
+    int pulse_count;
+    int sync1_pulse;
+    int sync2_pulse;
+    int zero_pulse;
+    int one_pulse;
+    int used_bits;
+    int pause_ms;
+    const uint8_t* block_data;
+    int block_len;
+    int byte_pos;
+    int bit_pos;
+    int bit_pulse;
+    int loop_pos;
+    int loop_index;
+    int loop_count;
+
+    uint8_t* out_data;
+    int out_size;
+    int out_pos;
+} tape_t;
+
+static void tape_init(tape_t* tape);
+static bool tape_insert(tape_t* tape, const uint8_t* ptr, int num_bytes);
+static void tape_eject(tape_t* tape);
+static void tape_rewind(tape_t* tape);
+static bool tape_inserted(const tape_t* tape);
+static bool tape_next_block(tape_t* tape, const uint8_t** block, int* num_bytes);
+static bool tape_has_standard_block(const tape_t* tape);
+static bool tape_at_end(const tape_t* tape);
+static void tape_set_freq(tape_t* tape, int freq_hz);
+static void tape_play(tape_t* tape);
+static void tape_stop(tape_t* tape);
+static void tape_tick(tape_t* tape, int num_ticks);
+static void tape_set_output(tape_t* tape, uint8_t* ptr, int num_bytes);
+static uint8_t* tape_alloc_block(tape_t* tape, int num_bytes);
+
+static inline int _tape_u16(const uint8_t* ptr)
+{
+    return ptr[0] | (ptr[1] << 8);
+}
+
+static inline int _tape_u24(const uint8_t* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+}
+
+static inline int _tape_u32(const uint8_t* ptr)
+{
+    return (int)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+}
+
+// size of a TZX block including its id byte, -1 for unknown or truncated blocks
+static int _tape_tzx_block_size(const uint8_t* ptr, int num_bytes)
+{
+    static const int header_sizes[0x60] =
+    {
+        //   0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     // 0x00
+             5, 19,  5,  2, 11,  9, -1, -1,  5,  5, -1, -1, -1, -1, -1, -1,     // 0x10
+             3,  2,  1,  3,  3,  1,  3,  1,  3, -1,  5,  5, -1, -1, -1, -1,     // 0x20
+             2,  3,  3,  2,  9, 21, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     // 0x30
+             5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,     // 0x40
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 10, -1, -1, -1, -1, -1,     // 0x50
+    };
+    const int id = ptr[0];
+    if ((id >= 0x60) || (header_sizes[id] < 0) || (num_bytes < header_sizes[id]))
+    {
+        return -1;
+    }
+    const uint8_t* p = ptr + 1;
+    int size = header_sizes[id];
+    switch (id)
+    {
+    case 0x10: size += _tape_u16(p + 2); break;
+    case 0x11: size += _tape_u24(p + 0x0F); break;
+    case 0x13: size += 2 * p[0]; break;
+    case 0x14: size += _tape_u24(p + 0x07); break;
+    case 0x15: size += _tape_u24(p + 0x05); break;
+    case 0x18:
+    case 0x19:
+    case 0x2A:
+    case 0x2B: size += _tape_u32(p); break;
+    case 0x21:
+    case 0x30: size += p[0]; break;
+    case 0x26: size += 2 * _tape_u16(p); break;
+    case 0x28:
+    case 0x32: size += _tape_u16(p); break;
+    case 0x31: size += p[1]; break;
+    case 0x33: size += 3 * p[0]; break;
+    case 0x35: size += _tape_u32(p + 0x10); break;
+    case 0x40: size += _tape_u24(p + 1); break;
+    }
+    return (size <= num_bytes) ? size : -1;
+}
+
+static bool _tape_check_tap(const uint8_t* ptr, int num_bytes)
+{
+    int pos = 0;
+    while (pos < num_bytes)
+    {
+        if ((pos + 2) > num_bytes)
+        {
+            return false;
+        }
+        pos += 2 + _tape_u16(ptr + pos);
+    }
+    return pos == num_bytes;
+}
+
+static bool _tape_check_tzx(const uint8_t* ptr, int num_bytes)
+{
+    if ((num_bytes < 10) || (0 != memcmp(ptr, "ZXTape!\x1A", 8)))
+    {
+        return false;
+    }
+    int pos = 10;
+    while (pos < num_bytes)
+    {
+        const int size = _tape_tzx_block_size(ptr + pos, num_bytes - pos);
+        if (size < 0)
+        {
+            return false;
+        }
+        pos += size;
+    }
+    return true;
+}
+
+static void tape_init(tape_t* tape)
+{
+    CHIPS_ASSERT(tape);
+    memset(tape, 0, sizeof(tape_t));
+    tape->freq_hz = TAPE_TSTATE_FREQ;
+}
+
+static bool tape_insert(tape_t* tape, const uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(tape && ptr);
+    tape_format_t format;
+    if (_tape_check_tzx(ptr, num_bytes))
+    {
+        format = TAPE_FORMAT_TZX;
+    }
+    else if (_tape_check_tap(ptr, num_bytes))
+    {
+        format = TAPE_FORMAT_TAP;
+    }
+    else
+    {
+        return false;
+    }
+    tape_eject(tape);
+    tape->format = format;
+    tape->data = ptr;
+    tape->size = num_bytes;
+    tape_rewind(tape);
+    return true;
+}
+
+static void tape_eject(tape_t* tape)
+{
+    CHIPS_ASSERT(tape);
+    tape->format = TAPE_FORMAT_NONE;
+    tape->data = 0;
+    tape->size = 0;
+    tape_rewind(tape);
+}
+
+static void tape_rewind(tape_t* tape)
+{
+    CHIPS_ASSERT(tape);
+    tape->pos = (tape->format == TAPE_FORMAT_TZX) ? 10 : 0;
+    tape->block_index = 0;
+    tape->playing = false;
+    tape->level = false;
+    tape->ticks_to_next = 0;
+    tape->state = TAPE_STATE_IDLE;
+    tape->loop_count = 0;
+}
+
+static bool tape_inserted(const tape_t* tape)
+{
+    return tape->format != TAPE_FORMAT_NONE;
+}
+
+static bool tape_at_end(const tape_t* tape)
+{
+    return (tape->pos >= tape->size) && (tape->state == TAPE_STATE_IDLE);
+}
+
+// advance over a TZX block without playing it
+static void _tape_skip_block(tape_t* tape, int size)
+{
+    tape->pos += size;
+    tape->block_index++;
+}
+
+// index of the block starting at an offset into the image, the end of
+// the image counts as one past the last block, -1 if no block starts there
+static int _tape_block_index_at(const tape_t* tape, int pos)
+{
+    int p = (tape->format == TAPE_FORMAT_TZX) ? 10 : 0;
+    int index = 0;
+    while (p < pos)
+    {
+        if (tape->format == TAPE_FORMAT_TZX)
+        {
+            p += _tape_tzx_block_size(tape->data + p, tape->size - p);
+        }
+        else
+        {
+            p += 2 + _tape_u16(tape->data + p);
+        }
+        index++;
+    }
+    return (p == pos) ? index : -1;
+}
+
+// TZX blocks which carry no signal and can be stepped over when
+// looking for the next data block
+static bool _tape_tzx_is_info(uint8_t id)
+{
+    return (id >= 0x21 && id <= 0x22) || (id >= 0x30 && id <= 0x35) || (id == 0x5A);
+}
+
+// find the next standard speed block, this fails while a block is being
+// played back or if the next block is not a standard ROM block
+static bool _tape_find_standard_block(const tape_t* tape, int* pos, int* index)
+{
+    if ((tape->state != TAPE_STATE_IDLE) && (tape->state != TAPE_STATE_PAUSE))
+    {
+        return false;
+    }
+    *pos = tape->pos;
+    *index = tape->block_index;
+    if (tape->format == TAPE_FORMAT_TAP)
+    {
+        return (*pos + 2) <= tape->size;
+    }
+    if (tape->format == TAPE_FORMAT_TZX)
+    {
+        while ((*pos < tape->size) && _tape_tzx_is_info(tape->data[*pos]))
+        {
+            *pos += _tape_tzx_block_size(tape->data + *pos, tape->size - *pos);
+            (*index)++;
+        }
+        return (*pos < tape->size) && (tape->data[*pos] == 0x10);
+    }
+    return false;
+}
+
+static bool tape_has_standard_block(const tape_t* tape)
+{
+    int pos, index;
+    return _tape_find_standard_block(tape, &pos, &index);
+}
+
+// return the next standard speed block (flag, data and checksum) and
+// advance past it
+static bool tape_next_block(tape_t* tape, const uint8_t** block, int* num_bytes)
+{
+    CHIPS_ASSERT(tape && block && num_bytes);
+    int pos, index;
+    if (!_tape_find_standard_block(tape, &pos, &index))
+    {
+        return false;
+    }
+    const uint8_t* ptr = tape->data + pos;
+    if (tape->format == TAPE_FORMAT_TAP)
+    {
+        *num_bytes = _tape_u16(ptr);
+        *block = ptr + 2;
+        tape->pos = pos + 2 + *num_bytes;
+        tape->pause_ms = TAPE_ROM_PAUSE_MS;
+    }
+    else
+    {
+        *num_bytes = _tape_u16(ptr + 3);
+        *block = ptr + 5;
+        tape->pos = pos + 5 + *num_bytes;
+        tape->pause_ms = _tape_u16(ptr + 1);
+    }
+    tape->block_index = index + 1;
+    // a tape which keeps playing continues with the block's pause
+    tape->state = TAPE_STATE_PAUSE;
+    tape->ticks_to_next = 0;
+    return true;
+}
+
+static void tape_set_freq(tape_t* tape, int freq_hz)
+{
+    CHIPS_ASSERT(tape && (freq_hz > 0));
+    tape->ticks_to_next = (int)(((int64_t)tape->ticks_to_next * freq_hz) / tape->freq_hz);
+    tape->freq_hz = freq_hz;
+}
+
+static void _tape_begin_data(tape_t* tape, const uint8_t* data, int len, int used_bits)
+{
+    tape->block_data = data;
+    tape->block_len = len;
+    tape->used_bits = used_bits;
+    tape->byte_pos = 0;
+    tape->bit_pos = 0;
+    tape->bit_pulse = 0;
+}
+
+// set up playback of the block at the tape position, returns false at
+// the end of the tape
+static bool _tape_begin_block(tape_t* tape)
+{
+    const int first_index = tape->block_index;
+    int num_blocks = 0;
+    while (tape->pos < tape->size)
+    {
+        if (++num_blocks > TAPE_MAX_CONTROL_BLOCKS)
+        {
+            tape->pos = tape->size;
+            return false;
+        }
+        const uint8_t* ptr = tape->data + tape->pos;
+        if (tape->format == TAPE_FORMAT_TAP)
+        {
+            const int len = _tape_u16(ptr);
+            _tape_skip_block(tape, 2 + len);
+            if (len == 0)
+            {
+                continue;
+            }
+            tape->pilot_pulse = TAPE_ROM_PILOT_PULSE;
+            tape->pulse_count = (ptr[2] & 0x80) ? TAPE_ROM_DATA_PILOTS : TAPE_ROM_HEADER_PILOTS;
+            tape->sync1_pulse = TAPE_ROM_SYNC1_PULSE;
+            tape->sync2_pulse = TAPE_ROM_SYNC2_PULSE;
+            tape->zero_pulse = TAPE_ROM_ZERO_PULSE;
+            tape->one_pulse = TAPE_ROM_ONE_PULSE;
+            tape->pause_ms = TAPE_ROM_PAUSE_MS;
+            _tape_begin_data(tape, ptr + 2, len, 8);
+            tape->state = TAPE_STATE_PILOT;
+            return true;
+        }
+
+        const int size = _tape_tzx_block_size(ptr, tape->size - tape->pos);
+        const uint8_t* p = ptr + 1;
+        _tape_skip_block(tape, size);
+        switch (ptr[0])
+        {
+        case 0x10:
+            tape->pilot_pulse = TAPE_ROM_PILOT_PULSE;
+            tape->pulse_count = (_tape_u16(p + 2) && (p[4] & 0x80)) ? TAPE_ROM_DATA_PILOTS : TAPE_ROM_HEADER_PILOTS;
+            tape->sync1_pulse = TAPE_ROM_SYNC1_PULSE;
+            tape->sync2_pulse = TAPE_ROM_SYNC2_PULSE;
+            tape->zero_pulse = TAPE_ROM_ZERO_PULSE;
+            tape->one_pulse = TAPE_ROM_ONE_PULSE;
+            tape->pause_ms = _tape_u16(p);
+            _tape_begin_data(tape, p + 4, _tape_u16(p + 2), 8);
+            tape->state = TAPE_STATE_PILOT;
+            return true;
+        case 0x11:
+            tape->pilot_pulse = _tape_u16(p);
+            tape->sync1_pulse = _tape_u16(p + 2);
+            tape->sync2_pulse = _tape_u16(p + 4);
+            tape->zero_pulse = _tape_u16(p + 6);
+            tape->one_pulse = _tape_u16(p + 8);
+            tape->pulse_count = _tape_u16(p + 10);
+            tape->pause_ms = _tape_u16(p + 13);
+            _tape_begin_data(tape, p + 18, _tape_u24(p + 15), p[12]);
+            tape->state = TAPE_STATE_PILOT;
+            return true;
+        case 0x12:
+            // a pure tone is a pilot without sync pulses and data
+            tape->pilot_pulse = _tape_u16(p);
+            tape->pulse_count = _tape_u16(p + 2);
+            tape->sync1_pulse = tape->sync2_pulse = 0;
+            tape->pause_ms = 0;
+            _tape_begin_data(tape, p, 0, 8);
+            tape->state = TAPE_STATE_PILOT;
+            return true;
+        case 0x13:
+            tape->pulse_count = p[0];
+            tape->pause_ms = 0;
+            _tape_begin_data(tape, p + 1, 2 * p[0], 8);
+            tape->state = TAPE_STATE_PULSES;
+            return true;
+        case 0x14:
+            tape->zero_pulse = _tape_u16(p);
+            tape->one_pulse = _tape_u16(p + 2);
+            tape->pause_ms = _tape_u16(p + 5);
+            _tape_begin_data(tape, p + 10, _tape_u24(p + 7), p[4]);
+            tape->state = TAPE_STATE_DATA;
+            return true;
+        case 0x15:
+            // the pilot pulse holds the T-states per sample
+            tape->pilot_pulse = _tape_u16(p);
+            tape->pause_ms = _tape_u16(p + 2);
+            _tape_begin_data(tape, p + 8, _tape_u24(p + 5), p[4]);
+            tape->state = TAPE_STATE_DIRECT;
+            return true;
+        case 0x20:
+            tape->pause_ms = _tape_u16(p);
+            if (tape->pause_ms == 0)
+            {
+                tape->playing = false;
+                return true;
+            }
+            tape->state = TAPE_STATE_PAUSE;
+            return true;
+        case 0x23:
+            {
+                // jump relative to this block, find the target by rescanning.
+                // Going back no further than the blocks stepped over since
+                // the last signal would spin forever, that ends the tape.
+                const int target = tape->block_index - 1 + (int16_t)_tape_u16(p);
+                if ((target >= first_index) && (target < tape->block_index))
+                {
+                    tape->pos = tape->size;
+                    return false;
+                }
+                tape->pos = 10;
+                tape->block_index = 0;
+                while ((tape->block_index < target) && (tape->pos < tape->size))
+                {
+                    _tape_skip_block(tape, _tape_tzx_block_size(tape->data + tape->pos, tape->size - tape->pos));
+                }
+            }
+            break;
+        case 0x24:
+            tape->loop_count = _tape_u16(p);
+            tape->loop_pos = tape->pos;
+            tape->loop_index = tape->block_index;
+            break;
+        case 0x25:
+            if (tape->loop_count > 1)
+            {
+                tape->loop_count--;
+                tape->pos = tape->loop_pos;
+                tape->block_index = tape->loop_index;
+            }
+            break;
+        case 0x2A:
+            // 'stop the tape if in 48K mode'
+            tape->playing = false;
+            return true;
+        case 0x2B:
+            tape->level = 0 != p[4];
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+// return the length of the next signal segment in T-states and update
+// the EAR level for it, 0 once the tape has stopped
+static int _tape_next_segment(tape_t* tape)
+{
+    for (;;)
+    {
+        switch (tape->state)
+        {
+        case TAPE_STATE_IDLE:
+            if (!_tape_begin_block(tape))
+            {
+                tape->playing = false;
+            }
+            if (!tape->playing)
+            {
+                return 0;
+            }
+            break;
+
+        case TAPE_STATE_PILOT:
+            if (tape->pulse_count > 0)
+            {
+                tape->pulse_count--;
+                tape->level = !tape->level;
+                return tape->pilot_pulse;
+            }
+            tape->state = TAPE_STATE_SYNC1;
+            break;
+
+        case TAPE_STATE_SYNC1:
+            tape->state = TAPE_STATE_SYNC2;
+            if (tape->sync1_pulse)
+            {
+                tape->level = !tape->level;
+                return tape->sync1_pulse;
+            }
+            break;
+
+        case TAPE_STATE_SYNC2:
+            tape->state = TAPE_STATE_DATA;
+            if (tape->sync2_pulse)
+            {
+                tape->level = !tape->level;
+                return tape->sync2_pulse;
+            }
+            break;
+
+        case TAPE_STATE_DATA:
+            {
+                const int num_bits = (tape->byte_pos == (tape->block_len - 1)) ? tape->used_bits : 8;
+                if ((tape->byte_pos >= tape->block_len) || (tape->bit_pos >= num_bits))
+                {
+                    tape->state = TAPE_STATE_PAUSE;
+                    tape->ticks_to_next = 0;
+                    break;
+                }
+                const bool bit = 0 != (tape->block_data[tape->byte_pos] & (0x80 >> tape->bit_pos));
+                if (++tape->bit_pulse == 2)
+                {
+                    tape->bit_pulse = 0;
+                    if (++tape->bit_pos == 8)
+                    {
+                        tape->bit_pos = 0;
+                        tape->byte_pos++;
+                    }
+                }
+                tape->level = !tape->level;
+                return bit ? tape->one_pulse : tape->zero_pulse;
+            }
+
+        case TAPE_STATE_PULSES:
+            if (tape->byte_pos < tape->block_len)
+            {
+                const int pulse = _tape_u16(tape->block_data + tape->byte_pos);
+                tape->byte_pos += 2;
+                tape->level = !tape->level;
+                return pulse;
+            }
+            tape->state = TAPE_STATE_IDLE;
+            break;
+
+        case TAPE_STATE_DIRECT:
+            {
+                // merge runs of equal samples into one segment
+                int num_samples = 0;
+                bool bit = false;
+                while (tape->byte_pos < tape->block_len)
+                {
+                    const int num_bits = (tape->byte_pos == (tape->block_len - 1)) ? tape->used_bits : 8;
+                    if (tape->bit_pos >= num_bits)
+                    {
+                        tape->bit_pos = 0;
+                        tape->byte_pos++;
+                        continue;
+                    }
+                    const bool b = 0 != (tape->block_data[tape->byte_pos] & (0x80 >> tape->bit_pos));
+                    if ((num_samples > 0) && (b != bit))
+                    {
+                        break;
+                    }
+                    bit = b;
+                    num_samples++;
+                    tape->bit_pos++;
+                }
+                if (num_samples == 0)
+                {
+                    tape->state = TAPE_STATE_PAUSE;
+                    break;
+                }
+                tape->level = bit;
+                return num_samples * tape->pilot_pulse;
+            }
+
+        case TAPE_STATE_PAUSE:
+            tape->state = TAPE_STATE_IDLE;
+            if (tape->pause_ms > 0)
+            {
+                tape->level = false;
+                return tape->pause_ms * TAPE_TSTATES_PER_MS;
+            }
+            break;
+        }
+    }
+}
+
+static void _tape_advance(tape_t* tape)
+{
+    while (tape->playing && (tape->ticks_to_next <= 0))
+    {
+        const bool old_level = tape->level;
+        const int tstates = _tape_next_segment(tape);
+        if (tape->level != old_level)
+        {
+            tape->edges++;
+        }
+        if (tstates == 0)
+        {
+            tape->ticks_to_next = 0;
+            break;
+        }
+        if (tape->freq_hz == TAPE_TSTATE_FREQ)
+        {
+            tape->ticks_to_next += tstates;
+        }
+        else
+        {
+            tape->ticks_to_next += (int)(((int64_t)tstates * tape->freq_hz) / TAPE_TSTATE_FREQ);
+        }
+    }
+}
+
+static void tape_play(tape_t* tape)
+{
+    CHIPS_ASSERT(tape);
+    if (tape_inserted(tape) && !tape->playing)
+    {
+        tape->playing = true;
+        _tape_advance(tape);
+    }
+}
+
+static void tape_stop(tape_t* tape)
+{
+    CHIPS_ASSERT(tape);
+    tape->playing = false;
+}
+
+static void tape_tick(tape_t* tape, int num_ticks)
+{
+    tape->ticks_to_next -= num_ticks;
+    if (tape->ticks_to_next <= 0)
+    {
+        _tape_advance(tape);
+    }
+}
+
+static void tape_set_output(tape_t* tape, uint8_t* ptr, int num_bytes)
+{
+    CHIPS_ASSERT(tape);
+    tape->out_data = ptr;
+    tape->out_size = ptr ? num_bytes : 0;
+    tape->out_pos = 0;
+}
+
+// reserve a TAP block in the output buffer, returns 0 if it doesn't fit
+static uint8_t* tape_alloc_block(tape_t* tape, int num_bytes)
+{
+    CHIPS_ASSERT(tape && (num_bytes > 0) && (num_bytes <= 0xFFFF));
+    if (!tape->out_data || (tape->out_pos + 2 + num_bytes) > tape->out_size)
+    {
+        return 0;
+    }
+    uint8_t* ptr = tape->out_data + tape->out_pos;
+    ptr[0] = (uint8_t)num_bytes;
+    ptr[1] = (uint8_t)(num_bytes >> 8);
+    tape->out_pos += 2 + num_bytes;
+    return ptr + 2;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Trace zones inside the core. They only record anything when ZXSC_TRACE
+// is defined, the zone functions then come from util/Trace.cpp; without
+// it the macros expand to nothing and the core has no trace code at all.
+//
+// A zone's name has to be a string literal, only the pointer is kept.
+
+#if defined(ZXSC_TRACE)
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void zx_trace_begin(const char* name);
+void zx_trace_end(void);
+void zx_trace_counter(const char* name, int64_t value);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#define ZX_TRACE_BEGIN(name) zx_trace_begin(name)
+#define ZX_TRACE_END() zx_trace_end()
+#define ZX_TRACE_COUNTER(name, value) zx_trace_counter(name, (int64_t)(value))
+
+#else
+
+#define ZX_TRACE_BEGIN(name) ((void)0)
+#define ZX_TRACE_END() ((void)0)
+#define ZX_TRACE_COUNTER(name, value) ((void)0)
+
+#endif
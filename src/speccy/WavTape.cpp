@@ -0,0 +1,470 @@
+#include "WavTape.hpp"
+
+#include "../util/MappedFile.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WAV_TAPE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace Speccy
+{
+    static const uint64_t tstate_freq = 3500000;
+    static const size_t min_chunk_samples = 0x10000;
+    static const size_t convert_block_samples = 0x1000;
+
+    struct WavFormat
+    {
+        uint16_t channels = 0;
+        uint16_t bits_per_sample = 0;
+        uint32_t sample_rate = 0;
+        const uint8_t* samples = nullptr;
+        size_t sample_count = 0;
+    };
+
+    // result of scanning one chunk of samples, the state is -1 until
+    // the signal first crosses one of the thresholds
+    struct WavChunk
+    {
+        size_t begin = 0;
+        size_t end = 0;
+        int64_t sum = 0;
+        int16_t min = 0;
+        int16_t max = 0;
+        int first_state = -1;
+        size_t first_pos = 0;
+        int last_state = -1;
+        std::vector<uint64_t> edges;
+    };
+
+    static uint16_t ReadU16(const uint8_t* ptr)
+    {
+        return static_cast<uint16_t>(ptr[0] | (ptr[1] << 8));
+    }
+
+    static uint32_t ReadU32(const uint8_t* ptr)
+    {
+        return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | (static_cast<uint32_t>(ptr[3]) << 24);
+    }
+
+    static inline int CountTrailingZeros(uint32_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    static WavFormat ParseWav(const uint8_t* data, size_t length)
+    {
+        WavFormat format;
+
+        if (length < 12 ||
+            memcmp(data, "RIFF", 4) != 0 ||
+            memcmp(data + 8, "WAVE", 4) != 0)
+        {
+            throw std::runtime_error("Not a WAV file.");
+        }
+
+        bool have_format = false;
+        size_t pos = 12;
+
+        while (pos + 8 <= length)
+        {
+            const uint8_t* chunk = data + pos;
+            const size_t chunk_size = std::min<size_t>(ReadU32(chunk + 4), length - pos - 8);
+
+            if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16)
+            {
+                uint16_t tag = ReadU16(chunk + 8);
+                // WAVE_FORMAT_EXTENSIBLE keeps the real tag in the sub format
+                if (tag == 0xFFFE && chunk_size >= 40)
+                {
+                    tag = ReadU16(chunk + 8 + 24);
+                }
+                if (tag != 1)
+                {
+                    throw std::runtime_error("Only PCM WAV files are supported.");
+                }
+                format.channels = ReadU16(chunk + 10);
+                format.sample_rate = ReadU32(chunk + 12);
+                format.bits_per_sample = ReadU16(chunk + 22);
+                have_format = true;
+            }
+            else if (memcmp(chunk, "data", 4) == 0 && have_format)
+            {
+                if ((format.bits_per_sample != 8 && format.bits_per_sample != 16) ||
+                    format.channels == 0 ||
+                    format.sample_rate == 0)
+                {
+                    throw std::runtime_error("Unsupported WAV sample format.");
+                }
+                const size_t frame_bytes = format.channels * (format.bits_per_sample / 8);
+                format.samples = chunk + 8;
+                format.sample_count = chunk_size / frame_bytes;
+                return format;
+            }
+
+            pos += 8 + chunk_size + (chunk_size & 1);
+        }
+
+        throw std::runtime_error("WAV file has no sample data.");
+    }
+
+    // first channel of a frame range as signed 16 bit samples, 16 bit
+    // mono data is used in place
+    static const int16_t* GetSamples(
+        const WavFormat& format,
+        const size_t begin,
+        const size_t count,
+        std::vector<int16_t>& buffer)
+    {
+        if (format.bits_per_sample == 16 && format.channels == 1)
+        {
+            return reinterpret_cast<const int16_t*>(format.samples) + begin;
+        }
+
+        buffer.resize(count);
+
+        if (format.bits_per_sample == 16)
+        {
+            const uint8_t* src = format.samples + begin * format.channels * 2;
+            for (size_t i = 0; i < count; i++, src += format.channels * 2)
+            {
+                buffer[i] = static_cast<int16_t>(ReadU16(src));
+            }
+        }
+        else
+        {
+            const uint8_t* src = format.samples + begin * format.channels;
+            for (size_t i = 0; i < count; i++, src += format.channels)
+            {
+                buffer[i] = static_cast<int16_t>((src[0] - 128) << 8);
+            }
+        }
+
+        return buffer.data();
+    }
+
+    static void ScanLevels(
+        const int16_t* samples,
+        const size_t count,
+        WavChunk& chunk)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            chunk.sum += samples[i];
+            chunk.min = std::min(chunk.min, samples[i]);
+            chunk.max = std::max(chunk.max, samples[i]);
+        }
+    }
+
+    // Find the samples where the signal crosses the threshold opposite
+    // to its current state. The SIMD path compares 16 samples against
+    // both thresholds at once and only walks the resulting bit masks,
+    // so runs without a crossing cost a couple of instructions.
+    static void FindEdges(
+        const int16_t* samples,
+        const size_t count,
+        const size_t base,
+        const int16_t low,
+        const int16_t high,
+        WavChunk& chunk)
+    {
+        int state = chunk.last_state;
+        size_t i = 0;
+
+#if defined(WAV_TAPE_SSE2)
+        const __m128i low_v = _mm_set1_epi16(low);
+        const __m128i high_v = _mm_set1_epi16(high);
+
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i + 8));
+
+            uint32_t above = static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(
+                _mm_cmpgt_epi16(a, high_v),
+                _mm_cmpgt_epi16(b, high_v))));
+            uint32_t below = static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(
+                _mm_cmplt_epi16(a, low_v),
+                _mm_cmplt_epi16(b, low_v))));
+
+            while (true)
+            {
+                const uint32_t mask =
+                    (state == 1) ? below :
+                    (state == 0) ? above :
+                    (above | below);
+
+                if (mask == 0)
+                {
+                    break;
+                }
+
+                const int bit = CountTrailingZeros(mask);
+                const size_t pos = base + i + bit;
+
+                if (state < 0)
+                {
+                    state = (above >> bit) & 1;
+                    chunk.first_state = state;
+                    chunk.first_pos = pos;
+                }
+                else
+                {
+                    state ^= 1;
+                    chunk.edges.push_back(pos);
+                }
+
+                const uint32_t remaining = ~((2u << bit) - 1);
+                above &= remaining;
+                below &= remaining;
+            }
+        }
+#endif
+
+        for (; i < count; i++)
+        {
+            const int16_t sample = samples[i];
+            int new_state = state;
+
+            if (sample > high && state != 1)
+            {
+                new_state = 1;
+            }
+            else if (sample < low && state != 0)
+            {
+                new_state = 0;
+            }
+
+            if (new_state != state)
+            {
+                if (state < 0)
+                {
+                    chunk.first_state = new_state;
+                    chunk.first_pos = base + i;
+                }
+                else
+                {
+                    chunk.edges.push_back(base + i);
+                }
+                state = new_state;
+            }
+        }
+
+        chunk.last_state = state;
+    }
+
+    WavTape::WavTape(
+        const std::string& path,
+        ThreadPool& thread_pool)
+    {
+        MappedFile file(path);
+
+        WavFormat format;
+        try
+        {
+            format = ParseWav(file.Data(), file.Length());
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cout << e.what() << " " << path << std::endl;
+            throw;
+        }
+
+        sample_rate = format.sample_rate;
+
+        const size_t chunk_count = std::max<size_t>(1, std::min(
+            thread_pool.ThreadCount() * 4,
+            format.sample_count / min_chunk_samples));
+        const size_t chunk_samples = (format.sample_count + chunk_count - 1) / chunk_count;
+
+        std::vector<WavChunk> chunks(chunk_count);
+        for (size_t i = 0; i < chunk_count; i++)
+        {
+            chunks[i].begin = std::min(format.sample_count, i * chunk_samples);
+            chunks[i].end = std::min(format.sample_count, (i + 1) * chunk_samples);
+        }
+
+        // pass over the recording in fixed size blocks, converting the
+        // samples first unless they can be used in place
+        auto for_each_block = [&](WavChunk& chunk, const std::function<void(const int16_t*, size_t, size_t)>& func)
+        {
+            std::vector<int16_t> buffer;
+            for (size_t pos = chunk.begin; pos < chunk.end; pos += convert_block_samples)
+            {
+                const size_t count = std::min(convert_block_samples, chunk.end - pos);
+                func(GetSamples(format, pos, count, buffer), count, pos);
+            }
+        };
+
+        // signal mean and range for the thresholds
+        thread_pool.Run(chunk_count, [&](size_t index)
+        {
+            WavChunk& chunk = chunks[index];
+            for_each_block(chunk, [&](const int16_t* samples, size_t count, size_t)
+            {
+                ScanLevels(samples, count, chunk);
+            });
+        });
+
+        int64_t sum = 0;
+        int16_t min = 0;
+        int16_t max = 0;
+        for (const auto& chunk : chunks)
+        {
+            sum += chunk.sum;
+            min = std::min(min, chunk.min);
+            max = std::max(max, chunk.max);
+        }
+
+        const int mean = format.sample_count ? static_cast<int>(sum / static_cast<int64_t>(format.sample_count)) : 0;
+        const int hysteresis = std::max(256, std::max(max - mean, mean - min) / 6);
+        const int16_t low = static_cast<int16_t>(std::max(-32768, mean - hysteresis));
+        const int16_t high = static_cast<int16_t>(std::min(32767, mean + hysteresis));
+
+        thread_pool.Run(chunk_count, [&](size_t index)
+        {
+            WavChunk& chunk = chunks[index];
+            for_each_block(chunk, [&](const int16_t* samples, size_t count, size_t pos)
+            {
+                FindEdges(samples, count, pos, low, high, chunk);
+            });
+        });
+
+        // Stitch the chunks together. A chunk doesn't know the state it
+        // starts in, so its first crossing is only an edge if it differs
+        // from where the previous chunks left the signal.
+        std::vector<uint64_t> edges;
+        int state = -1;
+        for (const auto& chunk : chunks)
+        {
+            if (chunk.first_state < 0)
+            {
+                continue;
+            }
+            if (state >= 0 && state != chunk.first_state)
+            {
+                edges.push_back(chunk.first_pos);
+            }
+            edges.insert(edges.end(), chunk.edges.begin(), chunk.edges.end());
+            state = chunk.last_state;
+        }
+
+        // convert the absolute edge positions so rounding doesn't drift
+        pulses.reserve(edges.empty() ? 0 : edges.size() - 1);
+        for (size_t i = 1; i < edges.size(); i++)
+        {
+            const uint64_t t0 = (edges[i - 1] * tstate_freq) / sample_rate;
+            const uint64_t t1 = (edges[i] * tstate_freq) / sample_rate;
+            pulses.push_back(static_cast<uint32_t>(std::min<uint64_t>(t1 - t0, 0xFFFFFFFF)));
+        }
+    }
+
+    uint32_t WavTape::SampleRate() const
+    {
+        return sample_rate;
+    }
+
+    const std::vector<uint32_t>& WavTape::Pulses() const
+    {
+        return pulses;
+    }
+
+    // Pulses become TZX pulse sequence blocks. Longer pulses than these
+    // can hold are gaps in the recording: low ones are written as a
+    // pause, high ones as a direct recording of a few long samples.
+    // What gets rounded off is carried into the next pulse, so every
+    // edge stays where the recording had it.
+    std::vector<uint8_t> WavTape::TZX() const
+    {
+        std::vector<uint8_t> tzx = { 'Z', 'X', 'T', 'a', 'p', 'e', '!', 0x1A, 1, 20 };
+        std::vector<uint16_t> sequence;
+
+        auto put16 = [&](uint32_t value)
+        {
+            tzx.push_back(static_cast<uint8_t>(value));
+            tzx.push_back(static_cast<uint8_t>(value >> 8));
+        };
+
+        auto flush = [&]()
+        {
+            for (size_t pos = 0; pos < sequence.size(); pos += 255)
+            {
+                const size_t count = std::min<size_t>(255, sequence.size() - pos);
+                tzx.push_back(0x13);
+                tzx.push_back(static_cast<uint8_t>(count));
+                for (size_t i = 0; i < count; i++)
+                {
+                    put16(sequence[pos + i]);
+                }
+            }
+            sequence.clear();
+        };
+
+        // pulses toggle the level, which starts out low
+        bool level = false;
+        uint64_t carry = 0;
+
+        for (const uint32_t pulse_length : pulses)
+        {
+            const uint64_t pulse = pulse_length + carry;
+            carry = 0;
+            level = !level;
+
+            if (pulse <= 0xFFFF)
+            {
+                sequence.push_back(static_cast<uint16_t>(pulse));
+                continue;
+            }
+
+            flush();
+
+            if (!level)
+            {
+                uint64_t pause_ms = pulse / 3500;
+                carry = pulse % 3500;
+                while (pause_ms > 0)
+                {
+                    const uint32_t ms = static_cast<uint32_t>(std::min<uint64_t>(pause_ms, 0xFFFF));
+                    tzx.push_back(0x20);
+                    put16(ms);
+                    pause_ms -= ms;
+                }
+            }
+            else
+            {
+                const uint64_t samples = (pulse + 0xFFFE) / 0xFFFF;
+                const uint64_t tstates_per_sample = pulse / samples;
+                const uint64_t bytes = (samples + 7) / 8;
+                carry = pulse - samples * tstates_per_sample;
+
+                tzx.push_back(0x15);
+                put16(static_cast<uint32_t>(tstates_per_sample));
+                put16(0);
+                tzx.push_back(static_cast<uint8_t>(samples - (bytes - 1) * 8));
+                put16(static_cast<uint32_t>(bytes));
+                tzx.push_back(static_cast<uint8_t>(bytes >> 16));
+                tzx.insert(tzx.end(), static_cast<size_t>(bytes), 0xFF);
+            }
+        }
+
+        flush();
+
+        return tzx;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../util/ThreadPool.hpp"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace Speccy
+{
+    // Decodes an audio recording of a tape (PCM WAV, 8 or 16 bit, first
+    // channel only) into the pulses between signal edges. The file is
+    // memory mapped and scanned in chunks on a thread pool, edges are
+    // found with a hysteresis threshold around the signal's mean so
+    // noise near the zero line doesn't produce spurious pulses.
+    //
+    // The pulses are handed to the emulator as a TZX image, which plays
+    // through the same EAR input path as any other tape and can be
+    // saved so a recording only needs decoding once.
+    class WavTape
+    {
+    private:
+        uint32_t sample_rate = 0;
+        std::vector<uint32_t> pulses;
+
+    public:
+        WavTape(
+            const std::string& path,
+            ThreadPool& thread_pool);
+
+        uint32_t SampleRate() const;
+
+        // pulse lengths in 3.5 MHz T-states, starting at the first edge
+        const std::vector<uint32_t>& Pulses() const;
+
+        std::vector<uint8_t> TZX() const;
+    };
+}
@@ -0,0 +1,547 @@
+#include "../util/MappedFile.hpp"
+#include "../util/PerfCounters.hpp"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+#include "../speccy/Snapshot.h"
+}
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Benchmarks of the emulator's inner loops, printed as JSON:
+//
+//     zxsc-bench [-filter <text>] [-samples <n>] [-sample-ms <ms>]
+//                [-baseline <bench.json>] [-threshold <percent>]
+//                [snapshot]
+//
+// Every benchmark is warmed up, calibrated to run for sample-ms, then
+// timed for a number of samples. The median of the nanoseconds per
+// operation is what counts, an operation is an emulated T-state, a
+// byte or a call depending on the benchmark.
+//
+// Given the output of an earlier run as a baseline, benchmarks whose
+// median got slower by more than the threshold are listed on stderr
+// and the exit code is 2. The snapshot (files/scr.z80 by default) is
+// run for the whole machine benchmarks, loaded for quickload and
+// provides the memory and screen for the others.
+
+struct Benchmark
+{
+    std::string name;
+    std::string unit;               // of the rate, 1000 / median ns
+    std::vector<double> samples;    // ns per operation
+    double instructions = -1.0;     // per operation, with perf counters
+    double ipc = -1.0;
+};
+
+// returns the number of operations it did
+typedef std::function<uint64_t()> Iteration;
+
+static int num_samples = 10;
+static double sample_ms = 50.0;
+static std::string filter;
+static std::vector<Benchmark> results;
+
+static volatile uint32_t sink;
+
+// read once per call where an argument would otherwise be loop invariant,
+// so the call can't be hoisted or vectorized away
+static volatile uint16_t source;
+
+static double elapsed_ns(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run(
+    const std::string& name,
+    const std::string& unit,
+    const Iteration& iteration)
+{
+    if (!filter.empty() && (name.find(filter) == std::string::npos))
+    {
+        return;
+    }
+
+    // warm up and find how many iterations make a sample
+    uint64_t iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (elapsed_ns(start) < (sample_ms * 1e6 / 4))
+    {
+        iteration();
+        iterations++;
+    }
+    const uint64_t sample_iterations = std::max<uint64_t>(1, iterations * 4);
+
+    Benchmark benchmark;
+    benchmark.name = name;
+    benchmark.unit = unit;
+    PerfCounters perf;
+    uint64_t total_ops = 0;
+    perf.Start();
+    for (int sample = 0; sample < num_samples; sample++)
+    {
+        uint64_t ops = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < sample_iterations; i++)
+        {
+            ops += iteration();
+        }
+        benchmark.samples.push_back(elapsed_ns(start) / static_cast<double>(ops));
+        total_ops += ops;
+    }
+    perf.Stop();
+
+    if (perf.Available() && (perf.Count(PerfCounters::Cycles) > 0))
+    {
+        benchmark.instructions = static_cast<double>(perf.Count(PerfCounters::Instructions)) / total_ops;
+        benchmark.ipc = static_cast<double>(perf.Count(PerfCounters::Instructions)) / perf.Count(PerfCounters::Cycles);
+    }
+    results.push_back(benchmark);
+    std::cerr << name << std::endl;
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    const size_t n = values.size();
+    return (n % 2) ? values[n / 2] : ((values[n / 2 - 1] + values[n / 2]) / 2.0);
+}
+
+// CPU on 64K of flat RAM without the machine around it
+struct FlatCpu
+{
+    z80_t cpu;
+    uint8_t ram[1 << 16];
+};
+
+static uint64_t flat_tick(int num_ticks, uint64_t pins, void* user_data)
+{
+    (void)num_ticks;
+    uint8_t* ram = static_cast<uint8_t*>(user_data);
+    if (pins & Z80_MREQ)
+    {
+        if (pins & Z80_RD)
+        {
+            Z80_SET_DATA(pins, ram[Z80_GET_ADDR(pins)]);
+        }
+        else if (pins & Z80_WR)
+        {
+            ram[Z80_GET_ADDR(pins)] = Z80_GET_DATA(pins);
+        }
+    }
+    else if ((pins & Z80_IORQ) && (pins & Z80_RD))
+    {
+        Z80_SET_DATA(pins, 0xFF);
+    }
+    return pins;
+}
+
+// endless loops at 0x8000 exercising one kind of instruction each
+static const std::map<std::string, std::vector<uint8_t>> opcode_mixes =
+{
+    // ADD A,B  INC C  LD D,A  XOR E  SUB H  AND L  DEC B  OR C  JP 8000
+    { "alu", { 0x80, 0x0C, 0x57, 0xAB, 0x94, 0xA5, 0x05, 0xB1, 0xC3, 0x00, 0x80 } },
+    // LD HL,9000  LD A,(HL)  INC A  LD (HL),A  INC L  LD B,(HL)  PUSH BC  POP DE  JP 8003
+    { "memory", { 0x21, 0x00, 0x90, 0x7E, 0x3C, 0x77, 0x2C, 0x46, 0xC5, 0xD1, 0xC3, 0x03, 0x80 } },
+    // LD HL,9000  LD DE,A000  LD BC,0400  LDIR  JP 8000
+    { "block", { 0x21, 0x00, 0x90, 0x11, 0x00, 0xA0, 0x01, 0x00, 0x04, 0xED, 0xB0, 0xC3, 0x00, 0x80 } },
+    // LD IX,9000  LD A,(IX+1)  ADD A,(IX+2)  LD (IX+3),A  RLC B  BIT 3,A  JP 8004
+    { "prefixed", { 0xDD, 0x21, 0x00, 0x90, 0xDD, 0x7E, 0x01, 0xDD, 0x86, 0x02, 0xDD, 0x77, 0x03, 0xCB, 0x00, 0xCB, 0x5F, 0xC3, 0x04, 0x80 } },
+    // LD B,0  DJNZ $  JR 8000
+    { "branch", { 0x06, 0x00, 0x10, 0xFE, 0x18, 0xFA } },
+};
+
+static void bench_z80_exec()
+{
+    // the stack for PUSH/POP sits in the same flat RAM
+    std::unique_ptr<FlatCpu> flat(new FlatCpu);
+    for (const auto& mix : opcode_mixes)
+    {
+        memset(flat->ram, 0, sizeof(flat->ram));
+        memcpy(&flat->ram[0x8000], mix.second.data(), mix.second.size());
+        z80_desc_t desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.tick_cb = flat_tick;
+        desc.user_data = flat->ram;
+        z80_init(&flat->cpu, &desc);
+        z80_set_pc(&flat->cpu, 0x8000);
+        z80_set_sp(&flat->cpu, 0xFF00);
+        run("z80_exec/" + mix.first, "MHz", [&]()
+        {
+            return static_cast<uint64_t>(z80_exec(&flat->cpu, 10000));
+        });
+    }
+}
+
+static void bench_machine(const std::vector<uint8_t>& snapshot, uint32_t* pixels)
+{
+    for (int video = 1; video >= 0; video--)
+    {
+        zx_desc_t desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.pixel_buffer = pixels;
+        desc.pixel_buffer_size = DISPLAY_BYTES;
+        std::unique_ptr<zx_t> sys(new zx_t);
+        zx_init(sys.get(), &desc);
+        zx_quickload(sys.get(), snapshot.data(), static_cast<int>(snapshot.size()));
+        sys->video_decode = (video != 0);
+        run(video ? "zx_exec/snapshot" : "zx_exec/snapshot-novideo", "MHz", [&]()
+        {
+            const uint64_t ticks = sys->ticks;
+            zx_exec(sys.get(), 20000);
+            return sys->ticks - ticks;
+        });
+        zx_discard(sys.get());
+    }
+}
+
+static void bench_tick(zx_t* sys)
+{
+    // ticks without a scanline or a tape to handle, as most of them are
+    sys->scanline_counter = 1 << 30;
+    run("zx_tick/memory-read", "Mcalls/s", [&]()
+    {
+        uint32_t sum = 0;
+        uint16_t addr = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            const uint64_t pins = _zx_tick(3, Z80_MAKE_PINS(Z80_MREQ | Z80_RD, addr, 0), sys);
+            sum += Z80_GET_DATA(pins);
+            addr = static_cast<uint16_t>((addr * 75) + 74);
+        }
+        sink = sum;
+        return 1000;
+    });
+    run("zx_tick/keyboard-read", "Mcalls/s", [&]()
+    {
+        uint32_t sum = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            const uint16_t port = static_cast<uint16_t>(((~(1 << (i & 7)) & 0xFF) << 8) | 0xFE);
+            const uint64_t pins = _zx_tick(4, Z80_MAKE_PINS(Z80_IORQ | Z80_RD, port, 0), sys);
+            sum += Z80_GET_DATA(pins);
+        }
+        sink = sum;
+        return 1000;
+    });
+    sys->scanline_counter = sys->scanline_period;
+}
+
+static void bench_decode(zx_t* sys)
+{
+    const bool video_decode = sys->video_decode;
+    sys->video_decode = true;
+    const int first_line = sys->top_border_scanlines;
+    run("decode_scanline/screen", "Mlines/s", [&]()
+    {
+        for (int line = 0; line < 192; line++)
+        {
+            sys->scanline_y = first_line + line;
+            _zx_decode_scanline(sys);
+        }
+        return 192;
+    });
+    sys->scanline_y = 0;
+    sys->video_decode = video_decode;
+}
+
+static void bench_quickload(const std::vector<uint8_t>& snapshot)
+{
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    std::unique_ptr<zx_t> sys(new zx_t);
+    zx_init(sys.get(), &desc);
+    run("quickload/snapshot", "MB/s", [&]()
+    {
+        zx_quickload(sys.get(), snapshot.data(), static_cast<int>(snapshot.size()));
+        return static_cast<uint64_t>(snapshot.size());
+    });
+    zx_discard(sys.get());
+}
+
+static void bench_keyboard(zx_t* sys)
+{
+    zx_key_down(sys, 'a');
+    zx_key_down(sys, 'p');
+    zx_key_down(sys, ' ');
+
+    // the ROM scans the half rows one after another
+    run("kbd_test_lines/scan", "Mcalls/s", [&]()
+    {
+        uint32_t lines = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            lines += kbd_test_lines(&sys->kbd, static_cast<uint16_t>(1 << (i & 7)));
+        }
+        sink = lines;
+        return 1000;
+    });
+    run("kbd_test_lines/same", "Mcalls/s", [&]()
+    {
+        uint32_t lines = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            lines += kbd_test_lines(&sys->kbd, static_cast<uint16_t>(0xFF | source));
+        }
+        sink = lines;
+        return 1000;
+    });
+
+    zx_key_up(sys, 'a');
+    zx_key_up(sys, 'p');
+    zx_key_up(sys, ' ');
+}
+
+static void bench_memory(zx_t* sys)
+{
+    run("mem_rd/scattered", "Mcalls/s", [&]()
+    {
+        uint32_t sum = 0;
+        uint16_t addr = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            sum += mem_rd(&sys->mem, addr);
+            addr = static_cast<uint16_t>((addr * 75) + 74);
+        }
+        sink = sum;
+        return 1000;
+    });
+    run("mem_rd/sequential", "Mcalls/s", [&]()
+    {
+        uint32_t sum = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            sum += mem_rd(&sys->mem, static_cast<uint16_t>(0x8000 + i + source));
+        }
+        sink = sum;
+        return 1000;
+    });
+
+    // writes go to the upper 32K and put back what was there
+    run("mem_wr/scattered", "Mcalls/s", [&]()
+    {
+        uint16_t addr = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            const uint16_t ram_addr = addr | 0x8000;
+            mem_wr(&sys->mem, ram_addr, mem_rd(&sys->mem, ram_addr));
+            addr = static_cast<uint16_t>((addr * 75) + 74);
+        }
+        return 1000;
+    });
+}
+
+static void print_json(std::ostream& out)
+{
+    char line[512];
+    out << "{" << std::endl;
+    out << "  \"version\": 1," << std::endl;
+    out << "  \"samples\": " << num_samples << "," << std::endl;
+    out << "  \"benchmarks\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Benchmark& b = results[i];
+        const double med = median(b.samples);
+        double mean = 0.0;
+        for (double s : b.samples)
+        {
+            mean += s;
+        }
+        mean /= b.samples.size();
+        double variance = 0.0;
+        for (double s : b.samples)
+        {
+            variance += (s - mean) * (s - mean);
+        }
+        const double stddev = sqrt(variance / b.samples.size());
+
+        // one benchmark per line, -baseline reads them back line by line
+        snprintf(
+            line,
+            sizeof(line),
+            "    {\"name\": \"%s\", \"median_ns\": %.4f, \"min_ns\": %.4f, \"max_ns\": %.4f, \"mean_ns\": %.4f, \"stddev_pct\": %.2f, \"rate\": %.3f, \"unit\": \"%s\"",
+            b.name.c_str(),
+            med,
+            *std::min_element(b.samples.begin(), b.samples.end()),
+            *std::max_element(b.samples.begin(), b.samples.end()),
+            mean,
+            (mean > 0.0) ? (100.0 * stddev / mean) : 0.0,
+            1000.0 / med,
+            b.unit.c_str());
+        out << line;
+        if (b.instructions >= 0.0)
+        {
+            snprintf(
+                line,
+                sizeof(line),
+                ", \"instructions\": %.2f, \"ipc\": %.2f",
+                b.instructions,
+                b.ipc);
+            out << line;
+        }
+        out << "}" << ((i + 1) < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+// name to median ns of an earlier run
+static std::map<std::string, double> read_baseline(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cout << "Failed to open " << path << std::endl;
+        throw std::runtime_error("Failed to open baseline.");
+    }
+    std::map<std::string, double> baseline;
+    const std::string name_key = "\"name\": \"";
+    const std::string median_key = "\"median_ns\": ";
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const size_t name_pos = line.find(name_key);
+        const size_t median_pos = line.find(median_key);
+        if ((name_pos == std::string::npos) || (median_pos == std::string::npos))
+        {
+            continue;
+        }
+        const size_t name_begin = name_pos + name_key.size();
+        const size_t name_end = line.find('"', name_begin);
+        baseline[line.substr(name_begin, name_end - name_begin)] = atof(line.c_str() + median_pos + median_key.size());
+    }
+    return baseline;
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-bench [-filter <text>] [-samples <n>] [-sample-ms <ms>] [-baseline <bench.json>] [-threshold <percent>] [snapshot]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string snapshot_path = "files/scr.z80";
+    std::string baseline_path;
+    double threshold = 5.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-filter") && has_value)
+        {
+            filter = argv[++i];
+        }
+        else if ((arg == "-samples") && has_value)
+        {
+            num_samples = std::max(1, atoi(argv[++i]));
+        }
+        else if ((arg == "-sample-ms") && has_value)
+        {
+            sample_ms = std::max(1.0, atof(argv[++i]));
+        }
+        else if ((arg == "-baseline") && has_value)
+        {
+            baseline_path = argv[++i];
+        }
+        else if ((arg == "-threshold") && has_value)
+        {
+            threshold = atof(argv[++i]);
+        }
+        else if (arg[0] != '-')
+        {
+            snapshot_path = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    try
+    {
+        std::map<std::string, double> baseline;
+        if (!baseline_path.empty())
+        {
+            baseline = read_baseline(baseline_path);
+        }
+
+        MappedFile file(snapshot_path);
+        const std::vector<uint8_t> snapshot(file.Data(), file.Data() + file.Length());
+        std::vector<uint32_t> pixels(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+
+        // the state the component benchmarks work on
+        zx_desc_t desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.pixel_buffer = pixels.data();
+        desc.pixel_buffer_size = DISPLAY_BYTES;
+        std::unique_ptr<zx_t> sys(new zx_t);
+        zx_init(sys.get(), &desc);
+        if (!zx_quickload(
+            sys.get(),
+            snapshot.data(),
+            static_cast<int>(snapshot.size())))
+        {
+            std::cout << "Invalid snapshot: " << snapshot_path << std::endl;
+            return 1;
+        }
+        for (int frame = 0; frame < 50; frame++)
+        {
+            zx_exec(sys.get(), 20000);
+        }
+
+        bench_z80_exec();
+        bench_machine(snapshot, pixels.data());
+        bench_tick(sys.get());
+        bench_decode(sys.get());
+        bench_quickload(snapshot);
+        bench_keyboard(sys.get());
+        bench_memory(sys.get());
+        zx_discard(sys.get());
+
+        print_json(std::cout);
+
+        int regressions = 0;
+        for (const Benchmark& b : results)
+        {
+            const auto it = baseline.find(b.name);
+            if ((it == baseline.end()) || (it->second <= 0.0))
+            {
+                continue;
+            }
+            const double change = 100.0 * (median(b.samples) - it->second) / it->second;
+            if (change > threshold)
+            {
+                std::cerr << "regression: " << b.name << " " << change << "% slower" << std::endl;
+                regressions++;
+            }
+        }
+        if (regressions > 0)
+        {
+            return 2;
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        return 1;
+    }
+
+    return 0;
+}
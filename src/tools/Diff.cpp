@@ -0,0 +1,579 @@
+#include "../util/MappedFile.hpp"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Savestate.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Runs two machines side by side from the same snapshot and finds the
+// first instruction where they stop agreeing:
+//
+//     zxsc-diff [-a <variant>] [-b <variant>] [-frames <n>]
+//               [-granularity instruction|scanline|frame]
+//               [-tape <file>] <snapshot>
+//
+// A variant is a comma separated list of the ways a machine can run:
+//
+//     video, novideo          decode the video or not
+//     flash, noflash          tape blocks through the ROM trap
+//     accelerate, noaccelerate
+//                             fast-forward loader edge detection loops
+//     trapped                 a debug callback after every instruction,
+//                             so frames go through the trap path
+//     fork                    run a fork of the loaded machine, reading
+//                             its RAM copy-on-write
+//     savestate               save and load back the state after every
+//                             step
+//
+// The machines are stepped by the granularity and compared after every
+// step, the CPU registers, the machine's counters and a hash of the
+// RAM. On a mismatch both go back to the state before the step and run
+// it again a scanline and then an instruction at a time, until the
+// instruction is found. Both states, the RAM which differs and the last
+// instructions of each are printed and the exit code is 2.
+//
+// Without a mismatch the rolling hash of all compared states is
+// printed, which only matches between runs (and builds) which went
+// through the same states. A new core path is compared by adding it
+// as a variant.
+
+enum Granularity
+{
+    GRANULARITY_INSTRUCTION,
+    GRANULARITY_SCANLINE,
+    GRANULARITY_FRAME
+};
+
+static const char* granularity_names[] =
+{
+    "instruction",
+    "scanline",
+    "frame"
+};
+
+static const uint32_t frame_us = 20000;
+static const size_t trace_length = 16;
+
+struct Variant
+{
+    std::string name;
+    int video = -1;         // -1 keeps what the machine starts with
+    int flash = -1;
+    int accelerate = -1;
+    bool trapped = false;
+    bool fork = false;
+    bool savestate = false;
+};
+
+static bool parse_variant(const std::string& text, Variant& variant)
+{
+    variant = Variant();
+    variant.name = text.empty() ? "default" : text;
+    std::istringstream words(text);
+    std::string word;
+    while (std::getline(words, word, ','))
+    {
+        if (word == "video") variant.video = 1;
+        else if (word == "novideo") variant.video = 0;
+        else if (word == "flash") variant.flash = 1;
+        else if (word == "noflash") variant.flash = 0;
+        else if (word == "accelerate") variant.accelerate = 1;
+        else if (word == "noaccelerate") variant.accelerate = 0;
+        else if (word == "trapped") variant.trapped = true;
+        else if (word == "fork") variant.fork = true;
+        else if (word == "savestate") variant.savestate = true;
+        else if (!word.empty()) return false;
+    }
+    return true;
+}
+
+// an instruction as it was about to run
+struct TraceEntry
+{
+    uint64_t ticks;
+    uint16_t pc;
+    uint8_t bytes[4];
+    uint16_t af, bc, de, hl, ix, iy, sp;
+};
+
+class Machine
+{
+private:
+    zx_t base;              // the fork source, fork variants only
+    std::vector<uint32_t> pixels;
+    std::vector<uint8_t> state;
+    std::vector<uint8_t> checkpoint;
+    int checkpoint_size = 0;
+    Granularity step_granularity = GRANULARITY_FRAME;
+    int step_scanline = 0;
+
+    static bool debug_break(zx_t* sys, uint16_t pc, void* user_data)
+    {
+        (void)pc;
+        const Machine* machine = static_cast<const Machine*>(user_data);
+        switch (machine->step_granularity)
+        {
+        case GRANULARITY_INSTRUCTION: return true;
+        case GRANULARITY_SCANLINE: return sys->scanline_y != machine->step_scanline;
+        default: return false;
+        }
+    }
+
+    void Configure()
+    {
+        if (variant.video >= 0) sys.video_decode = (variant.video != 0);
+        if (variant.flash >= 0) sys.tape_flash_load = (variant.flash != 0);
+        if (variant.accelerate >= 0) sys.tape_accelerate = (variant.accelerate != 0);
+    }
+
+    void Trace()
+    {
+        TraceEntry entry;
+        z80_t* cpu = &sys.cpu;
+        entry.ticks = sys.ticks;
+        entry.pc = z80_pc(cpu);
+        for (int i = 0; i < 4; i++)
+        {
+            entry.bytes[i] = mem_rd(&sys.mem, static_cast<uint16_t>(entry.pc + i));
+        }
+        entry.af = z80_af(cpu);
+        entry.bc = z80_bc(cpu);
+        entry.de = z80_de(cpu);
+        entry.hl = z80_hl(cpu);
+        entry.ix = z80_ix(cpu);
+        entry.iy = z80_iy(cpu);
+        entry.sp = z80_sp(cpu);
+        trace[num_traced++ % trace_length] = entry;
+    }
+
+public:
+    zx_t sys;
+    Variant variant;
+    TraceEntry trace[trace_length];
+    uint64_t num_traced = 0;
+    int frames = 0;
+    int checkpoint_frames = 0;
+
+    Machine(
+        const Variant& variant,
+        const std::vector<uint8_t>& snapshot,
+        const std::vector<uint8_t>& tape) :
+        pixels(DISPLAY_WIDTH * DISPLAY_HEIGHT),
+        state(ZX_SAVESTATE_MAX_SIZE),
+        checkpoint(ZX_SAVESTATE_MAX_SIZE),
+        variant(variant)
+    {
+        zx_desc_t desc;
+        memset(&desc, 0, sizeof(desc));
+        desc.pixel_buffer = pixels.data();
+        desc.pixel_buffer_size = DISPLAY_BYTES;
+
+        zx_t* loaded = variant.fork ? &base : &sys;
+        zx_init(loaded, &desc);
+        if (!tape.empty() && !zx_insert_tape(loaded, tape.data(), static_cast<int>(tape.size())))
+        {
+            throw std::runtime_error("Invalid tape.");
+        }
+        if (!zx_quickload(loaded, snapshot.data(), static_cast<int>(snapshot.size())))
+        {
+            throw std::runtime_error("Invalid snapshot.");
+        }
+        if (variant.fork)
+        {
+            zx_init(&sys, &desc);
+            zx_fork(&sys, &base);
+            sys.pixel_buffer = pixels.data();
+        }
+        Configure();
+    }
+
+    ~Machine()
+    {
+        zx_discard(&sys);
+        if (variant.fork)
+        {
+            zx_discard(&base);
+        }
+    }
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    // runs an instruction, up to the end of the scanline or the frame
+    void Step(const Granularity granularity)
+    {
+        step_granularity = granularity;
+        step_scanline = sys.scanline_y;
+
+        const bool stepped = variant.trapped || (granularity != GRANULARITY_FRAME);
+        zx_set_debug_cb(&sys, stepped ? debug_break : nullptr, this);
+
+        if (granularity == GRANULARITY_INSTRUCTION)
+        {
+            Trace();
+        }
+
+        const bool resumed = sys.frame_pending;
+        if (resumed)
+        {
+            zx_exec_resume(&sys);
+        }
+        else
+        {
+            zx_exec(&sys, frame_us);
+        }
+        if (!sys.frame_pending)
+        {
+            frames++;
+        }
+
+        if (variant.savestate)
+        {
+            const int size = zx_save_state(&sys, state.data(), static_cast<int>(state.size()));
+            if ((size <= 0) || !zx_load_state(&sys, state.data(), size))
+            {
+                throw std::runtime_error("Savestate round trip failed.");
+            }
+            Configure();
+        }
+    }
+
+    void SaveCheckpoint()
+    {
+        checkpoint_size = zx_save_state(&sys, checkpoint.data(), static_cast<int>(checkpoint.size()));
+        checkpoint_frames = frames;
+    }
+
+    void LoadCheckpoint()
+    {
+        if ((checkpoint_size <= 0) || !zx_load_state(&sys, checkpoint.data(), checkpoint_size))
+        {
+            throw std::runtime_error("Failed to go back to the checkpoint.");
+        }
+        Configure();
+        frames = checkpoint_frames;
+    }
+
+    // NULL for banks the machine doesn't have
+    const uint8_t* RamPage(int page) const
+    {
+        return sys.ram[page / ZX_RAM_BANK_PAGES] ? _zx_ram_page(&sys, page) : nullptr;
+    }
+
+    uint64_t MemoryHash() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (int page = 0; page < ZX_RAM_PAGES; page++)
+        {
+            const uint8_t* ptr = RamPage(page);
+            if (!ptr)
+            {
+                continue;
+            }
+            for (int i = 0; i < MEM_PAGE_SIZE; i += 8)
+            {
+                uint64_t word;
+                memcpy(&word, ptr + i, sizeof(word));
+                hash = (hash ^ word) * 1099511628211ull;
+            }
+        }
+        return hash;
+    }
+};
+
+// what's compared after every step, in the order it's printed
+static std::vector<std::pair<const char*, uint64_t>> compared_state(Machine& machine)
+{
+    zx_t* sys = &machine.sys;
+    z80_t* cpu = &sys->cpu;
+    return
+    {
+        { "AF", z80_af(cpu) }, { "BC", z80_bc(cpu) }, { "DE", z80_de(cpu) }, { "HL", z80_hl(cpu) },
+        { "AF'", z80_af_(cpu) }, { "BC'", z80_bc_(cpu) }, { "DE'", z80_de_(cpu) }, { "HL'", z80_hl_(cpu) },
+        { "IX", z80_ix(cpu) }, { "IY", z80_iy(cpu) }, { "SP", z80_sp(cpu) }, { "PC", z80_pc(cpu) },
+        { "WZ", z80_wz(cpu) }, { "IR", z80_ir(cpu) }, { "IM", z80_im(cpu) },
+        { "IFF1", z80_iff1(cpu) }, { "IFF2", z80_iff2(cpu) },
+        { "ticks", sys->ticks },
+        { "scanline", static_cast<uint64_t>(sys->scanline_y) },
+        { "scanline_counter", static_cast<uint64_t>(sys->scanline_counter) },
+        { "fe_out", sys->last_fe_out },
+        { "mem_config", sys->last_mem_config },
+        { "frame_pending", sys->frame_pending },
+        { "memory", machine.MemoryHash() }
+    };
+}
+
+static uint64_t rolling_hash(uint64_t hash, const std::vector<std::pair<const char*, uint64_t>>& state)
+{
+    for (const auto& value : state)
+    {
+        hash = (hash ^ value.second) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool same_state(
+    const std::vector<std::pair<const char*, uint64_t>>& a,
+    const std::vector<std::pair<const char*, uint64_t>>& b)
+{
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].second != b[i].second)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_state(Machine& a, Machine& b)
+{
+    const auto state_a = compared_state(a);
+    const auto state_b = compared_state(b);
+    printf("%-18s %-18s %-18s\n", "", a.variant.name.c_str(), b.variant.name.c_str());
+    for (size_t i = 0; i < state_a.size(); i++)
+    {
+        printf(
+            "%-18s %-18llx %-18llx%s\n",
+            state_a[i].first,
+            static_cast<unsigned long long>(state_a[i].second),
+            static_cast<unsigned long long>(state_b[i].second),
+            (state_a[i].second != state_b[i].second) ? "  <<" : "");
+    }
+
+    // RAM by bank and offset, the first few bytes which differ
+    int num_printed = 0;
+    for (int page = 0; (page < ZX_RAM_PAGES) && (num_printed < 16); page++)
+    {
+        const uint8_t* page_a = a.RamPage(page);
+        const uint8_t* page_b = b.RamPage(page);
+        if (!page_a || !page_b)
+        {
+            if (page_a != page_b)
+            {
+                printf("RAM page %d only in one machine\n", page);
+                num_printed++;
+            }
+            continue;
+        }
+        for (int i = 0; (i < MEM_PAGE_SIZE) && (num_printed < 16); i++)
+        {
+            if (page_a[i] != page_b[i])
+            {
+                const int offset = (page * MEM_PAGE_SIZE) + i;
+                printf(
+                    "RAM bank %d %04X: %02X %02X\n",
+                    offset / ZX_RAM_BANK_SIZE,
+                    offset % ZX_RAM_BANK_SIZE,
+                    page_a[i],
+                    page_b[i]);
+                num_printed++;
+            }
+        }
+    }
+}
+
+static void print_trace(const Machine& machine)
+{
+    std::cout << "last instructions of " << machine.variant.name << ":" << std::endl;
+    const uint64_t first = (machine.num_traced > trace_length) ? (machine.num_traced - trace_length) : 0;
+    for (uint64_t n = first; n < machine.num_traced; n++)
+    {
+        const TraceEntry& e = machine.trace[n % trace_length];
+        printf(
+            "  %10llu  %04X  %02X %02X %02X %02X  AF=%04X BC=%04X DE=%04X HL=%04X IX=%04X IY=%04X SP=%04X\n",
+            static_cast<unsigned long long>(e.ticks),
+            e.pc,
+            e.bytes[0], e.bytes[1], e.bytes[2], e.bytes[3],
+            e.af, e.bc, e.de, e.hl, e.ix, e.iy, e.sp);
+    }
+}
+
+// goes back to before the step which didn't match and runs it again a
+// finer step at a time, returns true once the instruction is found
+static bool narrow_down(Machine& a, Machine& b, Granularity granularity, uint64_t end_ticks)
+{
+    a.LoadCheckpoint();
+    b.LoadCheckpoint();
+    const Granularity finer = static_cast<Granularity>(granularity - 1);
+    while (a.sys.ticks < end_ticks)
+    {
+        if (finer != GRANULARITY_INSTRUCTION)
+        {
+            a.SaveCheckpoint();
+            b.SaveCheckpoint();
+        }
+        a.Step(finer);
+        b.Step(finer);
+        if (same_state(compared_state(a), compared_state(b)))
+        {
+            continue;
+        }
+        if (finer == GRANULARITY_INSTRUCTION)
+        {
+            return true;
+        }
+        return narrow_down(a, b, finer, a.sys.ticks);
+    }
+    return false;
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-diff [-a <variant>] [-b <variant>] [-frames <n>] [-granularity instruction|scanline|frame] [-tape <file>] <snapshot>" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string path;
+    std::string tape_path;
+    std::string variant_a;
+    std::string variant_b = "trapped";
+    int num_frames = 500;
+    Granularity granularity = GRANULARITY_FRAME;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-a") && has_value)
+        {
+            variant_a = argv[++i];
+        }
+        else if ((arg == "-b") && has_value)
+        {
+            variant_b = argv[++i];
+        }
+        else if ((arg == "-frames") && has_value)
+        {
+            num_frames = atoi(argv[++i]);
+        }
+        else if ((arg == "-granularity") && has_value)
+        {
+            const std::string name = argv[++i];
+            if (name == "instruction") granularity = GRANULARITY_INSTRUCTION;
+            else if (name == "scanline") granularity = GRANULARITY_SCANLINE;
+            else if (name == "frame") granularity = GRANULARITY_FRAME;
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if ((arg == "-tape") && has_value)
+        {
+            tape_path = argv[++i];
+        }
+        else if (arg[0] != '-')
+        {
+            path = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    Variant variants[2];
+    if (path.empty() ||
+        !parse_variant(variant_a, variants[0]) ||
+        !parse_variant(variant_b, variants[1]))
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        MappedFile file(path);
+        const std::vector<uint8_t> snapshot(file.Data(), file.Data() + file.Length());
+        std::vector<uint8_t> tape;
+        if (!tape_path.empty())
+        {
+            MappedFile tape_file(tape_path);
+            tape.assign(tape_file.Data(), tape_file.Data() + tape_file.Length());
+        }
+
+        std::unique_ptr<Machine> a(new Machine(variants[0], snapshot, tape));
+        std::unique_ptr<Machine> b(new Machine(variants[1], snapshot, tape));
+
+        uint64_t hash = 14695981039346656037ull;
+        uint64_t steps = 0;
+        while (a->frames < num_frames)
+        {
+            a->SaveCheckpoint();
+            b->SaveCheckpoint();
+            a->Step(granularity);
+            b->Step(granularity);
+            steps++;
+
+            const auto state_a = compared_state(*a);
+            const auto state_b = compared_state(*b);
+            if (same_state(state_a, state_b))
+            {
+                hash = rolling_hash(hash, state_a);
+                continue;
+            }
+
+            printf(
+                "%s and %s differ after %s step %llu, in frame %d\n",
+                a->variant.name.c_str(),
+                b->variant.name.c_str(),
+                granularity_names[granularity],
+                static_cast<unsigned long long>(steps),
+                a->checkpoint_frames);
+
+            if ((granularity != GRANULARITY_INSTRUCTION) &&
+                !narrow_down(*a, *b, granularity, a->sys.ticks))
+            {
+                std::cout << "The difference didn't come back when stepping again, states at the end of the step:" << std::endl;
+                a->LoadCheckpoint();
+                b->LoadCheckpoint();
+                a->Step(granularity);
+                b->Step(granularity);
+                print_state(*a, *b);
+                return 2;
+            }
+
+            const TraceEntry& last = a->trace[(a->num_traced - 1) % trace_length];
+            printf(
+                "First difference after the instruction at %04X, T-state %llu of the run\n",
+                last.pc,
+                static_cast<unsigned long long>(last.ticks));
+            print_state(*a, *b);
+            print_trace(*a);
+            print_trace(*b);
+            return 2;
+        }
+
+        printf(
+            "%s and %s agree over %d frames, %llu %s steps, hash %016llx\n",
+            a->variant.name.c_str(),
+            b->variant.name.c_str(),
+            a->frames,
+            static_cast<unsigned long long>(steps),
+            granularity_names[granularity],
+            static_cast<unsigned long long>(hash));
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
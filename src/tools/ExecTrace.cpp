@@ -0,0 +1,804 @@
+#include "../util/MappedFile.hpp"
+
+// the recorder's tick hook has to be set before Speccy.h comes in
+extern "C"
+{
+#include "../speccy/ExecTrace.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Movie.h"
+}
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records execution traces and reads them back (speccy/ExecTrace.h):
+//
+//     zxsc-etrace record [-frames <n>] [-seek <frame>] [-tape <file>]
+//                        [-chunk <KB>] [-ring <MB>] -o <trace.zxet>
+//                        <movie.zxm | snapshot>
+//
+//     zxsc-etrace show [-from <n>] [-count <n>] [-pc <range>]
+//                      [-write <range>] [-out <range>] [-reg <name>=<value>]
+//                      [-int] [-first] [-stats] <trace.zxet>
+//
+// Recording streams the chunks to the file on a writer thread while
+// the machine runs. With -ring only the latest chunks up to that many
+// megabytes are kept in memory and written at the end, for runs too
+// long to keep whole where the interesting part is the end.
+//
+// show prints one line per instruction: its number, the T-state it
+// started at, the PC, the opcode bytes, then the registers it changed,
+// the bytes it wrote, its port writes and whether an interrupt was
+// taken after it. The registers come from running the instructions
+// again while decoding, from the CPU state the recorder wrote at the
+// last frame end on, instructions the replay couldn't follow have none.
+// The filters pick instructions which:
+//
+//     -pc 8000-80FF       ran in the range
+//     -write 5800-5AFF    wrote to the range
+//     -out FE             wrote to a port in the range (all 16 bits)
+//     -reg HL=4000        set a register pair, or a byte register
+//                         like A or L, to the value
+//     -int                were followed by an interrupt
+//
+// Filters combine, an instruction has to pass all of them. -first stops
+// at the first match, which makes show a search. Decoding starts at the
+// chunk holding -from, or the last one before it with a CPU state when
+// replaying, and -stats without -reg doesn't replay.
+// Numbers are hex, with or without a 0x or $ prefix, except the counts.
+
+static const uint32_t frame_us = 20000;
+
+// hands full chunks to a thread which writes them out, the recorder
+// only waits when all buffers are queued
+class ChunkWriter
+{
+private:
+    FILE* file = nullptr;
+    std::vector<std::vector<uint8_t>> buffers;
+    std::vector<uint8_t*> free_buffers;
+    std::deque<std::pair<uint8_t*, int>> queue;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+    bool finished = false;
+    bool failed = false;
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            changed.wait(lock, [this]() { return finished || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            const std::pair<uint8_t*, int> chunk = queue.front();
+            queue.pop_front();
+
+            lock.unlock();
+            const bool written = fwrite(chunk.first, 1, chunk.second, file) == static_cast<size_t>(chunk.second);
+            lock.lock();
+
+            failed = failed || !written;
+            free_buffers.push_back(chunk.first);
+            changed.notify_all();
+        }
+    }
+
+public:
+    ChunkWriter(
+        const std::string& path,
+        const int chunk_size,
+        const int num_buffers) :
+        buffers(num_buffers, std::vector<uint8_t>(chunk_size))
+    {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            std::cout << "Failed to open file: " << path << std::endl;
+            throw std::runtime_error("Failed to open file.");
+        }
+        for (std::vector<uint8_t>& buffer : buffers)
+        {
+            free_buffers.push_back(buffer.data());
+        }
+        thread = std::thread([this]() { Run(); });
+    }
+
+    ~ChunkWriter()
+    {
+        Finish();
+    }
+
+    uint8_t* Buffer()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint8_t* buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    uint8_t* Flush(
+        uint8_t* chunk,
+        const int num_bytes)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(std::make_pair(chunk, num_bytes));
+        changed.notify_all();
+        changed.wait(lock, [this]() { return !free_buffers.empty(); });
+        uint8_t* buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    // false if anything failed to write
+    bool Finish()
+    {
+        if (thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished = true;
+                changed.notify_all();
+            }
+            thread.join();
+            failed = failed || (fclose(file) != 0);
+            file = nullptr;
+        }
+        return !failed;
+    }
+
+    static uint8_t* FlushCallback(void* user_data, uint8_t* chunk, int num_bytes)
+    {
+        return static_cast<ChunkWriter*>(user_data)->Flush(chunk, num_bytes);
+    }
+};
+
+// keeps the latest chunks within a budget, the oldest go first
+class ChunkRing
+{
+private:
+    std::vector<uint8_t> buffer;
+    std::deque<std::vector<uint8_t>> chunks;
+    size_t budget = 0;
+    size_t size = 0;
+
+public:
+    ChunkRing(
+        const int chunk_size,
+        const size_t budget) :
+        buffer(chunk_size),
+        budget(budget)
+    {
+    }
+
+    uint8_t* Buffer()
+    {
+        return buffer.data();
+    }
+
+    uint8_t* Flush(
+        uint8_t* chunk,
+        const int num_bytes)
+    {
+        std::vector<uint8_t> kept;
+        while (!chunks.empty() && ((size + num_bytes) > budget))
+        {
+            size -= chunks.front().size();
+            kept.swap(chunks.front());
+            chunks.pop_front();
+        }
+        kept.assign(chunk, chunk + num_bytes);
+        size += kept.size();
+        chunks.push_back(std::move(kept));
+        return buffer.data();
+    }
+
+    void Write(
+        const std::string& path) const
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file)
+        {
+            std::cout << "Failed to open file: " << path << std::endl;
+            throw std::runtime_error("Failed to open file.");
+        }
+        bool written = true;
+        for (const std::vector<uint8_t>& chunk : chunks)
+        {
+            written = written && (fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size());
+        }
+        written = (fclose(file) == 0) && written;
+        if (!written)
+        {
+            std::cout << "Failed to write file: " << path << std::endl;
+            throw std::runtime_error("Failed to write file.");
+        }
+    }
+
+    static uint8_t* FlushCallback(void* user_data, uint8_t* chunk, int num_bytes)
+    {
+        return static_cast<ChunkRing*>(user_data)->Flush(chunk, num_bytes);
+    }
+};
+
+struct Range
+{
+    bool active = false;
+    uint32_t first = 0;
+    uint32_t last = 0;
+
+    bool Contains(const uint32_t value) const
+    {
+        return (value >= first) && (value <= last);
+    }
+};
+
+static bool parse_hex(
+    std::string text,
+    uint32_t& value)
+{
+    if ((text.size() > 2) && (text[0] == '0') && ((text[1] == 'x') || (text[1] == 'X')))
+    {
+        text = text.substr(2);
+    }
+    else if (!text.empty() && (text[0] == '$'))
+    {
+        text = text.substr(1);
+    }
+    if (text.empty() || (text.size() > 4))
+    {
+        return false;
+    }
+    for (const char c : text)
+    {
+        if (!isxdigit(static_cast<unsigned char>(c)))
+        {
+            return false;
+        }
+    }
+    value = static_cast<uint32_t>(strtoul(text.c_str(), nullptr, 16));
+    return true;
+}
+
+// one address or first-last
+static bool parse_range(
+    const std::string& text,
+    Range& range)
+{
+    const size_t dash = text.find('-');
+    range.active = true;
+    if (dash == std::string::npos)
+    {
+        return parse_hex(text, range.first) && parse_hex(text, range.last);
+    }
+    return
+        parse_hex(text.substr(0, dash), range.first) &&
+        parse_hex(text.substr(dash + 1), range.last) &&
+        (range.first <= range.last);
+}
+
+struct RegFilter
+{
+    bool active = false;
+    int reg = 0;
+    int shift = 0;                  // 8 for the high byte
+    uint32_t mask = 0xFFFF;
+    uint32_t value = 0;
+};
+
+// a pair from zx_etrace_reg_names, or one of the byte registers
+static bool parse_reg(
+    const std::string& text,
+    RegFilter& filter)
+{
+    static const char* byte_names = "AFBCDEHL";
+
+    const size_t equals = text.find('=');
+    if (equals == std::string::npos)
+    {
+        return false;
+    }
+    std::string name = text.substr(0, equals);
+    for (char& c : name)
+    {
+        c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+    }
+
+    filter.active = true;
+    bool found = false;
+    for (int reg = 0; reg < ZX_ETRACE_NUM_REGS; reg++)
+    {
+        if (name == zx_etrace_reg_names[reg])
+        {
+            filter.reg = reg;
+            found = true;
+        }
+    }
+    if (!found && (name.size() == 1))
+    {
+        const char* pos = strchr(byte_names, name[0]);
+        if (pos)
+        {
+            const int index = static_cast<int>(pos - byte_names);
+            filter.reg = ZX_ETRACE_AF + (index / 2);
+            filter.shift = (index % 2) ? 0 : 8;
+            filter.mask = 0xFF;
+            found = true;
+        }
+    }
+    return found &&
+        parse_hex(text.substr(equals + 1), filter.value) &&
+        (filter.value <= filter.mask);
+}
+
+struct Filters
+{
+    Range pc;
+    Range write;
+    Range out;
+    RegFilter reg;
+    bool interrupt = false;
+
+    bool Match(const zx_etrace_rec_t& rec) const
+    {
+        if (pc.active && !pc.Contains(rec.pc))
+        {
+            return false;
+        }
+        if (interrupt && !rec.interrupt)
+        {
+            return false;
+        }
+        if (reg.active &&
+            (!rec.has_regs ||
+            !(rec.changed & (1 << reg.reg)) ||
+            (((rec.regs[reg.reg] >> reg.shift) & reg.mask) != reg.value)))
+        {
+            return false;
+        }
+        if (write.active)
+        {
+            bool found = false;
+            for (int i = 0; i < rec.num_writes; i++)
+            {
+                found = found || write.Contains(rec.write_addr[i]);
+            }
+            if (!found)
+            {
+                return false;
+            }
+        }
+        if (out.active)
+        {
+            bool found = false;
+            for (int i = 0; i < rec.num_outs; i++)
+            {
+                found = found || out.Contains(rec.out_port[i]);
+            }
+            if (!found)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static void print_record(
+    const zx_etrace_rec_t& rec)
+{
+    char line[512];
+    int len = snprintf(
+        line,
+        sizeof(line),
+        "%10llu %12llu  %04X ",
+        static_cast<unsigned long long>(rec.index),
+        static_cast<unsigned long long>(rec.ticks),
+        rec.pc);
+
+    for (int i = 0; i < ZX_ETRACE_MAX_OPS; i++)
+    {
+        len += (i < rec.num_ops) ?
+            snprintf(line + len, sizeof(line) - len, " %02X", rec.ops[i]) :
+            snprintf(line + len, sizeof(line) - len, "   ");
+    }
+    len += snprintf(line + len, sizeof(line) - len, " %3u ", rec.num_ticks);
+
+    for (int reg = 0; reg < ZX_ETRACE_NUM_REGS; reg++)
+    {
+        if (rec.changed & (1 << reg))
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%04X",
+                zx_etrace_reg_names[reg],
+                rec.regs[reg]);
+        }
+    }
+    for (int i = 0; i < rec.num_writes; i++)
+    {
+        len += snprintf(line + len, sizeof(line) - len, " (%04X)=%02X",
+            rec.write_addr[i],
+            rec.write_data[i]);
+    }
+    for (int i = 0; i < rec.num_outs; i++)
+    {
+        len += snprintf(line + len, sizeof(line) - len, " OUT(%04X)=%02X",
+            rec.out_port[i],
+            rec.out_data[i]);
+    }
+    if (rec.interrupt)
+    {
+        snprintf(line + len, sizeof(line) - len, " INT");
+    }
+    puts(line);
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-etrace record [-frames <n>] [-seek <frame>] [-tape <file>] [-chunk <KB>] [-ring <MB>] -o <trace.zxet> <movie.zxm | snapshot>" << std::endl;
+    std::cout << "       zxsc-etrace show [-from <n>] [-count <n>] [-pc <range>] [-write <range>] [-out <range>] [-reg <name>=<value>] [-int] [-first] [-stats] <trace.zxet>" << std::endl;
+}
+
+static int record(
+    int argc,
+    char* argv[])
+{
+    std::string tape_path;
+    std::string out_path;
+    std::string path;
+    int seek_frame = 0;
+    int num_frames = -1;
+    int chunk_kb = 1024;
+    int ring_mb = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-tape") && has_value)
+        {
+            tape_path = argv[++i];
+        }
+        else if ((arg == "-seek") && has_value)
+        {
+            seek_frame = atoi(argv[++i]);
+        }
+        else if ((arg == "-frames") && has_value)
+        {
+            num_frames = atoi(argv[++i]);
+        }
+        else if ((arg == "-chunk") && has_value)
+        {
+            chunk_kb = atoi(argv[++i]);
+        }
+        else if ((arg == "-ring") && has_value)
+        {
+            ring_mb = atoi(argv[++i]);
+        }
+        else if ((arg == "-o") && has_value)
+        {
+            out_path = argv[++i];
+        }
+        else if (path.empty() && (arg[0] != '-'))
+        {
+            path = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty() || out_path.empty() || (chunk_kb < 1) || (ring_mb < 0))
+    {
+        usage();
+        return 1;
+    }
+
+    std::unique_ptr<MappedFile> tape_file;
+    if (!tape_path.empty())
+    {
+        tape_file.reset(new MappedFile(tape_path));
+    }
+
+    MappedFile file(path);
+    const uint8_t* data = file.Data();
+    const int size = static_cast<int>(file.Length());
+    const bool is_movie = (size >= 4) && (0 == memcmp(data, "ZXMV", 4));
+
+    static zx_t zx_sys;
+    static zx_movie_t zx_movie;
+    zx_desc_t zx_desc;
+    memset(&zx_desc, 0, sizeof(zx_desc));
+    zx_init(&zx_sys, &zx_desc);
+
+    if (tape_file && !zx_insert_tape(
+        &zx_sys,
+        tape_file->Data(),
+        static_cast<int>(tape_file->Length())))
+    {
+        std::cout << "Invalid tape: " << tape_path << std::endl;
+        return 1;
+    }
+    if (is_movie)
+    {
+        if (!zx_movie_play(&zx_movie, &zx_sys, data, size) ||
+            !zx_movie_seek(&zx_movie, &zx_sys, seek_frame))
+        {
+            std::cout << "Invalid movie: " << path << std::endl;
+            return 1;
+        }
+        if (num_frames < 0)
+        {
+            num_frames = zx_movie.num_frames - zx_movie.frame;
+        }
+    }
+    else if (!zx_quickload(&zx_sys, data, size))
+    {
+        std::cout << "Invalid snapshot: " << path << std::endl;
+        return 1;
+    }
+    else if (num_frames < 0)
+    {
+        num_frames = 50;
+    }
+
+    const int chunk_size = chunk_kb << 10;
+    std::unique_ptr<ChunkWriter> writer;
+    std::unique_ptr<ChunkRing> ring;
+    std::unique_ptr<zx_etrace_t> trace(new zx_etrace_t);
+
+    if (ring_mb > 0)
+    {
+        ring.reset(new ChunkRing(chunk_size, static_cast<size_t>(ring_mb) << 20));
+        zx_etrace_init(
+            trace.get(),
+            ring->Buffer(),
+            chunk_size,
+            ChunkRing::FlushCallback,
+            ring.get());
+    }
+    else
+    {
+        writer.reset(new ChunkWriter(out_path, chunk_size, 4));
+        zx_etrace_init(
+            trace.get(),
+            writer->Buffer(),
+            chunk_size,
+            ChunkWriter::FlushCallback,
+            writer.get());
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    zx_etrace_start(trace.get(), &zx_sys);
+
+    int frames_run = 0;
+    for (; frames_run < num_frames; frames_run++)
+    {
+        if (is_movie)
+        {
+            if (!zx_movie_play_frame(&zx_movie, &zx_sys))
+            {
+                break;
+            }
+        }
+        else
+        {
+            zx_exec(&zx_sys, frame_us);
+        }
+        zx_etrace_end_frame(trace.get(), &zx_sys);
+    }
+
+    zx_etrace_stop(trace.get(), &zx_sys);
+    if (writer && !writer->Finish())
+    {
+        std::cout << "Failed to write file: " << out_path << std::endl;
+        return 1;
+    }
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    if (ring)
+    {
+        ring->Write(out_path);
+    }
+
+    printf(
+        "%d frames, %llu instructions in %.3f s (%.1f M/s), %llu chunks, %.2f bytes per instruction\n",
+        frames_run,
+        static_cast<unsigned long long>(trace->instructions),
+        seconds,
+        (seconds > 0.0) ? (trace->instructions / seconds / 1e6) : 0.0,
+        static_cast<unsigned long long>(trace->chunks),
+        trace->instructions ? (static_cast<double>(trace->bytes) / trace->instructions) : 0.0);
+    return 0;
+}
+
+static int show(
+    int argc,
+    char* argv[])
+{
+    std::string path;
+    Filters filters;
+    uint64_t from = 0;
+    uint64_t count = UINT64_MAX;
+    bool first = false;
+    bool stats = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        bool valid = true;
+        if ((arg == "-from") && has_value)
+        {
+            from = strtoull(argv[++i], nullptr, 10);
+        }
+        else if ((arg == "-count") && has_value)
+        {
+            count = strtoull(argv[++i], nullptr, 10);
+        }
+        else if ((arg == "-pc") && has_value)
+        {
+            valid = parse_range(argv[++i], filters.pc);
+        }
+        else if ((arg == "-write") && has_value)
+        {
+            valid = parse_range(argv[++i], filters.write);
+        }
+        else if ((arg == "-out") && has_value)
+        {
+            valid = parse_range(argv[++i], filters.out);
+        }
+        else if ((arg == "-reg") && has_value)
+        {
+            valid = parse_reg(argv[++i], filters.reg);
+        }
+        else if (arg == "-int")
+        {
+            filters.interrupt = true;
+        }
+        else if (arg == "-first")
+        {
+            first = true;
+        }
+        else if (arg == "-stats")
+        {
+            stats = true;
+        }
+        else if (path.empty() && (arg[0] != '-'))
+        {
+            path = arg;
+        }
+        else
+        {
+            valid = false;
+        }
+        if (!valid)
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    MappedFile file(path);
+    std::unique_ptr<zx_etrace_reader_t> reader(new zx_etrace_reader_t);
+    zx_etrace_reader_init(
+        reader.get(),
+        file.Data(),
+        static_cast<int>(file.Length()),
+        !stats || filters.reg.active);
+    zx_etrace_seek(reader.get(), from);
+
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t decoded = 0;
+    uint64_t with_regs = 0;
+    uint64_t matched = 0;
+    uint64_t first_index = 0;
+    uint64_t first_ticks = 0;
+    uint64_t end_ticks = 0;
+    int result = 0;
+
+    zx_etrace_rec_t rec;
+    while (matched < count)
+    {
+        result = zx_etrace_next(reader.get(), &rec);
+        if (result <= 0)
+        {
+            break;
+        }
+        if (decoded++ == 0)
+        {
+            first_index = rec.index;
+            first_ticks = rec.ticks;
+        }
+        with_regs += rec.has_regs ? 1 : 0;
+        end_ticks = rec.ticks + rec.num_ticks;
+        if ((rec.index < from) || !filters.Match(rec))
+        {
+            continue;
+        }
+        matched++;
+        if (!stats)
+        {
+            print_record(rec);
+        }
+        if (first)
+        {
+            break;
+        }
+    }
+    const bool damaged = result < 0;
+
+    const double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    if (stats)
+    {
+        printf(
+            "%llu chunks, %llu bytes, %llu instructions decoded from %llu in %.3f s (%.1f M/s), %llu with registers, %llu matched\n",
+            static_cast<unsigned long long>(reader->chunks),
+            static_cast<unsigned long long>(file.Length()),
+            static_cast<unsigned long long>(decoded),
+            static_cast<unsigned long long>(first_index),
+            seconds,
+            (seconds > 0.0) ? (decoded / seconds / 1e6) : 0.0,
+            static_cast<unsigned long long>(with_regs),
+            static_cast<unsigned long long>(matched));
+        printf(
+            "T-states %llu to %llu\n",
+            static_cast<unsigned long long>(first_ticks),
+            static_cast<unsigned long long>(end_ticks));
+    }
+
+    if (damaged && !(first && matched) && (matched < count))
+    {
+        std::cout << "The trace is damaged after instruction " << (first_index + decoded) << std::endl;
+        return 1;
+    }
+    return (first && !matched) ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const std::string command = (argc > 1) ? argv[1] : "";
+
+    try
+    {
+        if (command == "record")
+        {
+            return record(argc, argv);
+        }
+        if (command == "show")
+        {
+            return show(argc, argv);
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        return 1;
+    }
+
+    usage();
+    return 1;
+}
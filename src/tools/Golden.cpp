@@ -0,0 +1,725 @@
+#include "../util/MappedFile.hpp"
+#include "../util/ThreadPool.hpp"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Movie.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define GOLDEN_SSE2
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Runs every snapshot and movie in a directory and checks selected
+// frames against goldens stored by an earlier run:
+//
+//     zxsc-golden [-frames <n>] [-every <n>] [-pixels] [-update]
+//                 [-goldens <dir>] [-diffs <dir>] [-threads <n>] <dir>
+//
+// Titles (.z80, .sna, .szx and .zxm movies) run for n frames, spread
+// over all cores one title per task, movies for at most n of their
+// frames. Every nth frame and the last one are hashed: the screen memory
+// with the border color of every line, or with -pixels the whole decoded
+// frame. Video is only decoded for the frames which are hashed.
+//
+// Goldens go to <dir>/goldens, one file per title holding the hash and
+// the hashed data of each frame, written with -update. A frame which no
+// longer matches writes a picture of it to the diffs directory
+// (golden-diffs by default): golden, actual, and the pixels which
+// differ in red on a dimmed copy of the actual frame. A hashed frame
+// without a golden, or a movie which ends early, fails the title too.
+//
+// The summary on stdout is JSON, one title per line with its status
+// and emulation speed. The exit code is 2 if a title failed or didn't
+// run.
+
+#define GOLDEN_MAGIC (0x4447585A)       // 'ZXGD'
+#define GOLDEN_VERSION (1)
+
+#define SCREEN_BYTES (6912)
+
+// what a hashed frame holds
+enum FrameMode
+{
+    FRAME_SCREEN,   // screen memory, then the border's palette index per line
+    FRAME_PIXELS    // palette index per pixel
+};
+
+static const char* status_names[] =
+{
+    "pass",
+    "fail",
+    "new",
+    "updated",
+    "error"
+};
+
+enum Status
+{
+    STATUS_PASS,
+    STATUS_FAIL,
+    STATUS_NEW,
+    STATUS_UPDATED,
+    STATUS_ERROR
+};
+
+struct Frame
+{
+    uint32_t frame;
+    uint64_t hash;
+    std::vector<uint8_t> data;
+};
+
+struct Title
+{
+    std::string name;
+    std::string path;
+
+    Status status = STATUS_ERROR;
+    std::string message;
+    int frames_run = 0;
+    double seconds = 0.0;
+    uint64_t ticks = 0;
+    uint32_t frame_us = 20000;
+    std::vector<uint32_t> failed_frames;
+};
+
+struct Options
+{
+    int num_frames = 500;
+    int every = 50;
+    FrameMode mode = FRAME_SCREEN;
+    bool update = false;
+    std::string golden_dir;
+    std::string diff_dir = "golden-diffs";
+};
+
+static std::vector<std::string> list_directory(const std::string& dir)
+{
+    std::vector<std::string> names;
+#if defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        std::cout << "Failed to open directory: " << dir << std::endl;
+        throw std::runtime_error("Failed to open directory.");
+    }
+    do
+    {
+        if (0 == (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            names.push_back(data.cFileName);
+        }
+    }
+    while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR* handle = opendir(dir.c_str());
+    if (!handle)
+    {
+        std::cout << "Failed to open directory: " << dir << std::endl;
+        throw std::runtime_error("Failed to open directory.");
+    }
+    while (const dirent* entry = readdir(handle))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(handle);
+#endif
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void make_directory(const std::string& dir)
+{
+#if defined(_WIN32)
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+}
+
+static bool is_title(const std::string& name)
+{
+    const size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+    {
+        return false;
+    }
+    std::string ext = name.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return (ext == "z80") || (ext == "sna") || (ext == "szx") || (ext == "zxm");
+}
+
+static uint64_t hash_bytes(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// palette index 0-15 of a decoded pixel, bright ones have full channels
+static uint8_t palette_index(uint32_t rgba)
+{
+    const uint32_t r = rgba & 0xFF;
+    const uint32_t g = (rgba >> 8) & 0xFF;
+    const uint32_t b = (rgba >> 16) & 0xFF;
+    const uint8_t color = static_cast<uint8_t>((b ? 1 : 0) | (r ? 2 : 0) | (g ? 4 : 0));
+    const bool bright = (r == 0xFF) || (g == 0xFF) || (b == 0xFF);
+    return static_cast<uint8_t>(color | (bright ? 8 : 0));
+}
+
+static void frame_data(zx_t* sys, FrameMode mode, std::vector<uint8_t>& data)
+{
+    if (mode == FRAME_PIXELS)
+    {
+        data.resize(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+        for (size_t i = 0; i < data.size(); i++)
+        {
+            data[i] = palette_index(sys->pixel_buffer[i]);
+        }
+        return;
+    }
+
+    data.resize(SCREEN_BYTES + DISPLAY_HEIGHT);
+    const int bank_page = static_cast<int>(sys->display_ram_bank) * ZX_RAM_BANK_PAGES;
+    for (int i = 0; i < SCREEN_BYTES; i += MEM_PAGE_SIZE)
+    {
+        const int size = std::min(MEM_PAGE_SIZE, SCREEN_BYTES - i);
+        memcpy(&data[i], _zx_ram_page(sys, bank_page + (i >> MEM_PAGE_SHIFT)), size);
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        data[SCREEN_BYTES + y] = palette_index(sys->pixel_buffer[y * DISPLAY_WIDTH]);
+    }
+}
+
+// a hashed frame as palette indices, flashing attributes not inverted
+static void frame_image(const std::vector<uint8_t>& data, FrameMode mode, uint8_t* image)
+{
+    if (mode == FRAME_PIXELS)
+    {
+        memcpy(image, data.data(), DISPLAY_WIDTH * DISPLAY_HEIGHT);
+        return;
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        uint8_t* dst = &image[y * DISPLAY_WIDTH];
+        memset(dst, data[SCREEN_BYTES + y], DISPLAY_WIDTH);
+        if ((y < 32) || (y >= 224))
+        {
+            continue;
+        }
+        const int yy = y - 32;
+        const int y_offset = ((yy & 0xC0) << 5) | ((yy & 0x07) << 8) | ((yy & 0x38) << 2);
+        const int clr_line = 0x1800 + ((yy & ~0x7) << 2);
+        for (int x = 0; x < 32; x++)
+        {
+            const uint8_t pix = data[y_offset + x];
+            const uint8_t clr = data[clr_line + x];
+            const uint8_t bright = (clr & 0x40) ? 8 : 0;
+            const uint8_t fg = (clr & 7) | bright;
+            const uint8_t bg = ((clr >> 3) & 7) | bright;
+            for (int px = 0; px < 8; px++)
+            {
+                dst[32 + (x * 8) + px] = (pix & (0x80 >> px)) ? fg : bg;
+            }
+        }
+    }
+}
+
+// marks the pixels which differ with 0xFF, returns how many do
+static size_t diff_images(const uint8_t* a, const uint8_t* b, uint8_t* mask, size_t size)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(GOLDEN_SSE2)
+    const __m128i ones = _mm_set1_epi8(-1);
+    for (; (i + 16) <= size; i += 16)
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i differ = _mm_xor_si128(_mm_cmpeq_epi8(va, vb), ones);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), differ);
+        uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(differ));
+        while (bits)
+        {
+            bits &= bits - 1;
+            count++;
+        }
+    }
+#endif
+    for (; i < size; i++)
+    {
+        mask[i] = (a[i] != b[i]) ? 0xFF : 0x00;
+        count += (a[i] != b[i]) ? 1 : 0;
+    }
+    return count;
+}
+
+static void palette_rgb(uint8_t index, uint8_t* rgb)
+{
+    uint32_t c = _zx_palette[index & 7];
+    if (0 == (index & 8))
+    {
+        c &= 0xFFD7D7D7;
+    }
+    rgb[0] = static_cast<uint8_t>(c);
+    rgb[1] = static_cast<uint8_t>(c >> 8);
+    rgb[2] = static_cast<uint8_t>(c >> 16);
+}
+
+// golden, actual and the difference side by side as a binary PPM
+static size_t write_diff(
+    const std::string& path,
+    const Frame& golden,
+    const Frame& actual,
+    FrameMode mode)
+{
+    const size_t num_pixels = DISPLAY_WIDTH * DISPLAY_HEIGHT;
+    std::vector<uint8_t> golden_image(num_pixels);
+    std::vector<uint8_t> actual_image(num_pixels);
+    std::vector<uint8_t> mask(num_pixels);
+    frame_image(golden.data, mode, golden_image.data());
+    frame_image(actual.data, mode, actual_image.data());
+    const size_t num_differing = diff_images(
+        golden_image.data(),
+        actual_image.data(),
+        mask.data(),
+        num_pixels);
+
+    std::vector<uint8_t> rgb(num_pixels * 3 * 3);
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        uint8_t* row = &rgb[y * DISPLAY_WIDTH * 3 * 3];
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        {
+            const size_t i = (y * DISPLAY_WIDTH) + x;
+            palette_rgb(golden_image[i], &row[x * 3]);
+            palette_rgb(actual_image[i], &row[(DISPLAY_WIDTH + x) * 3]);
+            uint8_t* diff = &row[((2 * DISPLAY_WIDTH) + x) * 3];
+            if (mask[i])
+            {
+                diff[0] = 0xFF;
+                diff[1] = 0x00;
+                diff[2] = 0x00;
+            }
+            else
+            {
+                palette_rgb(actual_image[i], diff);
+                diff[0] /= 4;
+                diff[1] /= 4;
+                diff[2] /= 4;
+            }
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file << "P6\n" << (DISPLAY_WIDTH * 3) << " " << DISPLAY_HEIGHT << "\n255\n";
+    file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+    return num_differing;
+}
+
+static std::string golden_path(const Options& options, const Title& title)
+{
+    return options.golden_dir + "/" + title.name + ".golden";
+}
+
+static void write_u32(std::ofstream& file, uint32_t value)
+{
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void write_goldens(const std::string& path, FrameMode mode, const std::vector<Frame>& frames)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Failed to write " << path << std::endl;
+        throw std::runtime_error("Failed to write goldens.");
+    }
+    write_u32(file, GOLDEN_MAGIC);
+    write_u32(file, GOLDEN_VERSION);
+    write_u32(file, static_cast<uint32_t>(mode));
+    write_u32(file, static_cast<uint32_t>(frames.size()));
+    for (const Frame& frame : frames)
+    {
+        write_u32(file, frame.frame);
+        file.write(reinterpret_cast<const char*>(&frame.hash), sizeof(frame.hash));
+        write_u32(file, static_cast<uint32_t>(frame.data.size()));
+        file.write(reinterpret_cast<const char*>(frame.data.data()), frame.data.size());
+    }
+}
+
+// false if there are none, or they were stored in another mode
+static bool read_goldens(const std::string& path, FrameMode mode, std::map<uint32_t, Frame>& frames)
+{
+    std::ifstream probe(path, std::ios::binary);
+    if (!probe)
+    {
+        return false;
+    }
+    probe.close();
+
+    MappedFile file(path);
+    const uint8_t* ptr = file.Data();
+    const uint8_t* end = ptr + file.Length();
+    uint32_t header[4];
+    if ((end - ptr) < static_cast<ptrdiff_t>(sizeof(header)))
+    {
+        return false;
+    }
+    memcpy(header, ptr, sizeof(header));
+    ptr += sizeof(header);
+    if ((header[0] != GOLDEN_MAGIC) || (header[1] != GOLDEN_VERSION) || (header[2] != static_cast<uint32_t>(mode)))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < header[3]; i++)
+    {
+        Frame frame;
+        uint32_t size;
+        if ((end - ptr) < 16)
+        {
+            return false;
+        }
+        memcpy(&frame.frame, ptr, 4);
+        memcpy(&frame.hash, ptr + 4, 8);
+        memcpy(&size, ptr + 12, 4);
+        ptr += 16;
+        if (static_cast<uint32_t>(end - ptr) < size)
+        {
+            return false;
+        }
+        frame.data.assign(ptr, ptr + size);
+        ptr += size;
+        frames[frame.frame] = frame;
+    }
+    return true;
+}
+
+static void run_title(const Options& options, Title& title)
+{
+    MappedFile file(title.path);
+    const uint8_t* data = file.Data();
+    const int size = static_cast<int>(file.Length());
+
+    std::vector<uint32_t> pixels(DISPLAY_WIDTH * DISPLAY_HEIGHT);
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.pixel_buffer = pixels.data();
+    desc.pixel_buffer_size = DISPLAY_BYTES;
+    std::unique_ptr<zx_t> sys(new zx_t);
+    zx_init(sys.get(), &desc);
+
+    std::unique_ptr<zx_movie_t> movie;
+    int num_frames = options.num_frames;
+    if ((size >= 4) && (0 == memcmp(data, "ZXMV", 4)))
+    {
+        movie.reset(new zx_movie_t);
+        if (!zx_movie_play(movie.get(), sys.get(), data, size))
+        {
+            title.message = "invalid movie";
+            zx_discard(sys.get());
+            return;
+        }
+        title.frame_us = movie->frame_us;
+        num_frames = std::min(num_frames, movie->num_frames);
+    }
+    else if (!zx_quickload(sys.get(), data, size))
+    {
+        title.message = "invalid snapshot";
+        zx_discard(sys.get());
+        return;
+    }
+
+    std::vector<Frame> frames;
+    const uint64_t start_ticks = sys->ticks;
+    const auto start = std::chrono::steady_clock::now();
+    for (int frame = 1; frame <= num_frames; frame++)
+    {
+        const bool hashed = ((frame % options.every) == 0) || (frame == num_frames);
+        sys->video_decode = hashed;
+        if (movie)
+        {
+            if (!zx_movie_play_frame(movie.get(), sys.get()))
+            {
+                break;
+            }
+        }
+        else
+        {
+            zx_exec(sys.get(), title.frame_us);
+        }
+        title.frames_run = frame;
+        if (hashed)
+        {
+            Frame hashed_frame;
+            hashed_frame.frame = static_cast<uint32_t>(frame);
+            frame_data(sys.get(), options.mode, hashed_frame.data);
+            hashed_frame.hash = hash_bytes(hashed_frame.data.data(), hashed_frame.data.size());
+            frames.push_back(hashed_frame);
+        }
+    }
+    title.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    title.ticks = sys->ticks - start_ticks;
+    zx_discard(sys.get());
+
+    if (title.frames_run != num_frames)
+    {
+        title.status = STATUS_FAIL;
+        title.message = "movie ended after " + std::to_string(title.frames_run) + " of " + std::to_string(num_frames) + " frames";
+        return;
+    }
+
+    if (options.update)
+    {
+        write_goldens(golden_path(options, title), options.mode, frames);
+        title.status = STATUS_UPDATED;
+        return;
+    }
+
+    std::map<uint32_t, Frame> goldens;
+    if (!read_goldens(golden_path(options, title), options.mode, goldens))
+    {
+        title.status = STATUS_NEW;
+        return;
+    }
+
+    // goldens recorded with other -frames or -every don't cover the run,
+    // a frame without a golden fails rather than passing unchecked
+    title.status = STATUS_PASS;
+    int num_missing = 0;
+    for (const Frame& frame : frames)
+    {
+        const auto golden = goldens.find(frame.frame);
+        if (golden == goldens.end())
+        {
+            num_missing++;
+            continue;
+        }
+        if (golden->second.hash != frame.hash)
+        {
+            title.status = STATUS_FAIL;
+            title.failed_frames.push_back(frame.frame);
+            make_directory(options.diff_dir);
+            write_diff(
+                options.diff_dir + "/" + title.name + "." + std::to_string(frame.frame) + ".ppm",
+                golden->second,
+                frame,
+                options.mode);
+        }
+    }
+    if ((num_missing > 0) || frames.empty())
+    {
+        title.status = STATUS_FAIL;
+        title.message = std::to_string(num_missing) + " of " + std::to_string(frames.size()) + " frames have no golden";
+    }
+}
+
+static std::string json_string(const std::string& text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-golden [-frames <n>] [-every <n>] [-pixels] [-update] [-goldens <dir>] [-diffs <dir>] [-threads <n>] <dir>" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    std::string dir;
+    int num_threads = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-frames") && has_value)
+        {
+            options.num_frames = std::max(1, atoi(argv[++i]));
+        }
+        else if ((arg == "-every") && has_value)
+        {
+            options.every = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "-pixels")
+        {
+            options.mode = FRAME_PIXELS;
+        }
+        else if (arg == "-update")
+        {
+            options.update = true;
+        }
+        else if ((arg == "-goldens") && has_value)
+        {
+            options.golden_dir = argv[++i];
+        }
+        else if ((arg == "-diffs") && has_value)
+        {
+            options.diff_dir = argv[++i];
+        }
+        else if ((arg == "-threads") && has_value)
+        {
+            num_threads = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg[0] != '-')
+        {
+            dir = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (dir.empty())
+    {
+        usage();
+        return 1;
+    }
+    if (options.golden_dir.empty())
+    {
+        options.golden_dir = dir + "/goldens";
+    }
+
+    try
+    {
+        std::vector<Title> titles;
+        for (const std::string& name : list_directory(dir))
+        {
+            if (is_title(name))
+            {
+                Title title;
+                title.name = name;
+                title.path = dir + "/" + name;
+                titles.push_back(title);
+            }
+        }
+        if (options.update)
+        {
+            make_directory(options.golden_dir);
+        }
+
+        ThreadPool thread_pool(static_cast<size_t>(num_threads));
+        std::mutex progress_mutex;
+        const auto start = std::chrono::steady_clock::now();
+        thread_pool.Run(titles.size(), [&](size_t i)
+        {
+            Title& title = titles[i];
+            try
+            {
+                run_title(options, title);
+            }
+            catch (const std::exception& e)
+            {
+                title.status = STATUS_ERROR;
+                title.message = e.what();
+            }
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            std::cerr << title.name << ": " << status_names[title.status] << std::endl;
+        });
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        int counts[5] = {};
+        char line[512];
+        std::cout << "{" << std::endl;
+        std::cout << "  \"version\": 1," << std::endl;
+        std::cout << "  \"frames\": " << options.num_frames << "," << std::endl;
+        std::cout << "  \"mode\": \"" << ((options.mode == FRAME_PIXELS) ? "pixels" : "screen") << "\"," << std::endl;
+        std::cout << "  \"threads\": " << thread_pool.ThreadCount() << "," << std::endl;
+        std::cout << "  \"titles\": [" << std::endl;
+        for (size_t i = 0; i < titles.size(); i++)
+        {
+            const Title& title = titles[i];
+            counts[title.status]++;
+
+            // one title per line, speed is emulated time over wall time
+            const double emulated = title.frames_run * (title.frame_us / 1e6);
+            snprintf(
+                line,
+                sizeof(line),
+                ", \"status\": \"%s\", \"frames\": %d, \"seconds\": %.3f, \"speed\": %.2f, \"mhz\": %.2f",
+                status_names[title.status],
+                title.frames_run,
+                title.seconds,
+                (title.seconds > 0.0) ? (emulated / title.seconds) : 0.0,
+                (title.seconds > 0.0) ? (title.ticks / title.seconds / 1e6) : 0.0);
+            std::cout << "    {\"name\": " << json_string(title.name) << line;
+            if (!title.failed_frames.empty())
+            {
+                std::cout << ", \"failed_frames\": [";
+                for (size_t f = 0; f < title.failed_frames.size(); f++)
+                {
+                    std::cout << (f ? ", " : "") << title.failed_frames[f];
+                }
+                std::cout << "]";
+            }
+            if (!title.message.empty())
+            {
+                std::cout << ", \"message\": " << json_string(title.message);
+            }
+            std::cout << "}" << (((i + 1) < titles.size()) ? "," : "") << std::endl;
+        }
+        std::cout << "  ]," << std::endl;
+        for (int s = 0; s < 5; s++)
+        {
+            std::cout << "  \"" << status_names[s] << "\": " << counts[s] << "," << std::endl;
+        }
+        snprintf(line, sizeof(line), "  \"seconds\": %.3f", seconds);
+        std::cout << line << std::endl;
+        std::cout << "}" << std::endl;
+
+        return ((counts[STATUS_FAIL] + counts[STATUS_ERROR]) > 0) ? 2 : 0;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
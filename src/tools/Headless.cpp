@@ -0,0 +1,555 @@
+#include "../util/HugeBuffer.hpp"
+#include "../util/MappedFile.hpp"
+#include "../util/PerfCounters.hpp"
+#include "../util/ThreadPool.hpp"
+#include "../util/Trace.hpp"
+
+#include "../speccy/Coverage.hpp"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Movie.h"
+#include "../speccy/Pool.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Runs the emulator without a window, to replay input movies and
+// check that they end up in the same state on every run:
+//
+//     zxsc-headless [-tape <file>] [-seek <frame>] [-frames <n>] [-video]
+//                   [-branches <n>] [-farm <n>] [-lockstep <n>]
+//                   [-trace <file.json>] [-coverage <file>]
+//                   <movie.zxm | snapshot>
+//
+// Movies are played from the seek frame to the end (or for n frames),
+// snapshots run for n frames. The state hash at the end is printed, it
+// only matches between runs if the replay was bit-exact.
+//
+// With -trace the trace zones are written to the file as Chrome trace
+// JSON at the end, which needs a build with ZXSC_TRACE.
+//
+// With -coverage the memory accesses of the replayed frames are counted
+// and the ranges executed, read and written are saved to the file, see
+// Speccy::SaveCoverage. Not in builds with ZX_NO_HEATMAP.
+//
+// With -branches the end state is forked that many times and each fork
+// holds down a different key for a second, spread over all cores, to
+// measure how fast a search can explore from one state.
+//
+// With -farm that many copies of the end state are stepped round-robin
+// a scanline at a time, like a batch of environments would be, which
+// shows what the machine layout costs in cache misses per step.
+//
+// With -lockstep that many copies, each with a different key held down,
+// are stepped an instruction at a time side by side. It counts how
+// often they would execute the same opcode, which is what running
+// machines across SIMD lanes would get out of one pass.
+
+static uint32_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+static uint8_t state[ZX_SAVESTATE_MAX_SIZE];
+
+static uint32_t state_hash(zx_t* sys, uint8_t* buffer = state)
+{
+    const int size = zx_save_state(sys, buffer, ZX_SAVESTATE_MAX_SIZE);
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < size; i++)
+    {
+        hash = (hash ^ buffer[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char keys[] = "abcdefghijklmnopqrstuvwxyz0123456789 ";
+
+static void run_branches(zx_t* sys, int num_branches)
+{
+    const int num_frames = 50;
+
+    ThreadPool thread_pool;
+    const size_t num_slots = thread_pool.ThreadCount() + 1;
+    std::vector<uint32_t> hashes(num_branches);
+
+    // one machine per slot, forked again for each of its branches
+    HugeBuffer arena(zx_pool_bytes(static_cast<int>(num_slots), 3));
+    zx_pool_t pool;
+    zx_pool_init(
+        &pool,
+        arena.Data(),
+        arena.Length());
+
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    std::vector<zx_t*> machines(num_slots);
+    for (auto& machine : machines)
+    {
+        machine = zx_pool_alloc(&pool, &desc);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    thread_pool.Run(num_slots, [&](size_t slot)
+    {
+        zx_t* branch = machines[slot];
+        std::vector<uint8_t> buffer(ZX_SAVESTATE_MAX_SIZE);
+        for (size_t i = slot; i < hashes.size(); i += num_slots)
+        {
+            zx_fork(branch, sys);
+            branch->video_decode = false;
+            zx_key_down(branch, keys[i % (sizeof(keys) - 1)]);
+            for (int frame = 0; frame < num_frames; frame++)
+            {
+                zx_exec(branch, 20000);
+            }
+            hashes[i] = state_hash(branch, &buffer[0]);
+        }
+    });
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    const std::unordered_set<uint32_t> distinct(hashes.begin(), hashes.end());
+    printf(
+        "%d branches of %d frames in %.1f ms (%.0f branches/s, %d threads, %d KB per machine%s), %d distinct end states\n",
+        num_branches,
+        num_frames,
+        ms,
+        (ms > 0.0) ? (num_branches * 1000.0 / ms) : 0.0,
+        static_cast<int>(num_slots),
+        static_cast<int>((ZX_POOL_MACHINE_SIZE + 3 * ZX_RAM_BANK_SIZE) / 1024),
+        arena.HugePages() ? ", huge pages" : "",
+        static_cast<int>(distinct.size()));
+}
+
+// stops after every instruction
+static bool lockstep_break(zx_t* sys, uint16_t pc, void* user_data)
+{
+    (void)sys;
+    (void)pc;
+    (void)user_data;
+    return true;
+}
+
+// next opcode, together with its prefix for prefixed ones
+static uint16_t lockstep_opcode(zx_t* sys)
+{
+    const uint16_t pc = z80_pc(&sys->cpu);
+    const uint8_t op = mem_rd(&sys->mem, pc);
+    if ((op == 0xCB) || (op == 0xDD) || (op == 0xED) || (op == 0xFD))
+    {
+        return static_cast<uint16_t>((op << 8) | mem_rd(&sys->mem, pc + 1));
+    }
+    return op;
+}
+
+static void run_lockstep(zx_t* sys, int num_lanes)
+{
+    const int num_frames = 10;
+
+    // a divergence this long would drop a SIMD interpreter back to
+    // running the lanes one by one
+    const int max_divergence = 64;
+
+    HugeBuffer arena(zx_pool_bytes(num_lanes, 3));
+    zx_pool_t pool;
+    zx_pool_init(
+        &pool,
+        arena.Data(),
+        arena.Length());
+
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    std::vector<zx_t*> lanes(num_lanes);
+    for (int i = 0; i < num_lanes; i++)
+    {
+        lanes[i] = zx_pool_alloc(&pool, &desc);
+        zx_fork(lanes[i], sys);
+        lanes[i]->video_decode = false;
+        zx_set_debug_cb(lanes[i], lockstep_break, nullptr);
+        zx_key_down(lanes[i], keys[i % (sizeof(keys) - 1)]);
+    }
+
+    std::vector<int> frames(num_lanes);
+    std::vector<uint16_t> pcs(num_lanes);
+    std::vector<uint16_t> ops(num_lanes);
+    uint64_t steps = 0;
+    uint64_t same_pc = 0;
+    uint64_t same_op = 0;
+    uint64_t passes = 0;
+    uint64_t fallback_steps = 0;
+    int divergence = 0;
+    int longest_divergence = 0;
+    while (*std::min_element(frames.begin(), frames.end()) < num_frames)
+    {
+        for (int i = 0; i < num_lanes; i++)
+        {
+            zx_t* lane = lanes[i];
+            if (lane->frame_pending)
+            {
+                zx_exec_resume(lane);
+            }
+            else
+            {
+                zx_exec(
+                    lane,
+                    20000);
+            }
+            if (!lane->frame_pending)
+            {
+                frames[i]++;
+            }
+            pcs[i] = z80_pc(&lane->cpu);
+            ops[i] = lockstep_opcode(lane);
+        }
+
+        // a pass per distinct opcode
+        std::sort(ops.begin(), ops.end());
+        const int num_ops = static_cast<int>(std::unique(ops.begin(), ops.end()) - ops.begin());
+        steps++;
+        passes += num_ops;
+        same_op += (num_ops == 1) ? 1 : 0;
+        same_pc += (std::count(pcs.begin(), pcs.end(), pcs[0]) == num_lanes) ? 1 : 0;
+
+        divergence = (num_ops == 1) ? 0 : (divergence + 1);
+        fallback_steps += (divergence > max_divergence) ? 1 : 0;
+        longest_divergence = std::max(longest_divergence, divergence);
+    }
+
+    printf(
+        "%d lanes, %llu steps: one PC %.1f%%, one opcode %.1f%%, %.2f lanes per pass, longest divergence %d steps, %.1f%% of steps past %d\n",
+        num_lanes,
+        static_cast<unsigned long long>(steps),
+        100.0 * same_pc / steps,
+        100.0 * same_op / steps,
+        static_cast<double>(steps) * num_lanes / passes,
+        longest_divergence,
+        100.0 * fallback_steps / steps,
+        max_divergence);
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-headless [-tape <file>] [-seek <frame>] [-frames <n>] [-video] [-branches <n>] [-farm <n>] [-lockstep <n>] [-trace <file.json>] [-coverage <file>] <movie.zxm | snapshot>" << std::endl;
+}
+
+static void run_farm(zx_t* sys, int num_machines)
+{
+    const int num_frames = 10;
+    const uint32_t slice_us = 64;
+    const int num_slices = (num_frames * 20000) / slice_us;
+
+    HugeBuffer arena(zx_pool_bytes(num_machines, 3));
+    zx_pool_t pool;
+    zx_pool_init(
+        &pool,
+        arena.Data(),
+        arena.Length());
+
+    // each machine gets its own RAM and a different key held down, so
+    // they don't share anything in the caches
+    zx_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    std::vector<zx_t*> machines(num_machines);
+    for (int i = 0; i < num_machines; i++)
+    {
+        machines[i] = zx_pool_alloc(&pool, &desc);
+        zx_fork(machines[i], sys);
+        zx_unshare(machines[i]);
+        machines[i]->video_decode = false;
+        zx_key_down(machines[i], keys[i % (sizeof(keys) - 1)]);
+    }
+
+    PerfCounters perf;
+    const auto start = std::chrono::steady_clock::now();
+    perf.Start();
+    for (int slice = 0; slice < num_slices; slice++)
+    {
+        for (zx_t* machine : machines)
+        {
+            zx_exec(
+                machine,
+                slice_us);
+        }
+    }
+    perf.Stop();
+    const auto end = std::chrono::steady_clock::now();
+
+    const double steps = static_cast<double>(num_slices) * num_machines;
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf(
+        "%d machines round-robin, %d slices of %u us: %.0f ns per slice",
+        num_machines,
+        num_slices,
+        slice_us,
+        ns / steps);
+    if (perf.Available())
+    {
+        printf(
+            ", %.1f L1D misses, %.2f cache misses, %.2f IPC per slice",
+            perf.Count(PerfCounters::L1DMisses) / steps,
+            perf.Count(PerfCounters::CacheMisses) / steps,
+            static_cast<double>(perf.Count(PerfCounters::Instructions)) / perf.Count(PerfCounters::Cycles));
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::string tape_path;
+    std::string trace_path;
+    std::string coverage_path;
+    std::string path;
+    int seek_frame = 0;
+    int num_frames = -1;
+    bool video = false;
+    int num_branches = 0;
+    int num_machines = 0;
+    int num_lanes = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-tape") && has_value)
+        {
+            tape_path = argv[++i];
+        }
+        else if ((arg == "-seek") && has_value)
+        {
+            seek_frame = atoi(argv[++i]);
+        }
+        else if ((arg == "-frames") && has_value)
+        {
+            num_frames = atoi(argv[++i]);
+        }
+        else if ((arg == "-branches") && has_value)
+        {
+            num_branches = atoi(argv[++i]);
+        }
+        else if ((arg == "-farm") && has_value)
+        {
+            num_machines = atoi(argv[++i]);
+        }
+        else if ((arg == "-lockstep") && has_value)
+        {
+            num_lanes = atoi(argv[++i]);
+        }
+        else if ((arg == "-trace") && has_value)
+        {
+            trace_path = argv[++i];
+        }
+        else if ((arg == "-coverage") && has_value)
+        {
+            coverage_path = argv[++i];
+        }
+        else if (arg == "-video")
+        {
+            video = true;
+        }
+        else if (path.empty() && (arg[0] != '-'))
+        {
+            path = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty())
+    {
+        usage();
+        return 1;
+    }
+
+#if !defined(ZXSC_TRACE)
+    if (!trace_path.empty())
+    {
+        std::cout << "Tracing needs a build with ZXSC_TRACE" << std::endl;
+        return 1;
+    }
+#endif
+
+#if defined(ZX_NO_HEATMAP)
+    if (!coverage_path.empty())
+    {
+        std::cout << "Coverage needs a build without ZX_NO_HEATMAP" << std::endl;
+        return 1;
+    }
+#endif
+
+    try
+    {
+        static zx_t zx_sys;
+        zx_desc_t zx_desc;
+        memset(&zx_desc, 0, sizeof(zx_desc));
+        zx_desc.pixel_buffer = pixels;
+        zx_desc.pixel_buffer_size = sizeof(pixels);
+        zx_init(&zx_sys, &zx_desc);
+        zx_sys.video_decode = video;
+
+        std::unique_ptr<MappedFile> tape_file;
+        if (!tape_path.empty())
+        {
+            tape_file.reset(new MappedFile(tape_path));
+            if (!zx_insert_tape(
+                &zx_sys,
+                tape_file->Data(),
+                static_cast<int>(tape_file->Length())))
+            {
+                std::cout << "Invalid tape: " << tape_path << std::endl;
+                return 1;
+            }
+        }
+
+        MappedFile file(path);
+        const uint8_t* data = file.Data();
+        const int size = static_cast<int>(file.Length());
+
+        static zx_movie_t zx_movie;
+        const bool is_movie = (size >= 4) && (0 == memcmp(data, "ZXMV", 4));
+        if (is_movie)
+        {
+            if (!zx_movie_play(
+                &zx_movie,
+                &zx_sys,
+                data,
+                size))
+            {
+                std::cout << "Invalid movie: " << path << std::endl;
+                return 1;
+            }
+            if (!zx_movie_seek(
+                &zx_movie,
+                &zx_sys,
+                seek_frame))
+            {
+                std::cout << "Failed to seek to frame " << seek_frame << std::endl;
+                return 1;
+            }
+            if (num_frames < 0)
+            {
+                num_frames = zx_movie.num_frames - zx_movie.frame;
+            }
+        }
+        else
+        {
+            if (!zx_quickload(
+                &zx_sys,
+                data,
+                size))
+            {
+                std::cout << "Invalid snapshot: " << path << std::endl;
+                return 1;
+            }
+            if (num_frames < 0)
+            {
+                num_frames = 50;
+            }
+        }
+
+        // only the frames replayed count, not the ones seeked over
+        std::vector<uint8_t> heat_buffer;
+        zx_heat_t heat;
+        if (!coverage_path.empty())
+        {
+            heat_buffer.resize(zx_heat_bytes());
+            zx_heat_init(
+                &heat,
+                heat_buffer.data(),
+                heat_buffer.size());
+            zx_set_heatmap(
+                &zx_sys,
+                &heat);
+        }
+
+        const uint32_t frame_us = is_movie ? zx_movie.frame_us : 20000;
+        const auto start = std::chrono::steady_clock::now();
+        int frames_run = 0;
+        for (; frames_run < num_frames; frames_run++)
+        {
+            if (is_movie)
+            {
+                if (!zx_movie_play_frame(
+                    &zx_movie,
+                    &zx_sys))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                zx_exec(
+                    &zx_sys,
+                    frame_us);
+            }
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        const double emulated_ms = frames_run * (frame_us / 1000.0);
+        printf(
+            "%d frames in %.1f ms (%.1fx), frame %d, state hash %08x\n",
+            frames_run,
+            ms,
+            (ms > 0.0) ? (emulated_ms / ms) : 0.0,
+            is_movie ? zx_movie.frame : frames_run,
+            state_hash(&zx_sys));
+
+        if (!coverage_path.empty())
+        {
+            zx_set_heatmap(
+                &zx_sys,
+                0);
+            Speccy::SaveCoverage(
+                heat,
+                coverage_path);
+        }
+
+        if (num_branches > 0)
+        {
+            run_branches(
+                &zx_sys,
+                num_branches);
+        }
+
+        if (num_machines > 0)
+        {
+            run_farm(
+                &zx_sys,
+                num_machines);
+        }
+
+        if (num_lanes > 0)
+        {
+            run_lockstep(
+                &zx_sys,
+                num_lanes);
+        }
+
+#if defined(ZXSC_TRACE)
+        if (!trace_path.empty() && !Trace::Dump(trace_path))
+        {
+            std::cout << "Failed to write " << trace_path << std::endl;
+            return 1;
+        }
+#endif
+    }
+    catch (const std::runtime_error&)
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,678 @@
+#include "../util/MappedFile.hpp"
+
+// the profiler's tick hook has to be set before Speccy.h comes in
+extern "C"
+{
+#include "../speccy/Profiler.h"
+#include "../speccy/Snapshot.h"
+#include "../speccy/Movie.h"
+}
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Profiles the emulated program of a snapshot or movie:
+//
+//     zxsc-profile [-frames <n>] [-seek <frame>] [-tape <file>]
+//                  [-symbols <file>]... [-callgrind <file>]
+//                  [-folded <file>] [-top <n>] <movie.zxm | snapshot>
+//
+// The machine runs the frames twice from the same start, once plain
+// and once profiled, and the report gives the slowdown, the hottest
+// PCs, the functions by exclusive and inclusive T-states and the
+// opcode mix. -callgrind writes a callgrind file (kcachegrind, qcachegrind)
+// with the T-states and instruction counts per PC and the call edges,
+// -folded the call paths in the folded stack format flamegraph.pl and
+// speedscope read, weighted by T-states.
+//
+// Symbol files label addresses. Most assembler and linker outputs work,
+// any line with a label and an address in one of the usual notations:
+//
+//     main: equ 0x8000        main EQU $8000        8000 main
+//     main = #8000            main 8000h
+//
+// Functions are named by their entry address, interrupt handlers get an
+// [irq] prefix and T-states spent before the first call are (root).
+
+static const int max_nodes = 1 << 18;
+
+// further than this from the symbol below, an address is unlabelled
+static const int max_symbol_offset = 0x400;
+
+struct Symbols
+{
+    std::map<uint16_t, std::string> names;
+
+    // exact, or the closest one not too far below with an offset
+    std::string Label(const uint16_t addr, const char* fallback) const
+    {
+        char text[80];
+        auto it = names.upper_bound(addr);
+        if (it != names.begin())
+        {
+            --it;
+            if (it->first == addr)
+            {
+                return it->second;
+            }
+            if ((addr - it->first) < max_symbol_offset)
+            {
+                snprintf(text, sizeof(text), "%s+%u", it->second.c_str(), addr - it->first);
+                return text;
+            }
+        }
+        snprintf(text, sizeof(text), fallback, addr);
+        return text;
+    }
+};
+
+static bool parse_address(const std::string& token, bool plain_hex, uint16_t& addr)
+{
+    std::string digits = token;
+    if ((digits.size() > 2) && (digits[0] == '0') && ((digits[1] == 'x') || (digits[1] == 'X')))
+    {
+        digits = digits.substr(2);
+    }
+    else if ((digits.size() > 1) && ((digits[0] == '$') || (digits[0] == '#')))
+    {
+        digits = digits.substr(1);
+    }
+    else if ((digits.size() > 1) && ((digits.back() == 'h') || (digits.back() == 'H')))
+    {
+        digits.pop_back();
+    }
+    else if (!plain_hex || (digits.size() != 4))
+    {
+        return false;
+    }
+    if (digits.empty() || (digits.size() > 4))
+    {
+        return false;
+    }
+    for (char c : digits)
+    {
+        if (!isxdigit(static_cast<unsigned char>(c)))
+        {
+            return false;
+        }
+    }
+    addr = static_cast<uint16_t>(strtoul(digits.c_str(), nullptr, 16));
+    return true;
+}
+
+static bool is_label(const std::string& token)
+{
+    if (token.empty() || !(isalpha(static_cast<unsigned char>(token[0])) || (token[0] == '_') || (token[0] == '.')))
+    {
+        return false;
+    }
+    std::string upper = token;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    return (upper != "EQU") && (upper != "DEFL") && (upper != "GLOBAL") && (upper != "PUBLIC");
+}
+
+static void load_symbols(const std::string& path, Symbols& symbols)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cout << "Can't open " << path << std::endl;
+        throw std::runtime_error("symbols");
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line = line.substr(0, line.find(';'));
+        for (char& c : line)
+        {
+            if ((c == ':') || (c == '=') || (c == ',') || (c == '\t'))
+            {
+                c = ' ';
+            }
+        }
+
+        std::vector<std::string> tokens;
+        std::istringstream stream(line);
+        std::string token;
+        while (stream >> token)
+        {
+            tokens.push_back(token);
+        }
+
+        // an address with a prefix or suffix wins over four plain hex
+        // digits, which could just as well be a label
+        int addr_index = -1;
+        uint16_t addr = 0;
+        for (int pass = 0; (pass < 2) && (addr_index < 0); pass++)
+        {
+            for (size_t i = 0; i < tokens.size(); i++)
+            {
+                if (parse_address(tokens[i], pass == 1, addr))
+                {
+                    addr_index = static_cast<int>(i);
+                    break;
+                }
+            }
+        }
+        if (addr_index < 0)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            if ((static_cast<int>(i) != addr_index) && is_label(tokens[i]))
+            {
+                symbols.names.emplace(addr, tokens[i]);
+                break;
+            }
+        }
+    }
+}
+
+struct Profile
+{
+    const zx_prof_t& prof;
+    const Symbols& symbols;
+    std::vector<uint64_t> inclusive_cycles;
+    std::vector<uint64_t> inclusive_instructions;
+    std::vector<std::string> names;
+
+    Profile(const zx_prof_t& prof, const Symbols& symbols) :
+        prof(prof),
+        symbols(symbols),
+        inclusive_cycles(prof.num_nodes),
+        inclusive_instructions(prof.num_nodes),
+        names(prof.num_nodes)
+    {
+        for (int i = prof.num_nodes - 1; i >= 0; i--)
+        {
+            const zx_prof_node_t& node = prof.nodes[i];
+            inclusive_cycles[i] += node.cycles;
+            inclusive_instructions[i] += node.instructions;
+            if (node.parent >= 0)
+            {
+                inclusive_cycles[node.parent] += inclusive_cycles[i];
+                inclusive_instructions[node.parent] += inclusive_instructions[i];
+            }
+
+            if (node.kind == ZX_PROF_ROOT)
+            {
+                names[i] = "(root)";
+            }
+            else
+            {
+                names[i] = symbols.Label(node.func, "sub_%04X");
+                if (node.kind == ZX_PROF_INTERRUPT)
+                {
+                    names[i] = "[irq] " + names[i];
+                }
+            }
+        }
+    }
+
+    // a node counts towards its function's inclusive time unless the
+    // function is already further up the path
+    bool Recursive(const int index) const
+    {
+        for (int p = prof.nodes[index].parent; p >= 0; p = prof.nodes[p].parent)
+        {
+            if (names[p] == names[index])
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WriteCallgrind(std::ostream& out) const
+    {
+        out << "# callgrind format\n";
+        out << "version: 1\n";
+        out << "creator: zxsc-profile\n";
+        out << "positions: instr\n";
+        out << "events: Cycles Instructions\n";
+        out << "summary: " << prof.cycles << " " << prof.instructions << "\n\n";
+
+        // per PC costs under the function they last ran in
+        std::map<std::string, std::vector<uint16_t>> pcs;
+        for (int pc = 0; pc < 0x10000; pc++)
+        {
+            if (prof.pc_count[pc] > 0)
+            {
+                pcs[names[prof.pc_node[pc]]].push_back(static_cast<uint16_t>(pc));
+            }
+        }
+
+        // calls merged by caller, call site and callee
+        typedef std::tuple<std::string, uint16_t, std::string> Edge;
+        struct EdgeCost
+        {
+            uint16_t target = 0;
+            uint64_t calls = 0;
+            uint64_t cycles = 0;
+            uint64_t instructions = 0;
+        };
+        std::map<std::string, std::map<Edge, EdgeCost>> edges;
+        for (int i = 1; i < prof.num_nodes; i++)
+        {
+            const zx_prof_node_t& node = prof.nodes[i];
+            const std::string& caller = names[node.parent];
+            EdgeCost& cost = edges[caller][Edge(caller, node.call_pc, names[i])];
+            cost.target = node.func;
+            cost.calls += node.calls;
+            cost.cycles += inclusive_cycles[i];
+            cost.instructions += inclusive_instructions[i];
+        }
+
+        std::vector<std::string> functions;
+        for (const auto& it : pcs)
+        {
+            functions.push_back(it.first);
+        }
+        for (const auto& it : edges)
+        {
+            if (pcs.find(it.first) == pcs.end())
+            {
+                functions.push_back(it.first);
+            }
+        }
+
+        char line[96];
+        for (const std::string& fn : functions)
+        {
+            out << "fn=" << fn << "\n";
+            const auto pc_it = pcs.find(fn);
+            if (pc_it != pcs.end())
+            {
+                for (const uint16_t pc : pc_it->second)
+                {
+                    snprintf(line, sizeof(line), "0x%04X %llu %u\n",
+                        pc,
+                        static_cast<unsigned long long>(prof.pc_cycles[pc]),
+                        prof.pc_count[pc]);
+                    out << line;
+                }
+            }
+            const auto edge_it = edges.find(fn);
+            if (edge_it != edges.end())
+            {
+                for (const auto& edge : edge_it->second)
+                {
+                    out << "cfn=" << std::get<2>(edge.first) << "\n";
+                    snprintf(line, sizeof(line), "calls=%llu 0x%04X\n0x%04X %llu %llu\n",
+                        static_cast<unsigned long long>(edge.second.calls),
+                        edge.second.target,
+                        std::get<1>(edge.first),
+                        static_cast<unsigned long long>(edge.second.cycles),
+                        static_cast<unsigned long long>(edge.second.instructions));
+                    out << line;
+                }
+            }
+            out << "\n";
+        }
+    }
+
+    void WriteFolded(std::ostream& out) const
+    {
+        std::vector<std::string> paths(prof.num_nodes);
+        for (int i = 0; i < prof.num_nodes; i++)
+        {
+            const int parent = prof.nodes[i].parent;
+            paths[i] = (parent < 0) ? names[i] : (paths[parent] + ";" + names[i]);
+            if (prof.nodes[i].cycles > 0)
+            {
+                out << paths[i] << " " << prof.nodes[i].cycles << "\n";
+            }
+        }
+    }
+};
+
+static const char* op_prefixes[ZX_PROF_OP_TABLES] =
+{
+    "",
+    "CB ",
+    "ED ",
+    "DD ",
+    "FD ",
+    "DD CB ",
+    "FD CB "
+};
+
+static void print_report(const Profile& profile, const int top)
+{
+    const zx_prof_t& prof = profile.prof;
+    const double total = (prof.cycles > 0) ? static_cast<double>(prof.cycles) : 1.0;
+
+    printf("\nhottest PCs\n");
+    std::vector<uint16_t> pcs;
+    for (int pc = 0; pc < 0x10000; pc++)
+    {
+        if (prof.pc_count[pc] > 0)
+        {
+            pcs.push_back(static_cast<uint16_t>(pc));
+        }
+    }
+    std::sort(pcs.begin(), pcs.end(), [&](uint16_t a, uint16_t b)
+    {
+        return prof.pc_cycles[a] > prof.pc_cycles[b];
+    });
+    for (size_t i = 0; (i < pcs.size()) && (i < static_cast<size_t>(top)); i++)
+    {
+        const uint16_t pc = pcs[i];
+        printf(
+            "  %6.2f%%  %04X  %-24s %12llu T  %10u x  in %s\n",
+            100.0 * prof.pc_cycles[pc] / total,
+            pc,
+            profile.symbols.Label(pc, "%04X").c_str(),
+            static_cast<unsigned long long>(prof.pc_cycles[pc]),
+            prof.pc_count[pc],
+            profile.names[prof.pc_node[pc]].c_str());
+    }
+
+    struct Function
+    {
+        uint64_t exclusive = 0;
+        uint64_t inclusive = 0;
+        uint64_t calls = 0;
+    };
+    std::map<std::string, Function> functions;
+    for (int i = 0; i < prof.num_nodes; i++)
+    {
+        Function& f = functions[profile.names[i]];
+        f.exclusive += prof.nodes[i].cycles;
+        f.calls += prof.nodes[i].calls;
+        if (!profile.Recursive(i))
+        {
+            f.inclusive += profile.inclusive_cycles[i];
+        }
+    }
+    std::vector<std::pair<std::string, Function>> sorted(functions.begin(), functions.end());
+
+    const char* orders[] = { "exclusive", "inclusive" };
+    for (int order = 0; order < 2; order++)
+    {
+        std::sort(sorted.begin(), sorted.end(), [&](const std::pair<std::string, Function>& a, const std::pair<std::string, Function>& b)
+        {
+            return (order == 0) ?
+                (a.second.exclusive > b.second.exclusive) :
+                (a.second.inclusive > b.second.inclusive);
+        });
+        printf("\nfunctions by %s T-states\n", orders[order]);
+        printf("  %8s %8s %10s\n", "self", "total", "calls");
+        for (size_t i = 0; (i < sorted.size()) && (i < static_cast<size_t>(top)); i++)
+        {
+            printf(
+                "  %7.2f%% %7.2f%% %10llu  %s\n",
+                100.0 * sorted[i].second.exclusive / total,
+                100.0 * sorted[i].second.inclusive / total,
+                static_cast<unsigned long long>(sorted[i].second.calls),
+                sorted[i].first.c_str());
+        }
+    }
+
+    printf("\nopcode mix\n");
+    std::vector<std::pair<int, int>> ops;
+    for (int table = 0; table < ZX_PROF_OP_TABLES; table++)
+    {
+        for (int op = 0; op < 256; op++)
+        {
+            if (prof.op_count[table][op] > 0)
+            {
+                ops.emplace_back(table, op);
+            }
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [&](std::pair<int, int> a, std::pair<int, int> b)
+    {
+        return prof.op_cycles[a.first][a.second] > prof.op_cycles[b.first][b.second];
+    });
+    for (size_t i = 0; (i < ops.size()) && (i < static_cast<size_t>(top)); i++)
+    {
+        const int table = ops[i].first;
+        const int op = ops[i].second;
+        const std::string name = std::string(op_prefixes[table]) + (
+            (table >= 5) ? "dd " : "");
+        printf(
+            "  %6.2f%% T  %6.2f%% x  %s%02X\n",
+            100.0 * prof.op_cycles[table][op] / total,
+            100.0 * prof.op_count[table][op] / static_cast<double>(prof.instructions),
+            name.c_str(),
+            op);
+    }
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-profile [-frames <n>] [-seek <frame>] [-tape <file>] [-symbols <file>]... [-callgrind <file>] [-folded <file>] [-top <n>] <movie.zxm | snapshot>" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string tape_path;
+    std::string path;
+    std::string callgrind_path;
+    std::string folded_path;
+    std::vector<std::string> symbol_paths;
+    int seek_frame = 0;
+    int num_frames = -1;
+    int top = 20;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-tape") && has_value)
+        {
+            tape_path = argv[++i];
+        }
+        else if ((arg == "-seek") && has_value)
+        {
+            seek_frame = atoi(argv[++i]);
+        }
+        else if ((arg == "-frames") && has_value)
+        {
+            num_frames = atoi(argv[++i]);
+        }
+        else if ((arg == "-symbols") && has_value)
+        {
+            symbol_paths.push_back(argv[++i]);
+        }
+        else if ((arg == "-callgrind") && has_value)
+        {
+            callgrind_path = argv[++i];
+        }
+        else if ((arg == "-folded") && has_value)
+        {
+            folded_path = argv[++i];
+        }
+        else if ((arg == "-top") && has_value)
+        {
+            top = atoi(argv[++i]);
+        }
+        else if (path.empty() && (arg[0] != '-'))
+        {
+            path = arg;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        Symbols symbols;
+        for (const std::string& symbol_path : symbol_paths)
+        {
+            load_symbols(
+                symbol_path,
+                symbols);
+        }
+
+        std::unique_ptr<MappedFile> tape_file;
+        if (!tape_path.empty())
+        {
+            tape_file.reset(new MappedFile(tape_path));
+        }
+
+        MappedFile file(path);
+        const uint8_t* data = file.Data();
+        const int size = static_cast<int>(file.Length());
+        const bool is_movie = (size >= 4) && (0 == memcmp(data, "ZXMV", 4));
+
+        static zx_t zx_sys;
+        static zx_movie_t zx_movie;
+        zx_desc_t zx_desc;
+        memset(&zx_desc, 0, sizeof(zx_desc));
+
+        // both runs start from the same state
+        auto load = [&]()
+        {
+            if (zx_sys.valid)
+            {
+                zx_discard(&zx_sys);
+            }
+            zx_init(&zx_sys, &zx_desc);
+            if (tape_file && !zx_insert_tape(
+                &zx_sys,
+                tape_file->Data(),
+                static_cast<int>(tape_file->Length())))
+            {
+                std::cout << "Invalid tape: " << tape_path << std::endl;
+                throw std::runtime_error("tape");
+            }
+            if (is_movie)
+            {
+                if (!zx_movie_play(&zx_movie, &zx_sys, data, size) ||
+                    !zx_movie_seek(&zx_movie, &zx_sys, seek_frame))
+                {
+                    std::cout << "Invalid movie: " << path << std::endl;
+                    throw std::runtime_error("movie");
+                }
+                if (num_frames < 0)
+                {
+                    num_frames = zx_movie.num_frames - zx_movie.frame;
+                }
+            }
+            else if (!zx_quickload(&zx_sys, data, size))
+            {
+                std::cout << "Invalid snapshot: " << path << std::endl;
+                throw std::runtime_error("snapshot");
+            }
+            else if (num_frames < 0)
+            {
+                num_frames = 500;
+            }
+        };
+
+        const uint32_t frame_us = 20000;
+        auto run = [&]()
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < num_frames; i++)
+            {
+                if (is_movie)
+                {
+                    if (!zx_movie_play_frame(&zx_movie, &zx_sys))
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    zx_exec(&zx_sys, frame_us);
+                }
+            }
+            return std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        };
+
+        load();
+        const double plain_seconds = run();
+
+        std::vector<uint8_t> buffer(zx_prof_bytes(max_nodes));
+        std::unique_ptr<zx_prof_t> prof(new zx_prof_t);
+        zx_prof_init(
+            prof.get(),
+            buffer.data(),
+            buffer.size(),
+            max_nodes);
+
+        load();
+        zx_prof_start(prof.get(), &zx_sys);
+        const double profiled_seconds = run();
+        zx_prof_stop(prof.get(), &zx_sys);
+
+        printf(
+            "%d frames, %llu instructions, %llu T-states, %llu interrupts, %d call paths\n",
+            num_frames,
+            static_cast<unsigned long long>(prof->instructions),
+            static_cast<unsigned long long>(prof->cycles),
+            static_cast<unsigned long long>(prof->interrupts),
+            prof->num_nodes);
+        printf(
+            "profiled in %.3f s, %.3f s plain, %.2fx slower\n",
+            profiled_seconds,
+            plain_seconds,
+            (plain_seconds > 0.0) ? (profiled_seconds / plain_seconds) : 0.0);
+        if (prof->lost_calls > 0)
+        {
+            printf(
+                "%llu calls went to their caller, the call stack or tree was full\n",
+                static_cast<unsigned long long>(prof->lost_calls));
+        }
+
+        const Profile profile(*prof, symbols);
+        print_report(profile, top);
+
+        if (!callgrind_path.empty())
+        {
+            std::ofstream out(callgrind_path);
+            profile.WriteCallgrind(out);
+            if (!out)
+            {
+                std::cout << "Failed to write " << callgrind_path << std::endl;
+                return 1;
+            }
+        }
+
+        if (!folded_path.empty())
+        {
+            std::ofstream out(folded_path);
+            profile.WriteFolded(out);
+            if (!out)
+            {
+                std::cout << "Failed to write " << folded_path << std::endl;
+                return 1;
+            }
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        return 1;
+    }
+
+    return 0;
+}
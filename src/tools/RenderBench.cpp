@@ -0,0 +1,567 @@
+#include "../GUI.hpp"
+#include "../speccy/Render.hpp"
+
+#include "imgui/imgui.h"
+
+extern "C"
+{
+#include "../speccy/Speccy.h"
+}
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Times the renderer without a window, printed as JSON:
+//
+//     zxsc-render-bench [-frames <n>] [-sizes <w>x<h>,...] [-cpu]
+//
+// Draws frames into an EGL pbuffer for every window size with
+// supersampling off and on, timing the stages of a frame one by one:
+//
+//     upload       display texture upload and its mipmaps
+//     supersample  the 12x pass into the frame buffer
+//     present      display (or frame buffer mipmaps and display) to the window
+//     gui          ImGui::Render and its draw calls
+//
+// GPU time comes from GL_EXT_disjoint_timer_query when a hardware
+// driver has it, else (or with -cpu) every stage is fenced with glFinish
+// and timed on the CPU, which with a software renderer like llvmpipe is
+// where the work happens anyway. The medians over the frames are
+// reported.
+
+static const char* stage_names[] =
+{
+    "upload",
+    "supersample",
+    "present",
+    "gui"
+};
+
+static const size_t num_stages = sizeof(stage_names) / sizeof(stage_names[0]);
+
+struct Size
+{
+    uint32_t width;
+    uint32_t height;
+};
+
+// a pbuffer big enough for the largest window, the renderer draws to
+// frame buffer 0 like it does to a window
+class Offscreen
+{
+private:
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLSurface surface = EGL_NO_SURFACE;
+    EGLContext context = EGL_NO_CONTEXT;
+
+public:
+    Offscreen(
+        const uint32_t width,
+        const uint32_t height)
+    {
+        // Mesa's surfaceless platform needs no X or Wayland server
+        const char* client_extensions = eglQueryString(
+            EGL_NO_DISPLAY,
+            EGL_EXTENSIONS);
+
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+                eglGetProcAddress("eglGetPlatformDisplayEXT"));
+
+        if (get_platform_display &&
+            client_extensions &&
+            strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+        {
+            display = get_platform_display(
+                EGL_PLATFORM_SURFACELESS_MESA,
+                EGL_DEFAULT_DISPLAY,
+                nullptr);
+        }
+
+        if (display == EGL_NO_DISPLAY)
+        {
+            display = eglGetDisplay(
+                EGL_DEFAULT_DISPLAY);
+        }
+
+        if ((display == EGL_NO_DISPLAY) ||
+            !eglInitialize(display, nullptr, nullptr) ||
+            !eglBindAPI(EGL_OPENGL_ES_API))
+        {
+            throw std::runtime_error("Failed to initialize EGL.");
+        }
+
+        const EGLint config_attributes[] =
+        {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+            EGL_RED_SIZE, 8,
+            EGL_GREEN_SIZE, 8,
+            EGL_BLUE_SIZE, 8,
+            EGL_ALPHA_SIZE, 8,
+            EGL_DEPTH_SIZE, 24,
+            EGL_STENCIL_SIZE, 8,
+            EGL_NONE
+        };
+
+        EGLConfig config;
+        EGLint num_configs = 0;
+        if (!eglChooseConfig(display, config_attributes, &config, 1, &num_configs) ||
+            (num_configs < 1))
+        {
+            throw std::runtime_error("No EGL config for a pbuffer.");
+        }
+
+        const EGLint surface_attributes[] =
+        {
+            EGL_WIDTH, static_cast<EGLint>(width),
+            EGL_HEIGHT, static_cast<EGLint>(height),
+            EGL_NONE
+        };
+
+        surface = eglCreatePbufferSurface(
+            display,
+            config,
+            surface_attributes);
+
+        // the renderer's shaders are GLSL ES 1.0, ES 3 gets timer queries
+        for (EGLint version = 3; (version >= 2) && (context == EGL_NO_CONTEXT); version--)
+        {
+            const EGLint context_attributes[] =
+            {
+                EGL_CONTEXT_CLIENT_VERSION, version,
+                EGL_NONE
+            };
+
+            context = eglCreateContext(
+                display,
+                config,
+                EGL_NO_CONTEXT,
+                context_attributes);
+        }
+
+        if ((surface == EGL_NO_SURFACE) ||
+            (context == EGL_NO_CONTEXT) ||
+            !eglMakeCurrent(display, surface, surface, context))
+        {
+            throw std::runtime_error("Failed to create the EGL pbuffer context.");
+        }
+    }
+
+    ~Offscreen()
+    {
+        eglMakeCurrent(
+            display,
+            EGL_NO_SURFACE,
+            EGL_NO_SURFACE,
+            EGL_NO_CONTEXT);
+
+        eglDestroyContext(display, context);
+        eglDestroySurface(display, surface);
+        eglTerminate(display);
+    }
+};
+
+// times a stage either with a timer query or fenced on the CPU
+class StageTimer
+{
+private:
+    bool gpu = false;
+    std::vector<GLuint> queries;
+
+public:
+    StageTimer(const bool allow_gpu)
+    {
+        const char* extensions = reinterpret_cast<const char*>(
+            glGetString(GL_EXTENSIONS));
+
+        const std::string renderer = reinterpret_cast<const char*>(
+            glGetString(GL_RENDERER));
+
+        // software renderers bin the draws and rasterize them at the
+        // next flush, their queries end up timing the wrong stages
+        const bool software =
+            (renderer.find("llvmpipe") != std::string::npos) ||
+            (renderer.find("softpipe") != std::string::npos) ||
+            (renderer.find("SwiftShader") != std::string::npos);
+
+        gpu = allow_gpu &&
+            !software &&
+            extensions &&
+            strstr(extensions, "GL_EXT_disjoint_timer_query");
+
+        if (gpu)
+        {
+            queries.resize(num_stages);
+            glGenQueries(
+                static_cast<GLsizei>(queries.size()),
+                &queries[0]);
+        }
+    }
+
+    ~StageTimer()
+    {
+        if (gpu)
+        {
+            glDeleteQueries(
+                static_cast<GLsizei>(queries.size()),
+                &queries[0]);
+        }
+    }
+
+    bool GPU() const
+    {
+        return gpu;
+    }
+
+    // runs the stages of one frame, times are in ms, false if the GPU
+    // was disjoint (clock change, context loss) and the frame is void
+    bool Frame(
+        const std::vector<std::function<void()>>& stages,
+        std::vector<double>& times)
+    {
+        times.assign(stages.size(), 0.0);
+
+        if (!gpu)
+        {
+            glFinish();
+            for (size_t i = 0; i < stages.size(); i++)
+            {
+                const auto start = std::chrono::steady_clock::now();
+                stages[i]();
+                glFinish();
+                times[i] = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+            }
+            return true;
+        }
+
+        // clears the disjoint flag
+        GLint disjoint = 0;
+        glGetIntegerv(
+            GL_GPU_DISJOINT_EXT,
+            &disjoint);
+
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            glBeginQuery(
+                GL_TIME_ELAPSED_EXT,
+                queries[i]);
+
+            stages[i]();
+
+            glEndQuery(
+                GL_TIME_ELAPSED_EXT);
+        }
+
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            GLuint ns = 0;
+            glGetQueryObjectuiv(
+                queries[i],
+                GL_QUERY_RESULT,
+                &ns);
+            times[i] = ns / 1e6;
+        }
+
+        glGetIntegerv(
+            GL_GPU_DISJOINT_EXT,
+            &disjoint);
+
+        return disjoint == 0;
+    }
+};
+
+static double median(std::vector<double> values)
+{
+    if (values.empty())
+    {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    const size_t n = values.size();
+    return (n % 2) ? values[n / 2] : ((values[n / 2 - 1] + values[n / 2]) / 2.0);
+}
+
+// something like the emulator's menu, so the GUI stage draws a
+// realistic amount of text and widgets
+static void build_gui()
+{
+    static bool supersampling = true;
+    static int cpu_clock = 0;
+    static int movie_frame = 0;
+    static char file_path[256] = "files/scr.z80";
+
+    ImGui::NewFrame();
+
+    ImGui::Begin(
+        "Menu",
+        NULL,
+        ImGuiWindowFlags_AlwaysAutoResize);
+
+    ImGui::LabelText("Controls", "Cursor keys, Ctrl.");
+    ImGui::Checkbox("Supersampling", &supersampling);
+    ImGui::Combo("CPU Clock", &cpu_clock, "3.5 MHz\0" "7 MHz\0" "14 MHz\0" "28 MHz\0");
+    ImGui::InputText("File", file_path, sizeof(file_path));
+    ImGui::Button("Load");
+    ImGui::SameLine();
+    ImGui::Button("Eject Tape");
+    ImGui::SameLine();
+    ImGui::Button("Save Tape");
+    ImGui::SameLine();
+    ImGui::Button("Save Snapshot");
+    ImGui::Button("Save State");
+    ImGui::SameLine();
+    ImGui::Button("Load State");
+    ImGui::Button("Rewind");
+    ImGui::SameLine();
+    ImGui::Text("%.1f s, %.1f MB, %.0fx", 12.3f, 4.5f, 6.0f);
+    ImGui::SliderInt("Movie Frame", &movie_frame, 0, 1000);
+    ImGui::Button("Play");
+    ImGui::SameLine();
+    ImGui::Button("Stop");
+    ImGui::SameLine();
+    ImGui::Button("Rewind Tape");
+
+    ImGui::End();
+}
+
+static bool parse_sizes(const std::string& text, std::vector<Size>& sizes)
+{
+    sizes.clear();
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = text.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        unsigned int width = 0;
+        unsigned int height = 0;
+        if ((sscanf(text.substr(begin, end - begin).c_str(), "%ux%u", &width, &height) != 2) ||
+            (width == 0) ||
+            (height == 0))
+        {
+            return false;
+        }
+        sizes.push_back({ width, height });
+        begin = end + 1;
+    }
+    return !sizes.empty();
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-render-bench [-frames <n>] [-sizes <w>x<h>,...] [-cpu]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_frames = 30;
+    bool allow_gpu = true;
+    std::vector<Size> sizes =
+    {
+        { 640, 480 },
+        { 1280, 720 },
+        { 1920, 1080 },
+        { 2560, 1440 },
+        { 3840, 2160 }
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1) < argc;
+        if ((arg == "-frames") && has_value)
+        {
+            num_frames = std::max(1, atoi(argv[++i]));
+        }
+        else if ((arg == "-sizes") && has_value)
+        {
+            if (!parse_sizes(argv[++i], sizes))
+            {
+                usage();
+                return 1;
+            }
+        }
+        else if (arg == "-cpu")
+        {
+            allow_gpu = false;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    try
+    {
+        uint32_t max_width = 0;
+        uint32_t max_height = 0;
+        for (const Size& size : sizes)
+        {
+            max_width = std::max(max_width, size.width);
+            max_height = std::max(max_height, size.height);
+        }
+
+        Offscreen offscreen(
+            max_width,
+            max_height);
+
+        // attribute blocks of every color with a stripe pattern, so the
+        // texture doesn't compress into nothing
+        std::vector<uint32_t> display_pixels(
+            DISPLAY_WIDTH * DISPLAY_HEIGHT);
+
+        for (uint32_t y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            for (uint32_t x = 0; x < DISPLAY_WIDTH; x++)
+            {
+                const uint32_t color = _zx_palette[((x / 8) + (y / 8)) & 7];
+                display_pixels[(y * DISPLAY_WIDTH) + x] = ((x ^ y) & 1) ? color : _zx_palette[0];
+            }
+        }
+
+        Speccy::Render speccy_render;
+        speccy_render.Init(
+            DISPLAY_WIDTH,
+            DISPLAY_HEIGHT,
+            display_pixels);
+
+        GUI gui;
+        gui.Init();
+
+        // no imgui.ini left behind
+        ImGui::GetIO().IniFilename = nullptr;
+
+        StageTimer timer(allow_gpu);
+
+        const uint32_t border_color = _zx_palette[1];
+
+        std::cout << "{" << std::endl;
+        std::cout << "  \"version\": 1," << std::endl;
+        std::cout << "  \"renderer\": \"" << reinterpret_cast<const char*>(glGetString(GL_RENDERER)) << "\"," << std::endl;
+        std::cout << "  \"timer\": \"" << (timer.GPU() ? "gpu" : "cpu") << "\"," << std::endl;
+        std::cout << "  \"frames\": " << num_frames << "," << std::endl;
+        std::cout << "  \"runs\": [" << std::endl;
+
+        char line[512];
+        for (size_t s = 0; s < sizes.size(); s++)
+        {
+            const Size& size = sizes[s];
+            for (int supersampling = 0; supersampling <= 1; supersampling++)
+            {
+                const std::vector<std::function<void()>> stages =
+                {
+                    [&]()
+                    {
+                        speccy_render.UploadDisplay();
+                    },
+                    [&]()
+                    {
+                        if (supersampling)
+                        {
+                            speccy_render.DrawSupersampled();
+                        }
+                    },
+                    [&]()
+                    {
+                        speccy_render.DrawWindow(
+                            size.width,
+                            size.height,
+                            border_color,
+                            supersampling != 0);
+                    },
+                    [&]()
+                    {
+                        build_gui();
+                        gui.Draw(
+                            size.width,
+                            size.height);
+                    }
+                };
+
+                // the first frames allocate textures and compile shader
+                // variants, they aren't counted
+                std::vector<double> times;
+                for (int frame = 0; frame < 3; frame++)
+                {
+                    timer.Frame(stages, times);
+                }
+
+                std::vector<std::vector<double>> stage_times(num_stages);
+                std::vector<double> total_times;
+                int disjoint_frames = 0;
+                for (int frame = 0; frame < num_frames; frame++)
+                {
+                    if (!timer.Frame(stages, times))
+                    {
+                        disjoint_frames++;
+                        continue;
+                    }
+                    double total = 0.0;
+                    for (size_t i = 0; i < num_stages; i++)
+                    {
+                        stage_times[i].push_back(times[i]);
+                        total += times[i];
+                    }
+                    total_times.push_back(total);
+                }
+
+                OpenGL::GLCheckError();
+
+                // one run per line, like zxsc-bench
+                std::cout << "    {\"width\": " << size.width
+                    << ", \"height\": " << size.height
+                    << ", \"supersampling\": " << (supersampling ? "true" : "false");
+                for (size_t i = 0; i < num_stages; i++)
+                {
+                    snprintf(
+                        line,
+                        sizeof(line),
+                        ", \"%s_ms\": %.4f",
+                        stage_names[i],
+                        median(stage_times[i]));
+                    std::cout << line;
+                }
+                snprintf(
+                    line,
+                    sizeof(line),
+                    ", \"total_ms\": %.4f, \"disjoint_frames\": %d}",
+                    median(total_times),
+                    disjoint_frames);
+                std::cout << line
+                    << (((s + 1) < sizes.size()) || !supersampling ? "," : "")
+                    << std::endl;
+            }
+        }
+
+        std::cout << "  ]" << std::endl;
+        std::cout << "}" << std::endl;
+
+        gui.Deinit();
+        speccy_render.Deinit();
+        ImGui::DestroyContext();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
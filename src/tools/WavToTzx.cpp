@@ -0,0 +1,59 @@
+#include "../speccy/WavTape.hpp"
+#include "../util/ThreadPool.hpp"
+
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+// Offline converter from tape recordings to TZX, so each recording
+// only has to be decoded once:
+//
+//     wav2tzx <input.wav> <output.tzx>
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        std::cout << "usage: wav2tzx <input.wav> <output.tzx>" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        ThreadPool thread_pool;
+
+        const auto start = std::chrono::steady_clock::now();
+        Speccy::WavTape wav(argv[1], thread_pool);
+        const std::vector<uint8_t> tzx = wav.TZX();
+        const auto end = std::chrono::steady_clock::now();
+
+        FILE* file = fopen(argv[2], "wb");
+        if (file == nullptr)
+        {
+            std::cout << "Failed to open file: " << argv[2] << std::endl;
+            return 1;
+        }
+        const size_t written = fwrite(tzx.data(), 1, tzx.size(), file);
+        fclose(file);
+
+        if (written != tzx.size())
+        {
+            std::cout << "Failed to write file: " << argv[2] << std::endl;
+            return 1;
+        }
+
+        std::cout
+            << wav.Pulses().size() << " pulses at "
+            << wav.SampleRate() << " Hz, "
+            << tzx.size() << " bytes of TZX in "
+            << std::chrono::duration<double, std::milli>(end - start).count() << " ms on "
+            << thread_pool.ThreadCount() << " threads" << std::endl;
+    }
+    catch (const std::runtime_error&)
+    {
+        return 1;
+    }
+
+    return 0;
+}
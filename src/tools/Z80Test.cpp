@@ -0,0 +1,508 @@
+extern "C"
+{
+#define CHIPS_IMPL
+#include "../speccy/Z80.h"
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Checks the Z80 core on its own, without the machine around it:
+//
+//     zxsc-z80test -cpm <program.com> [-ticks <n>]
+//     zxsc-z80test -fuse <tests.in> <tests.expected>
+//
+// -cpm runs a CP/M program like ZEXDOC or ZEXALL on 64K of flat RAM.
+// The BDOS calls it prints with (C=2 and C=9) are caught with a trap at
+// 0005 and go to stdout, a jump to 0000 ends it. It passes if the
+// program got back to 0000 and printed no "ERROR". ZEXALL runs for
+// billions of T-states, which makes it a good sustained benchmark of the
+// core too, -ticks stops it early for a run of fixed length.
+//
+// -fuse runs the per-opcode tests of the FUSE emulator, each test sets
+// up the registers and memory, runs to its T-state count and compares
+// the registers, the changed memory and the T-states taken with the
+// expected file. The bus events in the expected file aren't compared,
+// the core doesn't give them at the same granularity.
+//
+// Both print the emulated MHz, the exit code is 0 if everything passed.
+
+#define TRAP_BDOS (1)
+#define TRAP_WARM_BOOT (2)
+
+struct FlatMachine
+{
+    z80_t cpu;
+    uint8_t ram[1 << 16];
+};
+
+static uint64_t flat_tick(int num_ticks, uint64_t pins, void* user_data)
+{
+    (void)num_ticks;
+    uint8_t* ram = static_cast<uint8_t*>(user_data);
+    if (pins & Z80_MREQ)
+    {
+        if (pins & Z80_RD)
+        {
+            Z80_SET_DATA(pins, ram[Z80_GET_ADDR(pins)]);
+        }
+        else if (pins & Z80_WR)
+        {
+            ram[Z80_GET_ADDR(pins)] = Z80_GET_DATA(pins);
+        }
+    }
+    else if ((pins & Z80_IORQ) && (pins & Z80_RD))
+    {
+        // what FUSE's tests expect, the high byte of the port
+        Z80_SET_DATA(pins, Z80_GET_ADDR(pins) >> 8);
+    }
+    return pins;
+}
+
+static void init_machine(FlatMachine* machine)
+{
+    z80_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.tick_cb = flat_tick;
+    desc.user_data = machine->ram;
+    z80_init(&machine->cpu, &desc);
+}
+
+static double elapsed_s(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_rate(uint64_t ticks, double seconds)
+{
+    printf(
+        "%llu T-states in %.2f s, %.2f MHz\n",
+        static_cast<unsigned long long>(ticks),
+        seconds,
+        (seconds > 0.0) ? (ticks / seconds / 1e6) : 0.0);
+}
+
+static int cpm_trap(uint16_t pc, uint32_t ticks, uint64_t pins, void* trap_user_data)
+{
+    (void)ticks;
+    (void)pins;
+    (void)trap_user_data;
+    switch (pc)
+    {
+    case 0x0005: return TRAP_BDOS;
+    case 0x0000: return TRAP_WARM_BOOT;
+    default: return 0;
+    }
+}
+
+static int run_cpm(const std::string& path, uint64_t max_ticks)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Failed to open " << path << std::endl;
+        return 1;
+    }
+    const std::vector<uint8_t> program(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    if (program.size() > (0xFE00 - 0x0100))
+    {
+        std::cout << "Program too big for the TPA: " << path << std::endl;
+        return 1;
+    }
+
+    // the BDOS entry at 0005 is a RET, run after the trap has done the
+    // call, and 0006 holds the top of the TPA which programs take for
+    // their stack
+    std::unique_ptr<FlatMachine> machine(new FlatMachine);
+    memset(machine->ram, 0, sizeof(machine->ram));
+    memcpy(&machine->ram[0x0100], program.data(), program.size());
+    machine->ram[0x0000] = 0x76;    // HALT
+    machine->ram[0x0005] = 0xC9;    // RET
+    machine->ram[0x0006] = 0x00;
+    machine->ram[0x0007] = 0xFE;
+
+    init_machine(machine.get());
+    z80_t* cpu = &machine->cpu;
+    uint8_t* ram = machine->ram;
+    z80_trap_cb(cpu, cpm_trap, nullptr);
+    z80_set_pc(cpu, 0x0100);
+    z80_set_sp(cpu, 0xFDFE);        // returns to 0000
+
+    std::string output;
+    uint64_t ticks = 0;
+    bool finished = false;
+    const auto start = std::chrono::steady_clock::now();
+    while (!finished && (!max_ticks || (ticks < max_ticks)))
+    {
+        const uint64_t left = max_ticks ? (max_ticks - ticks) : UINT64_MAX;
+        ticks += z80_exec(cpu, static_cast<uint32_t>(std::min<uint64_t>(left, 100000000)));
+        if (cpu->trap_id == TRAP_WARM_BOOT)
+        {
+            finished = true;
+        }
+        else if (cpu->trap_id == TRAP_BDOS)
+        {
+            std::string text;
+            if (z80_c(cpu) == 2)
+            {
+                text = static_cast<char>(z80_e(cpu));
+            }
+            else if (z80_c(cpu) == 9)
+            {
+                for (uint16_t addr = z80_de(cpu); ram[addr] != '$'; addr++)
+                {
+                    text += static_cast<char>(ram[addr]);
+                }
+            }
+            output += text;
+            fputs(text.c_str(), stdout);
+            fflush(stdout);
+        }
+    }
+    const double seconds = elapsed_s(start);
+
+    std::cout << std::endl;
+    print_rate(ticks, seconds);
+
+    if (!finished)
+    {
+        std::cout << "Stopped after " << ticks << " T-states" << std::endl;
+        return (output.find("ERROR") == std::string::npos) ? 0 : 1;
+    }
+    const bool passed = (output.find("ERROR") == std::string::npos);
+    std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+    return passed ? 0 : 1;
+}
+
+// one test of FUSE's tests.in, or its result in tests.expected
+struct FuseState
+{
+    std::string name;
+    uint16_t regs[13];      // AF BC DE HL AF' BC' DE' HL' IX IY SP PC MEMPTR
+    unsigned int i, r, iff1, iff2, im, halted, tstates;
+    std::vector<std::pair<uint16_t, std::vector<uint8_t>>> memory;
+};
+
+static const char* fuse_reg_names[13] =
+{
+    "AF", "BC", "DE", "HL", "AF'", "BC'", "DE'", "HL'", "IX", "IY", "SP", "PC", "MEMPTR"
+};
+
+static bool next_line(std::istream& in, std::string& line)
+{
+    while (std::getline(in, line))
+    {
+        if (line.find_first_not_of(" \t\r") != std::string::npos)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// bus event lines, "<time> <MR|MW|MC|PR|PW|PC> ...", only in the
+// expected file
+static bool is_event(const std::string& line)
+{
+    std::istringstream words(line);
+    std::string time, type;
+    words >> time >> type;
+    return (type.size() == 2) &&
+        ((type[0] == 'M') || (type[0] == 'P')) &&
+        ((type[1] == 'R') || (type[1] == 'W') || (type[1] == 'C'));
+}
+
+static bool read_fuse(std::istream& in, FuseState& state, bool expected)
+{
+    std::string line;
+    if (!next_line(in, line))
+    {
+        return false;
+    }
+    state.name = line.substr(0, line.find_last_not_of(" \t\r") + 1);
+
+    if (!next_line(in, line))
+    {
+        return false;
+    }
+    while (expected && is_event(line))
+    {
+        if (!next_line(in, line))
+        {
+            return false;
+        }
+    }
+
+    std::istringstream regs(line);
+    for (int i = 0; i < 13; i++)
+    {
+        unsigned int value = 0;
+        regs >> std::hex >> value;
+        state.regs[i] = static_cast<uint16_t>(value);
+    }
+    if (!regs || !next_line(in, line))
+    {
+        return false;
+    }
+    std::istringstream flags(line);
+    flags >> std::hex >> state.i >> state.r >> std::dec >> state.iff1 >> state.iff2 >> state.im >> state.halted >> state.tstates;
+    if (!flags)
+    {
+        return false;
+    }
+
+    // memory blocks, "<addr> <bytes> -1", the input ends them with a
+    // line of -1, the expected file with a blank line
+    state.memory.clear();
+    for (;;)
+    {
+        if (!std::getline(in, line) ||
+            (line.find_first_not_of(" \t\r") == std::string::npos))
+        {
+            break;
+        }
+        std::istringstream words(line);
+        std::string word;
+        words >> word;
+        if (word == "-1")
+        {
+            break;
+        }
+        std::pair<uint16_t, std::vector<uint8_t>> block;
+        block.first = static_cast<uint16_t>(strtoul(word.c_str(), nullptr, 16));
+        while ((words >> word) && (word != "-1"))
+        {
+            block.second.push_back(static_cast<uint8_t>(strtoul(word.c_str(), nullptr, 16)));
+        }
+        state.memory.push_back(block);
+    }
+    return true;
+}
+
+static void set_fuse(FlatMachine* machine, const FuseState& in)
+{
+    init_machine(machine);
+    z80_t* cpu = &machine->cpu;
+
+    // FUSE fills memory with DE AD BE EF
+    static const uint8_t fill[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+    for (size_t addr = 0; addr < sizeof(machine->ram); addr++)
+    {
+        machine->ram[addr] = fill[addr & 3];
+    }
+    for (const auto& block : in.memory)
+    {
+        for (size_t i = 0; i < block.second.size(); i++)
+        {
+            machine->ram[static_cast<uint16_t>(block.first + i)] = block.second[i];
+        }
+    }
+
+    z80_set_af(cpu, in.regs[0]);
+    z80_set_bc(cpu, in.regs[1]);
+    z80_set_de(cpu, in.regs[2]);
+    z80_set_hl(cpu, in.regs[3]);
+    z80_set_af_(cpu, in.regs[4]);
+    z80_set_bc_(cpu, in.regs[5]);
+    z80_set_de_(cpu, in.regs[6]);
+    z80_set_hl_(cpu, in.regs[7]);
+    z80_set_ix(cpu, in.regs[8]);
+    z80_set_iy(cpu, in.regs[9]);
+    z80_set_sp(cpu, in.regs[10]);
+    z80_set_pc(cpu, in.regs[11]);
+    z80_set_wz(cpu, in.regs[12]);
+    z80_set_i(cpu, static_cast<uint8_t>(in.i));
+    z80_set_r(cpu, static_cast<uint8_t>(in.r));
+    z80_set_iff1(cpu, in.iff1 != 0);
+    z80_set_iff2(cpu, in.iff2 != 0);
+    z80_set_im(cpu, static_cast<uint8_t>(in.im));
+    if (in.halted)
+    {
+        cpu->pins |= Z80_HALT;
+    }
+}
+
+// returns the differences, empty if it matches
+static std::string compare_fuse(FlatMachine* machine, const FuseState& expected, uint32_t tstates)
+{
+    z80_t* cpu = &machine->cpu;
+    const uint16_t regs[13] =
+    {
+        z80_af(cpu), z80_bc(cpu), z80_de(cpu), z80_hl(cpu),
+        z80_af_(cpu), z80_bc_(cpu), z80_de_(cpu), z80_hl_(cpu),
+        z80_ix(cpu), z80_iy(cpu), z80_sp(cpu), z80_pc(cpu), z80_wz(cpu)
+    };
+
+    std::ostringstream diff;
+    char text[64];
+    for (int i = 0; i < 13; i++)
+    {
+        if (regs[i] != expected.regs[i])
+        {
+            snprintf(text, sizeof(text), " %s=%04X (%04X)", fuse_reg_names[i], regs[i], expected.regs[i]);
+            diff << text;
+        }
+    }
+
+    const unsigned int flags[7] =
+    {
+        z80_i(cpu),
+        z80_r(cpu),
+        z80_iff1(cpu) ? 1u : 0u,
+        z80_iff2(cpu) ? 1u : 0u,
+        z80_im(cpu),
+        (cpu->pins & Z80_HALT) ? 1u : 0u,
+        tstates
+    };
+    const unsigned int expected_flags[7] =
+    {
+        expected.i, expected.r, expected.iff1, expected.iff2, expected.im, expected.halted, expected.tstates
+    };
+    static const char* flag_names[7] = { "I", "R", "IFF1", "IFF2", "IM", "halted", "T-states" };
+    for (int i = 0; i < 7; i++)
+    {
+        if (flags[i] != expected_flags[i])
+        {
+            snprintf(text, sizeof(text), " %s=%u (%u)", flag_names[i], flags[i], expected_flags[i]);
+            diff << text;
+        }
+    }
+
+    for (const auto& block : expected.memory)
+    {
+        for (size_t i = 0; i < block.second.size(); i++)
+        {
+            const uint16_t addr = static_cast<uint16_t>(block.first + i);
+            if (machine->ram[addr] != block.second[i])
+            {
+                snprintf(text, sizeof(text), " (%04X)=%02X (%02X)", addr, machine->ram[addr], block.second[i]);
+                diff << text;
+            }
+        }
+    }
+    return diff.str();
+}
+
+static int run_fuse(const std::string& in_path, const std::string& expected_path)
+{
+    std::ifstream in_file(in_path);
+    std::ifstream expected_file(expected_path);
+    if (!in_file || !expected_file)
+    {
+        std::cout << "Failed to open " << (in_file ? expected_path : in_path) << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<FlatMachine> machine(new FlatMachine);
+    FuseState in;
+    FuseState expected;
+    int passed = 0;
+    int failed = 0;
+    uint64_t total_ticks = 0;
+    double seconds = 0.0;
+    while (read_fuse(in_file, in, false))
+    {
+        if (!read_fuse(expected_file, expected, true) || (expected.name != in.name))
+        {
+            std::cout << "No expected result for " << in.name << std::endl;
+            return 1;
+        }
+
+        set_fuse(machine.get(), in);
+
+        // runs whole instructions until the T-states are reached, a DD
+        // or FD prefix isn't a whole instruction on its own
+        const auto start = std::chrono::steady_clock::now();
+        uint32_t ticks = 0;
+        do
+        {
+            ticks += z80_exec(&machine->cpu, (ticks < in.tstates) ? (in.tstates - ticks) : 1);
+        }
+        while ((ticks < in.tstates) || !z80_opdone(&machine->cpu));
+        seconds += elapsed_s(start);
+        total_ticks += ticks;
+
+        const std::string diff = compare_fuse(machine.get(), expected, ticks);
+        if (diff.empty())
+        {
+            passed++;
+        }
+        else
+        {
+            failed++;
+            std::cout << in.name << ":" << diff << std::endl;
+        }
+    }
+
+    std::cout << passed << " passed, " << failed << " failed" << std::endl;
+    print_rate(total_ticks, seconds);
+    return ((failed == 0) && (passed > 0)) ? 0 : 1;
+}
+
+static void usage()
+{
+    std::cout << "usage: zxsc-z80test -cpm <program.com> [-ticks <n>]" << std::endl;
+    std::cout << "       zxsc-z80test -fuse <tests.in> <tests.expected>" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string cpm_path;
+    std::string fuse_in_path;
+    std::string fuse_expected_path;
+    uint64_t max_ticks = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if ((arg == "-cpm") && ((i + 1) < argc))
+        {
+            cpm_path = argv[++i];
+        }
+        else if ((arg == "-fuse") && ((i + 2) < argc))
+        {
+            fuse_in_path = argv[++i];
+            fuse_expected_path = argv[++i];
+        }
+        else if ((arg == "-ticks") && ((i + 1) < argc))
+        {
+            max_ticks = strtoull(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!cpm_path.empty() == !fuse_in_path.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        return cpm_path.empty() ?
+            run_fuse(fuse_in_path, fuse_expected_path) :
+            run_cpm(cpm_path, max_ticks);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,128 @@
+#include "HugeBuffer.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(_WIN32) || defined(MAP_HUGETLB)
+static size_t round_up(size_t length, size_t alignment)
+{
+    return ((length + alignment - 1) / alignment) * alignment;
+}
+#endif
+
+#if defined(_WIN32)
+
+HugeBuffer::HugeBuffer(size_t length) :
+    length(length)
+{
+    // large pages need the lock memory privilege, most accounts don't
+    // have it
+    const size_t large_page = GetLargePageMinimum();
+    if (large_page > 0)
+    {
+        mapped_length = round_up(length, large_page);
+        data = static_cast<uint8_t*>(VirtualAlloc(
+            NULL,
+            mapped_length,
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+            PAGE_READWRITE));
+        huge_pages = (data != nullptr);
+    }
+
+    if (data == nullptr)
+    {
+        mapped_length = length;
+        data = static_cast<uint8_t*>(VirtualAlloc(
+            NULL,
+            mapped_length,
+            MEM_RESERVE | MEM_COMMIT,
+            PAGE_READWRITE));
+    }
+
+    if (data == nullptr)
+    {
+        std::cout << "Failed to allocate " << length << " bytes" << std::endl;
+        throw std::runtime_error("Failed to allocate buffer.");
+    }
+}
+
+HugeBuffer::~HugeBuffer()
+{
+    VirtualFree(data, 0, MEM_RELEASE);
+}
+
+#else
+
+HugeBuffer::HugeBuffer(size_t length) :
+    length(length)
+{
+    void* ptr = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+    // only works if the system has reserved huge pages
+    mapped_length = round_up(length, 2 << 20);
+    ptr = mmap(
+        nullptr,
+        mapped_length,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+        -1,
+        0);
+    huge_pages = (ptr != MAP_FAILED);
+#endif
+
+    if (ptr == MAP_FAILED)
+    {
+        mapped_length = length;
+        ptr = mmap(
+            nullptr,
+            mapped_length,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0);
+#if defined(MADV_HUGEPAGE)
+        // transparent huge pages, if the kernel has them enabled
+        if (ptr != MAP_FAILED)
+        {
+            madvise(ptr, mapped_length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    if (ptr == MAP_FAILED)
+    {
+        std::cout << "Failed to allocate " << length << " bytes" << std::endl;
+        throw std::runtime_error("Failed to allocate buffer.");
+    }
+
+    data = static_cast<uint8_t*>(ptr);
+}
+
+HugeBuffer::~HugeBuffer()
+{
+    munmap(data, mapped_length);
+}
+
+#endif
+
+uint8_t* HugeBuffer::Data() const
+{
+    return data;
+}
+
+size_t HugeBuffer::Length() const
+{
+    return length;
+}
+
+bool HugeBuffer::HugePages() const
+{
+    return huge_pages;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Zeroed memory for large arenas, on huge pages where the OS hands them
+// out, so walking through thousands of emulated machines doesn't miss
+// the TLB on every one of them.
+class HugeBuffer
+{
+private:
+    uint8_t* data = nullptr;
+    size_t length = 0;
+    size_t mapped_length = 0;
+    bool huge_pages = false;
+
+public:
+    HugeBuffer(size_t length);
+    virtual ~HugeBuffer();
+
+    HugeBuffer(const HugeBuffer&) = delete;
+    HugeBuffer& operator=(const HugeBuffer&) = delete;
+
+    uint8_t* Data() const;
+    size_t Length() const;
+    bool HugePages() const;
+};
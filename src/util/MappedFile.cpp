@@ -0,0 +1,148 @@
+#include "MappedFile.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(std::string path)
+{
+    file_handle = CreateFileA(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+
+    if (file_handle == INVALID_HANDLE_VALUE)
+    {
+        std::cout << "Failed to open file: " << path << std::endl;
+        throw std::runtime_error("Failed to open file.");
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file_handle, &size);
+    length = static_cast<size_t>(size.QuadPart);
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    mapping_handle = CreateFileMappingA(
+        file_handle,
+        NULL,
+        PAGE_READONLY,
+        0,
+        0,
+        NULL);
+
+    if (mapping_handle != NULL)
+    {
+        data = static_cast<const uint8_t*>(MapViewOfFile(
+            mapping_handle,
+            FILE_MAP_READ,
+            0,
+            0,
+            0));
+    }
+
+    if (data == nullptr)
+    {
+        std::cout << "Failed to map file: " << path << std::endl;
+        if (mapping_handle != NULL)
+        {
+            CloseHandle(mapping_handle);
+        }
+        CloseHandle(file_handle);
+        throw std::runtime_error("Failed to map file.");
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+    {
+        UnmapViewOfFile(data);
+    }
+    if (mapping_handle != nullptr)
+    {
+        CloseHandle(mapping_handle);
+    }
+    CloseHandle(file_handle);
+}
+
+#else
+
+MappedFile::MappedFile(std::string path)
+{
+    handle = open(path.c_str(), O_RDONLY);
+
+    if (handle < 0)
+    {
+        std::cout << "Failed to open file: " << path << std::endl;
+        throw std::runtime_error("Failed to open file.");
+    }
+
+    struct stat st;
+    fstat(handle, &st);
+    length = static_cast<size_t>(st.st_size);
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    void* ptr = mmap(
+        nullptr,
+        length,
+        PROT_READ,
+        MAP_PRIVATE,
+        handle,
+        0);
+
+    if (ptr == MAP_FAILED)
+    {
+        std::cout << "Failed to map file: " << path << std::endl;
+        close(handle);
+        throw std::runtime_error("Failed to map file.");
+    }
+
+#if defined(MADV_SEQUENTIAL)
+    madvise(ptr, length, MADV_SEQUENTIAL);
+#endif
+
+    data = static_cast<const uint8_t*>(ptr);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+    {
+        munmap(const_cast<uint8_t*>(data), length);
+    }
+    close(handle);
+}
+
+#endif
+
+const uint8_t* MappedFile::Data() const
+{
+    return data;
+}
+
+size_t MappedFile::Length() const
+{
+    return length;
+}
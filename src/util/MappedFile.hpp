@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// Read-only memory mapping of a whole file. The mapping stays valid
+// for the lifetime of the object, so emulator components can keep
+// pointers into it (tape images, snapshots) without copying.
+class MappedFile
+{
+private:
+    const uint8_t* data = nullptr;
+    size_t length = 0;
+
+#if defined(_WIN32)
+    void* file_handle = nullptr;
+    void* mapping_handle = nullptr;
+#else
+    int handle = -1;
+#endif
+
+public:
+    MappedFile(std::string path);
+    virtual ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* Data() const;
+    size_t Length() const;
+};
@@ -0,0 +1,130 @@
+#include "PerfCounters.hpp"
+
+#if defined(__linux__)
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__linux__)
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(
+        __NR_perf_event_open,
+        &attr,
+        0,
+        -1,
+        -1,
+        0));
+}
+
+PerfCounters::PerfCounters()
+{
+    fds[Cycles] = open_counter(
+        PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_CPU_CYCLES);
+
+    fds[Instructions] = open_counter(
+        PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_INSTRUCTIONS);
+
+    fds[L1DMisses] = open_counter(
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    fds[CacheMisses] = open_counter(
+        PERF_TYPE_HARDWARE,
+        PERF_COUNT_HW_CACHE_MISSES);
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+bool PerfCounters::Available() const
+{
+    return fds[Cycles] >= 0;
+}
+
+void PerfCounters::Start()
+{
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::Stop()
+{
+    for (int i = 0; i < EventCount; i++)
+    {
+        counts[i] = 0;
+        if (fds[i] >= 0)
+        {
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t value = 0;
+            if (read(fds[i], &value, sizeof(value)) == sizeof(value))
+            {
+                counts[i] = value;
+            }
+        }
+    }
+}
+
+#else
+
+PerfCounters::PerfCounters()
+{
+    for (int& fd : fds)
+    {
+        fd = -1;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+}
+
+bool PerfCounters::Available() const
+{
+    return false;
+}
+
+void PerfCounters::Start()
+{
+}
+
+void PerfCounters::Stop()
+{
+}
+
+#endif
+
+uint64_t PerfCounters::Count(Event event) const
+{
+    return counts[event];
+}
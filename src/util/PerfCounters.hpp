@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hardware event counts for a stretch of code on the calling thread,
+// through perf_event_open() on Linux. Elsewhere, or where the kernel or
+// the VM doesn't expose the counters, Available() is false and the
+// counts stay 0.
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        Cycles,
+        Instructions,
+        L1DMisses,
+        CacheMisses,
+        EventCount
+    };
+
+private:
+    int fds[EventCount];
+    uint64_t counts[EventCount] = {};
+
+public:
+    PerfCounters();
+    virtual ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool Available() const;
+
+    void Start();
+    void Stop();
+
+    uint64_t Count(Event event) const;
+};
@@ -0,0 +1,110 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(size_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        thread_count = std::thread::hardware_concurrency();
+    }
+
+    // the calling thread works as well
+    for (size_t i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    work_cv.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::ThreadCount() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::Run(
+    const size_t count,
+    const std::function<void(size_t)>& task)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (workers.empty() || count == 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    this->task = &task;
+    task_count = count;
+    next_task = 0;
+    tasks_done = 0;
+    generation++;
+    work_cv.notify_all();
+
+    RunTasks(lock);
+
+    done_cv.wait(lock, [this]()
+    {
+        return tasks_done == task_count;
+    });
+
+    this->task = nullptr;
+}
+
+void ThreadPool::RunTasks(std::unique_lock<std::mutex>& lock)
+{
+    while (next_task < task_count)
+    {
+        const size_t index = next_task++;
+        const std::function<void(size_t)>& current = *task;
+
+        lock.unlock();
+        current(index);
+        lock.lock();
+
+        if (++tasks_done == task_count)
+        {
+            done_cv.notify_all();
+        }
+    }
+}
+
+void ThreadPool::WorkerLoop()
+{
+    size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        work_cv.wait(lock, [&]()
+        {
+            return quit || (generation != seen_generation);
+        });
+
+        if (quit)
+        {
+            return;
+        }
+
+        seen_generation = generation;
+        RunTasks(lock);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data parallel jobs. Run() splits a
+// job into a number of tasks, executes them on the workers and the
+// calling thread, and returns once all of them are done.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    const std::function<void(size_t)>* task = nullptr;
+    size_t task_count = 0;
+    size_t next_task = 0;
+    size_t tasks_done = 0;
+    size_t generation = 0;
+    bool quit = false;
+
+    void WorkerLoop();
+    void RunTasks(std::unique_lock<std::mutex>& lock);
+
+public:
+    // 0 threads picks one per hardware thread
+    ThreadPool(size_t thread_count = 0);
+    virtual ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t ThreadCount() const;
+
+    void Run(
+        const size_t count,
+        const std::function<void(size_t)>& task);
+};
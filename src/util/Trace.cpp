@@ -0,0 +1,255 @@
+#include "Trace.hpp"
+
+#if defined(ZXSC_TRACE)
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_TSC 1
+#endif
+
+namespace
+{
+    enum EventType
+    {
+        EVENT_BEGIN,
+        EVENT_END,
+        EVENT_COUNTER
+    };
+
+    struct Event
+    {
+        uint64_t time;
+        const char* name;
+        int64_t value;
+        int type;
+    };
+
+    // a power of two, 1M events is 32 MB per thread that records
+    const uint64_t ring_size = 1 << 20;
+    const uint64_t ring_mask = ring_size - 1;
+
+    // events the writer may be overwriting while a dump reads the ring
+    const uint64_t ring_margin = 1024;
+
+    struct Ring
+    {
+        std::vector<Event> events;
+        std::atomic<uint64_t> head;
+        uint32_t thread_id = 0;
+        std::string thread_name;
+
+        Ring() :
+            events(ring_size),
+            head(0)
+        {
+        }
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    // rings live until exit, so threads which finished still show up
+    std::mutex rings_mutex;
+    std::vector<Ring*> rings;
+    uint32_t next_thread_id = 1;
+
+    Clock::time_point start_clock = Clock::now();
+#if defined(TRACE_TSC)
+    uint64_t start_tsc = __rdtsc();
+#endif
+
+    thread_local Ring* thread_ring = nullptr;
+
+    inline uint64_t now()
+    {
+#if defined(TRACE_TSC)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(Clock::now().time_since_epoch().count());
+#endif
+    }
+
+    Ring* register_thread()
+    {
+        Ring* ring = new Ring();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        ring->thread_id = next_thread_id++;
+        rings.push_back(ring);
+        thread_ring = ring;
+        return ring;
+    }
+
+    inline void record(
+        const int type,
+        const char* name,
+        const int64_t value)
+    {
+        Ring* ring = thread_ring;
+        if (!ring)
+        {
+            ring = register_thread();
+        }
+
+        // only this thread writes the ring, the head publishes the event
+        const uint64_t head = ring->head.load(std::memory_order_relaxed);
+        Event& event = ring->events[head & ring_mask];
+        event.time = now();
+        event.name = name;
+        event.value = value;
+        event.type = type;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    void write_escaped(FILE* file, const char* text)
+    {
+        for (; *text; text++)
+        {
+            if ((*text == '"') || (*text == '\\'))
+            {
+                fputc('\\', file);
+            }
+            fputc(*text, file);
+        }
+    }
+}
+
+extern "C" void zx_trace_begin(const char* name)
+{
+    record(EVENT_BEGIN, name, 0);
+}
+
+extern "C" void zx_trace_end(void)
+{
+    record(EVENT_END, nullptr, 0);
+}
+
+extern "C" void zx_trace_counter(const char* name, int64_t value)
+{
+    record(EVENT_COUNTER, name, value);
+}
+
+void Trace::SetThreadName(const char* name)
+{
+    Ring* ring = thread_ring;
+    if (!ring)
+    {
+        ring = register_thread();
+    }
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    ring->thread_name = name;
+}
+
+bool Trace::Dump(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    // timestamps to microseconds since start
+#if defined(TRACE_TSC)
+    const uint64_t end_tsc = __rdtsc();
+    const double elapsed_us = std::chrono::duration<double, std::micro>(
+        Clock::now() - start_clock).count();
+    const uint64_t base = start_tsc;
+    const double us_per_tick = (end_tsc > start_tsc) ?
+        (elapsed_us / (end_tsc - start_tsc)) : 0.0;
+#else
+    const uint64_t base = static_cast<uint64_t>(start_clock.time_since_epoch().count());
+    const double us_per_tick = 1e6 * Clock::period::num / Clock::period::den;
+#endif
+
+    std::lock_guard<std::mutex> lock(rings_mutex);
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    bool first = true;
+
+    for (const Ring* ring : rings)
+    {
+        if (!ring->thread_name.empty())
+        {
+            fprintf(file, "%s{\"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_name\", \"args\": {\"name\": \"",
+                first ? "" : ",\n",
+                ring->thread_id);
+            write_escaped(file, ring->thread_name.c_str());
+            fprintf(file, "\"}}");
+            first = false;
+        }
+
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t tail = (head > ring_size) ? (head - ring_size + ring_margin) : 0;
+
+        // zones which began before the oldest event kept have lost their
+        // begin, their ends are dropped, and open zones get closed at the
+        // last timestamp so the viewer shows them
+        int open = 0;
+        uint64_t last_time = 0;
+
+        for (uint64_t i = tail; i < head; i++)
+        {
+            const Event& event = ring->events[i & ring_mask];
+            const double ts = (event.time - base) * us_per_tick;
+            last_time = event.time;
+
+            if (event.type == EVENT_END)
+            {
+                if (open == 0)
+                {
+                    continue;
+                }
+                open--;
+                fprintf(file, "%s{\"ph\": \"E\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}",
+                    first ? "" : ",\n",
+                    ring->thread_id,
+                    ts);
+            }
+            else
+            {
+                fprintf(file, "%s{\"ph\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"name\": \"",
+                    first ? "" : ",\n",
+                    (event.type == EVENT_BEGIN) ? "B" : "C",
+                    ring->thread_id,
+                    ts);
+                write_escaped(file, event.name);
+                if (event.type == EVENT_BEGIN)
+                {
+                    open++;
+                    fprintf(file, "\"}");
+                }
+                else
+                {
+                    fprintf(file, "\", \"args\": {\"value\": %lld}}",
+                        static_cast<long long>(event.value));
+                }
+            }
+            first = false;
+        }
+
+        for (; open > 0; open--)
+        {
+            fprintf(file, "%s{\"ph\": \"E\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}",
+                first ? "" : ",\n",
+                ring->thread_id,
+                (last_time - base) * us_per_tick);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    const bool written = !ferror(file);
+    fclose(file);
+    return written;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../speccy/Trace.h"
+
+#include <string>
+
+// Timeline tracing: scoped zones and counters are recorded into a ring
+// buffer per thread and dumped on demand as Chrome trace JSON, which
+// chrome://tracing and Perfetto open. Only built with ZXSC_TRACE, the
+// macros compile to nothing otherwise.
+//
+// Recording is a timestamp and a store into the calling thread's ring,
+// no locks and no allocation once a thread recorded its first event.
+// Each ring keeps the latest events, older ones are overwritten.
+
+#if defined(ZXSC_TRACE)
+
+namespace Trace
+{
+    class Zone
+    {
+    public:
+        explicit Zone(const char* name)
+        {
+            zx_trace_begin(name);
+        }
+
+        ~Zone()
+        {
+            zx_trace_end();
+        }
+
+        Zone(const Zone&) = delete;
+        Zone& operator=(const Zone&) = delete;
+    };
+
+    // names the calling thread in the dump
+    void SetThreadName(const char* name);
+
+    // writes what the rings hold, false if the file can't be written.
+    // Threads may keep recording meanwhile, their oldest events can then
+    // come out torn and are left out.
+    bool Dump(const std::string& path);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_ZONE(name) Trace::Zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_COUNTER(name, value) zx_trace_counter(name, static_cast<int64_t>(value))
+#define TRACE_THREAD_NAME(name) Trace::SetThreadName(name)
+
+#else
+
+#define TRACE_ZONE(name) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+
+#endif